@@ -0,0 +1,738 @@
+#include "Benchmark.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "SDL.h"
+#include "glm/glm.hpp"
+#include "glm/gtc/constants.hpp"
+#include "glm/gtc/matrix_transform.hpp"
+#include "glm/gtc/quaternion.hpp"
+
+#include <algorithm>
+#include <vector>
+
+#include "Bvh.h"
+#include "DrawList.h"
+#include "EntityStore.h"
+#include "Meshlets.h"
+#include "MeshSimplify.h"
+#include "ParallelFor.h"
+#include "SceneGraph.h"
+#include "TransformKernels.h"
+#include "VertexFormat.h"
+
+// Calls frame() until `duration` seconds have passed after a warm-up second
+// and prints average, worst and jitter of the frame times
+template<typename Frame>
+static void MeasureFrames(const char* label, float duration, Frame frame)
+{
+  const double WARM_UP = 1.0;
+  double frequency = (double)SDL_GetPerformanceFrequency();
+  uint64_t start = SDL_GetPerformanceCounter();
+
+  uint32_t numFrames = 0;
+  double sum = 0.0;
+  double sumSq = 0.0;
+  double worst = 0.0;
+  while (1)
+  {
+    uint64_t frameStart = SDL_GetPerformanceCounter();
+    frame();
+    uint64_t frameEnd = SDL_GetPerformanceCounter();
+
+    double elapsed = (double)(frameEnd - start) / frequency;
+    if (elapsed < WARM_UP)
+    {
+      continue;
+    }
+
+    double time = (double)(frameEnd - frameStart) / frequency;
+    numFrames++;
+    sum += time;
+    sumSq += time * time;
+    worst = time > worst ? time : worst;
+    if (elapsed >= WARM_UP + (double)duration)
+    {
+      break;
+    }
+  }
+
+  double mean = sum / (double)numFrames;
+  double variance = sumSq / (double)numFrames - mean * mean;
+  printf("  %-24s %.3f ms avg, %.3f ms worst, %.3f ms jitter (%u frames)\n",
+         label, mean * 1000.0, worst * 1000.0, sqrt(variance > 0.0 ? variance : 0.0) * 1000.0, numFrames);
+}
+
+// Scene graph
+// A forest of 1000 trees with a branching factor of 4, one million nodes in total
+static void BuildBenchmarkSceneGraph(SceneGraph& graph, uint32_t numNodes, uint32_t numRoots)
+{
+  const uint32_t BRANCHING = 4;
+  graph.Clear();
+  graph.Reserve(numNodes);
+  for (uint32_t i = 0; i < numNodes; i++)
+  {
+    uint32_t parent = i < numRoots ? SceneGraph::NO_PARENT : (i - numRoots) / BRANCHING;
+    graph.AddNode(parent,
+                  glm::vec3((float)(i % 7), (float)(i % 5), (float)(i % 3)),
+                  glm::angleAxis(0.01f * (float)i, glm::vec3(0.0f, 1.0f, 0.0f)),
+                  glm::vec3(0.99f));
+  }
+  graph.UpdateWorldTransforms();
+}
+
+static void RunSceneGraphBenchmark(float duration)
+{
+  const uint32_t NUM_NODES = 1000000;
+  const uint32_t NUM_ROOTS = 1000;
+
+  SceneGraph graph;
+  BuildBenchmarkSceneGraph(graph, NUM_NODES, NUM_ROOTS);
+  printf("Benchmark scenegraph: %u nodes, %u roots, %s kernels\n",
+         graph.GetNumNodes(), NUM_ROOTS, TransformKernelName(GetTransformKernel()));
+
+  float time = 0.0f;
+  uint64_t numUpdated = 0;
+  uint64_t numFrames = 0;
+
+  // Every root moves, so every node is recomputed
+  MeasureFrames("all nodes dirty", duration, [&]()
+  {
+    time += 1.0f / 60.0f;
+    for (uint32_t root = 0; root < NUM_ROOTS; root++)
+    {
+      graph.SetRotation(root, glm::angleAxis(time + (float)root, glm::vec3(0.0f, 1.0f, 0.0f)));
+    }
+    graph.UpdateWorldTransforms();
+    numUpdated += graph.GetNumUpdatedNodes();
+    numFrames++;
+  });
+  printf("  %-24s %.0f nodes/frame\n", "", (double)numUpdated / (double)numFrames);
+
+  // 1% of the nodes move, only their subtrees are recomputed
+  uint32_t seed = 1;
+  numUpdated = 0;
+  numFrames = 0;
+  MeasureFrames("1% of nodes dirty", duration, [&]()
+  {
+    time += 1.0f / 60.0f;
+    for (uint32_t i = 0; i < NUM_NODES / 100; i++)
+    {
+      seed = seed * 1664525u + 1013904223u;
+      uint32_t node = seed % NUM_NODES;
+      graph.SetTranslation(node, glm::vec3(sinf(time), 0.0f, cosf(time)));
+    }
+    graph.UpdateWorldTransforms();
+    numUpdated += graph.GetNumUpdatedNodes();
+    numFrames++;
+  });
+  printf("  %-24s %.0f nodes/frame\n", "", (double)numUpdated / (double)numFrames);
+
+  // Nothing moves, the update is a no-op
+  MeasureFrames("no nodes dirty", duration, [&]()
+  {
+    graph.UpdateWorldTransforms();
+  });
+}
+
+// Transform kernels
+static float MaxDifference(const std::vector<glm::mat4x4>& a, const std::vector<glm::mat4x4>& b)
+{
+  float maxDifference = 0.0f;
+  for (size_t i = 0; i < a.size(); i++)
+  {
+    for (int column = 0; column < 4; column++)
+    {
+      glm::vec4 difference = glm::abs(a[i][column] - b[i][column]);
+      maxDifference = glm::max(maxDifference, glm::max(glm::max(difference.x, difference.y), glm::max(difference.z, difference.w)));
+    }
+  }
+  return maxDifference;
+}
+
+static void RunTransformsBenchmark(float duration)
+{
+  const uint32_t COUNT = 1000000;
+
+  std::vector<glm::quat> rotations(COUNT);
+  std::vector<glm::vec3> translations(COUNT);
+  std::vector<glm::vec3> scales(COUNT);
+  for (uint32_t i = 0; i < COUNT; i++)
+  {
+    glm::vec3 axis = glm::normalize(glm::vec3((float)(i % 7) + 1.0f, (float)(i % 5), (float)(i % 3)));
+    rotations[i] = glm::angleAxis(0.001f * (float)i, axis);
+    translations[i] = glm::vec3((float)(i % 11), (float)(i % 13), (float)(i % 17));
+    scales[i] = glm::vec3(1.0f + 0.001f * (float)(i % 100));
+  }
+
+  std::vector<glm::mat4x4> reference(COUNT);
+  std::vector<glm::mat4x4> result(COUNT);
+  std::vector<glm::mat4x4> product(COUNT);
+  TransformKernel bestKernel = GetTransformKernel();
+  printf("Benchmark transforms: %u transforms, best kernel %s\n", COUNT, TransformKernelName(bestKernel));
+
+  // Matrices built the way the update step used to, one glm call per step
+  MeasureFrames("compose glm", duration, [&]()
+  {
+    for (uint32_t i = 0; i < COUNT; i++)
+    {
+      glm::mat4x4 transform = glm::translate(glm::identity<glm::mat4x4>(), translations[i]);
+      transform = transform * glm::mat4_cast(rotations[i]);
+      reference[i] = glm::scale(transform, scales[i]);
+    }
+  });
+
+  for (int kernel = 0; kernel < TRANSFORM_KERNEL_COUNT; kernel++)
+  {
+    if (!SetTransformKernel((TransformKernel)kernel))
+    {
+      printf("  compose %-16s unsupported\n", TransformKernelName((TransformKernel)kernel));
+      continue;
+    }
+    char label[64];
+    snprintf(label, sizeof(label), "compose %s", TransformKernelName((TransformKernel)kernel));
+    MeasureFrames(label, duration, [&]()
+    {
+      ComposeTransforms(rotations.data(), translations.data(), scales.data(), nullptr, COUNT, result.data());
+    });
+    printf("  %-24s max difference to glm %g\n", "", MaxDifference(reference, result));
+  }
+
+  MeasureFrames("multiply glm", duration, [&]()
+  {
+    for (uint32_t i = 0; i < COUNT; i++)
+    {
+      product[i] = reference[i] * result[i];
+    }
+  });
+  std::vector<glm::mat4x4> referenceProduct = product;
+
+  for (int kernel = 0; kernel < TRANSFORM_KERNEL_COUNT; kernel++)
+  {
+    if (!SetTransformKernel((TransformKernel)kernel))
+    {
+      continue;
+    }
+    char label[64];
+    snprintf(label, sizeof(label), "multiply %s", TransformKernelName((TransformKernel)kernel));
+    MeasureFrames(label, duration, [&]()
+    {
+      MultiplyTransforms(reference.data(), result.data(), product.data(), COUNT);
+    });
+    printf("  %-24s max difference to glm %g\n", "", MaxDifference(referenceProduct, product));
+  }
+
+  SetTransformKernel(bestKernel);
+}
+
+// Entities
+struct BenchmarkTransform
+{
+  glm::mat4x4 world;
+};
+
+struct BenchmarkMesh
+{
+  uint32_t mesh;
+  uint32_t material;
+};
+
+struct BenchmarkVelocity
+{
+  glm::vec3 velocity;
+};
+
+static void RunEntitiesBenchmark(float duration)
+{
+  const uint32_t NUM_ENTITIES = 100000;
+
+  // Half of the renderables also move, so the query spans two archetypes
+  EntityStore store;
+  std::vector<Entity> entities;
+  for (uint32_t i = 0; i < NUM_ENTITIES; i++)
+  {
+    Entity entity = i % 2 == 0
+      ? store.Create<BenchmarkTransform, BenchmarkMesh>()
+      : store.Create<BenchmarkTransform, BenchmarkMesh, BenchmarkVelocity>();
+    if (entity == INVALID_ENTITY)
+    {
+      printf("Benchmark entities: out of memory\n");
+      return;
+    }
+    store.Get<BenchmarkTransform>(entity)->world = glm::mat4x4(1.0f);
+    *store.Get<BenchmarkMesh>(entity) = { i % 16, i % 64 };
+    entities.push_back(entity);
+  }
+
+  std::vector<glm::mat4x4> transforms(NUM_ENTITIES);
+  std::vector<BenchmarkMesh> meshes(NUM_ENTITIES);
+  std::vector<EntityStore::ChunkView> chunks;
+  printf("Benchmark entities: %u entities, %u cores\n", store.GetNumEntities(), (uint32_t)SDL_GetCPUCount());
+
+  MeasureFrames("extract", duration, [&]()
+  {
+    uint32_t index = 0;
+    store.ForEach<BenchmarkTransform, BenchmarkMesh>(
+      [&](uint32_t count, const Entity*, BenchmarkTransform* chunkTransforms, BenchmarkMesh* chunkMeshes)
+    {
+      for (uint32_t i = 0; i < count; i++)
+      {
+        transforms[index + i] = chunkTransforms[i].world;
+        meshes[index + i] = chunkMeshes[i];
+      }
+      index += count;
+    });
+  });
+
+  MeasureFrames("extract parallel", duration, [&]()
+  {
+    chunks.clear();
+    store.CollectChunks(MakeComponentMask<BenchmarkTransform, BenchmarkMesh>(), chunks);
+    ParallelFor((uint32_t)chunks.size(), 16, [&](uint32_t begin, uint32_t end)
+    {
+      for (uint32_t c = begin; c < end; c++)
+      {
+        const EntityStore::ChunkView& chunk = chunks[c];
+        const BenchmarkTransform* chunkTransforms = chunk.Get<BenchmarkTransform>();
+        const BenchmarkMesh* chunkMeshes = chunk.Get<BenchmarkMesh>();
+        for (uint32_t i = 0; i < chunk.GetCount(); i++)
+        {
+          transforms[chunk.firstIndex + i] = chunkTransforms[i].world;
+          meshes[chunk.firstIndex + i] = chunkMeshes[i];
+        }
+      }
+    });
+  });
+
+  MeasureFrames("integrate velocity", duration, [&]()
+  {
+    store.ForEach<BenchmarkTransform, BenchmarkVelocity>(
+      [](uint32_t count, const Entity*, BenchmarkTransform* chunkTransforms, BenchmarkVelocity* velocities)
+    {
+      for (uint32_t i = 0; i < count; i++)
+      {
+        chunkTransforms[i].world[3] += glm::vec4(velocities[i].velocity * (1.0f / 60.0f), 0.0f);
+      }
+    });
+  });
+
+  // 1% of the entities are replaced every frame
+  uint32_t seed = 1;
+  MeasureFrames("churn 1%", duration, [&]()
+  {
+    for (uint32_t i = 0; i < NUM_ENTITIES / 100; i++)
+    {
+      seed = seed * 1664525u + 1013904223u;
+      uint32_t slot = seed % NUM_ENTITIES;
+      store.Destroy(entities[slot]);
+      entities[slot] = store.Create<BenchmarkTransform, BenchmarkMesh>();
+    }
+  });
+}
+
+// Draw sorting
+// Keys spread over a few pipelines, many materials and meshes, and random depth
+static void RunDrawSortBenchmark(float duration)
+{
+  const uint32_t COUNT = 100000;
+
+  std::vector<uint64_t> keys(COUNT);
+  uint32_t seed = 1;
+  for (uint32_t i = 0; i < COUNT; i++)
+  {
+    seed = seed * 1664525u + 1013904223u;
+    uint32_t random = seed >> 8;
+    keys[i] = MakeDrawSortKey(0, random % 8, random % 500, random % 2000, seed & 0xFFFF);
+  }
+
+  DrawList drawList;
+  printf("Benchmark drawsort: %u draws, %u cores\n", COUNT, (uint32_t)SDL_GetCPUCount());
+
+  std::vector<std::pair<uint64_t, uint32_t>> pairs(COUNT);
+  MeasureFrames("std::sort", duration, [&]()
+  {
+    for (uint32_t i = 0; i < COUNT; i++)
+    {
+      pairs[i] = std::make_pair(keys[i], i);
+    }
+    std::sort(pairs.begin(), pairs.end());
+  });
+
+  MeasureFrames("radix sort", duration, [&]()
+  {
+    drawList.Clear();
+    drawList.Reserve(COUNT);
+    for (uint32_t i = 0; i < COUNT; i++)
+    {
+      drawList.Add(keys[i], i);
+    }
+    drawList.Sort();
+  });
+
+  // The radix sort is stable, so it matches std::sort on (key, item) pairs exactly
+  uint32_t mismatches = 0;
+  for (uint32_t i = 0; i < COUNT; i++)
+  {
+    if (drawList.GetKeys()[i] != pairs[i].first || drawList.GetItems()[i] != pairs[i].second)
+    {
+      mismatches++;
+    }
+  }
+  printf("  %-24s %u passes, %u mismatches\n", "", drawList.GetNumSortPasses(), mismatches);
+}
+
+// Bounding volume hierarchy
+// Unit-ish boxes scattered uniformly through a cube, about one object per unit volume
+static void BuildBenchmarkBounds(std::vector<Aabb>& bounds, uint32_t count, uint32_t& seed)
+{
+  float side = (float)cbrt((double)count);
+  bounds.resize(count);
+  for (uint32_t i = 0; i < count; i++)
+  {
+    glm::vec3 position;
+    for (int axis = 0; axis < 3; axis++)
+    {
+      seed = seed * 1664525u + 1013904223u;
+      position[axis] = (float)(seed >> 8) / (float)(1 << 24) * side;
+    }
+    float halfSize = 0.25f + 0.25f * (float)(i % 3);
+    bounds[i] = { position - halfSize, position + halfSize };
+  }
+}
+
+static void RunBvhBenchmark(float duration)
+{
+  const uint32_t SCENE_SIZES[] = { 100000, 1000000 };
+  const uint32_t NUM_RAYS = 1000;
+
+  for (uint32_t numObjects : SCENE_SIZES)
+  {
+    uint32_t seed = 1;
+    std::vector<Aabb> bounds;
+    BuildBenchmarkBounds(bounds, numObjects, seed);
+    float side = (float)cbrt((double)numObjects);
+    glm::vec3 center(0.5f * side);
+
+    Bvh bvh;
+    printf("Benchmark bvh: %u objects\n", numObjects);
+    MeasureFrames("build", duration, [&]()
+    {
+      bvh.Build(bounds.data(), numObjects);
+    });
+    printf("  %-24s %u nodes\n", "", bvh.GetNumNodes());
+
+    // Every object drifts a little each frame
+    uint32_t frame = 0;
+    MeasureFrames("move + refit", duration, [&]()
+    {
+      glm::vec3 offset = 0.01f * glm::vec3(sinf(0.1f * (float)frame), cosf(0.1f * (float)frame), 0.0f);
+      for (uint32_t i = 0; i < numObjects; i++)
+      {
+        glm::vec3 move = (i % 2 == 0) ? offset : -offset;
+        bounds[i].min += move;
+        bounds[i].max += move;
+      }
+      bvh.Refit(bounds.data());
+      frame++;
+    });
+    printf("  %-24s cost ratio %.3f after %u refits\n", "", bvh.GetRefitCostRatio(), frame);
+
+    // A 60 degree camera in the middle of the scene, looking along a diagonal
+    glm::mat4x4 proj = glm::perspective(glm::radians(60.0f), 16.0f / 9.0f, 0.1f, 0.5f * side);
+    glm::mat4x4 viewProj = proj * glm::lookAt(center, center + glm::vec3(1.0f, 0.2f, 0.5f), glm::vec3(0.0f, 1.0f, 0.0f));
+    Frustum frustum = MakeFrustum(viewProj);
+    std::vector<uint32_t> visible;
+    MeasureFrames("frustum query", duration, [&]()
+    {
+      visible.clear();
+      bvh.QueryFrustum(frustum, visible);
+    });
+
+    uint32_t numVisible = 0;
+    MeasureFrames("frustum brute force", duration, [&]()
+    {
+      numVisible = 0;
+      for (uint32_t i = 0; i < numObjects; i++)
+      {
+        bool inside = true;
+        for (const glm::vec4& plane : frustum.planes)
+        {
+          glm::vec3 normal = glm::vec3(plane);
+          glm::vec3 positive = glm::mix(bounds[i].min, bounds[i].max, glm::greaterThanEqual(normal, glm::vec3(0.0f)));
+          if (glm::dot(normal, positive) + plane.w < 0.0f)
+          {
+            inside = false;
+            break;
+          }
+        }
+        numVisible += inside ? 1 : 0;
+      }
+    });
+    printf("  %-24s %u visible, brute force %u\n", "", (uint32_t)visible.size(), numVisible);
+
+    // Rays from the center in random directions
+    std::vector<Ray> rays(NUM_RAYS);
+    for (Ray& ray : rays)
+    {
+      glm::vec3 direction;
+      for (int axis = 0; axis < 3; axis++)
+      {
+        seed = seed * 1664525u + 1013904223u;
+        direction[axis] = (float)(seed >> 8) / (float)(1 << 23) - 1.0f;
+      }
+      ray = { center, glm::normalize(direction + glm::vec3(1e-3f)) };
+    }
+    uint32_t numHits = 0;
+    MeasureFrames("1000 rays", duration, [&]()
+    {
+      numHits = 0;
+      for (const Ray& ray : rays)
+      {
+        numHits += bvh.Raycast(ray, side, nullptr) != Bvh::NO_OBJECT ? 1 : 0;
+      }
+    });
+
+    // The first rays checked against every object
+    uint32_t numMismatches = 0;
+    for (uint32_t r = 0; r < 10; r++)
+    {
+      float distance = 0.0f;
+      uint32_t hit = bvh.Raycast(rays[r], side, &distance);
+      float closest = side;
+      uint32_t closestObject = Bvh::NO_OBJECT;
+      glm::vec3 inverseDirection = 1.0f / rays[r].direction;
+      for (uint32_t i = 0; i < numObjects; i++)
+      {
+        glm::vec3 t0 = (bounds[i].min - rays[r].origin) * inverseDirection;
+        glm::vec3 t1 = (bounds[i].max - rays[r].origin) * inverseDirection;
+        glm::vec3 tNear = glm::min(t0, t1);
+        glm::vec3 tFar = glm::max(t0, t1);
+        float enter = glm::max(glm::max(tNear.x, tNear.y), glm::max(tNear.z, 0.0f));
+        float exit = glm::min(glm::min(tFar.x, tFar.y), tFar.z);
+        if (enter <= exit && enter < closest)
+        {
+          closest = enter;
+          closestObject = i;
+        }
+      }
+      numMismatches += (hit != closestObject && distance != closest) ? 1 : 0;
+    }
+    printf("  %-24s %u hits, %u of 10 differ from brute force\n", "", numHits, numMismatches);
+  }
+}
+
+// Mesh simplification
+// A UV sphere with a bumpy surface, so the levels can't just fall back to flat patches
+static void BuildBenchmarkSphere(std::vector<glm::vec3>& positions, std::vector<uint32_t>& indices, uint32_t rings, uint32_t segments)
+{
+  positions.clear();
+  indices.clear();
+  for (uint32_t ring = 0; ring <= rings; ring++)
+  {
+    float theta = glm::pi<float>() * (float)ring / (float)rings;
+    for (uint32_t segment = 0; segment <= segments; segment++)
+    {
+      float phi = 2.0f * glm::pi<float>() * (float)segment / (float)segments;
+      float radius = 0.5f + 0.02f * sinf(8.0f * theta) * sinf(8.0f * phi);
+      positions.push_back(radius * glm::vec3(sinf(theta) * cosf(phi), cosf(theta), sinf(theta) * sinf(phi)));
+    }
+  }
+  for (uint32_t ring = 0; ring < rings; ring++)
+  {
+    for (uint32_t segment = 0; segment < segments; segment++)
+    {
+      uint32_t v0 = ring * (segments + 1) + segment;
+      uint32_t v1 = v0 + segments + 1;
+      uint32_t quad[6] = { v0, v0 + 1, v1, v0 + 1, v1 + 1, v1 };
+      indices.insert(indices.end(), quad, quad + 6);
+    }
+  }
+}
+
+static void RunSimplifyBenchmark(float duration)
+{
+  std::vector<glm::vec3> positions;
+  std::vector<uint32_t> sphereIndices;
+  BuildBenchmarkSphere(positions, sphereIndices, 256, 512);
+  printf("Benchmark simplify: %u vertices, %u triangles\n", (uint32_t)positions.size(), (uint32_t)sphereIndices.size() / 3);
+
+  std::vector<uint32_t> indices;
+  MeshLod lods[MAX_MESH_LODS];
+  uint32_t numLods = 0;
+  MeasureFrames("generate lods", duration, [&]()
+  {
+    indices = sphereIndices;
+    numLods = GenerateMeshLods(positions.data(), (uint32_t)positions.size(), indices, lods);
+  });
+  for (uint32_t lod = 0; lod < numLods; lod++)
+  {
+    printf("  %-24s lod %u: %u triangles, error %.5f\n", "", lod, lods[lod].indexCount / 3, lods[lod].error);
+  }
+}
+
+// Meshlets
+static void RunMeshletsBenchmark(float duration)
+{
+  std::vector<glm::vec3> positions;
+  std::vector<uint32_t> indices;
+  BuildBenchmarkSphere(positions, indices, 256, 512);
+  printf("Benchmark meshlets: %u vertices, %u triangles\n", (uint32_t)positions.size(), (uint32_t)indices.size() / 3);
+
+  MeshletData data;
+  MeasureFrames("build meshlets", duration, [&]()
+  {
+    BuildMeshlets(positions.data(), (uint32_t)positions.size(), indices.data(), (uint32_t)indices.size(), data);
+  });
+
+  uint32_t numMeshlets = (uint32_t)data.meshlets.size();
+  printf("  %-24s %u meshlets, %.1f vertices and %.1f triangles on average\n", "", numMeshlets,
+         (float)data.vertices.size() / (float)numMeshlets, (float)data.triangles.size() / (float)numMeshlets);
+
+  // The cull test of the meshlet culling shader, for a viewer looking at the sphere from outside
+  glm::vec3 viewer(0.0f, 0.0f, 2.0f);
+  uint32_t numCulled = 0;
+  for (const Meshlet& meshlet : data.meshlets)
+  {
+    glm::vec3 center = glm::vec3(meshlet.sphere);
+    glm::vec3 toCenter = center - viewer;
+    if (glm::dot(toCenter, glm::vec3(meshlet.cone)) >= meshlet.cone.w * glm::length(toCenter) + meshlet.sphere.w)
+    {
+      numCulled++;
+    }
+  }
+  printf("  %-24s %.1f%% culled by normal cones from (0, 0, 2)\n", "", 100.0f * (float)numCulled / (float)numMeshlets);
+}
+
+// Vertex formats
+static void RunVertexFormatBenchmark(float duration)
+{
+  std::vector<glm::vec3> positions;
+  std::vector<uint32_t> indices;
+  BuildBenchmarkSphere(positions, indices, 256, 512);
+  uint32_t numVertices = (uint32_t)positions.size();
+  printf("Benchmark vertexformat: %u vertices\n", numVertices);
+
+  std::vector<glm::vec3> normals(numVertices);
+  std::vector<glm::vec3> colors(numVertices);
+  std::vector<glm::vec2> texcoords(numVertices);
+  glm::vec3 boundsMin = positions[0];
+  glm::vec3 boundsMax = positions[0];
+  for (uint32_t v = 0; v < numVertices; v++)
+  {
+    normals[v] = glm::normalize(positions[v]);
+    colors[v] = 0.5f * normals[v] + 0.5f;
+    texcoords[v] = glm::vec2(atan2f(normals[v].z, normals[v].x) / glm::two_pi<float>() + 0.5f, acosf(normals[v].y) / glm::pi<float>());
+    boundsMin = glm::min(boundsMin, positions[v]);
+    boundsMax = glm::max(boundsMax, positions[v]);
+  }
+  VertexAttributeArrays arrays = { positions.data(), normals.data(), colors.data(), texcoords.data(), numVertices };
+  VertexQuantization quantization = MakeVertexQuantization(boundsMin, boundsMax);
+
+  // Positions in stream 0, everything else in stream 1
+  const uint32_t streams[NUM_VERTEX_ATTRIBUTES] = { 0, 1, 1, 1 };
+  const VertexAttributeFormat floatFormats[NUM_VERTEX_ATTRIBUTES] = {
+    VERTEX_FORMAT_FLOAT32X3, VERTEX_FORMAT_FLOAT32X3, VERTEX_FORMAT_FLOAT32X3, VERTEX_FORMAT_FLOAT32X2 };
+  const VertexAttributeFormat quantizedFormats[NUM_VERTEX_ATTRIBUTES] = {
+    VERTEX_FORMAT_UNORM16X4, VERTEX_FORMAT_SNORM16X2_OCTAHEDRAL, VERTEX_FORMAT_UNORM8X4, VERTEX_FORMAT_FLOAT16X2 };
+  VertexLayout floatLayout = MakeVertexLayout(floatFormats, streams);
+  VertexLayout quantizedLayout = MakeVertexLayout(quantizedFormats, streams);
+
+  std::vector<char> floatStreams[MAX_VERTEX_STREAMS];
+  std::vector<char> quantizedStreams[MAX_VERTEX_STREAMS];
+  void* floatOut[MAX_VERTEX_STREAMS];
+  void* quantizedOut[MAX_VERTEX_STREAMS];
+  for (uint32_t stream = 0; stream < MAX_VERTEX_STREAMS; stream++)
+  {
+    floatStreams[stream].resize(numVertices * floatLayout.strides[stream]);
+    quantizedStreams[stream].resize(numVertices * quantizedLayout.strides[stream]);
+    floatOut[stream] = floatStreams[stream].data();
+    quantizedOut[stream] = quantizedStreams[stream].data();
+  }
+  MeasureFrames("encode float", duration / 2.0f, [&]()
+  {
+    EncodeVertices(floatLayout, arrays, quantization, floatOut);
+  });
+  MeasureFrames("encode quantized", duration / 2.0f, [&]()
+  {
+    EncodeVertices(quantizedLayout, arrays, quantization, quantizedOut);
+  });
+
+  // Decode the quantized streams the way the vertex input stage does
+  float maxPositionError = 0.0f;
+  float maxNormalError = 0.0f;
+  float maxTexcoordError = 0.0f;
+  for (uint32_t v = 0; v < numVertices; v++)
+  {
+    const char* positionVertex = &quantizedStreams[0][v * quantizedLayout.strides[0]];
+    const char* vertex = &quantizedStreams[1][v * quantizedLayout.strides[1]];
+    uint16_t position[4];
+    memcpy(position, positionVertex + quantizedLayout.offsets[VERTEX_ATTRIBUTE_POSITION], sizeof(position));
+    glm::vec3 decoded = quantization.offset + quantization.scale / 65535.0f * glm::vec3(position[0], position[1], position[2]);
+    maxPositionError = std::max(maxPositionError, glm::length(decoded - positions[v]));
+
+    int16_t normal[2];
+    memcpy(normal, vertex + quantizedLayout.offsets[VERTEX_ATTRIBUTE_NORMAL], sizeof(normal));
+    glm::vec3 decodedNormal = DecodeOctahedral(glm::vec2(normal[0], normal[1]) / 32767.0f);
+    maxNormalError = std::max(maxNormalError, acosf(glm::clamp(glm::dot(decodedNormal, normals[v]), -1.0f, 1.0f)));
+
+    uint16_t texcoord[2];
+    memcpy(texcoord, vertex + quantizedLayout.offsets[VERTEX_ATTRIBUTE_TEXCOORD], sizeof(texcoord));
+    glm::vec2 decodedTexcoord(HalfToFloat(texcoord[0]), HalfToFloat(texcoord[1]));
+    maxTexcoordError = std::max(maxTexcoordError, glm::max(fabsf(decodedTexcoord.x - texcoords[v].x), fabsf(decodedTexcoord.y - texcoords[v].y)));
+  }
+
+  // Depth-only passes read the position stream alone, shading passes all streams
+  uint32_t floatStride = floatLayout.strides[0] + floatLayout.strides[1];
+  uint32_t quantizedStride = quantizedLayout.strides[0] + quantizedLayout.strides[1];
+  printf("  %-24s shading: %u -> %u bytes per vertex, %.1f -> %.1f MB per pass (%.0f%% saved)\n", "",
+         floatStride, quantizedStride, (float)(numVertices * floatStride) / 1e6f, (float)(numVertices * quantizedStride) / 1e6f,
+         100.0f * (1.0f - (float)quantizedStride / (float)floatStride));
+  printf("  %-24s depth only: %u -> %u bytes per vertex, %.0f%% and %.0f%% saved over reading interleaved floats\n", "",
+         floatLayout.strides[0], quantizedLayout.strides[0],
+         100.0f * (1.0f - (float)floatLayout.strides[0] / (float)floatStride),
+         100.0f * (1.0f - (float)quantizedLayout.strides[0] / (float)floatStride));
+  printf("  %-24s max error: position %.2e of the bounds, normal %.4f deg, texcoord %.2e\n", "",
+         maxPositionError / quantization.scale, glm::degrees(maxNormalError), maxTexcoordError);
+}
+
+static const struct CpuBenchmark
+{
+  const char* name;
+  void (*run)(float duration);
+} g_CpuBenchmarks[] = {
+  {"scenegraph", RunSceneGraphBenchmark},
+  {"transforms", RunTransformsBenchmark},
+  {"entities", RunEntitiesBenchmark},
+  {"drawsort", RunDrawSortBenchmark},
+  {"bvh", RunBvhBenchmark},
+  {"simplify", RunSimplifyBenchmark},
+  {"meshlets", RunMeshletsBenchmark},
+  {"vertexformat", RunVertexFormatBenchmark}
+};
+
+bool IsCpuBenchmark(const char* name)
+{
+  for (const CpuBenchmark& benchmark : g_CpuBenchmarks)
+  {
+    if (strcmp(benchmark.name, name) == 0)
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool RunCpuBenchmark(const char* name, float duration)
+{
+  for (const CpuBenchmark& benchmark : g_CpuBenchmarks)
+  {
+    if (strcmp(benchmark.name, name) == 0)
+    {
+      benchmark.run(duration);
+      return true;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+// CPU-only benchmarks, run headless before any window or device is created
+
+bool IsCpuBenchmark(const char* name);
+
+// Runs the benchmark for about `duration` seconds after a warm-up second
+// and prints a summary. Returns false if the name is unknown.
+bool RunCpuBenchmark(const char* name, float duration);
@@ -0,0 +1,415 @@
+#include "Bvh.h"
+
+#include <algorithm>
+#include <float.h>
+
+// Leaves are only forced below this depth, which bounds the query stacks
+static const uint32_t MAX_DEPTH = 48;
+static const uint32_t MAX_LEAF_OBJECTS = 8;
+static const uint32_t NUM_SAH_BINS = 16;
+
+static Aabb EmptyAabb()
+{
+  return { glm::vec3(FLT_MAX), glm::vec3(-FLT_MAX) };
+}
+
+static void Grow(Aabb& box, const Aabb& other)
+{
+  box.min = glm::min(box.min, other.min);
+  box.max = glm::max(box.max, other.max);
+}
+
+static float SurfaceArea(const Aabb& box)
+{
+  glm::vec3 extent = glm::max(box.max - box.min, glm::vec3(0.0f));
+  return 2.0f * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+}
+
+Aabb TransformAabb(const Aabb& box, const glm::mat4x4& transform)
+{
+  glm::vec3 center = 0.5f * (box.min + box.max);
+  glm::vec3 extent = 0.5f * (box.max - box.min);
+  glm::vec3 newCenter = glm::vec3(transform * glm::vec4(center, 1.0f));
+  glm::vec3 newExtent =
+    glm::abs(glm::vec3(transform[0])) * extent.x +
+    glm::abs(glm::vec3(transform[1])) * extent.y +
+    glm::abs(glm::vec3(transform[2])) * extent.z;
+  return { newCenter - newExtent, newCenter + newExtent };
+}
+
+Frustum MakeFrustum(const glm::mat4x4& viewProj)
+{
+  glm::vec4 rows[4];
+  for (int i = 0; i < 4; i++)
+  {
+    rows[i] = glm::vec4(viewProj[0][i], viewProj[1][i], viewProj[2][i], viewProj[3][i]);
+  }
+
+  Frustum frustum;
+  frustum.planes[0] = rows[3] + rows[0]; // left
+  frustum.planes[1] = rows[3] - rows[0]; // right
+  frustum.planes[2] = rows[3] + rows[1]; // bottom
+  frustum.planes[3] = rows[3] - rows[1]; // top
+  frustum.planes[4] = rows[3] + rows[2]; // near
+  frustum.planes[5] = rows[3] - rows[2]; // far
+  for (glm::vec4& plane : frustum.planes)
+  {
+    plane /= glm::length(glm::vec3(plane));
+  }
+  return frustum;
+}
+
+Ray MakeRay(const glm::mat4x4& viewProj, float ndcX, float ndcY)
+{
+  glm::mat4x4 inverseViewProj = glm::inverse(viewProj);
+  glm::vec4 nearPoint = inverseViewProj * glm::vec4(ndcX, ndcY, -1.0f, 1.0f);
+  glm::vec4 farPoint = inverseViewProj * glm::vec4(ndcX, ndcY, 1.0f, 1.0f);
+  glm::vec3 origin = glm::vec3(nearPoint) / nearPoint.w;
+  glm::vec3 target = glm::vec3(farPoint) / farPoint.w;
+  return { origin, glm::normalize(target - origin) };
+}
+
+void Bvh::Build(const Aabb* bounds, uint32_t numObjects)
+{
+  m_Objects.resize(numObjects);
+  m_Centroids.resize(numObjects);
+  m_Nodes.clear();
+  m_Nodes.reserve(numObjects > 0 ? 2 * numObjects - 1 : 0);
+
+  Aabb rootBounds = EmptyAabb();
+  for (uint32_t i = 0; i < numObjects; i++)
+  {
+    m_Objects[i] = i;
+    m_Centroids[i] = 0.5f * (bounds[i].min + bounds[i].max);
+    Grow(rootBounds, bounds[i]);
+  }
+  m_Nodes.push_back({ rootBounds, 0, 0, numObjects });
+
+  struct BuildEntry
+  {
+    uint32_t node;
+    uint32_t depth;
+  };
+  std::vector<BuildEntry> stack;
+  stack.push_back({ 0, 0 });
+  while (!stack.empty())
+  {
+    BuildEntry entry = stack.back();
+    stack.pop_back();
+
+    uint32_t leftCount = entry.depth + 1 < MAX_DEPTH ? Split(entry.node, bounds) : 0;
+    if (leftCount == 0)
+    {
+      continue;
+    }
+
+    Node node = m_Nodes[entry.node];
+    uint32_t child = (uint32_t)m_Nodes.size();
+    m_Nodes[entry.node].child = child;
+    m_Nodes.push_back({ EmptyAabb(), 0, node.first, leftCount });
+    m_Nodes.push_back({ EmptyAabb(), 0, node.first + leftCount, node.count - leftCount });
+    for (uint32_t i = child; i < child + 2; i++)
+    {
+      for (uint32_t j = m_Nodes[i].first; j < m_Nodes[i].first + m_Nodes[i].count; j++)
+      {
+        Grow(m_Nodes[i].bounds, bounds[m_Objects[j]]);
+      }
+      stack.push_back({ i, entry.depth + 1 });
+    }
+  }
+
+  m_ObjectBounds.resize(numObjects);
+  for (uint32_t i = 0; i < numObjects; i++)
+  {
+    m_ObjectBounds[i] = bounds[m_Objects[i]];
+  }
+  m_Centroids.clear();
+  m_Centroids.shrink_to_fit();
+  m_Cost = ComputeCost();
+  m_BuildCost = m_Cost;
+}
+
+// Partitions the node's objects along the cheapest binned SAH plane and returns
+// the size of the left half, or 0 if the node is better off as a leaf
+uint32_t Bvh::Split(uint32_t nodeIndex, const Aabb* bounds)
+{
+  const Node& node = m_Nodes[nodeIndex];
+  if (node.count <= 2)
+  {
+    return 0;
+  }
+
+  uint32_t* objects = m_Objects.data() + node.first;
+  glm::vec3 centroidMin(FLT_MAX);
+  glm::vec3 centroidMax(-FLT_MAX);
+  for (uint32_t i = 0; i < node.count; i++)
+  {
+    centroidMin = glm::min(centroidMin, m_Centroids[objects[i]]);
+    centroidMax = glm::max(centroidMax, m_Centroids[objects[i]]);
+  }
+
+  float bestCost = FLT_MAX;
+  int bestAxis = -1;
+  uint32_t bestPlane = 0;
+  for (int axis = 0; axis < 3; axis++)
+  {
+    float extent = centroidMax[axis] - centroidMin[axis];
+    if (extent <= 0.0f)
+    {
+      continue;
+    }
+    float scale = (float)NUM_SAH_BINS / extent;
+
+    Aabb binBounds[NUM_SAH_BINS];
+    uint32_t binCounts[NUM_SAH_BINS] = {};
+    for (uint32_t bin = 0; bin < NUM_SAH_BINS; bin++)
+    {
+      binBounds[bin] = EmptyAabb();
+    }
+    for (uint32_t i = 0; i < node.count; i++)
+    {
+      uint32_t bin = std::min((uint32_t)((m_Centroids[objects[i]][axis] - centroidMin[axis]) * scale), NUM_SAH_BINS - 1);
+      binCounts[bin]++;
+      Grow(binBounds[bin], bounds[objects[i]]);
+    }
+
+    // Sweep from the right to get the cost of everything right of each plane
+    float rightCosts[NUM_SAH_BINS];
+    Aabb rightBounds = EmptyAabb();
+    uint32_t rightCount = 0;
+    for (uint32_t plane = NUM_SAH_BINS - 1; plane > 0; plane--)
+    {
+      Grow(rightBounds, binBounds[plane]);
+      rightCount += binCounts[plane];
+      rightCosts[plane] = rightCount > 0 ? SurfaceArea(rightBounds) * (float)rightCount : 0.0f;
+    }
+
+    Aabb leftBounds = EmptyAabb();
+    uint32_t leftCount = 0;
+    for (uint32_t plane = 1; plane < NUM_SAH_BINS; plane++)
+    {
+      Grow(leftBounds, binBounds[plane - 1]);
+      leftCount += binCounts[plane - 1];
+      if (leftCount == 0 || leftCount == node.count)
+      {
+        continue;
+      }
+      float cost = SurfaceArea(leftBounds) * (float)leftCount + rightCosts[plane];
+      if (cost < bestCost)
+      {
+        bestCost = cost;
+        bestAxis = axis;
+        bestPlane = plane;
+      }
+    }
+  }
+
+  // Traversing an extra node is assumed to cost about as much as one object test
+  float leafCost = SurfaceArea(node.bounds) * (float)node.count;
+  float splitCost = SurfaceArea(node.bounds) + bestCost;
+  if (bestAxis < 0 || splitCost >= leafCost)
+  {
+    if (node.count <= MAX_LEAF_OBJECTS)
+    {
+      return 0;
+    }
+    if (bestAxis < 0)
+    {
+      // All centroids coincide, any split is as good as the other
+      return node.count / 2;
+    }
+  }
+
+  float scale = (float)NUM_SAH_BINS / (centroidMax[bestAxis] - centroidMin[bestAxis]);
+  uint32_t* middle = std::partition(objects, objects + node.count, [&](uint32_t object)
+  {
+    uint32_t bin = std::min((uint32_t)((m_Centroids[object][bestAxis] - centroidMin[bestAxis]) * scale), NUM_SAH_BINS - 1);
+    return bin < bestPlane;
+  });
+  return (uint32_t)(middle - objects);
+}
+
+void Bvh::Refit(const Aabb* bounds)
+{
+  for (uint32_t i = (uint32_t)m_Nodes.size(); i-- > 0;)
+  {
+    Node& node = m_Nodes[i];
+    if (node.child == 0)
+    {
+      node.bounds = EmptyAabb();
+      for (uint32_t j = node.first; j < node.first + node.count; j++)
+      {
+        m_ObjectBounds[j] = bounds[m_Objects[j]];
+        Grow(node.bounds, m_ObjectBounds[j]);
+      }
+    }
+    else
+    {
+      node.bounds = m_Nodes[node.child].bounds;
+      Grow(node.bounds, m_Nodes[node.child + 1].bounds);
+    }
+  }
+  m_Cost = ComputeCost();
+}
+
+// SAH cost of the tree relative to its root, with the same weights Split() uses
+float Bvh::ComputeCost() const
+{
+  if (m_Nodes.empty())
+  {
+    return 0.0f;
+  }
+  float cost = 0.0f;
+  for (const Node& node : m_Nodes)
+  {
+    cost += SurfaceArea(node.bounds) * (node.child == 0 ? (float)node.count : 1.0f);
+  }
+  float rootArea = SurfaceArea(m_Nodes[0].bounds);
+  return rootArea > 0.0f ? cost / rootArea : 0.0f;
+}
+
+// Returns false if box is outside one of the planes in planeMask, and
+// clears the bits of the planes box is completely inside of
+static bool TestFrustumPlanes(const Frustum& frustum, const Aabb& box, uint32_t& planeMask)
+{
+  for (uint32_t p = 0; p < 6; p++)
+  {
+    if ((planeMask & (1u << p)) == 0)
+    {
+      continue;
+    }
+    const glm::vec4& plane = frustum.planes[p];
+    glm::vec3 normal = glm::vec3(plane);
+    glm::bvec3 positiveAxes = glm::greaterThanEqual(normal, glm::vec3(0.0f));
+    if (glm::dot(normal, glm::mix(box.min, box.max, positiveAxes)) + plane.w < 0.0f)
+    {
+      return false;
+    }
+    if (glm::dot(normal, glm::mix(box.max, box.min, positiveAxes)) + plane.w >= 0.0f)
+    {
+      planeMask &= ~(1u << p);
+    }
+  }
+  return true;
+}
+
+void Bvh::QueryFrustum(const Frustum& frustum, std::vector<uint32_t>& outObjects) const
+{
+  if (m_Nodes.empty())
+  {
+    return;
+  }
+
+  // Planes a node is already known to be inside of are not tested for its children
+  const uint32_t ALL_PLANES = 0x3F;
+  struct QueryEntry
+  {
+    uint32_t node;
+    uint32_t planeMask;
+  };
+  QueryEntry stack[MAX_DEPTH + 1];
+  uint32_t stackSize = 0;
+  stack[stackSize++] = { 0, ALL_PLANES };
+  while (stackSize > 0)
+  {
+    QueryEntry entry = stack[--stackSize];
+    const Node& node = m_Nodes[entry.node];
+    if (!TestFrustumPlanes(frustum, node.bounds, entry.planeMask))
+    {
+      continue;
+    }
+
+    if (entry.planeMask == 0)
+    {
+      outObjects.insert(outObjects.end(), m_Objects.begin() + node.first, m_Objects.begin() + node.first + node.count);
+    }
+    else if (node.child == 0)
+    {
+      for (uint32_t i = node.first; i < node.first + node.count; i++)
+      {
+        uint32_t planeMask = entry.planeMask;
+        if (TestFrustumPlanes(frustum, m_ObjectBounds[i], planeMask))
+        {
+          outObjects.push_back(m_Objects[i]);
+        }
+      }
+    }
+    else
+    {
+      stack[stackSize++] = { node.child, entry.planeMask };
+      stack[stackSize++] = { node.child + 1, entry.planeMask };
+    }
+  }
+}
+
+// Ray entry distance into box, or FLT_MAX if the ray misses it
+static float IntersectRayAabb(const glm::vec3& origin, const glm::vec3& inverseDirection, const Aabb& box)
+{
+  glm::vec3 t0 = (box.min - origin) * inverseDirection;
+  glm::vec3 t1 = (box.max - origin) * inverseDirection;
+  glm::vec3 tNear = glm::min(t0, t1);
+  glm::vec3 tFar = glm::max(t0, t1);
+  float enter = glm::max(glm::max(tNear.x, tNear.y), glm::max(tNear.z, 0.0f));
+  float exit = glm::min(glm::min(tFar.x, tFar.y), tFar.z);
+  return enter <= exit ? enter : FLT_MAX;
+}
+
+uint32_t Bvh::Raycast(const Ray& ray, float maxDistance, float* outDistance) const
+{
+  uint32_t closestObject = NO_OBJECT;
+  float closestDistance = maxDistance;
+  if (m_Nodes.empty())
+  {
+    return closestObject;
+  }
+
+  glm::vec3 inverseDirection = 1.0f / ray.direction;
+  uint32_t stack[MAX_DEPTH + 1];
+  uint32_t stackSize = 0;
+  if (IntersectRayAabb(ray.origin, inverseDirection, m_Nodes[0].bounds) < closestDistance)
+  {
+    stack[stackSize++] = 0;
+  }
+  while (stackSize > 0)
+  {
+    const Node& node = m_Nodes[stack[--stackSize]];
+    if (node.child == 0)
+    {
+      for (uint32_t i = node.first; i < node.first + node.count; i++)
+      {
+        float distance = IntersectRayAabb(ray.origin, inverseDirection, m_ObjectBounds[i]);
+        if (distance < closestDistance)
+        {
+          closestDistance = distance;
+          closestObject = m_Objects[i];
+        }
+      }
+      continue;
+    }
+
+    // Visit the nearer child first, the farther one is often pruned by then
+    float leftDistance = IntersectRayAabb(ray.origin, inverseDirection, m_Nodes[node.child].bounds);
+    float rightDistance = IntersectRayAabb(ray.origin, inverseDirection, m_Nodes[node.child + 1].bounds);
+    uint32_t nearChild = node.child;
+    uint32_t farChild = node.child + 1;
+    if (rightDistance < leftDistance)
+    {
+      std::swap(nearChild, farChild);
+      std::swap(leftDistance, rightDistance);
+    }
+    if (rightDistance < closestDistance)
+    {
+      stack[stackSize++] = farChild;
+    }
+    if (leftDistance < closestDistance)
+    {
+      stack[stackSize++] = nearChild;
+    }
+  }
+
+  if (outDistance != nullptr && closestObject != NO_OBJECT)
+  {
+    *outDistance = closestDistance;
+  }
+  return closestObject;
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+#include "glm/glm.hpp"
+
+struct Aabb
+{
+  glm::vec3 min;
+  glm::vec3 max;
+};
+
+// Bounds of the eight transformed corners of box
+Aabb TransformAabb(const Aabb& box, const glm::mat4x4& transform);
+
+// Planes point inwards, a point p is inside when dot(plane, vec4(p, 1)) >= 0 for all six
+struct Frustum
+{
+  glm::vec4 planes[6];
+};
+
+// Extracts the planes of a GL style (-1 to 1 depth) projection * view matrix
+Frustum MakeFrustum(const glm::mat4x4& viewProj);
+
+struct Ray
+{
+  glm::vec3 origin;
+  glm::vec3 direction;
+};
+
+// Ray through a point given in normalized device coordinates
+Ray MakeRay(const glm::mat4x4& viewProj, float ndcX, float ndcY);
+
+// Bounding volume hierarchy over object bounds. Build() splits nodes with a
+// binned surface area heuristic, Refit() keeps the topology and recomputes
+// node bounds bottom-up after objects have moved. Refitting degrades the
+// tree as objects drift apart, GetRefitCostRatio() tells when to rebuild.
+class Bvh
+{
+public:
+  static const uint32_t NO_OBJECT = (uint32_t)-1;
+
+  void Build(const Aabb* bounds, uint32_t numObjects);
+  // bounds must hold the same objects Build() was given
+  void Refit(const Aabb* bounds);
+
+  // Appends the objects whose bounds intersect the frustum
+  void QueryFrustum(const Frustum& frustum, std::vector<uint32_t>& outObjects) const;
+  // Closest object whose bounds the ray enters within maxDistance, or NO_OBJECT
+  uint32_t Raycast(const Ray& ray, float maxDistance, float* outDistance) const;
+
+  uint32_t GetNumObjects() const { return (uint32_t)m_Objects.size(); }
+  uint32_t GetNumNodes() const { return (uint32_t)m_Nodes.size(); }
+  // SAH cost of the current bounds relative to the cost right after Build()
+  float GetRefitCostRatio() const { return m_BuildCost > 0.0f ? m_Cost / m_BuildCost : 1.0f; }
+
+private:
+  // Children are stored after their parent, left child at index child and
+  // right child at child + 1. Every node covers the contiguous range
+  // [first, first + count) of m_Objects, leaves have child == 0.
+  struct Node
+  {
+    Aabb bounds;
+    uint32_t child;
+    uint32_t first;
+    uint32_t count;
+  };
+
+  uint32_t Split(uint32_t node, const Aabb* bounds);
+  float ComputeCost() const;
+
+  std::vector<Node> m_Nodes;
+  std::vector<uint32_t> m_Objects;
+  // Bounds of m_Objects[i], so leaves read them contiguously
+  std::vector<Aabb> m_ObjectBounds;
+  // Object centroids, only needed during Build()
+  std::vector<glm::vec3> m_Centroids;
+  float m_BuildCost = 0.0f;
+  float m_Cost = 0.0f;
+};
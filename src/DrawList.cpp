@@ -0,0 +1,122 @@
+#include "DrawList.h"
+
+#include <utility>
+
+#include "SDL.h"
+
+#include "ParallelFor.h"
+
+uint64_t MakeDrawSortKey(uint32_t pass, uint32_t pipeline, uint32_t material, uint32_t mesh, uint32_t depth)
+{
+  uint64_t key = pass & ((1u << DRAW_KEY_PASS_BITS) - 1);
+  key = (key << DRAW_KEY_PIPELINE_BITS) | (pipeline & ((1u << DRAW_KEY_PIPELINE_BITS) - 1));
+  key = (key << DRAW_KEY_MATERIAL_BITS) | (material & ((1u << DRAW_KEY_MATERIAL_BITS) - 1));
+  key = (key << DRAW_KEY_MESH_BITS) | (mesh & ((1u << DRAW_KEY_MESH_BITS) - 1));
+  key = (key << DRAW_KEY_DEPTH_BITS) | (depth & ((1u << DRAW_KEY_DEPTH_BITS) - 1));
+  return key;
+}
+
+uint32_t QuantizeDrawDepth(float viewDepth, float nearPlane, float farPlane)
+{
+  float t = (viewDepth - nearPlane) / (farPlane - nearPlane);
+  t = t < 0.0f ? 0.0f : (t > 1.0f ? 1.0f : t);
+  return (uint32_t)(t * (float)((1u << DRAW_KEY_DEPTH_BITS) - 1) + 0.5f);
+}
+
+void DrawList::Clear()
+{
+  m_Keys.clear();
+  m_Items.clear();
+}
+
+void DrawList::Reserve(uint32_t count)
+{
+  m_Keys.reserve(count);
+  m_Items.reserve(count);
+}
+
+void DrawList::Sort()
+{
+  const uint32_t RADIX = 256;
+  const uint32_t MIN_KEYS_PER_BLOCK = 16 * 1024;
+
+  m_NumSortPasses = 0;
+  uint32_t count = GetCount();
+  if (count < 2)
+  {
+    return;
+  }
+
+  // Bits that differ from the first key differ somewhere
+  uint64_t varyingBits = 0;
+  for (uint32_t i = 1; i < count; i++)
+  {
+    varyingBits |= m_Keys[i] ^ m_Keys[0];
+  }
+
+  // Each block gets its own histogram, and blocks scatter in order, which keeps the sort stable
+  uint32_t numBlocks = count / MIN_KEYS_PER_BLOCK;
+  uint32_t numCores = (uint32_t)SDL_GetCPUCount();
+  numBlocks = numBlocks < 1 ? 1 : (numBlocks > numCores ? numCores : numBlocks);
+  m_Histograms.resize(numBlocks * RADIX);
+  m_ScratchKeys.resize(count);
+  m_ScratchItems.resize(count);
+
+  for (uint32_t shift = 0; shift < 64; shift += 8)
+  {
+    if (((varyingBits >> shift) & 0xFF) == 0)
+    {
+      continue;
+    }
+
+    ParallelFor(numBlocks, 1, [this, count, numBlocks, shift](uint32_t firstBlock, uint32_t endBlock)
+    {
+      for (uint32_t block = firstBlock; block < endBlock; block++)
+      {
+        uint32_t* histogram = &m_Histograms[block * RADIX];
+        for (uint32_t bucket = 0; bucket < RADIX; bucket++)
+        {
+          histogram[bucket] = 0;
+        }
+        uint32_t begin = (uint32_t)((uint64_t)count * block / numBlocks);
+        uint32_t end = (uint32_t)((uint64_t)count * (block + 1) / numBlocks);
+        for (uint32_t i = begin; i < end; i++)
+        {
+          histogram[(m_Keys[i] >> shift) & 0xFF]++;
+        }
+      }
+    });
+
+    // Exclusive prefix sum, bucket-major so earlier blocks come first within a bucket
+    uint32_t offset = 0;
+    for (uint32_t bucket = 0; bucket < RADIX; bucket++)
+    {
+      for (uint32_t block = 0; block < numBlocks; block++)
+      {
+        uint32_t bucketCount = m_Histograms[block * RADIX + bucket];
+        m_Histograms[block * RADIX + bucket] = offset;
+        offset += bucketCount;
+      }
+    }
+
+    ParallelFor(numBlocks, 1, [this, count, numBlocks, shift](uint32_t firstBlock, uint32_t endBlock)
+    {
+      for (uint32_t block = firstBlock; block < endBlock; block++)
+      {
+        uint32_t* offsets = &m_Histograms[block * RADIX];
+        uint32_t begin = (uint32_t)((uint64_t)count * block / numBlocks);
+        uint32_t end = (uint32_t)((uint64_t)count * (block + 1) / numBlocks);
+        for (uint32_t i = begin; i < end; i++)
+        {
+          uint32_t destination = offsets[(m_Keys[i] >> shift) & 0xFF]++;
+          m_ScratchKeys[destination] = m_Keys[i];
+          m_ScratchItems[destination] = m_Items[i];
+        }
+      }
+    });
+
+    std::swap(m_Keys, m_ScratchKeys);
+    std::swap(m_Items, m_ScratchItems);
+    m_NumSortPasses++;
+  }
+}
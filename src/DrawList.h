@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+// Draw packets are sorted by a 64-bit key so that draws sharing state end
+// up next to each other. From the most significant bits down:
+//
+//   pass (4) | pipeline (8) | material (16) | mesh (20) | depth (16)
+//
+// Depth is last, so it only orders draws that share all other state. The
+// mesh field holds mesh and LOD. Fields are truncated to their width, so
+// callers merging draws by key must still compare the state itself.
+static const uint32_t DRAW_KEY_PASS_BITS = 4;
+static const uint32_t DRAW_KEY_PIPELINE_BITS = 8;
+static const uint32_t DRAW_KEY_MATERIAL_BITS = 16;
+static const uint32_t DRAW_KEY_MESH_BITS = 20;
+static const uint32_t DRAW_KEY_DEPTH_BITS = 16;
+static_assert(DRAW_KEY_PASS_BITS + DRAW_KEY_PIPELINE_BITS + DRAW_KEY_MATERIAL_BITS + DRAW_KEY_MESH_BITS + DRAW_KEY_DEPTH_BITS == 64,
+              "Draw sort key fields must fill 64 bits");
+
+uint64_t MakeDrawSortKey(uint32_t pass, uint32_t pipeline, uint32_t material, uint32_t mesh, uint32_t depth);
+
+// Maps view depth in [nearPlane, farPlane] to the key's depth bits,
+// increasing with distance (front to back). Flip for back to front.
+uint32_t QuantizeDrawDepth(float viewDepth, float nearPlane, float farPlane);
+
+class DrawList
+{
+public:
+  void Clear();
+  void Reserve(uint32_t count);
+  // item is the caller's index of the draw, returned in sorted order by GetItems()
+  void Add(uint64_t key, uint32_t item)
+  {
+    m_Keys.push_back(key);
+    m_Items.push_back(item);
+  }
+
+  // Stable LSD radix sort, one byte per pass. Histograms and scatters are
+  // split across cores, and bytes that are equal in all keys are skipped.
+  void Sort();
+
+  uint32_t GetCount() const { return (uint32_t)m_Keys.size(); }
+  const uint64_t* GetKeys() const { return m_Keys.data(); }
+  const uint32_t* GetItems() const { return m_Items.data(); }
+  // Number of radix passes the last Sort() needed
+  uint32_t GetNumSortPasses() const { return m_NumSortPasses; }
+
+private:
+  std::vector<uint64_t> m_Keys;
+  std::vector<uint32_t> m_Items;
+  std::vector<uint64_t> m_ScratchKeys;
+  std::vector<uint32_t> m_ScratchItems;
+  std::vector<uint32_t> m_Histograms;
+  uint32_t m_NumSortPasses = 0;
+};
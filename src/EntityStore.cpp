@@ -0,0 +1,241 @@
+#include "EntityStore.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Component type registry
+static struct ComponentTypeInfo
+{
+  uint32_t size;
+  uint32_t alignment;
+} g_ComponentTypes[MAX_COMPONENT_TYPES];
+static uint32_t g_NumComponentTypes = 0;
+
+uint32_t RegisterComponentType(uint32_t size, uint32_t alignment)
+{
+  if (g_NumComponentTypes >= MAX_COMPONENT_TYPES)
+  {
+    abort();
+  }
+  g_ComponentTypes[g_NumComponentTypes] = { size, alignment };
+  return g_NumComponentTypes++;
+}
+
+static uint32_t AlignUp(uint32_t value, uint32_t alignment)
+{
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+static Entity MakeEntity(uint32_t index, uint32_t generation)
+{
+  return ((Entity)generation << 32) | index;
+}
+
+EntityStore::~EntityStore()
+{
+  Clear();
+}
+
+void EntityStore::Clear()
+{
+  for (Archetype* archetype : m_Archetypes)
+  {
+    for (Chunk& chunk : archetype->chunks)
+    {
+      free(chunk.allocation);
+    }
+    delete archetype;
+  }
+  m_Archetypes.clear();
+  m_Records.clear();
+  m_FreeRecords.clear();
+  m_NumEntities = 0;
+}
+
+// Arrays are aligned to their component's alignment, and to 16 bytes at least
+static uint32_t GetArrayAlignment(uint32_t type)
+{
+  const uint32_t MIN_ARRAY_ALIGNMENT = 16;
+  return g_ComponentTypes[type].alignment > MIN_ARRAY_ALIGNMENT ? g_ComponentTypes[type].alignment : MIN_ARRAY_ALIGNMENT;
+}
+
+uint32_t EntityStore::GetOrCreateArchetype(ComponentMask mask)
+{
+  for (uint32_t i = 0; i < (uint32_t)m_Archetypes.size(); i++)
+  {
+    if (m_Archetypes[i]->mask == mask)
+    {
+      return i;
+    }
+  }
+
+  // Aligning an array costs at most its alignment minus one byte, the
+  // entity array comes first and needs nothing
+  uint32_t bytesPerEntity = (uint32_t)sizeof(Entity);
+  uint32_t alignmentBytes = 0;
+  uint32_t chunkAlignment = GetArrayAlignment(0);
+  for (uint32_t type = 0; type < g_NumComponentTypes; type++)
+  {
+    if (mask & ((ComponentMask)1 << type))
+    {
+      bytesPerEntity += g_ComponentTypes[type].size;
+      alignmentBytes += GetArrayAlignment(type) - 1;
+      chunkAlignment = GetArrayAlignment(type) > chunkAlignment ? GetArrayAlignment(type) : chunkAlignment;
+    }
+  }
+  // Not even one entity fits a chunk
+  if (alignmentBytes >= CHUNK_SIZE || (CHUNK_SIZE - alignmentBytes) / bytesPerEntity == 0)
+  {
+    return INVALID_ARCHETYPE;
+  }
+
+  Archetype* archetype = new Archetype();
+  archetype->mask = mask;
+  archetype->capacity = (CHUNK_SIZE - alignmentBytes) / bytesPerEntity;
+  archetype->alignment = chunkAlignment;
+
+  uint32_t offset = 0;
+  archetype->entityOffset = offset;
+  offset += archetype->capacity * (uint32_t)sizeof(Entity);
+  for (uint32_t type = 0; type < MAX_COMPONENT_TYPES; type++)
+  {
+    archetype->componentOffsets[type] = INVALID_OFFSET;
+    if (type < g_NumComponentTypes && (mask & ((ComponentMask)1 << type)))
+    {
+      offset = AlignUp(offset, GetArrayAlignment(type));
+      archetype->componentOffsets[type] = offset;
+      offset += archetype->capacity * g_ComponentTypes[type].size;
+    }
+  }
+
+  m_Archetypes.push_back(archetype);
+  return (uint32_t)m_Archetypes.size() - 1;
+}
+
+Entity EntityStore::Create(ComponentMask mask)
+{
+  uint32_t archetypeIndex = GetOrCreateArchetype(mask);
+  if (archetypeIndex == INVALID_ARCHETYPE)
+  {
+    return INVALID_ENTITY;
+  }
+  Archetype& archetype = *m_Archetypes[archetypeIndex];
+  if (archetype.chunks.empty() || archetype.chunks.back().count == archetype.capacity)
+  {
+    // malloc only guarantees fundamental alignment, so the chunk is
+    // placed at the archetype's alignment inside a larger block
+    Chunk chunk;
+    chunk.allocation = (uint8_t*)malloc(CHUNK_SIZE + archetype.alignment - 1);
+    if (chunk.allocation == nullptr)
+    {
+      return INVALID_ENTITY;
+    }
+    chunk.data = (uint8_t*)(((uintptr_t)chunk.allocation + archetype.alignment - 1) / archetype.alignment * archetype.alignment);
+    chunk.count = 0;
+    archetype.chunks.push_back(chunk);
+  }
+
+  uint32_t index;
+  if (!m_FreeRecords.empty())
+  {
+    index = m_FreeRecords.back();
+    m_FreeRecords.pop_back();
+  }
+  else
+  {
+    index = (uint32_t)m_Records.size();
+    m_Records.push_back({ 0, 0, 0, 0 });
+  }
+
+  Chunk& chunk = archetype.chunks.back();
+  EntityRecord& record = m_Records[index];
+  record.archetype = archetypeIndex;
+  record.chunk = (uint32_t)archetype.chunks.size() - 1;
+  record.row = chunk.count++;
+
+  Entity entity = MakeEntity(index, record.generation);
+  ((Entity*)(chunk.data + archetype.entityOffset))[record.row] = entity;
+  for (uint32_t type = 0; type < g_NumComponentTypes; type++)
+  {
+    uint32_t offset = archetype.componentOffsets[type];
+    if (offset != INVALID_OFFSET)
+    {
+      uint32_t size = g_ComponentTypes[type].size;
+      memset(chunk.data + offset + record.row * size, 0, size);
+    }
+  }
+
+  m_NumEntities++;
+  return entity;
+}
+
+void EntityStore::Destroy(Entity entity)
+{
+  if (!IsAlive(entity))
+  {
+    return;
+  }
+
+  EntityRecord& record = m_Records[(uint32_t)entity];
+  Archetype& archetype = *m_Archetypes[record.archetype];
+  Chunk& chunk = archetype.chunks[record.chunk];
+  Chunk& lastChunk = archetype.chunks.back();
+  uint32_t lastRow = lastChunk.count - 1;
+
+  // Fill the hole with the archetype's last entity
+  if (&chunk != &lastChunk || record.row != lastRow)
+  {
+    Entity* entities = (Entity*)(chunk.data + archetype.entityOffset);
+    Entity* lastEntities = (Entity*)(lastChunk.data + archetype.entityOffset);
+    Entity moved = lastEntities[lastRow];
+    entities[record.row] = moved;
+    for (uint32_t type = 0; type < g_NumComponentTypes; type++)
+    {
+      uint32_t offset = archetype.componentOffsets[type];
+      if (offset != INVALID_OFFSET)
+      {
+        uint32_t size = g_ComponentTypes[type].size;
+        memcpy(chunk.data + offset + record.row * size, lastChunk.data + offset + lastRow * size, size);
+      }
+    }
+
+    EntityRecord& movedRecord = m_Records[(uint32_t)moved];
+    movedRecord.chunk = record.chunk;
+    movedRecord.row = record.row;
+  }
+
+  lastChunk.count--;
+  if (lastChunk.count == 0)
+  {
+    free(lastChunk.allocation);
+    archetype.chunks.pop_back();
+  }
+
+  record.generation++;
+  m_FreeRecords.push_back((uint32_t)entity);
+  m_NumEntities--;
+}
+
+bool EntityStore::IsAlive(Entity entity) const
+{
+  uint32_t index = (uint32_t)entity;
+  return index < m_Records.size() && m_Records[index].generation == (uint32_t)(entity >> 32);
+}
+
+uint32_t EntityStore::CollectChunks(ComponentMask mask, std::vector<ChunkView>& outChunks) const
+{
+  uint32_t numEntities = 0;
+  for (const Archetype* archetype : m_Archetypes)
+  {
+    if ((archetype->mask & mask) != mask)
+    {
+      continue;
+    }
+    for (const Chunk& chunk : archetype->chunks)
+    {
+      outChunks.push_back({ archetype, &chunk, numEntities });
+      numEntities += chunk.count;
+    }
+  }
+  return numEntities;
+}
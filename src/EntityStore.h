@@ -0,0 +1,158 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+// Entities are grouped by archetype, the exact set of components they
+// have. Each archetype stores its entities in fixed-size chunks, with one
+// contiguous array per component inside every chunk, so iterating over a
+// component set walks memory linearly. Chunks are kept dense by moving the
+// archetype's last entity into the hole left by a destroyed one.
+//
+// Components must be trivially copyable, they are moved with memcpy and
+// start out zeroed.
+
+typedef uint64_t Entity;
+static const Entity INVALID_ENTITY = (Entity)-1;
+
+typedef uint64_t ComponentMask;
+static const uint32_t MAX_COMPONENT_TYPES = 64;
+
+uint32_t RegisterComponentType(uint32_t size, uint32_t alignment);
+
+template<typename T>
+uint32_t ComponentTypeId()
+{
+  static const uint32_t id = RegisterComponentType((uint32_t)sizeof(T), (uint32_t)alignof(T));
+  return id;
+}
+
+template<typename... Ts>
+ComponentMask MakeComponentMask()
+{
+  ComponentMask mask = 0;
+  ComponentMask bits[] = { 0, ((ComponentMask)1 << ComponentTypeId<Ts>())... };
+  for (ComponentMask bit : bits)
+  {
+    mask |= bit;
+  }
+  return mask;
+}
+
+class EntityStore
+{
+public:
+  static const uint32_t CHUNK_SIZE = 16 * 1024;
+
+  struct Chunk
+  {
+    // data is allocation aligned to the archetype's alignment
+    uint8_t* allocation;
+    uint8_t* data;
+    uint32_t count;
+  };
+
+  struct Archetype
+  {
+    ComponentMask mask;
+    // Entities per chunk
+    uint32_t capacity;
+    // Largest alignment of the chunk's arrays
+    uint32_t alignment;
+    uint32_t entityOffset;
+    uint32_t componentOffsets[MAX_COMPONENT_TYPES];
+    std::vector<Chunk> chunks;
+  };
+
+  // A chunk matched by a query. firstIndex is the number of matching
+  // entities in the chunks before it, so chunks can be processed in
+  // parallel and still write to disjoint ranges of an output array.
+  struct ChunkView
+  {
+    const Archetype* archetype;
+    const Chunk* chunk;
+    uint32_t firstIndex;
+
+    uint32_t GetCount() const { return chunk->count; }
+    const Entity* GetEntities() const { return (const Entity*)(chunk->data + archetype->entityOffset); }
+
+    template<typename T>
+    T* Get() const { return (T*)(chunk->data + archetype->componentOffsets[ComponentTypeId<T>()]); }
+  };
+
+  EntityStore() = default;
+  EntityStore(const EntityStore&) = delete;
+  EntityStore& operator=(const EntityStore&) = delete;
+  ~EntityStore();
+
+  // Returns INVALID_ENTITY if out of memory, or if the components are too
+  // large for a single entity to fit a chunk
+  Entity Create(ComponentMask mask);
+  template<typename... Ts>
+  Entity Create() { return Create(MakeComponentMask<Ts...>()); }
+  void Destroy(Entity entity);
+  void Clear();
+
+  bool IsAlive(Entity entity) const;
+  uint32_t GetNumEntities() const { return m_NumEntities; }
+
+  // Returns null if the entity was destroyed or does not have the component
+  template<typename T>
+  T* Get(Entity entity)
+  {
+    if (!IsAlive(entity))
+    {
+      return nullptr;
+    }
+    const EntityRecord& record = m_Records[(uint32_t)entity];
+    const Archetype& archetype = *m_Archetypes[record.archetype];
+    uint32_t offset = archetype.componentOffsets[ComponentTypeId<T>()];
+    if (offset == INVALID_OFFSET)
+    {
+      return nullptr;
+    }
+    return (T*)(archetype.chunks[record.chunk].data + offset) + record.row;
+  }
+
+  // Appends all chunks whose archetype has every component in mask,
+  // returns the total number of matching entities
+  uint32_t CollectChunks(ComponentMask mask, std::vector<ChunkView>& outChunks) const;
+
+  // Calls f(count, entities, Ts*...) once per matching chunk
+  template<typename... Ts, typename F>
+  void ForEach(F f)
+  {
+    ComponentMask mask = MakeComponentMask<Ts...>();
+    for (Archetype* archetype : m_Archetypes)
+    {
+      if ((archetype->mask & mask) != mask)
+      {
+        continue;
+      }
+      for (Chunk& chunk : archetype->chunks)
+      {
+        f(chunk.count, (const Entity*)(chunk.data + archetype->entityOffset),
+          (Ts*)(chunk.data + archetype->componentOffsets[ComponentTypeId<Ts>()])...);
+      }
+    }
+  }
+
+private:
+  static const uint32_t INVALID_OFFSET = (uint32_t)-1;
+  static const uint32_t INVALID_ARCHETYPE = (uint32_t)-1;
+
+  struct EntityRecord
+  {
+    uint32_t generation;
+    uint32_t archetype;
+    uint32_t chunk;
+    uint32_t row;
+  };
+
+  uint32_t GetOrCreateArchetype(ComponentMask mask);
+
+  std::vector<Archetype*> m_Archetypes;
+  std::vector<EntityRecord> m_Records;
+  std::vector<uint32_t> m_FreeRecords;
+  uint32_t m_NumEntities = 0;
+};
@@ -1,5 +1,7 @@
 #include <stdio.h>
+#include <stdlib.h>
 
+#include <algorithm>
 #include <vector>
 
 #include "vulkan/vulkan.h"
@@ -12,27 +14,43 @@
 #include "stb_image.h"
 #include "vk_mem_alloc.h"
 
+#include "Benchmark.h"
+#include "Bvh.h"
+#include "DrawList.h"
+#include "EntityStore.h"
+#include "MeshImport.h"
+#include "Meshlets.h"
+#include "ParallelFor.h"
+#include "SceneGraph.h"
+#include "VertexFormat.h"
+
 #include "ShaderBytecode/Triangle.vert.h"
 #include "ShaderBytecode/Triangle.frag.h"
+#include "ShaderBytecode/Triangle_bindless.vert.h"
+#include "ShaderBytecode/DepthOnly.vert.h"
+#include "ShaderBytecode/DepthOnly_bindless.vert.h"
+#include "ShaderBytecode/Meshlet.vert.h"
+#include "ShaderBytecode/MeshletCull.comp.h"
+#include "ShaderBytecode/DepthPyramid.comp.h"
 
 struct Vertex
 {
-  glm::vec2 pos;
+  glm::vec3 pos;
   glm::vec3 color;
 };
 
 static Vertex g_VertexBuffer[] = {
-  {{-0.5f,  0.5f},  {1.0f, 1.0f, 1.0f}}, // left-top
-  {{0.5f,   0.5f},  {0.0f, 0.0f, 1.0f}}, // right-top
-  {{0.5f,   -0.5f}, {0.0f, 1.0f, 0.0f}}, // right-bottom
-  {{-0.5f,  -0.5f}, {1.0f, 0.0f, 0.0f}}, // left-bottom
-  {{-0.5f,  0.5f},  {0.25f, 0.25f, 0.25f}}, // left-top-backface
-  {{0.5f,   0.5f},  {0.0f, 0.0f, 0.25f}}, // right-top-backface
-  {{0.5f,   -0.5f}, {0.0f, 0.25f, 0.0f}}, // right-bottom-backface
-  {{-0.5f,  -0.5f}, {0.25f, 0.0f, 0.0f}}, // left-bottom-backface
+  {{-0.5f,  0.5f, 0.0f},  {1.0f, 1.0f, 1.0f}}, // left-top
+  {{0.5f,   0.5f, 0.0f},  {0.0f, 0.0f, 1.0f}}, // right-top
+  {{0.5f,   -0.5f, 0.0f}, {0.0f, 1.0f, 0.0f}}, // right-bottom
+  {{-0.5f,  -0.5f, 0.0f}, {1.0f, 0.0f, 0.0f}}, // left-bottom
+  {{-0.5f,  0.5f, 0.0f},  {0.25f, 0.25f, 0.25f}}, // left-top-backface
+  {{0.5f,   0.5f, 0.0f},  {0.0f, 0.0f, 0.25f}}, // right-top-backface
+  {{0.5f,   -0.5f, 0.0f}, {0.0f, 0.25f, 0.0f}}, // right-bottom-backface
+  {{-0.5f,  -0.5f, 0.0f}, {0.25f, 0.0f, 0.0f}}, // left-bottom-backface
 };
 
-static uint32_t g_IndexBuffer[] = {
+static uint16_t g_IndexBuffer[] = {
   0, 1, 2, 0, 2, 3,
   4, 6, 5, 4, 7, 6
 };
@@ -44,7 +62,8 @@ static struct UniformBuffer
   alignas(16) glm::mat4x4 proj;
 } g_UniformBuffer;
 
-static const uint32_t MAX_FRAMES_IN_FLIGHT = 2;
+// Upper bound, the actual number comes from the present profile
+static const uint32_t MAX_FRAMES_IN_FLIGHT = 3;
 
 struct Result
 {
@@ -113,6 +132,196 @@ void HandleResult(Result res, const char* message)
   }                                             \
 }
 
+// Present profiles trade input latency for throughput
+struct PresentProfile
+{
+  const char* name;
+  uint32_t framesInFlight;
+  // Preferred present modes in order, FIFO is used if none is available
+  VkPresentModeKHR presentModes[2];
+  uint32_t numPresentModes;
+  // Swapchain images requested on top of minImageCount
+  uint32_t extraSwapchainImages;
+};
+
+static const PresentProfile g_PresentProfiles[] = {
+  { "balanced", 2, { VK_PRESENT_MODE_MAILBOX_KHR, VK_PRESENT_MODE_IMMEDIATE_KHR }, 2, 1 },
+  { "low-latency", 1, { VK_PRESENT_MODE_FIFO_RELAXED_KHR }, 1, 0 },
+  { "throughput", 3, { VK_PRESENT_MODE_MAILBOX_KHR }, 1, 1 },
+};
+
+enum Scene
+{
+  SCENE_SINGLE = 0,
+  // Grid of identical quads drawn with a single instanced draw
+  SCENE_INSTANCED = 1
+};
+
+// Command line options
+static struct Options
+{
+  // Frame rate cap in frames per second, 0 = derive from present mode and display refresh
+  float targetFrameRate = 0.0f;
+  const PresentProfile* profile = &g_PresentProfiles[0];
+  Scene scene = SCENE_SINGLE;
+  uint32_t numInstances = 1;
+  // Benchmark runs quit after this many seconds and print a summary, 0 = interactive
+  const char* benchmarkName = nullptr;
+  float benchmarkDuration = 0.0f;
+  // Use per-frame descriptor sets even if descriptor indexing is supported
+  bool classicDescriptors = false;
+  // Model file drawn by the instances instead of the quad
+  const char* meshPath = nullptr;
+  // Coarser levels of detail are drawn while their error stays below this many pixels, 0 = always full detail
+  float lodErrorPixels = 1.0f;
+  // Draw the imported mesh as meshlets culled by a compute pass
+  bool meshlets = false;
+  // Store imported vertices with 16 bit positions and 8 bit colors
+  bool quantizeVertices = false;
+  // Lay down depth from the position streams first, then shade only visible fragments
+  bool depthPrepass = false;
+  // File rewritten with the frame and memory statistics once per second
+  const char* statsJsonPath = nullptr;
+  // Bytes per frame defragmentation may move in device-local memory, 0 = never defragment
+  VkDeviceSize defragBudget = 0;
+  // Run compute passes on a queue of their own, alongside graphics, where the device has one
+  bool asyncCompute = true;
+  // Track frames with a timeline semaphore per queue where supported, else with fences
+  bool timelineSemaphores = true;
+  // Time spent blocked in the frame fence wait, acquire and present, shown with the frame stats
+  bool measureStalls = false;
+} g_Options;
+
+static uint32_t g_FramesInFlight = 2;
+
+Result ParseCommandLine(int argc, char** argv)
+{
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "--fps") == 0 && i + 1 < argc)
+    {
+      g_Options.targetFrameRate = (float)atof(argv[++i]);
+      RETURN_IF_FAILURE(Result::Application(
+        g_Options.targetFrameRate < 0.0f ? 1 : 0),
+        "--fps expects a non-negative frame rate");
+    }
+    else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc)
+    {
+      const char* name = argv[++i];
+      g_Options.profile = nullptr;
+      for (const PresentProfile& profile : g_PresentProfiles)
+      {
+        if (strcmp(profile.name, name) == 0)
+        {
+          g_Options.profile = &profile;
+        }
+      }
+      RETURN_IF_FAILURE(Result::Application(
+        g_Options.profile == nullptr ? 1 : 0),
+        "--profile expects balanced, low-latency or throughput");
+    }
+    else if (strcmp(argv[i], "--instances") == 0 && i + 1 < argc)
+    {
+      int numInstances = atoi(argv[++i]);
+      RETURN_IF_FAILURE(Result::Application(
+        numInstances < 1 ? 1 : 0),
+        "--instances expects a positive instance count");
+      g_Options.scene = SCENE_INSTANCED;
+      g_Options.numInstances = (uint32_t)numInstances;
+    }
+    else if (strcmp(argv[i], "--benchmark") == 0 && i + 1 < argc)
+    {
+      g_Options.benchmarkName = argv[++i];
+      if (strcmp(g_Options.benchmarkName, "instancing") == 0)
+      {
+        g_Options.scene = SCENE_INSTANCED;
+        g_Options.numInstances = 100000;
+      }
+      else if (!IsCpuBenchmark(g_Options.benchmarkName))
+      {
+        fprintf(stderr, "Unknown benchmark: %s\n", g_Options.benchmarkName);
+        return Result::Application(1);
+      }
+      if (g_Options.benchmarkDuration == 0.0f)
+      {
+        g_Options.benchmarkDuration = 10.0f;
+      }
+    }
+    else if (strcmp(argv[i], "--classic-descriptors") == 0)
+    {
+      g_Options.classicDescriptors = true;
+    }
+    else if (strcmp(argv[i], "--mesh") == 0 && i + 1 < argc)
+    {
+      g_Options.meshPath = argv[++i];
+    }
+    else if (strcmp(argv[i], "--meshlets") == 0)
+    {
+      g_Options.meshlets = true;
+    }
+    else if (strcmp(argv[i], "--quantize-vertices") == 0)
+    {
+      g_Options.quantizeVertices = true;
+    }
+    else if (strcmp(argv[i], "--depth-prepass") == 0)
+    {
+      g_Options.depthPrepass = true;
+    }
+    else if (strcmp(argv[i], "--no-async-compute") == 0)
+    {
+      g_Options.asyncCompute = false;
+    }
+    else if (strcmp(argv[i], "--no-timeline-semaphores") == 0)
+    {
+      g_Options.timelineSemaphores = false;
+    }
+    else if (strcmp(argv[i], "--measure-stalls") == 0)
+    {
+      g_Options.measureStalls = true;
+    }
+    else if (strcmp(argv[i], "--stats-json") == 0 && i + 1 < argc)
+    {
+      g_Options.statsJsonPath = argv[++i];
+    }
+    else if (strcmp(argv[i], "--defrag-budget") == 0 && i + 1 < argc)
+    {
+      int budgetKB = atoi(argv[++i]);
+      RETURN_IF_FAILURE(Result::Application(
+        budgetKB < 0 ? 1 : 0),
+        "--defrag-budget expects a non-negative number of KB per frame");
+      g_Options.defragBudget = (VkDeviceSize)budgetKB * 1024;
+    }
+    else if (strcmp(argv[i], "--lod-error") == 0 && i + 1 < argc)
+    {
+      g_Options.lodErrorPixels = (float)atof(argv[++i]);
+      RETURN_IF_FAILURE(Result::Application(
+        g_Options.lodErrorPixels < 0.0f ? 1 : 0),
+        "--lod-error expects a non-negative number of pixels");
+    }
+    else if (strcmp(argv[i], "--benchmark-duration") == 0 && i + 1 < argc)
+    {
+      g_Options.benchmarkDuration = (float)atof(argv[++i]);
+      RETURN_IF_FAILURE(Result::Application(
+        g_Options.benchmarkDuration <= 0.0f ? 1 : 0),
+        "--benchmark-duration expects a positive number of seconds");
+    }
+    else
+    {
+      fprintf(stderr, "Unknown argument: %s\n", argv[i]);
+      return Result::Application(1);
+    }
+  }
+  g_FramesInFlight = g_Options.profile->framesInFlight;
+  RETURN_IF_FAILURE(Result::Application(
+    g_Options.meshlets && g_Options.meshPath == nullptr ? 1 : 0),
+    "--meshlets needs a mesh given with --mesh");
+  RETURN_IF_FAILURE(Result::Application(
+    g_Options.benchmarkDuration > 0.0f && g_Options.benchmarkName == nullptr ? 1 : 0),
+    "--benchmark-duration needs a benchmark given with --benchmark");
+
+  return Result::Application(0);
+}
+
 static SDL_Window* g_Window;
 static uint32_t g_WindowWidth = 640;
 static uint32_t g_WindowHeight = 480;
@@ -159,20 +368,29 @@ struct Input
   void Update()
   {
     prevMouse = curMouse;
-    uint32_t buttons = SDL_GetMouseState(&curMouse.x, &curMouse.y);
+    curMouse.buttons = SDL_GetMouseState(&curMouse.x, &curMouse.y);
+    sampleTime = SDL_GetPerformanceCounter();
   }
 
   struct MouseState
   {
     int x = 0, y = 0;
+    uint32_t buttons = 0;
   };
 
+  bool ButtonPressed(uint32_t mask) const
+  {
+    return (curMouse.buttons & mask) != 0 && (prevMouse.buttons & mask) == 0;
+  }
+
   MouseState curMouse, prevMouse;
+  uint64_t sampleTime = 0;
 } g_Input;
 
 
 // Instance
 static VkInstance g_Instance = VK_NULL_HANDLE;
+static bool g_HasPhysicalDeviceProperties2 = false;
 
 Result InitVkInstance()
 {
@@ -203,6 +421,26 @@ Result InitVkInstance()
   instanceLayers.push_back("VK_LAYER_KHRONOS_validation");
 #endif
 
+  // Optional, needed to query extended device features
+  {
+    uint32_t numAvailableExtensions;
+    RETURN_IF_FAILURE(Result::Vulkan(
+      vkEnumerateInstanceExtensionProperties(nullptr, &numAvailableExtensions, nullptr)),
+      "vkEnumerateInstanceExtensionProperties");
+    std::vector<VkExtensionProperties> availableExtensions(numAvailableExtensions);
+    RETURN_IF_FAILURE(Result::Vulkan(
+      vkEnumerateInstanceExtensionProperties(nullptr, &numAvailableExtensions, availableExtensions.data())),
+      "vkEnumerateInstanceExtensionProperties");
+    for (auto const& extension : availableExtensions)
+    {
+      if (strcmp(extension.extensionName, "VK_KHR_get_physical_device_properties2") == 0)
+      {
+        instanceExtensions.push_back("VK_KHR_get_physical_device_properties2");
+        g_HasPhysicalDeviceProperties2 = true;
+      }
+    }
+  }
+
   uint32_t numInstanceLayers = (uint32_t)instanceLayers.size();
   uint32_t numInstanceExtensions = (uint32_t)instanceExtensions.size();
 
@@ -228,6 +466,7 @@ void DestroyVkInstance()
     vkDestroyInstance(g_Instance, nullptr);
     g_Instance = VK_NULL_HANDLE;
   }
+  g_HasPhysicalDeviceProperties2 = false;
 }
 
 // Debug messenger
@@ -327,6 +566,19 @@ static uint32_t g_GraphicsQueueFamily = (uint32_t)-1;
 static uint32_t g_TransferQueueFamily = (uint32_t)-1;
 static uint32_t g_ComputeQueueFamily = (uint32_t)-1;
 static uint32_t g_PresentQueueFamily = (uint32_t)-1;
+static std::vector<VkExtensionProperties> g_DeviceExtensions;
+
+bool IsDeviceExtensionAvailable(const char* name)
+{
+  for (auto const& extension : g_DeviceExtensions)
+  {
+    if (strcmp(extension.extensionName, name) == 0)
+    {
+      return true;
+    }
+  }
+  return false;
+}
 
 Result InitVkPhysicalDevice()
 {
@@ -390,6 +642,21 @@ Result InitVkPhysicalDevice()
         queueFamilyIdx++;
       }
 
+      // Compute work on a family without graphics runs alongside it
+      if (g_Options.asyncCompute)
+      {
+        for (uint32_t i = 0; i < (uint32_t)queueFamilies.size(); i++)
+        {
+          if (queueFamilies[i].queueCount > 0
+              && (queueFamilies[i].queueFlags & VK_QUEUE_COMPUTE_BIT)
+              && !(queueFamilies[i].queueFlags & VK_QUEUE_GRAPHICS_BIT))
+          {
+            g_ComputeQueueFamily = i;
+            break;
+          }
+        }
+      }
+
       if (g_GraphicsQueueFamily == (uint32_t)-1
           || g_TransferQueueFamily == (uint32_t)-1
           || g_ComputeQueueFamily == (uint32_t)-1
@@ -470,8 +737,20 @@ Result InitVkPhysicalDevice()
     g_PhysicalDevice = physicalDevice;
     break;
   }
+  RETURN_IF_FAILURE(Result::Application(
+    g_PhysicalDevice == VK_NULL_HANDLE ? 1 : 0),
+    "No suitable physical device");
 
-  return Result::Application(g_PhysicalDevice == VK_NULL_HANDLE ? 1 : 0);
+  uint32_t numExtensions;
+  RETURN_IF_FAILURE(Result::Vulkan(
+    vkEnumerateDeviceExtensionProperties(g_PhysicalDevice, nullptr, &numExtensions, nullptr)),
+    "vkEnumerateDeviceExtensionProperties");
+  g_DeviceExtensions.resize(numExtensions);
+  RETURN_IF_FAILURE(Result::Vulkan(
+    vkEnumerateDeviceExtensionProperties(g_PhysicalDevice, nullptr, &numExtensions, g_DeviceExtensions.data())),
+    "vkEnumerateDeviceExtensionProperties");
+
+  return Result::Application(0);
 }
 
 void DestroyVkPhysicalDevice()
@@ -480,6 +759,7 @@ void DestroyVkPhysicalDevice()
   g_GraphicsQueueFamily = (uint32_t)-1;
   g_TransferQueueFamily = (uint32_t)-1;
   g_ComputeQueueFamily = (uint32_t)-1;
+  g_DeviceExtensions.clear();
   g_PhysicalDevice = VK_NULL_HANDLE;
 }
 
@@ -489,9 +769,166 @@ static VkQueue g_GraphicsQueue = VK_NULL_HANDLE;
 static VkQueue g_TransferQueue = VK_NULL_HANDLE;
 static VkQueue g_ComputeQueue = VK_NULL_HANDLE;
 static VkQueue g_PresentQueue = VK_NULL_HANDLE;
+// The compute queue is another queue than the graphics one
+static bool g_AsyncComputeEnabled = false;
+// Both the graphics and the compute queue support timestamps
+static bool g_TimestampsEnabled = false;
+static float g_TimestampPeriod = 1.0f;
+// The bits of timestamps both queues write
+static uint64_t g_TimestampMask = ~0ull;
+static bool g_BindlessEnabled = false;
+// Bindless array sizes, clamped to the device's update-after-bind limits
+static const uint32_t MAX_BINDLESS_STORAGE_BUFFERS = 1024;
+static const uint32_t MAX_BINDLESS_TEXTURES = 4096;
+static const uint32_t MIN_BINDLESS_DESCRIPTORS = 16;
+static uint32_t g_BindlessStorageBufferCapacity = MAX_BINDLESS_STORAGE_BUFFERS;
+static uint32_t g_BindlessTextureCapacity = MAX_BINDLESS_TEXTURES;
+// Heap budgets and usage come from the driver instead of being estimated
+static bool g_MemoryBudgetEnabled = false;
+// Frames are tracked with a timeline semaphore per queue instead of fences
+static bool g_TimelineSemaphoresEnabled = false;
+static PFN_vkWaitSemaphoresKHR g_WaitSemaphores;
+static PFN_vkGetSemaphoreCounterValueKHR g_GetSemaphoreCounterValue;
+
+// Sizes the bindless arrays to what the device can bind in one
+// update-after-bind set. Storage buffers are read in the vertex and fragment
+// stages and textures in the fragment stage, so both share its resource limit.
+bool GetBindlessDescriptorCapacities()
+{
+  auto getProperties2 = (PFN_vkGetPhysicalDeviceProperties2KHR)
+    vkGetInstanceProcAddr(g_Instance, "vkGetPhysicalDeviceProperties2KHR");
+  if (getProperties2 == nullptr)
+  {
+    return false;
+  }
+
+  VkPhysicalDeviceDescriptorIndexingPropertiesEXT indexingProperties = {};
+  indexingProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_PROPERTIES_EXT;
+  VkPhysicalDeviceProperties2KHR properties2 = {};
+  properties2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+  properties2.pNext = &indexingProperties;
+  getProperties2(g_PhysicalDevice, &properties2);
+
+  uint32_t storageBuffers = std::min({ MAX_BINDLESS_STORAGE_BUFFERS,
+    indexingProperties.maxDescriptorSetUpdateAfterBindStorageBuffers,
+    indexingProperties.maxPerStageDescriptorUpdateAfterBindStorageBuffers });
+  uint32_t textures = std::min({ MAX_BINDLESS_TEXTURES,
+    indexingProperties.maxDescriptorSetUpdateAfterBindSampledImages,
+    indexingProperties.maxDescriptorSetUpdateAfterBindSamplers,
+    indexingProperties.maxPerStageDescriptorUpdateAfterBindSampledImages,
+    indexingProperties.maxPerStageDescriptorUpdateAfterBindSamplers });
+  uint32_t resources = std::min(indexingProperties.maxPerStageUpdateAfterBindResources,
+    indexingProperties.maxUpdateAfterBindDescriptorsInAllPools);
+  storageBuffers = std::min(storageBuffers, resources / 2);
+  textures = std::min(textures, resources - storageBuffers);
+
+  if (storageBuffers < MIN_BINDLESS_DESCRIPTORS || textures < MIN_BINDLESS_DESCRIPTORS)
+  {
+    return false;
+  }
+  g_BindlessStorageBufferCapacity = storageBuffers;
+  g_BindlessTextureCapacity = textures;
+  return true;
+}
+
+// Bindless descriptors need runtime-sized, partially bound,
+// update-after-bind arrays of storage buffers and sampled images, indexed
+// dynamically by push constants
+bool IsDescriptorIndexingSupported(VkPhysicalDeviceDescriptorIndexingFeaturesEXT* outFeatures)
+{
+  if (!g_HasPhysicalDeviceProperties2
+      || !IsDeviceExtensionAvailable("VK_KHR_maintenance3")
+      || !IsDeviceExtensionAvailable("VK_EXT_descriptor_indexing"))
+  {
+    return false;
+  }
+
+  auto getFeatures2 = (PFN_vkGetPhysicalDeviceFeatures2KHR)
+    vkGetInstanceProcAddr(g_Instance, "vkGetPhysicalDeviceFeatures2KHR");
+  if (getFeatures2 == nullptr)
+  {
+    return false;
+  }
+
+  VkPhysicalDeviceDescriptorIndexingFeaturesEXT indexingFeatures = {};
+  indexingFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES_EXT;
+  VkPhysicalDeviceFeatures2KHR features2 = {};
+  features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+  features2.pNext = &indexingFeatures;
+  getFeatures2(g_PhysicalDevice, &features2);
+
+  if (!features2.features.shaderStorageBufferArrayDynamicIndexing
+      || !indexingFeatures.runtimeDescriptorArray
+      || !indexingFeatures.descriptorBindingPartiallyBound
+      || !indexingFeatures.descriptorBindingStorageBufferUpdateAfterBind
+      || !indexingFeatures.descriptorBindingSampledImageUpdateAfterBind
+      || !indexingFeatures.shaderSampledImageArrayNonUniformIndexing)
+  {
+    return false;
+  }
+
+  *outFeatures = {};
+  outFeatures->sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES_EXT;
+  outFeatures->runtimeDescriptorArray = VK_TRUE;
+  outFeatures->descriptorBindingPartiallyBound = VK_TRUE;
+  outFeatures->descriptorBindingStorageBufferUpdateAfterBind = VK_TRUE;
+  outFeatures->descriptorBindingSampledImageUpdateAfterBind = VK_TRUE;
+  outFeatures->shaderSampledImageArrayNonUniformIndexing = VK_TRUE;
+  return GetBindlessDescriptorCapacities();
+}
+
+bool IsTimelineSemaphoreSupported(VkPhysicalDeviceTimelineSemaphoreFeaturesKHR* outFeatures)
+{
+  if (!g_HasPhysicalDeviceProperties2
+      || !IsDeviceExtensionAvailable("VK_KHR_timeline_semaphore"))
+  {
+    return false;
+  }
+
+  auto getFeatures2 = (PFN_vkGetPhysicalDeviceFeatures2KHR)
+    vkGetInstanceProcAddr(g_Instance, "vkGetPhysicalDeviceFeatures2KHR");
+  if (getFeatures2 == nullptr)
+  {
+    return false;
+  }
+
+  VkPhysicalDeviceTimelineSemaphoreFeaturesKHR timelineFeatures = {};
+  timelineFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES_KHR;
+  VkPhysicalDeviceFeatures2KHR features2 = {};
+  features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+  features2.pNext = &timelineFeatures;
+  getFeatures2(g_PhysicalDevice, &features2);
+
+  if (!timelineFeatures.timelineSemaphore)
+  {
+    return false;
+  }
+
+  *outFeatures = {};
+  outFeatures->sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES_KHR;
+  outFeatures->timelineSemaphore = VK_TRUE;
+  return true;
+}
 
 Result InitVkDevice()
 {
+  std::vector<VkQueueFamilyProperties> queueFamilyProperties;
+  {
+    uint32_t numQueueFamilies;
+    vkGetPhysicalDeviceQueueFamilyProperties(g_PhysicalDevice, &numQueueFamilies, nullptr);
+    queueFamilyProperties.resize(numQueueFamilies);
+    vkGetPhysicalDeviceQueueFamilyProperties(g_PhysicalDevice, &numQueueFamilies, queueFamilyProperties.data());
+  }
+
+  // Without a compute-only family, a second queue of the graphics family
+  // still lets compute work overlap graphics
+  uint32_t computeQueueIndex = 0;
+  if (g_Options.asyncCompute && g_ComputeQueueFamily == g_GraphicsQueueFamily
+      && queueFamilyProperties[g_GraphicsQueueFamily].queueCount > 1)
+  {
+    computeQueueIndex = 1;
+  }
+
   std::vector<uint32_t> queueFamilies = {
     g_GraphicsQueueFamily,
     g_PresentQueueFamily,
@@ -519,12 +956,12 @@ Result InitVkDevice()
     }
     usedQueueFamilies.push_back(queueFamily);
 
-    float queuePriorities[] = { 1.0f };
+    static const float queuePriorities[] = { 1.0f, 1.0f };
 
     VkDeviceQueueCreateInfo queueCI = {};
     queueCI.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
     queueCI.queueFamilyIndex = queueFamily;
-    queueCI.queueCount = 1;
+    queueCI.queueCount = queueFamily == g_ComputeQueueFamily ? computeQueueIndex + 1 : 1;
     queueCI.pQueuePriorities = queuePriorities;
     queueCIs.push_back(queueCI);
   }
@@ -535,8 +972,45 @@ Result InitVkDevice()
   std::vector<const char*> extensions = {
     "VK_KHR_swapchain" };
 
+  VkPhysicalDeviceDescriptorIndexingFeaturesEXT indexingFeatures = {};
+  g_BindlessEnabled = !g_Options.classicDescriptors
+    && IsDescriptorIndexingSupported(&indexingFeatures);
+  if (g_BindlessEnabled)
+  {
+    features.shaderStorageBufferArrayDynamicIndexing = VK_TRUE;
+    extensions.push_back("VK_KHR_maintenance3");
+    extensions.push_back("VK_EXT_descriptor_indexing");
+  }
+  g_MemoryBudgetEnabled = g_HasPhysicalDeviceProperties2
+    && IsDeviceExtensionAvailable("VK_EXT_memory_budget");
+  if (g_MemoryBudgetEnabled)
+  {
+    extensions.push_back("VK_EXT_memory_budget");
+  }
+  VkPhysicalDeviceTimelineSemaphoreFeaturesKHR timelineFeatures = {};
+  g_TimelineSemaphoresEnabled = g_Options.timelineSemaphores
+    && IsTimelineSemaphoreSupported(&timelineFeatures);
+  if (g_TimelineSemaphoresEnabled)
+  {
+    extensions.push_back("VK_KHR_timeline_semaphore");
+  }
+
+  // The enabled extensions' feature structs
+  void* featureChain = nullptr;
+  if (g_BindlessEnabled)
+  {
+    indexingFeatures.pNext = featureChain;
+    featureChain = &indexingFeatures;
+  }
+  if (g_TimelineSemaphoresEnabled)
+  {
+    timelineFeatures.pNext = featureChain;
+    featureChain = &timelineFeatures;
+  }
+
   VkDeviceCreateInfo ci = {};
   ci.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+  ci.pNext = featureChain;
   ci.queueCreateInfoCount = (uint32_t)queueCIs.size();
   ci.pQueueCreateInfos = queueCIs.data();
   ci.pEnabledFeatures = &features;
@@ -551,8 +1025,26 @@ Result InitVkDevice()
 
   vkGetDeviceQueue(g_Device, g_GraphicsQueueFamily, 0, &g_GraphicsQueue);
   vkGetDeviceQueue(g_Device, g_TransferQueueFamily, 0, &g_TransferQueue);
-  vkGetDeviceQueue(g_Device, g_ComputeQueueFamily, 0, &g_ComputeQueue);
+  vkGetDeviceQueue(g_Device, g_ComputeQueueFamily, computeQueueIndex, &g_ComputeQueue);
   vkGetDeviceQueue(g_Device, g_PresentQueueFamily, 0, &g_PresentQueue);
+  g_AsyncComputeEnabled = g_Options.asyncCompute && g_ComputeQueue != g_GraphicsQueue;
+
+  if (g_TimelineSemaphoresEnabled)
+  {
+    g_WaitSemaphores = (PFN_vkWaitSemaphoresKHR)
+      vkGetDeviceProcAddr(g_Device, "vkWaitSemaphoresKHR");
+    g_GetSemaphoreCounterValue = (PFN_vkGetSemaphoreCounterValueKHR)
+      vkGetDeviceProcAddr(g_Device, "vkGetSemaphoreCounterValueKHR");
+    g_TimelineSemaphoresEnabled = g_WaitSemaphores != nullptr && g_GetSemaphoreCounterValue != nullptr;
+  }
+
+  VkPhysicalDeviceProperties deviceProperties;
+  vkGetPhysicalDeviceProperties(g_PhysicalDevice, &deviceProperties);
+  g_TimestampPeriod = deviceProperties.limits.timestampPeriod;
+  uint32_t timestampValidBits = glm::min(queueFamilyProperties[g_GraphicsQueueFamily].timestampValidBits,
+                                        queueFamilyProperties[g_ComputeQueueFamily].timestampValidBits);
+  g_TimestampsEnabled = timestampValidBits > 0;
+  g_TimestampMask = timestampValidBits >= 64 ? ~0ull : (1ull << timestampValidBits) - 1;
 
   return Result::Application(0);
 }
@@ -563,12 +1055,21 @@ void DestroyVkDevice()
   g_PresentQueue = VK_NULL_HANDLE;
   g_TransferQueue = VK_NULL_HANDLE;
   g_ComputeQueue = VK_NULL_HANDLE;
+  g_AsyncComputeEnabled = false;
+  g_TimestampsEnabled = false;
 
   if (g_Device != VK_NULL_HANDLE)
   {
     vkDestroyDevice(g_Device, nullptr);
     g_Device = VK_NULL_HANDLE;
   }
+  g_BindlessEnabled = false;
+  g_BindlessStorageBufferCapacity = MAX_BINDLESS_STORAGE_BUFFERS;
+  g_BindlessTextureCapacity = MAX_BINDLESS_TEXTURES;
+  g_MemoryBudgetEnabled = false;
+  g_TimelineSemaphoresEnabled = false;
+  g_WaitSemaphores = nullptr;
+  g_GetSemaphoreCounterValue = nullptr;
 }
 
 // Allocator
@@ -577,6 +1078,9 @@ static VmaAllocator g_Allocator;
 Result InitVmaAllocator()
 {
   VmaAllocatorCreateInfo ci = {};
+  // Only used from the main thread. Without locking, defragmentation steps
+  // may span frames that allocate and query stats meanwhile.
+  ci.flags = VMA_ALLOCATOR_CREATE_EXTERNALLY_SYNCHRONIZED_BIT;
   ci.physicalDevice = g_PhysicalDevice;
   ci.device = g_Device;
   ci.preferredLargeHeapBlockSize = 0;
@@ -602,106 +1106,407 @@ void DestroyVmaAllocator()
   g_Allocator = VK_NULL_HANDLE;
 }
 
-// Swapchain + image views
-static VkSwapchainKHR g_Swapchain = VK_NULL_HANDLE;
-static VkFormat g_SwapchainFormat;
-static VkExtent2D g_SwapchainExtent;
-static std::vector<VkImage> g_SwapchainImages;
-static std::vector<VkImageView> g_SwapchainImageViews;
+VkDeviceSize AlignUp(VkDeviceSize offset, VkDeviceSize alignment)
+{
+  return (offset + alignment - 1) / alignment * alignment;
+}
 
-Result InitVkSwapchain()
+// Deferred destruction
+// Objects the frames in flight may still use are retired instead of
+// destroyed, and destroyed once the last frame submitted before their
+// retirement has completed. Replacing them on a resize, a reload or while
+// streaming then doesn't wait for the device to go idle. Frames are numbered
+// in submission order from 1, so objects retired before the first frame go
+// right away. Swapchains are the exception, see RetireSwapchain().
+enum RetiredObjectType
 {
-  std::vector<VkSurfaceFormatKHR> availableFormats;
-  {
-    uint32_t numFormats;
-    vkGetPhysicalDeviceSurfaceFormatsKHR(g_PhysicalDevice, g_Surface, &numFormats, nullptr);
-    availableFormats.resize(numFormats);
-    vkGetPhysicalDeviceSurfaceFormatsKHR(g_PhysicalDevice, g_Surface, &numFormats, availableFormats.data());
-  }
+  RETIRED_BUFFER = 0,
+  RETIRED_IMAGE,
+  RETIRED_IMAGE_VIEW,
+  RETIRED_FRAMEBUFFER,
+  RETIRED_PIPELINE,
+  RETIRED_SWAPCHAIN,
+  RETIRED_ALLOCATION
+};
 
-  std::vector<VkPresentModeKHR> availablePresentModes;
+struct RetiredObject
+{
+  RetiredObjectType type;
+  // The last frame that may use the object
+  uint64_t frame;
+  union
   {
-    uint32_t numPresentModes;
-    vkGetPhysicalDeviceSurfacePresentModesKHR(g_PhysicalDevice, g_Surface, &numPresentModes, nullptr);
-    availablePresentModes.resize(numPresentModes);
-    vkGetPhysicalDeviceSurfacePresentModesKHR(g_PhysicalDevice, g_Surface, &numPresentModes, availablePresentModes.data());
-  }
+    VkBuffer buffer;
+    VkImage image;
+    VkImageView imageView;
+    VkFramebuffer framebuffer;
+    VkPipeline pipeline;
+    VkSwapchainKHR swapchain;
+  };
+  // Freed along with a buffer or image, if not null
+  VmaAllocation allocation;
+};
 
-  VkSurfaceCapabilitiesKHR capabilities;
-  vkGetPhysicalDeviceSurfaceCapabilitiesKHR(g_PhysicalDevice, g_Surface, &capabilities);
+// In retirement order, so by ascending frame
+static std::vector<RetiredObject> g_RetiredObjects;
+static uint64_t g_SubmittedFrames = 0;
+static uint64_t g_CompletedFrames = 0;
+// The frame last submitted with each frame slot
+static uint64_t g_FrameSlotNumbers[MAX_FRAMES_IN_FLIGHT];
 
-  VkSurfaceFormatKHR format;
+void DestroyRetiredObject(const RetiredObject& object)
+{
+  switch (object.type)
   {
-    if (availableFormats.size() == 1 && availableFormats[0].format == VK_FORMAT_UNDEFINED)
-    {
-      format.format = VK_FORMAT_B8G8R8A8_UNORM;
-      format.colorSpace = VK_COLORSPACE_SRGB_NONLINEAR_KHR;
-    }
-    else
-    {
-      bool desiredFormatFound = false;
-      for (auto const& availableFormat : availableFormats)
-      {
-        if (availableFormat.format == VK_FORMAT_B8G8R8A8_UNORM
-            && availableFormat.colorSpace == VK_COLORSPACE_SRGB_NONLINEAR_KHR)
-        {
-          format = availableFormat;
-          desiredFormatFound = true;
-          break;
-        }
-      }
-      if (!desiredFormatFound)
-      {
-        format = availableFormats[0];
-      }
-    }
+  case RETIRED_BUFFER:
+    vmaDestroyBuffer(g_Allocator, object.buffer, object.allocation);
+    break;
+  case RETIRED_IMAGE:
+    vkDestroyImage(g_Device, object.image, nullptr);
+    break;
+  case RETIRED_IMAGE_VIEW:
+    vkDestroyImageView(g_Device, object.imageView, nullptr);
+    break;
+  case RETIRED_FRAMEBUFFER:
+    vkDestroyFramebuffer(g_Device, object.framebuffer, nullptr);
+    break;
+  case RETIRED_PIPELINE:
+    vkDestroyPipeline(g_Device, object.pipeline, nullptr);
+    break;
+  case RETIRED_SWAPCHAIN:
+    vkDestroySwapchainKHR(g_Device, object.swapchain, nullptr);
+    break;
+  case RETIRED_ALLOCATION:
+    break;
   }
-
-  VkPresentModeKHR presentMode;
+  if (object.type != RETIRED_BUFFER && object.allocation != VK_NULL_HANDLE)
   {
-    presentMode = VK_PRESENT_MODE_FIFO_KHR;
-
-    for (auto availablePresentMode : availablePresentModes)
-    {
-      if (availablePresentMode == VK_PRESENT_MODE_MAILBOX_KHR)
-      {
-        presentMode = availablePresentMode;
-        break;
-      }
-      else if (availablePresentMode == VK_PRESENT_MODE_IMMEDIATE_KHR)
-      {
-        presentMode = availablePresentMode;
-        break;
-      };
-    }
+    vmaFreeMemory(g_Allocator, object.allocation);
   }
+}
 
-  VkExtent2D extent;
+void RetireObject(RetiredObject object)
+{
+  if (g_CompletedFrames >= g_SubmittedFrames)
   {
-    if (capabilities.currentExtent.width != (uint32_t)-1)
-    {
-      extent = capabilities.currentExtent;
-    }
-    else
-    {
-      extent.width = g_WindowWidth;
-      extent.height = g_WindowHeight;
-
-      extent.width = glm::clamp(extent.width, capabilities.minImageExtent.width, capabilities.maxImageExtent.width);
-      extent.height = glm::clamp(extent.height, capabilities.minImageExtent.height, capabilities.maxImageExtent.height);
-    }
+    DestroyRetiredObject(object);
+    return;
   }
+  object.frame = g_SubmittedFrames;
+  g_RetiredObjects.push_back(object);
+}
 
-  uint32_t imageCount = capabilities.minImageCount + 1;
-  if (capabilities.maxImageCount > 0
-      && imageCount > capabilities.maxImageCount)
-  {
-    imageCount = capabilities.maxImageCount;
-  }
+void RetireBuffer(VkBuffer buffer, VmaAllocation allocation)
+{
+  RetiredObject object = {};
+  object.type = RETIRED_BUFFER;
+  object.buffer = buffer;
+  object.allocation = allocation;
+  RetireObject(object);
+}
 
-  VkSwapchainCreateInfoKHR swapchainCI = {};
-  swapchainCI.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR;
-  swapchainCI.surface = g_Surface;
+// The allocation may be null for images bound to memory they don't own
+void RetireImage(VkImage image, VmaAllocation allocation)
+{
+  RetiredObject object = {};
+  object.type = RETIRED_IMAGE;
+  object.image = image;
+  object.allocation = allocation;
+  RetireObject(object);
+}
+
+void RetireImageView(VkImageView imageView)
+{
+  RetiredObject object = {};
+  object.type = RETIRED_IMAGE_VIEW;
+  object.imageView = imageView;
+  RetireObject(object);
+}
+
+void RetireFramebuffer(VkFramebuffer framebuffer)
+{
+  RetiredObject object = {};
+  object.type = RETIRED_FRAMEBUFFER;
+  object.framebuffer = framebuffer;
+  RetireObject(object);
+}
+
+void RetirePipeline(VkPipeline pipeline)
+{
+  RetiredObject object = {};
+  object.type = RETIRED_PIPELINE;
+  object.pipeline = pipeline;
+  RetireObject(object);
+}
+
+// Swapchains replaced by one that hasn't been presented yet. Frame fences
+// don't cover presentation, so an old swapchain is only retired once the
+// new one has presented, and then kept until every frame slot has cycled:
+// a slot's render finished semaphore isn't signaled again before the
+// present waiting on it has started.
+static std::vector<VkSwapchainKHR> g_UnpresentedOldSwapchains;
+
+void RetireSwapchain(VkSwapchainKHR swapchain)
+{
+  g_UnpresentedOldSwapchains.push_back(swapchain);
+}
+
+// Called once the current swapchain has been presented by the frame just submitted
+void RetireOldSwapchains()
+{
+  for (VkSwapchainKHR swapchain : g_UnpresentedOldSwapchains)
+  {
+    RetiredObject object = {};
+    object.type = RETIRED_SWAPCHAIN;
+    object.swapchain = swapchain;
+    object.frame = g_SubmittedFrames + g_FramesInFlight;
+    // Later than the objects retired so far, which are ordered by frame
+    auto position = std::upper_bound(g_RetiredObjects.begin(), g_RetiredObjects.end(), object,
+      [](const RetiredObject& a, const RetiredObject& b) { return a.frame < b.frame; });
+    g_RetiredObjects.insert(position, object);
+  }
+  g_UnpresentedOldSwapchains.clear();
+}
+
+// Memory shared by several resources, retired after them
+void RetireAllocation(VmaAllocation allocation)
+{
+  RetiredObject object = {};
+  object.type = RETIRED_ALLOCATION;
+  object.allocation = allocation;
+  RetireObject(object);
+}
+
+// Called with the number of a frame known to have completed, which means
+// every frame before it has as well
+void CollectRetiredObjects(uint64_t completedFrame)
+{
+  g_CompletedFrames = glm::max(g_CompletedFrames, completedFrame);
+  size_t numDestroyed = 0;
+  while (numDestroyed < g_RetiredObjects.size() && g_RetiredObjects[numDestroyed].frame <= g_CompletedFrames)
+  {
+    DestroyRetiredObject(g_RetiredObjects[numDestroyed++]);
+  }
+  g_RetiredObjects.erase(g_RetiredObjects.begin(), g_RetiredObjects.begin() + numDestroyed);
+}
+
+// Memory budget
+// Per-heap usage against the budget the driver grants this process. Without
+// VK_EXT_memory_budget the budget is guessed as a fraction of the heap and
+// usage is what VMA has allocated, which misses other processes. Refreshed
+// once per stats window and before growing long-lived allocations.
+static const float FALLBACK_BUDGET_FRACTION = 0.8f;
+// Above this share of its budget a heap is under pressure, idle staging
+// memory in it is released
+static const float BUDGET_PRESSURE = 0.9f;
+
+struct HeapStats
+{
+  VkDeviceSize size;
+  VkDeviceSize budget;
+  VkDeviceSize usage;
+  // VMA's VkDeviceMemory blocks in the heap and the allocations inside them
+  uint32_t blockCount;
+  uint32_t allocationCount;
+  VkDeviceSize blockBytes;
+  VkDeviceSize allocationBytes;
+  // 1 - largest free range / free bytes in the blocks, 0 = all free memory
+  // in one range
+  float fragmentation;
+  bool deviceLocal;
+};
+
+static HeapStats g_HeapStats[VK_MAX_MEMORY_HEAPS];
+static uint32_t g_NumHeaps;
+
+void UpdateMemoryBudget()
+{
+  const VkPhysicalDeviceMemoryProperties* memoryProperties;
+  vmaGetMemoryProperties(g_Allocator, &memoryProperties);
+  VmaStats stats;
+  vmaCalculateStats(g_Allocator, &stats);
+
+  VkPhysicalDeviceMemoryBudgetPropertiesEXT budgetProperties = {};
+  budgetProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT;
+  bool hasBudget = false;
+  if (g_MemoryBudgetEnabled)
+  {
+    auto getMemoryProperties2 = (PFN_vkGetPhysicalDeviceMemoryProperties2KHR)
+      vkGetInstanceProcAddr(g_Instance, "vkGetPhysicalDeviceMemoryProperties2KHR");
+    if (getMemoryProperties2 != nullptr)
+    {
+      VkPhysicalDeviceMemoryProperties2KHR memoryProperties2 = {};
+      memoryProperties2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2;
+      memoryProperties2.pNext = &budgetProperties;
+      getMemoryProperties2(g_PhysicalDevice, &memoryProperties2);
+      hasBudget = true;
+    }
+  }
+
+  g_NumHeaps = memoryProperties->memoryHeapCount;
+  for (uint32_t i = 0; i < g_NumHeaps; i++)
+  {
+    const VmaStatInfo& info = stats.memoryHeap[i];
+    HeapStats& heap = g_HeapStats[i];
+    heap.size = memoryProperties->memoryHeaps[i].size;
+    heap.blockCount = info.blockCount;
+    heap.allocationCount = info.allocationCount;
+    heap.blockBytes = info.usedBytes + info.unusedBytes;
+    heap.allocationBytes = info.usedBytes;
+    heap.fragmentation = info.unusedBytes > 0
+      ? 1.0f - (float)info.unusedRangeSizeMax / (float)info.unusedBytes : 0.0f;
+    heap.deviceLocal = (memoryProperties->memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) != 0;
+    if (hasBudget)
+    {
+      heap.budget = budgetProperties.heapBudget[i];
+      heap.usage = budgetProperties.heapUsage[i];
+    }
+    else
+    {
+      heap.budget = (VkDeviceSize)(FALLBACK_BUDGET_FRACTION * (float)heap.size);
+      heap.usage = heap.blockBytes;
+    }
+  }
+}
+
+// Bytes that can still be allocated from the heap without exceeding its
+// budget, as of the last UpdateMemoryBudget()
+VkDeviceSize GetHeapHeadroom(uint32_t heap)
+{
+  const HeapStats& stats = g_HeapStats[heap];
+  return stats.usage < stats.budget ? stats.budget - stats.usage : 0;
+}
+
+bool IsHeapUnderPressure(uint32_t heap)
+{
+  const HeapStats& stats = g_HeapStats[heap];
+  return (float)stats.usage > BUDGET_PRESSURE * (float)stats.budget;
+}
+
+// Heap that allocations of the given buffer usage and memory usage land in
+Result FindBufferHeap(VkBufferUsageFlags usage, VmaMemoryUsage memoryUsage, uint32_t* outHeap)
+{
+  VkBufferCreateInfo bufferCI = {};
+  bufferCI.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  bufferCI.size = 65536;
+  bufferCI.usage = usage;
+  bufferCI.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+  VmaAllocationCreateInfo allocCI = {};
+  allocCI.usage = memoryUsage;
+
+  uint32_t memoryType;
+  RETURN_IF_FAILURE(Result::Vulkan(
+    vmaFindMemoryTypeIndexForBufferInfo(g_Allocator, &bufferCI, &allocCI, &memoryType)),
+    "vmaFindMemoryTypeIndexForBufferInfo");
+  const VkPhysicalDeviceMemoryProperties* memoryProperties;
+  vmaGetMemoryProperties(g_Allocator, &memoryProperties);
+  *outHeap = memoryProperties->memoryTypes[memoryType].heapIndex;
+  return Result::Application(0);
+}
+
+// Swapchain + image views
+static VkSwapchainKHR g_Swapchain = VK_NULL_HANDLE;
+static VkFormat g_SwapchainFormat;
+static VkExtent2D g_SwapchainExtent;
+static VkPresentModeKHR g_SwapchainPresentMode;
+static std::vector<VkImage> g_SwapchainImages;
+static std::vector<VkImageView> g_SwapchainImageViews;
+
+Result InitVkSwapchain()
+{
+  std::vector<VkSurfaceFormatKHR> availableFormats;
+  {
+    uint32_t numFormats;
+    vkGetPhysicalDeviceSurfaceFormatsKHR(g_PhysicalDevice, g_Surface, &numFormats, nullptr);
+    availableFormats.resize(numFormats);
+    vkGetPhysicalDeviceSurfaceFormatsKHR(g_PhysicalDevice, g_Surface, &numFormats, availableFormats.data());
+  }
+
+  std::vector<VkPresentModeKHR> availablePresentModes;
+  {
+    uint32_t numPresentModes;
+    vkGetPhysicalDeviceSurfacePresentModesKHR(g_PhysicalDevice, g_Surface, &numPresentModes, nullptr);
+    availablePresentModes.resize(numPresentModes);
+    vkGetPhysicalDeviceSurfacePresentModesKHR(g_PhysicalDevice, g_Surface, &numPresentModes, availablePresentModes.data());
+  }
+
+  VkSurfaceCapabilitiesKHR capabilities;
+  vkGetPhysicalDeviceSurfaceCapabilitiesKHR(g_PhysicalDevice, g_Surface, &capabilities);
+
+  VkSurfaceFormatKHR format;
+  {
+    if (availableFormats.size() == 1 && availableFormats[0].format == VK_FORMAT_UNDEFINED)
+    {
+      format.format = VK_FORMAT_B8G8R8A8_UNORM;
+      format.colorSpace = VK_COLORSPACE_SRGB_NONLINEAR_KHR;
+    }
+    else
+    {
+      bool desiredFormatFound = false;
+      for (auto const& availableFormat : availableFormats)
+      {
+        if (availableFormat.format == VK_FORMAT_B8G8R8A8_UNORM
+            && availableFormat.colorSpace == VK_COLORSPACE_SRGB_NONLINEAR_KHR)
+        {
+          format = availableFormat;
+          desiredFormatFound = true;
+          break;
+        }
+      }
+      if (!desiredFormatFound)
+      {
+        format = availableFormats[0];
+      }
+    }
+  }
+
+  VkPresentModeKHR presentMode;
+  {
+    presentMode = VK_PRESENT_MODE_FIFO_KHR;
+
+    const PresentProfile* profile = g_Options.profile;
+    bool found = false;
+    for (uint32_t i = 0; i < profile->numPresentModes && !found; i++)
+    {
+      for (auto availablePresentMode : availablePresentModes)
+      {
+        if (availablePresentMode == profile->presentModes[i])
+        {
+          presentMode = availablePresentMode;
+          found = true;
+          break;
+        }
+      }
+    }
+  }
+
+  VkExtent2D extent;
+  {
+    if (capabilities.currentExtent.width != (uint32_t)-1)
+    {
+      extent = capabilities.currentExtent;
+    }
+    else
+    {
+      extent.width = g_WindowWidth;
+      extent.height = g_WindowHeight;
+
+      extent.width = glm::clamp(extent.width, capabilities.minImageExtent.width, capabilities.maxImageExtent.width);
+      extent.height = glm::clamp(extent.height, capabilities.minImageExtent.height, capabilities.maxImageExtent.height);
+    }
+  }
+
+  uint32_t imageCount = capabilities.minImageCount + g_Options.profile->extraSwapchainImages;
+  if (capabilities.maxImageCount > 0
+      && imageCount > capabilities.maxImageCount)
+  {
+    imageCount = capabilities.maxImageCount;
+  }
+
+  VkSwapchainCreateInfoKHR swapchainCI = {};
+  swapchainCI.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR;
+  swapchainCI.surface = g_Surface;
   swapchainCI.minImageCount = imageCount;
   swapchainCI.imageFormat = format.format;
   swapchainCI.imageColorSpace = format.colorSpace;
@@ -724,11 +1529,22 @@ Result InitVkSwapchain()
   swapchainCI.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
   swapchainCI.presentMode = presentMode;
   swapchainCI.clipped = VK_TRUE;
-  swapchainCI.oldSwapchain = VK_NULL_HANDLE;
+  // Frames in flight may still present the old swapchain's images
+  VkSwapchainKHR oldSwapchain = g_Swapchain;
+  swapchainCI.oldSwapchain = oldSwapchain;
 
   RETURN_IF_FAILURE(Result::Vulkan(
     vkCreateSwapchainKHR(g_Device, &swapchainCI, nullptr, &g_Swapchain)),
     "vkCreateSwapchainKHR");
+  if (oldSwapchain != VK_NULL_HANDLE)
+  {
+    for (VkImageView imageView : g_SwapchainImageViews)
+    {
+      RetireImageView(imageView);
+    }
+    g_SwapchainImageViews.clear();
+    RetireSwapchain(oldSwapchain);
+  }
 
   uint32_t numImages;
   RETURN_IF_FAILURE(Result::Vulkan(
@@ -741,6 +1557,7 @@ Result InitVkSwapchain()
 
   g_SwapchainFormat = format.format;
   g_SwapchainExtent = extent;
+  g_SwapchainPresentMode = presentMode;
 
   g_SwapchainImageViews.resize(numImages);
   for (uint32_t i = 0; i < numImages; i++)
@@ -774,13 +1591,19 @@ void DestroyVkSwapchain()
   {
     if (imageView != VK_NULL_HANDLE)
     {
-      vkDestroyImageView(g_Device, imageView, nullptr);
+      RetireImageView(imageView);
     }
   }
   g_SwapchainImageViews.clear();
 
   g_SwapchainImages.clear();
 
+  // The device is idle
+  for (VkSwapchainKHR swapchain : g_UnpresentedOldSwapchains)
+  {
+    vkDestroySwapchainKHR(g_Device, swapchain, nullptr);
+  }
+  g_UnpresentedOldSwapchains.clear();
   if (g_Swapchain != VK_NULL_HANDLE)
   {
     vkDestroySwapchainKHR(g_Device, g_Swapchain, nullptr);
@@ -788,9 +1611,261 @@ void DestroyVkSwapchain()
   }
 }
 
+// Render targets (recreated with the swapchain)
+// Images the passes of a frame render into, created for the render graph.
+// Each target declares the first and last pass using it in execution order,
+// and targets whose passes don't overlap share memory: they are packed into
+// as few allocations as possible, placed side by side where their lifetimes
+// overlap and on top of each other where they don't. A
+// target must therefore be cleared or discarded by its first pass and is
+// undefined after its last one. Targets that never leave the passes'
+// attachments (not loaded, stored, sampled or copied) are transient and go
+// to lazily allocated memory where the device has it, tilers then keep them
+// in tile memory without ever backing them.
+
+struct RenderTarget
+{
+  VkImageCreateInfo imageCI;
+  VkImageAspectFlags aspect;
+  // First and last pass using the target, in execution order
+  uint32_t firstPass;
+  uint32_t lastPass;
+  bool transient;
+  VkImage image;
+  VkImageView view;
+  VkMemoryRequirements memoryRequirements;
+  uint32_t allocation;
+  VkDeviceSize offset;
+};
+
+struct RenderTargetAllocation
+{
+  VmaAllocation allocation;
+  VkMemoryRequirements memoryRequirements;
+  bool lazy;
+};
+
+static std::vector<RenderTarget> g_RenderTargets;
+static std::vector<RenderTargetAllocation> g_RenderTargetAllocations;
+
+static struct RenderTargetStats
+{
+  // Sum of the targets' sizes, what they would take without aliasing
+  VkDeviceSize requestedBytes;
+  // Sizes of the allocations, in lazily allocated memory or not
+  VkDeviceSize allocatedBytes;
+  VkDeviceSize lazyBytes;
+} g_RenderTargetStats;
+
+// Targets are created by AllocateRenderTargets(), the index stays valid
+// until DestroyVkRenderTargets()
+uint32_t AddRenderTarget(VkFormat format, VkImageUsageFlags usage, VkImageAspectFlags aspect,
+                         uint32_t firstPass, uint32_t lastPass, bool transient)
+{
+  RenderTarget target = {};
+  target.imageCI.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+  target.imageCI.imageType = VK_IMAGE_TYPE_2D;
+  target.imageCI.format = format;
+  target.imageCI.extent = { g_SwapchainExtent.width, g_SwapchainExtent.height, 1 };
+  target.imageCI.mipLevels = 1;
+  target.imageCI.arrayLayers = 1;
+  target.imageCI.samples = VK_SAMPLE_COUNT_1_BIT;
+  target.imageCI.tiling = VK_IMAGE_TILING_OPTIMAL;
+  target.imageCI.usage = usage | (transient ? VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT : 0);
+  target.imageCI.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  target.imageCI.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  target.aspect = aspect;
+  target.firstPass = firstPass;
+  target.lastPass = lastPass;
+  target.transient = transient;
+  g_RenderTargets.push_back(target);
+  return (uint32_t)g_RenderTargets.size() - 1;
+}
+
+// Lowest offset in the allocation at which the target doesn't overlap the
+// memory of any target placed there whose passes overlap its own
+static VkDeviceSize FindAliasingOffset(const RenderTarget& target, uint32_t allocation)
+{
+  VkDeviceSize offset = 0;
+  bool moved = true;
+  while (moved)
+  {
+    moved = false;
+    for (const RenderTarget& placed : g_RenderTargets)
+    {
+      if (&placed == &target || placed.allocation != allocation
+          || placed.lastPass < target.firstPass || target.lastPass < placed.firstPass)
+      {
+        continue;
+      }
+      if (offset < placed.offset + placed.memoryRequirements.size
+          && placed.offset < offset + target.memoryRequirements.size)
+      {
+        offset = AlignUp(placed.offset + placed.memoryRequirements.size, target.memoryRequirements.alignment);
+        moved = true;
+      }
+    }
+  }
+  return offset;
+}
+
+Result AllocateRenderTargets()
+{
+  // Lazily allocated memory is only an option if transient images may use it
+  uint32_t lazyMemoryTypeBits = 0;
+  {
+    const VkPhysicalDeviceMemoryProperties* memoryProperties;
+    vmaGetMemoryProperties(g_Allocator, &memoryProperties);
+    for (uint32_t i = 0; i < memoryProperties->memoryTypeCount; i++)
+    {
+      if (memoryProperties->memoryTypes[i].propertyFlags & VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT)
+      {
+        lazyMemoryTypeBits |= 1u << i;
+      }
+    }
+  }
+
+  // Largest first, so small targets fill the gaps next to the large ones
+  std::vector<uint32_t> order(g_RenderTargets.size());
+  for (uint32_t i = 0; i < (uint32_t)order.size(); i++)
+  {
+    RenderTarget& target = g_RenderTargets[i];
+    RETURN_IF_FAILURE(Result::Vulkan(
+      vkCreateImage(g_Device, &target.imageCI, nullptr, &target.image)),
+      "vkCreateImage");
+    vkGetImageMemoryRequirements(g_Device, target.image, &target.memoryRequirements);
+    order[i] = i;
+  }
+  std::sort(order.begin(), order.end(), [](uint32_t a, uint32_t b)
+  {
+    return g_RenderTargets[a].memoryRequirements.size > g_RenderTargets[b].memoryRequirements.size;
+  });
+
+  const uint32_t NOT_PLACED = (uint32_t)-1;
+  for (RenderTarget& target : g_RenderTargets)
+  {
+    target.allocation = NOT_PLACED;
+  }
+  for (uint32_t t : order)
+  {
+    RenderTarget& target = g_RenderTargets[t];
+    bool lazy = target.transient && (target.memoryRequirements.memoryTypeBits & lazyMemoryTypeBits) != 0;
+    for (uint32_t a = 0; a < (uint32_t)g_RenderTargetAllocations.size() && target.allocation == NOT_PLACED; a++)
+    {
+      RenderTargetAllocation& allocation = g_RenderTargetAllocations[a];
+      uint32_t memoryTypeBits = allocation.memoryRequirements.memoryTypeBits & target.memoryRequirements.memoryTypeBits;
+      if (allocation.lazy != lazy || memoryTypeBits == 0)
+      {
+        continue;
+      }
+      target.allocation = a;
+      target.offset = FindAliasingOffset(target, a);
+      allocation.memoryRequirements.memoryTypeBits = memoryTypeBits;
+      allocation.memoryRequirements.alignment = glm::max(allocation.memoryRequirements.alignment, target.memoryRequirements.alignment);
+      allocation.memoryRequirements.size = glm::max(allocation.memoryRequirements.size, target.offset + target.memoryRequirements.size);
+    }
+    if (target.allocation == NOT_PLACED)
+    {
+      RenderTargetAllocation allocation = {};
+      allocation.memoryRequirements = target.memoryRequirements;
+      allocation.lazy = lazy;
+      if (lazy)
+      {
+        allocation.memoryRequirements.memoryTypeBits &= lazyMemoryTypeBits;
+      }
+      target.allocation = (uint32_t)g_RenderTargetAllocations.size();
+      target.offset = 0;
+      g_RenderTargetAllocations.push_back(allocation);
+    }
+  }
+
+  g_RenderTargetStats = {};
+  for (RenderTargetAllocation& allocation : g_RenderTargetAllocations)
+  {
+    VmaAllocationCreateInfo allocCI = {};
+    allocCI.usage = allocation.lazy ? VMA_MEMORY_USAGE_UNKNOWN : VMA_MEMORY_USAGE_GPU_ONLY;
+    allocCI.requiredFlags = allocation.lazy ? VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT : 0;
+    RETURN_IF_FAILURE(Result::Vulkan(
+      vmaAllocateMemory(g_Allocator, &allocation.memoryRequirements, &allocCI, &allocation.allocation, nullptr)),
+      "vmaAllocateMemory");
+    g_RenderTargetStats.allocatedBytes += allocation.memoryRequirements.size;
+    g_RenderTargetStats.lazyBytes += allocation.lazy ? allocation.memoryRequirements.size : 0;
+  }
+
+  for (RenderTarget& target : g_RenderTargets)
+  {
+    VmaAllocationInfo allocInfo;
+    vmaGetAllocationInfo(g_Allocator, g_RenderTargetAllocations[target.allocation].allocation, &allocInfo);
+    RETURN_IF_FAILURE(Result::Vulkan(
+      vkBindImageMemory(g_Device, target.image, allocInfo.deviceMemory, allocInfo.offset + target.offset)),
+      "vkBindImageMemory");
+    g_RenderTargetStats.requestedBytes += target.memoryRequirements.size;
+
+    VkImageViewCreateInfo imageViewCI = {};
+    imageViewCI.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+    imageViewCI.image = target.image;
+    imageViewCI.viewType = VK_IMAGE_VIEW_TYPE_2D;
+    imageViewCI.format = target.imageCI.format;
+    imageViewCI.subresourceRange.aspectMask = target.aspect;
+    imageViewCI.subresourceRange.levelCount = 1;
+    imageViewCI.subresourceRange.layerCount = 1;
+    RETURN_IF_FAILURE(Result::Vulkan(
+      vkCreateImageView(g_Device, &imageViewCI, nullptr, &target.view)),
+      "vkCreateImageView");
+  }
+
+  return Result::Application(0);
+}
+
+// D16 is always supported, also for sampling, one of the others is
+// required as well
+VkFormat FindDepthFormat(VkFormatFeatureFlags features)
+{
+  const VkFormat candidates[] = { VK_FORMAT_D32_SFLOAT, VK_FORMAT_X8_D24_UNORM_PACK32, VK_FORMAT_D16_UNORM };
+  for (VkFormat candidate : candidates)
+  {
+    VkFormatProperties properties;
+    vkGetPhysicalDeviceFormatProperties(g_PhysicalDevice, candidate, &properties);
+    if ((properties.optimalTilingFeatures & features) == features)
+    {
+      return candidate;
+    }
+  }
+  return VK_FORMAT_UNDEFINED;
+}
+
+void DestroyVkRenderTargets()
+{
+  for (RenderTarget& target : g_RenderTargets)
+  {
+    if (target.view != VK_NULL_HANDLE)
+    {
+      RetireImageView(target.view);
+    }
+    if (target.image != VK_NULL_HANDLE)
+    {
+      RetireImage(target.image, VK_NULL_HANDLE);
+    }
+  }
+  g_RenderTargets.clear();
+  for (RenderTargetAllocation& allocation : g_RenderTargetAllocations)
+  {
+    if (allocation.allocation != VK_NULL_HANDLE)
+    {
+      RetireAllocation(allocation.allocation);
+    }
+  }
+  g_RenderTargetAllocations.clear();
+}
+
 // Shaders
 static VkShaderModule g_TriangleShaderVert;
 static VkShaderModule g_TriangleShaderFrag;
+static VkShaderModule g_TriangleBindlessShaderVert;
+static VkShaderModule g_DepthOnlyShaderVert;
+static VkShaderModule g_MeshletShaderVert;
+static VkShaderModule g_MeshletCullShaderComp;
+static VkShaderModule g_DepthPyramidShaderComp;
 
 Result InitVkShaders()
 {
@@ -816,8 +1891,56 @@ Result InitVkShaders()
       "vkCreateShaderModule");
   }
 
-  return Result::Application(0);
-}
+  // Vertex shader (bindless variant)
+  if (g_BindlessEnabled)
+  {
+    VkShaderModuleCreateInfo ci = {};
+    ci.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+    ci.pCode = Triangle_bindless_vert_bytecode;
+    ci.codeSize = sizeof(Triangle_bindless_vert_bytecode);
+    RETURN_IF_FAILURE(Result::Vulkan(
+      vkCreateShaderModule(g_Device, &ci, nullptr, &g_TriangleBindlessShaderVert)),
+      "vkCreateShaderModule");
+  }
+
+  // Depth-only vertex shader, matching the vertex shader above
+  if (g_Options.depthPrepass)
+  {
+    VkShaderModuleCreateInfo ci = {};
+    ci.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+    ci.pCode = g_BindlessEnabled ? DepthOnly_bindless_vert_bytecode : DepthOnly_vert_bytecode;
+    ci.codeSize = g_BindlessEnabled ? sizeof(DepthOnly_bindless_vert_bytecode) : sizeof(DepthOnly_vert_bytecode);
+    RETURN_IF_FAILURE(Result::Vulkan(
+      vkCreateShaderModule(g_Device, &ci, nullptr, &g_DepthOnlyShaderVert)),
+      "vkCreateShaderModule");
+  }
+
+  // Meshlet vertex and culling shaders, and the depth pyramid build for culling
+  if (g_Options.meshlets)
+  {
+    VkShaderModuleCreateInfo ci = {};
+    ci.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+    ci.pCode = Meshlet_vert_bytecode;
+    ci.codeSize = sizeof(Meshlet_vert_bytecode);
+    RETURN_IF_FAILURE(Result::Vulkan(
+      vkCreateShaderModule(g_Device, &ci, nullptr, &g_MeshletShaderVert)),
+      "vkCreateShaderModule");
+
+    ci.pCode = MeshletCull_comp_bytecode;
+    ci.codeSize = sizeof(MeshletCull_comp_bytecode);
+    RETURN_IF_FAILURE(Result::Vulkan(
+      vkCreateShaderModule(g_Device, &ci, nullptr, &g_MeshletCullShaderComp)),
+      "vkCreateShaderModule");
+
+    ci.pCode = DepthPyramid_comp_bytecode;
+    ci.codeSize = sizeof(DepthPyramid_comp_bytecode);
+    RETURN_IF_FAILURE(Result::Vulkan(
+      vkCreateShaderModule(g_Device, &ci, nullptr, &g_DepthPyramidShaderComp)),
+      "vkCreateShaderModule");
+  }
+
+  return Result::Application(0);
+}
 
 void DestroyVkShaders()
 {
@@ -832,41 +1955,327 @@ void DestroyVkShaders()
     vkDestroyShaderModule(g_Device, g_TriangleShaderFrag, nullptr);
     g_TriangleShaderFrag = VK_NULL_HANDLE;
   }
+
+  if (g_TriangleBindlessShaderVert != VK_NULL_HANDLE)
+  {
+    vkDestroyShaderModule(g_Device, g_TriangleBindlessShaderVert, nullptr);
+    g_TriangleBindlessShaderVert = VK_NULL_HANDLE;
+  }
+
+  if (g_DepthOnlyShaderVert != VK_NULL_HANDLE)
+  {
+    vkDestroyShaderModule(g_Device, g_DepthOnlyShaderVert, nullptr);
+    g_DepthOnlyShaderVert = VK_NULL_HANDLE;
+  }
+
+  if (g_MeshletShaderVert != VK_NULL_HANDLE)
+  {
+    vkDestroyShaderModule(g_Device, g_MeshletShaderVert, nullptr);
+    g_MeshletShaderVert = VK_NULL_HANDLE;
+  }
+
+  if (g_MeshletCullShaderComp != VK_NULL_HANDLE)
+  {
+    vkDestroyShaderModule(g_Device, g_MeshletCullShaderComp, nullptr);
+    g_MeshletCullShaderComp = VK_NULL_HANDLE;
+  }
+
+  if (g_DepthPyramidShaderComp != VK_NULL_HANDLE)
+  {
+    vkDestroyShaderModule(g_Device, g_DepthPyramidShaderComp, nullptr);
+    g_DepthPyramidShaderComp = VK_NULL_HANDLE;
+  }
 }
 
-// Descriptor pool
-static VkDescriptorPool g_DescriptorPool;
+// Descriptor set layout cache
+// Layouts are deduplicated by their full description and live until shutdown
+struct DescriptorSetLayoutKey
+{
+  VkDescriptorSetLayoutCreateFlags flags;
+  std::vector<VkDescriptorSetLayoutBinding> bindings;
+  std::vector<VkDescriptorBindingFlagsEXT> bindingFlags;
+
+  bool operator==(DescriptorSetLayoutKey const& other) const
+  {
+    if (flags != other.flags
+        || bindings.size() != other.bindings.size()
+        || bindingFlags != other.bindingFlags)
+    {
+      return false;
+    }
+    for (size_t i = 0; i < bindings.size(); i++)
+    {
+      VkDescriptorSetLayoutBinding const& a = bindings[i];
+      VkDescriptorSetLayoutBinding const& b = other.bindings[i];
+      if (a.binding != b.binding
+          || a.descriptorType != b.descriptorType
+          || a.descriptorCount != b.descriptorCount
+          || a.stageFlags != b.stageFlags
+          || a.pImmutableSamplers != b.pImmutableSamplers)
+      {
+        return false;
+      }
+    }
+    return true;
+  }
+};
+
+struct DescriptorSetLayoutCacheEntry
+{
+  DescriptorSetLayoutKey key;
+  VkDescriptorSetLayout layout;
+};
+static std::vector<DescriptorSetLayoutCacheEntry> g_DescriptorSetLayoutCache;
 
-Result InitVkDescriptorPool()
+// bindingFlags is optional and, if given, has numBindings entries
+Result GetDescriptorSetLayout(const VkDescriptorSetLayoutBinding* bindings, uint32_t numBindings,
+                              const VkDescriptorBindingFlagsEXT* bindingFlags,
+                              VkDescriptorSetLayoutCreateFlags flags,
+                              VkDescriptorSetLayout* outLayout)
 {
-  VkDescriptorPoolSize poolSizes[] = {
-    {VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1024}
-  };
+  DescriptorSetLayoutKey key;
+  key.flags = flags;
+  key.bindings.assign(bindings, bindings + numBindings);
+  if (bindingFlags != nullptr)
+  {
+    key.bindingFlags.assign(bindingFlags, bindingFlags + numBindings);
+  }
+
+  for (auto const& entry : g_DescriptorSetLayoutCache)
+  {
+    if (entry.key == key)
+    {
+      *outLayout = entry.layout;
+      return Result::Application(0);
+    }
+  }
 
-  VkDescriptorPoolCreateInfo ci = {};
-  ci.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-  ci.maxSets = 1024;
-  ci.poolSizeCount = sizeof(poolSizes) / sizeof(poolSizes[0]);
-  ci.pPoolSizes = poolSizes;
+  VkDescriptorSetLayoutBindingFlagsCreateInfoEXT bindingFlagsCI = {};
+  bindingFlagsCI.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO_EXT;
+  bindingFlagsCI.bindingCount = numBindings;
+  bindingFlagsCI.pBindingFlags = bindingFlags;
+
+  VkDescriptorSetLayoutCreateInfo ci = {};
+  ci.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+  ci.pNext = bindingFlags != nullptr ? &bindingFlagsCI : nullptr;
+  ci.flags = flags;
+  ci.bindingCount = numBindings;
+  ci.pBindings = bindings;
+  VkDescriptorSetLayout layout;
   RETURN_IF_FAILURE(Result::Vulkan(
-    vkCreateDescriptorPool(g_Device, &ci, nullptr, &g_DescriptorPool)),
-    "vkCreateDescriptorPool");
+    vkCreateDescriptorSetLayout(g_Device, &ci, nullptr, &layout)),
+    "vkCreateDescriptorSetLayout");
 
+  g_DescriptorSetLayoutCache.push_back({ key, layout });
+  *outLayout = layout;
   return Result::Application(0);
 }
 
-void DestroyVkDescriptorPool()
+void DestroyVkDescriptorSetLayoutCache()
+{
+  for (auto const& entry : g_DescriptorSetLayoutCache)
+  {
+    vkDestroyDescriptorSetLayout(g_Device, entry.layout, nullptr);
+  }
+  g_DescriptorSetLayoutCache.clear();
+}
+
+// Descriptor allocator
+// Allocates sets from a growing list of pools. Sets and descriptors taken
+// from the current pool are counted so the allocator moves on to another
+// pool (created or recycled) before it runs out: without maintenance1 an
+// exhausted pool is invalid usage, not VK_ERROR_OUT_OF_POOL_MEMORY. Reset()
+// returns all pools at once, so a whole frame's worth of sets is dropped in
+// O(pools).
+static const uint32_t SETS_PER_DESCRIPTOR_POOL = 256;
+
+// Descriptors per set reserved in each pool, by type
+static const struct DescriptorPoolRatio
+{
+  VkDescriptorType type;
+  float perSet;
+} g_DescriptorPoolRatios[] = {
+  {VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 2.0f},
+  {VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, 1.0f},
+  {VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 2.0f},
+  {VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 4.0f}
+};
+static const uint32_t NUM_DESCRIPTOR_POOL_RATIOS = sizeof(g_DescriptorPoolRatios) / sizeof(g_DescriptorPoolRatios[0]);
+
+uint32_t GetDescriptorPoolCapacity(uint32_t ratioIndex)
+{
+  return (uint32_t)(g_DescriptorPoolRatios[ratioIndex].perSet * SETS_PER_DESCRIPTOR_POOL);
+}
+
+// Adds up the descriptors a cached layout needs, per pool ratio. Returns false
+// if the layout is unknown or uses a type the pools do not provide.
+bool GetDescriptorSetLayoutCounts(VkDescriptorSetLayout layout, uint32_t* outCounts)
+{
+  for (auto const& entry : g_DescriptorSetLayoutCache)
+  {
+    if (entry.layout != layout)
+    {
+      continue;
+    }
+    for (uint32_t i = 0; i < NUM_DESCRIPTOR_POOL_RATIOS; i++)
+    {
+      outCounts[i] = 0;
+    }
+    for (auto const& binding : entry.key.bindings)
+    {
+      uint32_t i = 0;
+      while (i < NUM_DESCRIPTOR_POOL_RATIOS && g_DescriptorPoolRatios[i].type != binding.descriptorType)
+      {
+        i++;
+      }
+      if (i == NUM_DESCRIPTOR_POOL_RATIOS)
+      {
+        return false;
+      }
+      outCounts[i] += binding.descriptorCount;
+    }
+    return true;
+  }
+  return false;
+}
+
+struct DescriptorAllocator
+{
+  VkDescriptorPool currentPool = VK_NULL_HANDLE;
+  std::vector<VkDescriptorPool> usedPools;
+  std::vector<VkDescriptorPool> freePools;
+  // What is left in currentPool
+  uint32_t setsLeft = 0;
+  uint32_t descriptorsLeft[NUM_DESCRIPTOR_POOL_RATIOS] = {};
+
+  // layout must come from GetDescriptorSetLayout
+  Result Allocate(VkDescriptorSetLayout layout, VkDescriptorSet* outSet)
+  {
+    uint32_t counts[NUM_DESCRIPTOR_POOL_RATIOS];
+    if (!GetDescriptorSetLayoutCounts(layout, counts))
+    {
+      RETURN_IF_FAILURE(Result::Application(1), "Descriptor set layout not supported by the descriptor pools");
+    }
+    for (uint32_t i = 0; i < NUM_DESCRIPTOR_POOL_RATIOS; i++)
+    {
+      if (counts[i] > GetDescriptorPoolCapacity(i))
+      {
+        RETURN_IF_FAILURE(Result::Application(1), "Descriptor set layout exceeds the descriptor pool size");
+      }
+    }
+
+    bool fits = currentPool != VK_NULL_HANDLE && setsLeft > 0;
+    for (uint32_t i = 0; fits && i < NUM_DESCRIPTOR_POOL_RATIOS; i++)
+    {
+      fits = counts[i] <= descriptorsLeft[i];
+    }
+    if (!fits)
+    {
+      RETURN_IF_FAILURE(NextPool(), "DescriptorAllocator::NextPool");
+    }
+
+    VkDescriptorSetAllocateInfo info = {};
+    info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    info.descriptorPool = currentPool;
+    info.descriptorSetCount = 1;
+    info.pSetLayouts = &layout;
+    VkResult res = vkAllocateDescriptorSets(g_Device, &info, outSet);
+    if (res == VK_ERROR_OUT_OF_POOL_MEMORY_KHR || res == VK_ERROR_FRAGMENTED_POOL)
+    {
+      RETURN_IF_FAILURE(NextPool(), "DescriptorAllocator::NextPool");
+      info.descriptorPool = currentPool;
+      res = vkAllocateDescriptorSets(g_Device, &info, outSet);
+    }
+    if (res == VK_SUCCESS)
+    {
+      setsLeft--;
+      for (uint32_t i = 0; i < NUM_DESCRIPTOR_POOL_RATIOS; i++)
+      {
+        descriptorsLeft[i] -= counts[i];
+      }
+    }
+    return Result::Vulkan(res);
+  }
+
+  // Sets allocated since the last reset must no longer be in use
+  void Reset()
+  {
+    for (VkDescriptorPool pool : usedPools)
+    {
+      vkResetDescriptorPool(g_Device, pool, 0);
+      freePools.push_back(pool);
+    }
+    usedPools.clear();
+    currentPool = VK_NULL_HANDLE;
+    setsLeft = 0;
+  }
+
+  void Destroy()
+  {
+    Reset();
+    for (VkDescriptorPool pool : freePools)
+    {
+      vkDestroyDescriptorPool(g_Device, pool, nullptr);
+    }
+    freePools.clear();
+  }
+
+private:
+  Result NextPool()
+  {
+    if (!freePools.empty())
+    {
+      currentPool = freePools.back();
+      freePools.pop_back();
+    }
+    else
+    {
+      VkDescriptorPoolSize poolSizes[NUM_DESCRIPTOR_POOL_RATIOS];
+      for (uint32_t i = 0; i < NUM_DESCRIPTOR_POOL_RATIOS; i++)
+      {
+        poolSizes[i].type = g_DescriptorPoolRatios[i].type;
+        poolSizes[i].descriptorCount = GetDescriptorPoolCapacity(i);
+      }
+
+      VkDescriptorPoolCreateInfo ci = {};
+      ci.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+      ci.maxSets = SETS_PER_DESCRIPTOR_POOL;
+      ci.poolSizeCount = NUM_DESCRIPTOR_POOL_RATIOS;
+      ci.pPoolSizes = poolSizes;
+      RETURN_IF_FAILURE(Result::Vulkan(
+        vkCreateDescriptorPool(g_Device, &ci, nullptr, &currentPool)),
+        "vkCreateDescriptorPool");
+    }
+    usedPools.push_back(currentPool);
+    setsLeft = SETS_PER_DESCRIPTOR_POOL;
+    for (uint32_t i = 0; i < NUM_DESCRIPTOR_POOL_RATIOS; i++)
+    {
+      descriptorsLeft[i] = GetDescriptorPoolCapacity(i);
+    }
+    return Result::Application(0);
+  }
+};
+
+// Transient sets, reset once the frame's fence has signaled
+static DescriptorAllocator g_FrameDescriptorAllocators[MAX_FRAMES_IN_FLIGHT];
+
+void DestroyVkDescriptorAllocators()
 {
-  if (g_DescriptorPool != VK_NULL_HANDLE)
+  for (DescriptorAllocator& allocator : g_FrameDescriptorAllocators)
   {
-    vkDestroyDescriptorPool(g_Device, g_DescriptorPool, nullptr);
-    g_DescriptorPool = VK_NULL_HANDLE;
+    allocator.Destroy();
   }
 }
 
 // Descriptor set layout
 static VkDescriptorSetLayout g_DescriptorSetLayout;
 
+// Meshlet culling and drawing share one set, see the meshlet shaders for the bindings
+static const uint32_t NUM_MESHLET_BINDINGS = 11;
+static VkDescriptorSetLayout g_MeshletDescriptorSetLayout;
+// The depth sampled by the depth pyramid build, and the pyramid
+static VkDescriptorSetLayout g_DepthPyramidDescriptorSetLayout;
+
 Result InitVkDescriptorSetLayout()
 {
   VkDescriptorSetLayoutBinding binding = {};
@@ -875,50 +2284,194 @@ Result InitVkDescriptorSetLayout()
   binding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
   binding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
 
-  VkDescriptorSetLayoutCreateInfo ci = {};
-  ci.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
-  ci.bindingCount = 1;
-  ci.pBindings = &binding;
-  VkResult res = vkCreateDescriptorSetLayout(g_Device, &ci, nullptr, &g_DescriptorSetLayout);
-  RETURN_IF_FAILURE(Result::Vulkan(res), "vkCreateDescriptorSetLayout");
+  RETURN_IF_FAILURE(
+    GetDescriptorSetLayout(&binding, 1, nullptr, 0, &g_DescriptorSetLayout),
+    "GetDescriptorSetLayout");
+
+  if (g_Options.meshlets)
+  {
+    VkDescriptorSetLayoutBinding meshletBindings[NUM_MESHLET_BINDINGS];
+    for (uint32_t i = 0; i < NUM_MESHLET_BINDINGS; i++)
+    {
+      meshletBindings[i] = {};
+      meshletBindings[i].binding = i;
+      meshletBindings[i].descriptorCount = 1;
+      meshletBindings[i].descriptorType = i == 0 ? VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER : VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+      meshletBindings[i].stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_COMPUTE_BIT;
+    }
+    RETURN_IF_FAILURE(
+      GetDescriptorSetLayout(meshletBindings, NUM_MESHLET_BINDINGS, nullptr, 0, &g_MeshletDescriptorSetLayout),
+      "GetDescriptorSetLayout");
+
+    VkDescriptorSetLayoutBinding depthPyramidBindings[2] = {};
+    for (uint32_t i = 0; i < 2; i++)
+    {
+      depthPyramidBindings[i].binding = i;
+      depthPyramidBindings[i].descriptorCount = 1;
+      depthPyramidBindings[i].descriptorType = i == 0 ? VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER : VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+      depthPyramidBindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    }
+    RETURN_IF_FAILURE(
+      GetDescriptorSetLayout(depthPyramidBindings, 2, nullptr, 0, &g_DepthPyramidDescriptorSetLayout),
+      "GetDescriptorSetLayout");
+  }
   return Result::Application(0);
 }
 
-void DestroyVkDescriptorSetLayout()
+// Descriptor sets (per frame, allocated from the frame's allocator)
+static VkDescriptorSet g_DescriptorSets[MAX_FRAMES_IN_FLIGHT];
+
+// Bindless descriptors
+// A single update-after-bind set holds every storage buffer and texture.
+// Shaders index into it with push constants, so it is bound once per
+// command buffer instead of once per draw.
+static const uint32_t BINDLESS_STORAGE_BUFFER_BINDING = 0;
+static const uint32_t BINDLESS_TEXTURE_BINDING = 1;
+static const uint32_t INVALID_BINDLESS_INDEX = (uint32_t)-1;
+
+static VkDescriptorPool g_BindlessDescriptorPool;
+static VkDescriptorSetLayout g_BindlessDescriptorSetLayout;
+static VkDescriptorSet g_BindlessDescriptorSet;
+
+// Slots are handed out linearly and recycled through a free list
+struct BindlessSlots
 {
-  if (g_DescriptorSetLayout != VK_NULL_HANDLE)
+  uint32_t capacity;
+  uint32_t numAllocated;
+  std::vector<uint32_t> freeList;
+
+  uint32_t Allocate()
   {
-    vkDestroyDescriptorSetLayout(g_Device, g_DescriptorSetLayout, nullptr);
-    g_DescriptorSetLayout = VK_NULL_HANDLE;
+    if (!freeList.empty())
+    {
+      uint32_t index = freeList.back();
+      freeList.pop_back();
+      return index;
+    }
+    return numAllocated < capacity ? numAllocated++ : INVALID_BINDLESS_INDEX;
   }
-}
 
-// Descriptor sets (per frame)
-static VkDescriptorSet g_DescriptorSets[MAX_FRAMES_IN_FLIGHT];
+  void Release(uint32_t index)
+  {
+    if (index != INVALID_BINDLESS_INDEX)
+    {
+      freeList.push_back(index);
+    }
+  }
+};
+static BindlessSlots g_BindlessStorageBufferSlots = { 0, 0 };
 
-Result InitVkDescriptorSets()
+Result InitVkBindlessDescriptors()
 {
-  VkDescriptorSetAllocateInfo info = {};
-  info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
-  info.descriptorPool = g_DescriptorPool;
-  info.descriptorSetCount = 1;
-  info.pSetLayouts = &g_DescriptorSetLayout;
+  if (!g_BindlessEnabled)
+  {
+    return Result::Application(0);
+  }
+
+  g_BindlessStorageBufferSlots = { g_BindlessStorageBufferCapacity, 0 };
+
+  // Pool
+  {
+    VkDescriptorPoolSize poolSizes[] = {
+      {VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, g_BindlessStorageBufferCapacity},
+      {VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, g_BindlessTextureCapacity}
+    };
+
+    VkDescriptorPoolCreateInfo ci = {};
+    ci.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    ci.flags = VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT_EXT;
+    ci.maxSets = 1;
+    ci.poolSizeCount = sizeof(poolSizes) / sizeof(poolSizes[0]);
+    ci.pPoolSizes = poolSizes;
+    RETURN_IF_FAILURE(Result::Vulkan(
+      vkCreateDescriptorPool(g_Device, &ci, nullptr, &g_BindlessDescriptorPool)),
+      "vkCreateDescriptorPool");
+  }
+
+  // Layout
+  {
+    VkDescriptorSetLayoutBinding bindings[2] = {};
+    bindings[0].binding = BINDLESS_STORAGE_BUFFER_BINDING;
+    bindings[0].descriptorCount = g_BindlessStorageBufferCapacity;
+    bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    bindings[0].stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT;
+    bindings[1].binding = BINDLESS_TEXTURE_BINDING;
+    bindings[1].descriptorCount = g_BindlessTextureCapacity;
+    bindings[1].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    bindings[1].stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+
+    // Unused slots are never written, and slots may be written while
+    // previously recorded command buffers are still pending
+    VkDescriptorBindingFlagsEXT bindingFlags[2] = {
+      VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT_EXT | VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT_EXT,
+      VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT_EXT | VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT_EXT };
+
+    RETURN_IF_FAILURE(GetDescriptorSetLayout(
+      bindings, 2, bindingFlags, VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT_EXT,
+      &g_BindlessDescriptorSetLayout),
+      "GetDescriptorSetLayout");
+  }
 
-  for (VkDescriptorSet& set : g_DescriptorSets)
+  // Set
   {
-    VkResult res = vkAllocateDescriptorSets(g_Device, &info, &set);
-    RETURN_IF_FAILURE(Result::Vulkan(res), "vkAllocateDescriptorSets");
+    VkDescriptorSetAllocateInfo info = {};
+    info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    info.descriptorPool = g_BindlessDescriptorPool;
+    info.descriptorSetCount = 1;
+    info.pSetLayouts = &g_BindlessDescriptorSetLayout;
+    RETURN_IF_FAILURE(Result::Vulkan(
+      vkAllocateDescriptorSets(g_Device, &info, &g_BindlessDescriptorSet)),
+      "vkAllocateDescriptorSets");
   }
+
   return Result::Application(0);
 }
 
-void DestroyVkDescriptorSets()
+void DestroyVkBindlessDescriptors()
+{
+  g_BindlessDescriptorSet = VK_NULL_HANDLE;
+  g_BindlessDescriptorSetLayout = VK_NULL_HANDLE;
+  if (g_BindlessDescriptorPool != VK_NULL_HANDLE)
+  {
+    vkDestroyDescriptorPool(g_Device, g_BindlessDescriptorPool, nullptr);
+    g_BindlessDescriptorPool = VK_NULL_HANDLE;
+  }
+  g_BindlessStorageBufferSlots = { 0, 0 };
+}
+
+// Returns the index shaders use to access the buffer range,
+// or INVALID_BINDLESS_INDEX if the array is full
+uint32_t RegisterBindlessStorageBuffer(VkBuffer buffer, VkDeviceSize offset, VkDeviceSize range)
 {
-  for (VkDescriptorSet& set : g_DescriptorSets)
+  uint32_t index = g_BindlessStorageBufferSlots.Allocate();
+  if (index == INVALID_BINDLESS_INDEX)
   {
-    set = VK_NULL_HANDLE;
+    return index;
   }
-  vkResetDescriptorPool(g_Device, g_DescriptorPool, 0);
+
+  VkDescriptorBufferInfo bufferInfo = {};
+  bufferInfo.buffer = buffer;
+  bufferInfo.offset = offset;
+  bufferInfo.range = range;
+
+  VkWriteDescriptorSet writeSet = {};
+  writeSet.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+  writeSet.dstSet = g_BindlessDescriptorSet;
+  writeSet.dstBinding = BINDLESS_STORAGE_BUFFER_BINDING;
+  writeSet.dstArrayElement = index;
+  writeSet.descriptorCount = 1;
+  writeSet.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+  writeSet.pBufferInfo = &bufferInfo;
+  vkUpdateDescriptorSets(g_Device, 1, &writeSet, 0, nullptr);
+
+  return index;
+}
+
+// The slot is reused by the next registration, so only release
+// once no pending command buffer reads from it
+void ReleaseBindlessStorageBuffer(uint32_t index)
+{
+  g_BindlessStorageBufferSlots.Release(index);
 }
 
 // Pipeline cache
@@ -949,13 +2502,46 @@ void DestroyVkPipelineCache()
 
 // Pipeline layout
 static VkPipelineLayout g_PipelineLayout;
+static VkPipelineLayout g_MeshletPipelineLayout;
+static VkPipelineLayout g_DepthPyramidPipelineLayout;
+
+// Matches the push constants of MeshletCull.comp
+struct MeshletCullPushConstants
+{
+  glm::vec4 frustumPlanes[6];
+  glm::vec3 cameraPosition;
+  uint32_t instanceBase;
+  uint32_t numInstances;
+  uint32_t numMeshlets;
+  uint32_t maxClusters;
+};
+
+// Matches the push constants of DepthPyramid.comp, offsets are in texels
+struct DepthPyramidPushConstants
+{
+  uint32_t srcOffset;
+  uint32_t dstOffset;
+  uint32_t srcWidth;
+  uint32_t srcHeight;
+  uint32_t dstWidth;
+  uint32_t dstHeight;
+  uint32_t fromDepth;
+};
+
+// Push constants of the bindless path, the classic path only pushes time
+struct BindlessPushConstants
+{
+  float time;
+  uint32_t uniformBufferIndex;
+  uint32_t textureIndex;
+};
 
 Result InitVkPipelineLayout()
 {
   // Pipeline layout
   {
     VkPushConstantRange pushConstantRange = {};
-    pushConstantRange.size = sizeof(float);
+    pushConstantRange.size = g_BindlessEnabled ? sizeof(BindlessPushConstants) : sizeof(float);
     pushConstantRange.offset = 0;
     pushConstantRange.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
 
@@ -964,13 +2550,39 @@ Result InitVkPipelineLayout()
     pipelineLayoutCI.pushConstantRangeCount = 1;
     pipelineLayoutCI.pPushConstantRanges = &pushConstantRange;
     pipelineLayoutCI.setLayoutCount = 1;
-    pipelineLayoutCI.pSetLayouts = &g_DescriptorSetLayout;
+    pipelineLayoutCI.pSetLayouts = g_BindlessEnabled ? &g_BindlessDescriptorSetLayout : &g_DescriptorSetLayout;
 
     RETURN_IF_FAILURE(Result::Vulkan(
       vkCreatePipelineLayout(g_Device, &pipelineLayoutCI, nullptr, &g_PipelineLayout)),
       "vkCreatePipelineLayout");
   }
 
+  // Meshlet pipeline layout, shared by the culling and draw pipelines
+  if (g_Options.meshlets)
+  {
+    VkPushConstantRange pushConstantRange = {};
+    pushConstantRange.size = sizeof(MeshletCullPushConstants);
+    pushConstantRange.offset = 0;
+    pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+
+    VkPipelineLayoutCreateInfo pipelineLayoutCI = {};
+    pipelineLayoutCI.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipelineLayoutCI.pushConstantRangeCount = 1;
+    pipelineLayoutCI.pPushConstantRanges = &pushConstantRange;
+    pipelineLayoutCI.setLayoutCount = 1;
+    pipelineLayoutCI.pSetLayouts = &g_MeshletDescriptorSetLayout;
+
+    RETURN_IF_FAILURE(Result::Vulkan(
+      vkCreatePipelineLayout(g_Device, &pipelineLayoutCI, nullptr, &g_MeshletPipelineLayout)),
+      "vkCreatePipelineLayout");
+
+    pushConstantRange.size = sizeof(DepthPyramidPushConstants);
+    pipelineLayoutCI.pSetLayouts = &g_DepthPyramidDescriptorSetLayout;
+    RETURN_IF_FAILURE(Result::Vulkan(
+      vkCreatePipelineLayout(g_Device, &pipelineLayoutCI, nullptr, &g_DepthPyramidPipelineLayout)),
+      "vkCreatePipelineLayout");
+  }
+
   return Result::Application(0);
 }
 
@@ -981,534 +2593,4165 @@ void DestroyVkPipelineLayout()
     vkDestroyPipelineLayout(g_Device, g_PipelineLayout, nullptr);
     g_PipelineLayout = VK_NULL_HANDLE;
   }
-}
 
-// Render pass
-static VkRenderPass g_RenderPass;
+  if (g_MeshletPipelineLayout != VK_NULL_HANDLE)
+  {
+    vkDestroyPipelineLayout(g_Device, g_MeshletPipelineLayout, nullptr);
+    g_MeshletPipelineLayout = VK_NULL_HANDLE;
+  }
+
+  if (g_DepthPyramidPipelineLayout != VK_NULL_HANDLE)
+  {
+    vkDestroyPipelineLayout(g_Device, g_DepthPyramidPipelineLayout, nullptr);
+    g_DepthPyramidPipelineLayout = VK_NULL_HANDLE;
+  }
+}
 
-Result InitVkRenderPass()
+// Render graph
+// Passes declare which resources they use and how, the graph derives the rest
+// once when compiled: which passes contribute to an output at all (the others
+// are culled), the barriers between passes with their layout transitions and
+// queue family ownership transfers, the load and store ops of attachments,
+// the images it creates, which become render targets living from their
+// first to their last pass, and the submissions: consecutive passes on one
+// queue form a batch, and batches wait for the batches on other queues whose
+// results they use with semaphores the graph creates. With timeline
+// semaphores, each queue has a single semaphore instead, signaled with one
+// more than its previous value by each batch, so a wait names the producing
+// batch's value and a frame is done once every queue reached the values of
+// its last batches. Passes run in
+// declaration order, which is also the order their accesses are resolved in,
+// so independent work declared on the compute queue overlaps the graphics
+// passes around it. Imported resources are referenced
+// through their owners' handles, so owners may replace them (on swapchain
+// recreation or defragmentation) without telling the graph.
+
+enum RenderQueue
 {
-  VkAttachmentDescription colorAttachment = {};
-  colorAttachment.format = g_SwapchainFormat;
-  colorAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
-  colorAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-  colorAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
-  colorAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
-  colorAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-  colorAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-  colorAttachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+  RENDER_QUEUE_GRAPHICS = 0,
+  RENDER_QUEUE_COMPUTE,
+  NUM_RENDER_QUEUES
+};
 
-  VkAttachmentReference colorAttachmentRef = {};
-  colorAttachmentRef.attachment = 0;
-  colorAttachmentRef.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+// How a pass uses a resource, a use may combine several
+enum RenderAccessBits
+{
+  RENDER_ACCESS_COLOR_ATTACHMENT = 1 << 0,
+  RENDER_ACCESS_DEPTH_ATTACHMENT = 1 << 1,
+  RENDER_ACCESS_SAMPLED_FRAGMENT = 1 << 2,
+  RENDER_ACCESS_SAMPLED_COMPUTE = 1 << 3,
+  RENDER_ACCESS_STORAGE_READ_VERTEX = 1 << 4,
+  RENDER_ACCESS_STORAGE_READ_COMPUTE = 1 << 5,
+  // Read-modify-write, like atomic counters
+  RENDER_ACCESS_STORAGE_WRITE_COMPUTE = 1 << 6,
+  RENDER_ACCESS_TRANSFER_WRITE = 1 << 7,
+  RENDER_ACCESS_INDIRECT_READ = 1 << 8,
+  RENDER_ACCESS_INDEX_READ = 1 << 9,
+  // Outputs only, what the resource is handed over to after the frame
+  RENDER_ACCESS_PRESENT = 1 << 10,
+  NUM_RENDER_ACCESS_BITS = 11
+};
 
-  VkSubpassDescription subpass = {};
-  subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
-  subpass.colorAttachmentCount = 1;
-  subpass.pColorAttachments = &colorAttachmentRef;
+static const uint32_t RENDER_ACCESS_ATTACHMENT = RENDER_ACCESS_COLOR_ATTACHMENT | RENDER_ACCESS_DEPTH_ATTACHMENT;
 
-  VkSubpassDependency dependency = {};
-  dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
-  dependency.dstSubpass = 0;
-  dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-  dependency.srcAccessMask = 0;
-  dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-  dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_COLOR_ATTACHMENT_READ_BIT;
+struct RenderAccessInfo
+{
+  VkPipelineStageFlags stages;
+  VkAccessFlags access;
+  // UNDEFINED for accesses only buffers have
+  VkImageLayout layout;
+  VkImageUsageFlags usage;
+  bool write;
+  // Whether the previous contents matter, attachments read them unless cleared
+  bool read;
+};
 
-  VkRenderPassCreateInfo renderPassCI = {};
-  renderPassCI.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
-  renderPassCI.attachmentCount = 1;
-  renderPassCI.pAttachments = &colorAttachment;
-  renderPassCI.subpassCount = 1;
-  renderPassCI.pSubpasses = &subpass;
-  renderPassCI.dependencyCount = 1;
-  renderPassCI.pDependencies = &dependency;
-  RETURN_IF_FAILURE(Result::Vulkan(
-    vkCreateRenderPass(g_Device, &renderPassCI, nullptr, &g_RenderPass)),
-    "vkCreateRenderPass");
+// Indexed by bit
+static const RenderAccessInfo g_RenderAccessInfos[NUM_RENDER_ACCESS_BITS] = {
+  { VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+    VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+    VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT, true, false },
+  { VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+    VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+    VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT, true, false },
+  { VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT,
+    VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_IMAGE_USAGE_SAMPLED_BIT, false, true },
+  { VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT,
+    VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_IMAGE_USAGE_SAMPLED_BIT, false, true },
+  { VK_PIPELINE_STAGE_VERTEX_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT,
+    VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_USAGE_STORAGE_BIT, false, true },
+  { VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT,
+    VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_USAGE_STORAGE_BIT, false, true },
+  { VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+    VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_USAGE_STORAGE_BIT, true, true },
+  { VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
+    VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_USAGE_TRANSFER_DST_BIT, true, false },
+  { VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, VK_ACCESS_INDIRECT_COMMAND_READ_BIT,
+    VK_IMAGE_LAYOUT_UNDEFINED, 0, false, true },
+  { VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, VK_ACCESS_INDEX_READ_BIT,
+    VK_IMAGE_LAYOUT_UNDEFINED, 0, false, true },
+  { VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0,
+    VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, 0, false, true },
+};
 
-  return Result::Application(0);
-}
+static const VkAccessFlags WRITE_ACCESS_MASK = VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT
+  | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
 
-void DestroyVkRenderPass()
+RenderAccessInfo GetRenderAccessInfo(uint32_t accesses)
 {
-  if (g_RenderPass != VK_NULL_HANDLE)
+  RenderAccessInfo info = {};
+  info.layout = VK_IMAGE_LAYOUT_UNDEFINED;
+  for (uint32_t bit = 0; bit < NUM_RENDER_ACCESS_BITS; bit++)
   {
-    vkDestroyRenderPass(g_Device, g_RenderPass, nullptr);
-    g_RenderPass = VK_NULL_HANDLE;
+    if ((accesses & (1u << bit)) == 0)
+    {
+      continue;
+    }
+    const RenderAccessInfo& bitInfo = g_RenderAccessInfos[bit];
+    info.stages |= bitInfo.stages;
+    info.access |= bitInfo.access;
+    info.usage |= bitInfo.usage;
+    info.write = info.write || bitInfo.write;
+    info.read = info.read || bitInfo.read;
+    // Image accesses that want different layouts settle on GENERAL
+    if (bitInfo.layout != VK_IMAGE_LAYOUT_UNDEFINED)
+    {
+      info.layout = info.layout == VK_IMAGE_LAYOUT_UNDEFINED || info.layout == bitInfo.layout
+        ? bitInfo.layout : VK_IMAGE_LAYOUT_GENERAL;
+    }
   }
+  return info;
 }
 
-// Framebuffers
-static std::vector<VkFramebuffer> g_SwapchainFramebuffers;
+uint32_t GetRenderQueueFamily(RenderQueue queue)
+{
+  return queue == RENDER_QUEUE_COMPUTE ? g_ComputeQueueFamily : g_GraphicsQueueFamily;
+}
 
-Result InitVkSwapchainFramebuffers()
+VkQueue GetRenderQueue(RenderQueue queue)
 {
-  g_SwapchainFramebuffers.resize(g_SwapchainImageViews.size());
+  return queue == RENDER_QUEUE_COMPUTE ? g_ComputeQueue : g_GraphicsQueue;
+}
+
+struct RenderResource
+{
+  const char* name;
+  bool image;
+  // Imported resources belong to someone else, the graph creates the others
+  bool imported;
+  VkFormat format;
+  VkImageAspectFlags aspect;
+  // Imported images, indexed by swapchain image if there is more than one
+  const std::vector<VkImage>* images;
+  const std::vector<VkImageView>* views;
+  // Imported buffers
+  const VkBuffer* buffer;
+  // Resources shared concurrently by all queue families never change owners
+  bool concurrent;
+  // Work that must be done before the frame may touch the resource (like the
+  // wait for a swapchain image), and the layout it comes in
+  VkPipelineStageFlags initialStages;
+  VkAccessFlags initialAccess;
+  VkImageLayout initialLayout;
+  // Accesses after the frame, 0 unless the resource is an output
+  uint32_t outputAccesses;
+
+  // Created images, set when compiling. Lifetimes are positions in the
+  // execution order, unused images aren't created.
+  VkImageUsageFlags usage;
+  uint32_t firstUse;
+  uint32_t lastUse;
+  bool transient;
+  uint32_t renderTarget;
+};
+
+struct RenderPassUse
+{
+  uint32_t resource;
+  uint32_t accesses;
+  bool clear;
+  VkClearValue clearValue;
+};
+
+struct RenderBarrier
+{
+  uint32_t resource;
+  VkPipelineStageFlags srcStages;
+  VkAccessFlags srcAccess;
+  VkPipelineStageFlags dstStages;
+  VkAccessFlags dstAccess;
+  VkImageLayout oldLayout;
+  VkImageLayout newLayout;
+  // Differ on both halves of an ownership transfer
+  RenderQueue srcQueue;
+  RenderQueue dstQueue;
+};
+
+struct RenderGraphPass
+{
+  const char* name;
+  RenderQueue queue;
+  // Raster passes run in a render pass over their attachments, in use order
+  bool raster;
+  void (*record)(VkCommandBuffer commandBuffer, uint32_t frame);
+  std::vector<RenderPassUse> uses;
+
+  bool culled;
+  uint32_t batch;
+  // Recorded before the pass, and after it (ownership releases and the
+  // hand-over of outputs)
+  std::vector<RenderBarrier> barriers;
+  std::vector<RenderBarrier> releases;
+  VkRenderPass renderPass;
+  std::vector<VkClearValue> clearValues;
+  // One per swapchain image if an attachment is one, else a single one
+  std::vector<VkFramebuffer> framebuffers;
+};
+
+// One command buffer and queue submission
+struct RenderBatch
+{
+  RenderQueue queue;
+  // Range in the execution order
+  uint32_t begin;
+  uint32_t end;
+  // Indices of the semaphore edges waited for before the batch and signaled after it
+  std::vector<uint32_t> waits;
+  std::vector<uint32_t> signals;
+};
+
+struct RenderBatchEdge
+{
+  uint32_t from;
+  uint32_t to;
+  // Where the waiting batch first needs the results
+  VkPipelineStageFlags stages;
+};
+
+// Each batch of barriers is one vkCmdPipelineBarrier call
+static const uint32_t MAX_RENDER_BARRIER_BATCH = 16;
+static const uint32_t MAX_RENDER_BATCHES = 8;
+
+static const uint32_t RENDER_GRAPH_NONE = (uint32_t)-1;
+
+static struct RenderGraph
+{
+  std::vector<RenderResource> resources;
+  std::vector<RenderGraphPass> passes;
+  // Passes that aren't culled, in execution order
+  std::vector<uint32_t> order;
+  std::vector<RenderBatch> batches;
+  std::vector<RenderBatchEdge> edges;
+  // [frame * number of edges + edge], binary semaphores without timelines
+  std::vector<VkSemaphore> semaphores;
+  // With timelines, the value last submitted to be signaled on each queue, and
+  // the values of each frame's last batches at [frame * NUM_RENDER_QUEUES + queue]
+  VkSemaphore timelines[NUM_RENDER_QUEUES];
+  uint64_t timelineValues[NUM_RENDER_QUEUES];
+  std::vector<uint64_t> frameValues;
+  // Timeline values of the current frame's batches, as submitted
+  uint64_t batchValues[MAX_RENDER_BATCHES];
+  // The batch first using an image that arrives with a semaphore, like the swapchain's
+  uint32_t acquireBatch;
+  VkPipelineStageFlags acquireStages;
+  // The batch last using an image presented after the frame, work after it
+  // doesn't hold up presentation
+  uint32_t presentBatch;
+  // The first batch using an image. Images are either the swapchain's or
+  // sized like it, so the batches before can be recorded and submitted
+  // before acquiring, and survive the swapchain's recreation.
+  uint32_t lateBatch;
+  uint32_t numBarriers;
+
+  uint32_t CreateImage(const char* name, VkFormat format, VkImageAspectFlags aspect)
+  {
+    RenderResource resource = {};
+    resource.name = name;
+    resource.image = true;
+    resource.format = format;
+    resource.aspect = aspect;
+    resource.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    resource.renderTarget = RENDER_GRAPH_NONE;
+    resources.push_back(resource);
+    return (uint32_t)resources.size() - 1;
+  }
+
+  uint32_t ImportImages(const char* name, const std::vector<VkImage>* images, const std::vector<VkImageView>* views,
+                        VkFormat format, VkImageAspectFlags aspect, VkPipelineStageFlags initialStages,
+                        VkImageLayout initialLayout, bool concurrent)
+  {
+    RenderResource resource = {};
+    resource.name = name;
+    resource.image = true;
+    resource.imported = true;
+    resource.format = format;
+    resource.aspect = aspect;
+    resource.images = images;
+    resource.views = views;
+    resource.concurrent = concurrent;
+    resource.initialStages = initialStages;
+    resource.initialLayout = initialLayout;
+    resource.renderTarget = RENDER_GRAPH_NONE;
+    resources.push_back(resource);
+    return (uint32_t)resources.size() - 1;
+  }
+
+  uint32_t ImportBuffer(const char* name, const VkBuffer* buffer, bool concurrent)
+  {
+    RenderResource resource = {};
+    resource.name = name;
+    resource.imported = true;
+    resource.buffer = buffer;
+    resource.concurrent = concurrent;
+    resource.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    resource.renderTarget = RENDER_GRAPH_NONE;
+    resources.push_back(resource);
+    return (uint32_t)resources.size() - 1;
+  }
+
+  // Passes writing outputs are what keeps passes from being culled
+  void SetOutput(uint32_t resource, uint32_t accesses)
+  {
+    resources[resource].outputAccesses = accesses;
+  }
+
+  uint32_t AddPass(const char* name, RenderQueue queue, bool raster, void (*record)(VkCommandBuffer, uint32_t))
+  {
+    RenderGraphPass pass = {};
+    pass.name = name;
+    pass.queue = queue;
+    pass.raster = raster;
+    pass.record = record;
+    passes.push_back(pass);
+    return (uint32_t)passes.size() - 1;
+  }
+
+  void Use(uint32_t pass, uint32_t resource, uint32_t accesses)
+  {
+    RenderPassUse use = {};
+    use.resource = resource;
+    use.accesses = accesses;
+    passes[pass].uses.push_back(use);
+  }
+
+  // Attachments only, the previous contents are discarded
+  void Clear(uint32_t pass, uint32_t resource, uint32_t accesses, VkClearValue clearValue)
+  {
+    Use(pass, resource, accesses);
+    passes[pass].uses.back().clear = true;
+    passes[pass].uses.back().clearValue = clearValue;
+  }
+
+  Result Compile();
+  // Render targets and framebuffers, recreated with the swapchain
+  Result CreateTargets();
+  void DestroyTargets();
+  // Timeline semaphores if g_TimelineSemaphoresEnabled, else binary ones per frame
+  Result CreateSemaphores(uint32_t numFrames);
+  void DestroySemaphores();
+  void Destroy();
+
+  void RecordBatch(VkCommandBuffer commandBuffer, uint32_t batch, uint32_t frame, uint32_t imageIndex) const;
+  // Submits the batches from firstBatch to endBatch, recorded into
+  // commandBuffers with one per batch of the frame. A frame's batches are
+  // submitted in order, in one or more calls. The acquire semaphore is waited
+  // for by acquireBatch, presentBatch signals the present semaphore and the
+  // last batch the fence, if any, once the whole frame is done.
+  Result Submit(const VkCommandBuffer* commandBuffers, uint32_t frame, uint32_t firstBatch, uint32_t endBatch,
+                VkSemaphore acquireSemaphore, VkSemaphore presentSemaphore, VkFence fence);
+  // With timelines, whether the frame's last submission has completed, and waiting for it
+  bool IsFrameComplete(uint32_t frame) const;
+  Result WaitForFrame(uint32_t frame) const;
+  // Views of created images are valid between CreateTargets() and DestroyTargets()
+  VkImageView GetImageView(uint32_t r, uint32_t imageIndex) const;
+
+private:
+  // Tracked per resource while scheduling barriers
+  struct ResourceState
+  {
+    VkImageLayout layout;
+    RenderQueue queue;
+    bool owned;
+    // Last write or layout transition, and the stages reading since
+    VkPipelineStageFlags writeStages;
+    VkAccessFlags writeAccess;
+    VkPipelineStageFlags readStages;
+    // Where the last write has been made visible
+    VkPipelineStageFlags visibleStages;
+    VkAccessFlags visibleAccess;
+    uint32_t lastPass;
+  };
+
+  static bool ReadsContents(const RenderPassUse& use)
+  {
+    return GetRenderAccessInfo(use.accesses).read || ((use.accesses & RENDER_ACCESS_ATTACHMENT) != 0 && !use.clear);
+  }
+
+  void Transition(uint32_t r, uint32_t p, const RenderAccessInfo& info, bool reads,
+                  ResourceState& state, std::vector<RenderBarrier>& outBarriers);
+  void AddBatchEdge(uint32_t from, uint32_t to, VkPipelineStageFlags stages);
+  void ScheduleBarriers();
+  void ScheduleBatches();
+  Result CreateRenderPass(RenderGraphPass& pass, const std::vector<uint8_t>& stores);
+  VkImage GetImage(uint32_t r, uint32_t imageIndex) const;
+  void RecordBarriers(VkCommandBuffer commandBuffer, const std::vector<RenderBarrier>& barriers, uint32_t imageIndex) const;
+} g_RenderGraph;
+
+// Render pass of the main pass, which the graphics pipelines are made for
+static VkRenderPass g_RenderPass;
+
+// Brings the resource from its tracked state to the one the access needs,
+// adding a barrier only where there is a hazard, a layout change or a change
+// of queue family
+void RenderGraph::Transition(uint32_t r, uint32_t p, const RenderAccessInfo& info, bool reads,
+                             ResourceState& state, std::vector<RenderBarrier>& outBarriers)
+{
+  const RenderResource& resource = resources[r];
+  RenderQueue queue = passes[p].queue;
+  VkImageLayout layout = resource.image ? info.layout : VK_IMAGE_LAYOUT_UNDEFINED;
+  bool layoutChange = resource.image && state.layout != layout;
+  bool queueChange = state.owned && state.queue != queue;
+  // Discarded contents need no transfer, the new queue just takes them over
+  bool ownershipChange = queueChange && reads && !resource.concurrent
+    && GetRenderQueueFamily(state.queue) != GetRenderQueueFamily(queue);
+  bool hazard = info.write
+    ? (state.writeStages | state.readStages) != 0
+    : state.writeStages != 0 && ((info.stages & ~state.visibleStages) != 0 || (info.access & ~state.visibleAccess) != 0);
+  if (queueChange)
+  {
+    AddBatchEdge(passes[state.lastPass].batch, passes[p].batch, info.stages);
+  }
+
+  // Across queues the semaphore between the batches covers hazards
+  if (layoutChange || ownershipChange || (hazard && !queueChange))
+  {
+    RenderBarrier barrier = {};
+    barrier.resource = r;
+    // Reads only need to wait for the write, writes and transitions for the reads as well
+    barrier.srcStages = state.writeStages | (info.write || layoutChange ? state.readStages : 0);
+    barrier.srcAccess = state.writeAccess;
+    barrier.dstStages = info.stages;
+    barrier.dstAccess = info.access;
+    barrier.oldLayout = resource.image && reads ? state.layout : VK_IMAGE_LAYOUT_UNDEFINED;
+    barrier.newLayout = layout;
+    barrier.srcQueue = queue;
+    barrier.dstQueue = queue;
+    if (ownershipChange)
+    {
+      // The previous queue releases after its last use
+      RenderBarrier release = barrier;
+      release.srcStages = state.writeStages | state.readStages;
+      release.dstStages = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
+      release.dstAccess = 0;
+      release.srcQueue = state.queue;
+      release.srcStages = release.srcStages != 0 ? release.srcStages : VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+      passes[state.lastPass].releases.push_back(release);
+      barrier.srcQueue = state.queue;
+    }
+    if (queueChange)
+    {
+      // The semaphore wait at the consumer's stages covers the other queue's
+      // work, the barrier chains onto it
+      barrier.srcStages = info.stages;
+      barrier.srcAccess = 0;
+    }
+    barrier.srcStages = barrier.srcStages != 0 ? barrier.srcStages : VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+    outBarriers.push_back(barrier);
+  }
+
+  if (info.write || layoutChange)
+  {
+    state.writeStages = info.stages;
+    state.writeAccess = info.access & WRITE_ACCESS_MASK;
+    state.readStages = 0;
+    state.visibleStages = info.stages;
+    state.visibleAccess = info.access;
+  }
+  else
+  {
+    state.readStages |= info.stages;
+    state.visibleStages |= info.stages;
+    state.visibleAccess |= info.access;
+  }
+  state.layout = layout;
+  state.queue = queue;
+  state.owned = true;
+}
+
+void RenderGraph::AddBatchEdge(uint32_t from, uint32_t to, VkPipelineStageFlags stages)
+{
+  for (RenderBatchEdge& edge : edges)
+  {
+    if (edge.from == from && edge.to == to)
+    {
+      edge.stages |= stages;
+      return;
+    }
+  }
+  edges.push_back({ from, to, stages });
+}
+
+void RenderGraph::ScheduleBarriers()
+{
+  for (RenderGraphPass& pass : passes)
+  {
+    pass.barriers.clear();
+    pass.releases.clear();
+  }
+  edges.clear();
+
+  std::vector<ResourceState> states(resources.size());
+  for (uint32_t r = 0; r < (uint32_t)resources.size(); r++)
+  {
+    ResourceState& state = states[r];
+    state = {};
+    state.layout = resources[r].initialLayout;
+    state.writeStages = resources[r].initialStages;
+    state.writeAccess = resources[r].initialAccess;
+    state.lastPass = RENDER_GRAPH_NONE;
+  }
+
+  for (uint32_t p : order)
+  {
+    RenderGraphPass& pass = passes[p];
+    for (const RenderPassUse& use : pass.uses)
+    {
+      Transition(use.resource, p, GetRenderAccessInfo(use.accesses), ReadsContents(use),
+                 states[use.resource], pass.barriers);
+      states[use.resource].lastPass = p;
+    }
+  }
+
+  // Outputs are handed over after the last pass using them
+  for (uint32_t r = 0; r < (uint32_t)resources.size(); r++)
+  {
+    ResourceState& state = states[r];
+    if (resources[r].outputAccesses != 0 && state.lastPass != RENDER_GRAPH_NONE)
+    {
+      Transition(r, state.lastPass, GetRenderAccessInfo(resources[r].outputAccesses), true, state,
+                 passes[state.lastPass].releases);
+    }
+  }
+
+  // Created images may alias each other's memory, and the next frame reuses
+  // their own, so each one's first barrier waits for the last uses of all
+  // of them, which the next round takes into account
+  VkPipelineStageFlags aliasStages = 0;
+  VkAccessFlags aliasAccess = 0;
+  for (uint32_t r = 0; r < (uint32_t)resources.size(); r++)
+  {
+    if (!resources[r].imported)
+    {
+      aliasStages |= states[r].writeStages | states[r].readStages;
+      aliasAccess |= states[r].writeAccess;
+    }
+  }
+  for (RenderResource& resource : resources)
+  {
+    if (!resource.imported)
+    {
+      resource.initialStages = aliasStages;
+      resource.initialAccess = aliasAccess;
+    }
+  }
+}
+
+// Called after the barriers, which add the edges for the results batches
+// pass between queues
+void RenderGraph::ScheduleBatches()
+{
+  // The fence goes with the last batch, so every other one must finish
+  // before it. Batches with a path of edges to it do,
+  // the others get an edge of their own, waited for only by the fence.
+  uint32_t last = (uint32_t)batches.size() - 1;
+  std::vector<uint8_t> reachesLast(batches.size(), 0);
+  reachesLast[last] = 1;
+  for (uint32_t b = last; b-- > 0;)
+  {
+    for (const RenderBatchEdge& edge : edges)
+    {
+      if (edge.from == b && reachesLast[edge.to])
+      {
+        reachesLast[b] = 1;
+      }
+    }
+    if (!reachesLast[b])
+    {
+      AddBatchEdge(b, last, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT);
+      reachesLast[b] = 1;
+    }
+  }
+
+  for (RenderBatch& batch : batches)
+  {
+    batch.waits.clear();
+    batch.signals.clear();
+  }
+  for (uint32_t e = 0; e < (uint32_t)edges.size(); e++)
+  {
+    batches[edges[e].from].signals.push_back(e);
+    batches[edges[e].to].waits.push_back(e);
+  }
+
+  acquireBatch = RENDER_GRAPH_NONE;
+  acquireStages = 0;
+  for (const RenderResource& resource : resources)
+  {
+    if (resource.imported && resource.image && resource.initialStages != 0 && resource.firstUse != RENDER_GRAPH_NONE)
+    {
+      uint32_t batch = passes[order[resource.firstUse]].batch;
+      acquireBatch = acquireBatch == RENDER_GRAPH_NONE ? batch : glm::min(acquireBatch, batch);
+      acquireStages |= resource.initialStages;
+    }
+  }
+
+  lateBatch = (uint32_t)batches.size();
+  for (const RenderResource& resource : resources)
+  {
+    if (resource.image && resource.firstUse != RENDER_GRAPH_NONE)
+    {
+      lateBatch = glm::min(lateBatch, passes[order[resource.firstUse]].batch);
+    }
+  }
+
+  presentBatch = last;
+  for (const RenderResource& resource : resources)
+  {
+    if ((resource.outputAccesses & RENDER_ACCESS_PRESENT) != 0 && resource.firstUse != RENDER_GRAPH_NONE)
+    {
+      presentBatch = passes[order[resource.lastUse]].batch;
+    }
+  }
+}
+
+Result RenderGraph::CreateRenderPass(RenderGraphPass& pass, const std::vector<uint8_t>& stores)
+{
+  std::vector<VkAttachmentDescription> attachments;
+  std::vector<VkAttachmentReference> colorAttachmentRefs;
+  VkAttachmentReference depthAttachmentRef = {};
+  bool hasDepth = false;
+  pass.clearValues.clear();
+  for (uint32_t u = 0; u < (uint32_t)pass.uses.size(); u++)
+  {
+    const RenderPassUse& use = pass.uses[u];
+    if ((use.accesses & RENDER_ACCESS_ATTACHMENT) == 0)
+    {
+      continue;
+    }
+    RenderAccessInfo info = GetRenderAccessInfo(use.accesses);
+
+    // The barriers around the pass do all layout transitions
+    VkAttachmentDescription attachment = {};
+    attachment.format = resources[use.resource].format;
+    attachment.samples = VK_SAMPLE_COUNT_1_BIT;
+    attachment.loadOp = use.clear ? VK_ATTACHMENT_LOAD_OP_CLEAR
+      : ReadsContents(use) ? VK_ATTACHMENT_LOAD_OP_LOAD : VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    attachment.storeOp = stores[u] ? VK_ATTACHMENT_STORE_OP_STORE : VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    attachment.initialLayout = info.layout;
+    attachment.finalLayout = info.layout;
+
+    VkAttachmentReference attachmentRef = {};
+    attachmentRef.attachment = (uint32_t)attachments.size();
+    attachmentRef.layout = info.layout;
+    if (use.accesses & RENDER_ACCESS_DEPTH_ATTACHMENT)
+    {
+      depthAttachmentRef = attachmentRef;
+      hasDepth = true;
+    }
+    else
+    {
+      colorAttachmentRefs.push_back(attachmentRef);
+    }
+    attachments.push_back(attachment);
+    pass.clearValues.push_back(use.clearValue);
+  }
+
+  VkSubpassDescription subpass = {};
+  subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+  subpass.colorAttachmentCount = (uint32_t)colorAttachmentRefs.size();
+  subpass.pColorAttachments = colorAttachmentRefs.data();
+  subpass.pDepthStencilAttachment = hasDepth ? &depthAttachmentRef : nullptr;
+
+  VkRenderPassCreateInfo renderPassCI = {};
+  renderPassCI.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+  renderPassCI.attachmentCount = (uint32_t)attachments.size();
+  renderPassCI.pAttachments = attachments.data();
+  renderPassCI.subpassCount = 1;
+  renderPassCI.pSubpasses = &subpass;
+  RETURN_IF_FAILURE(Result::Vulkan(
+    vkCreateRenderPass(g_Device, &renderPassCI, nullptr, &pass.renderPass)),
+    "vkCreateRenderPass");
+
+  return Result::Application(0);
+}
+
+Result RenderGraph::Compile()
+{
+  uint32_t numPasses = (uint32_t)passes.size();
+  uint32_t numResources = (uint32_t)resources.size();
+
+  // Passes that wrote what a pass reads are its producers
+  std::vector<std::vector<uint32_t>> producers(numPasses);
+  {
+    std::vector<uint32_t> lastWriters(numResources, RENDER_GRAPH_NONE);
+    for (uint32_t p = 0; p < numPasses; p++)
+    {
+      for (const RenderPassUse& use : passes[p].uses)
+      {
+        uint32_t lastWriter = lastWriters[use.resource];
+        if (lastWriter != RENDER_GRAPH_NONE && lastWriter != p && ReadsContents(use))
+        {
+          producers[p].push_back(lastWriter);
+        }
+        if (GetRenderAccessInfo(use.accesses).write)
+        {
+          lastWriters[use.resource] = p;
+        }
+      }
+    }
+  }
+
+  // Passes writing outputs are needed, and so are the producers of needed
+  // passes. Producers come first, so one sweep backwards finds them all.
+  std::vector<uint8_t> needed(numPasses, 0);
+  for (uint32_t p = numPasses; p-- > 0;)
+  {
+    for (const RenderPassUse& use : passes[p].uses)
+    {
+      if (resources[use.resource].outputAccesses != 0 && GetRenderAccessInfo(use.accesses).write)
+      {
+        needed[p] = 1;
+      }
+    }
+    if (needed[p])
+    {
+      for (uint32_t producer : producers[p])
+      {
+        needed[producer] = 1;
+      }
+    }
+    passes[p].culled = !needed[p];
+  }
+  order.clear();
+  for (uint32_t p = 0; p < numPasses; p++)
+  {
+    if (!passes[p].culled)
+    {
+      order.push_back(p);
+    }
+  }
+
+  // Lifetimes and usage of the created images
+  for (RenderResource& resource : resources)
+  {
+    resource.usage = 0;
+    resource.firstUse = RENDER_GRAPH_NONE;
+    resource.transient = !resource.imported;
+  }
+  for (uint32_t i = 0; i < (uint32_t)order.size(); i++)
+  {
+    for (const RenderPassUse& use : passes[order[i]].uses)
+    {
+      RenderResource& resource = resources[use.resource];
+      resource.usage |= GetRenderAccessInfo(use.accesses).usage;
+      resource.firstUse = resource.firstUse == RENDER_GRAPH_NONE ? i : resource.firstUse;
+      resource.lastUse = i;
+      if ((use.accesses & ~RENDER_ACCESS_ATTACHMENT) != 0 || ReadsContents(use))
+      {
+        resource.transient = false;
+      }
+    }
+  }
+
+  // An attachment is stored if a later pass or the resource's owner reads
+  // it, created images don't outlive the frame
+  std::vector<std::vector<uint8_t>> stores(numPasses);
+  {
+    std::vector<uint8_t> readLater(numResources);
+    for (uint32_t r = 0; r < numResources; r++)
+    {
+      readLater[r] = resources[r].imported;
+    }
+    for (uint32_t i = (uint32_t)order.size(); i-- > 0;)
+    {
+      const RenderGraphPass& pass = passes[order[i]];
+      stores[order[i]].resize(pass.uses.size());
+      for (uint32_t u = (uint32_t)pass.uses.size(); u-- > 0;)
+      {
+        const RenderPassUse& use = pass.uses[u];
+        stores[order[i]][u] = readLater[use.resource];
+        if (ReadsContents(use))
+        {
+          readLater[use.resource] = 1;
+        }
+        else if (GetRenderAccessInfo(use.accesses).write)
+        {
+          readLater[use.resource] = 0;
+        }
+        if (stores[order[i]][u] && (use.accesses & RENDER_ACCESS_ATTACHMENT) != 0)
+        {
+          resources[use.resource].transient = false;
+        }
+      }
+    }
+  }
+
+  // Consecutive passes on one queue share a batch
+  batches.clear();
+  for (uint32_t i = 0; i < (uint32_t)order.size(); i++)
+  {
+    RenderGraphPass& pass = passes[order[i]];
+    if (batches.empty() || batches.back().queue != pass.queue)
+    {
+      RenderBatch batch = {};
+      batch.queue = pass.queue;
+      batch.begin = i;
+      batches.push_back(batch);
+    }
+    batches.back().end = i + 1;
+    pass.batch = (uint32_t)batches.size() - 1;
+  }
+  RETURN_IF_FAILURE(Result::Application(
+    batches.empty() || batches.size() > MAX_RENDER_BATCHES ? 1 : 0),
+    "Unsupported number of render graph batches");
+
+  // The first round finds where created images are last used
+  for (uint32_t round = 0; round < 2; round++)
+  {
+    ScheduleBarriers();
+  }
+  ScheduleBatches();
+
+  numBarriers = 0;
+  for (uint32_t p : order)
+  {
+    RenderGraphPass& pass = passes[p];
+    RETURN_IF_FAILURE(Result::Application(
+      pass.barriers.size() > MAX_RENDER_BARRIER_BATCH || pass.releases.size() > MAX_RENDER_BARRIER_BATCH ? 1 : 0),
+      "Too many barriers around a pass");
+    numBarriers += (uint32_t)(pass.barriers.size() + pass.releases.size());
+    if (pass.raster)
+    {
+      RETURN_IF_FAILURE(CreateRenderPass(pass, stores[p]), "RenderGraph::CreateRenderPass");
+    }
+  }
+
+  printf("Render graph: %u passes (%u culled), %u barriers, %u batches, %u semaphores per frame\n",
+         numPasses, numPasses - (uint32_t)order.size(), numBarriers, (uint32_t)batches.size(), (uint32_t)edges.size());
+  for (uint32_t p = 0; p < numPasses; p++)
+  {
+    if (passes[p].culled)
+    {
+      printf("  culled pass \"%s\"\n", passes[p].name);
+    }
+  }
+  for (uint32_t b = 0; b < (uint32_t)batches.size(); b++)
+  {
+    printf("  batch %u on the %s queue:", b, batches[b].queue == RENDER_QUEUE_COMPUTE ? "compute" : "graphics");
+    for (uint32_t i = batches[b].begin; i < batches[b].end; i++)
+    {
+      printf(" \"%s\"", passes[order[i]].name);
+    }
+    printf("\n");
+  }
+  return Result::Application(0);
+}
+
+VkImage RenderGraph::GetImage(uint32_t r, uint32_t imageIndex) const
+{
+  const RenderResource& resource = resources[r];
+  if (!resource.imported)
+  {
+    return g_RenderTargets[resource.renderTarget].image;
+  }
+  return (*resource.images)[resource.images->size() > 1 ? imageIndex : 0];
+}
+
+VkImageView RenderGraph::GetImageView(uint32_t r, uint32_t imageIndex) const
+{
+  const RenderResource& resource = resources[r];
+  if (!resource.imported)
+  {
+    return g_RenderTargets[resource.renderTarget].view;
+  }
+  return (*resource.views)[resource.views->size() > 1 ? imageIndex : 0];
+}
+
+Result RenderGraph::CreateTargets()
+{
+  for (RenderResource& resource : resources)
+  {
+    if (!resource.imported && resource.firstUse != RENDER_GRAPH_NONE)
+    {
+      resource.renderTarget = AddRenderTarget(resource.format, resource.usage, resource.aspect,
+                                              resource.firstUse, resource.lastUse, resource.transient);
+    }
+  }
+  RETURN_IF_FAILURE(AllocateRenderTargets(), "AllocateRenderTargets");
+
+  for (uint32_t p : order)
+  {
+    RenderGraphPass& pass = passes[p];
+    if (!pass.raster)
+    {
+      continue;
+    }
+    uint32_t numFramebuffers = 1;
+    for (const RenderPassUse& use : pass.uses)
+    {
+      const RenderResource& resource = resources[use.resource];
+      if ((use.accesses & RENDER_ACCESS_ATTACHMENT) != 0 && resource.imported)
+      {
+        numFramebuffers = glm::max(numFramebuffers, (uint32_t)resource.views->size());
+      }
+    }
+
+    pass.framebuffers.resize(numFramebuffers);
+    for (uint32_t i = 0; i < numFramebuffers; i++)
+    {
+      std::vector<VkImageView> attachments;
+      for (const RenderPassUse& use : pass.uses)
+      {
+        if ((use.accesses & RENDER_ACCESS_ATTACHMENT) != 0)
+        {
+          attachments.push_back(GetImageView(use.resource, i));
+        }
+      }
+
+      VkFramebufferCreateInfo framebufferCI = {};
+      framebufferCI.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+      framebufferCI.renderPass = pass.renderPass;
+      framebufferCI.attachmentCount = (uint32_t)attachments.size();
+      framebufferCI.pAttachments = attachments.data();
+      framebufferCI.width = g_SwapchainExtent.width;
+      framebufferCI.height = g_SwapchainExtent.height;
+      framebufferCI.layers = 1;
+      RETURN_IF_FAILURE(Result::Vulkan(
+        vkCreateFramebuffer(g_Device, &framebufferCI, nullptr, &pass.framebuffers[i])),
+        "vkCreateFramebuffer");
+    }
+  }
+
+  return Result::Application(0);
+}
+
+void RenderGraph::DestroyTargets()
+{
+  for (RenderGraphPass& pass : passes)
+  {
+    for (VkFramebuffer framebuffer : pass.framebuffers)
+    {
+      if (framebuffer != VK_NULL_HANDLE)
+      {
+        RetireFramebuffer(framebuffer);
+      }
+    }
+    pass.framebuffers.clear();
+  }
+  for (RenderResource& resource : resources)
+  {
+    resource.renderTarget = RENDER_GRAPH_NONE;
+  }
+  DestroyVkRenderTargets();
+}
+
+void RenderGraph::Destroy()
+{
+  DestroyTargets();
+  for (RenderGraphPass& pass : passes)
+  {
+    if (pass.renderPass != VK_NULL_HANDLE)
+    {
+      vkDestroyRenderPass(g_Device, pass.renderPass, nullptr);
+    }
+  }
+  DestroySemaphores();
+  passes.clear();
+  resources.clear();
+  order.clear();
+  batches.clear();
+  edges.clear();
+}
+
+Result RenderGraph::CreateSemaphores(uint32_t numFrames)
+{
+  if (g_TimelineSemaphoresEnabled)
+  {
+    VkSemaphoreTypeCreateInfoKHR semaphoreTypeCI = {};
+    semaphoreTypeCI.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO_KHR;
+    semaphoreTypeCI.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE_KHR;
+    semaphoreTypeCI.initialValue = 0;
+
+    VkSemaphoreCreateInfo semaphoreCI = {};
+    semaphoreCI.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    semaphoreCI.pNext = &semaphoreTypeCI;
+    for (uint32_t q = 0; q < NUM_RENDER_QUEUES; q++)
+    {
+      RETURN_IF_FAILURE(Result::Vulkan(
+        vkCreateSemaphore(g_Device, &semaphoreCI, nullptr, &timelines[q])),
+        "vkCreateSemaphore");
+      timelineValues[q] = 0;
+    }
+    frameValues.assign(numFrames * NUM_RENDER_QUEUES, 0);
+    return Result::Application(0);
+  }
+
+  VkSemaphoreCreateInfo semaphoreCI = {};
+  semaphoreCI.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+  semaphores.resize(numFrames * edges.size());
+  for (VkSemaphore& semaphore : semaphores)
+  {
+    RETURN_IF_FAILURE(Result::Vulkan(
+      vkCreateSemaphore(g_Device, &semaphoreCI, nullptr, &semaphore)),
+      "vkCreateSemaphore");
+  }
+  return Result::Application(0);
+}
+
+void RenderGraph::DestroySemaphores()
+{
+  for (VkSemaphore semaphore : semaphores)
+  {
+    if (semaphore != VK_NULL_HANDLE)
+    {
+      vkDestroySemaphore(g_Device, semaphore, nullptr);
+    }
+  }
+  semaphores.clear();
+
+  for (uint32_t q = 0; q < NUM_RENDER_QUEUES; q++)
+  {
+    if (timelines[q] != VK_NULL_HANDLE)
+    {
+      vkDestroySemaphore(g_Device, timelines[q], nullptr);
+      timelines[q] = VK_NULL_HANDLE;
+    }
+    timelineValues[q] = 0;
+  }
+  frameValues.clear();
+}
+
+void RenderGraph::RecordBarriers(VkCommandBuffer commandBuffer, const std::vector<RenderBarrier>& barriers, uint32_t imageIndex) const
+{
+  if (barriers.empty())
+  {
+    return;
+  }
+
+  // Buffers staying on their queue share one global memory barrier
+  VkMemoryBarrier memoryBarrier = {};
+  memoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+  VkBufferMemoryBarrier bufferBarriers[MAX_RENDER_BARRIER_BATCH];
+  VkImageMemoryBarrier imageBarriers[MAX_RENDER_BARRIER_BATCH];
+  uint32_t numBufferBarriers = 0;
+  uint32_t numImageBarriers = 0;
+  VkPipelineStageFlags srcStages = 0;
+  VkPipelineStageFlags dstStages = 0;
+  for (const RenderBarrier& barrier : barriers)
+  {
+    const RenderResource& resource = resources[barrier.resource];
+    bool transfer = barrier.srcQueue != barrier.dstQueue;
+    uint32_t srcQueueFamily = transfer ? GetRenderQueueFamily(barrier.srcQueue) : VK_QUEUE_FAMILY_IGNORED;
+    uint32_t dstQueueFamily = transfer ? GetRenderQueueFamily(barrier.dstQueue) : VK_QUEUE_FAMILY_IGNORED;
+    srcStages |= barrier.srcStages;
+    dstStages |= barrier.dstStages;
+    if (resource.image)
+    {
+      VkImageMemoryBarrier& imageBarrier = imageBarriers[numImageBarriers++];
+      imageBarrier = {};
+      imageBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+      imageBarrier.srcAccessMask = barrier.srcAccess;
+      imageBarrier.dstAccessMask = barrier.dstAccess;
+      imageBarrier.oldLayout = barrier.oldLayout;
+      imageBarrier.newLayout = barrier.newLayout;
+      imageBarrier.srcQueueFamilyIndex = srcQueueFamily;
+      imageBarrier.dstQueueFamilyIndex = dstQueueFamily;
+      imageBarrier.image = GetImage(barrier.resource, imageIndex);
+      imageBarrier.subresourceRange.aspectMask = resource.aspect;
+      imageBarrier.subresourceRange.levelCount = 1;
+      imageBarrier.subresourceRange.layerCount = 1;
+    }
+    else if (transfer)
+    {
+      VkBufferMemoryBarrier& bufferBarrier = bufferBarriers[numBufferBarriers++];
+      bufferBarrier = {};
+      bufferBarrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+      bufferBarrier.srcAccessMask = barrier.srcAccess;
+      bufferBarrier.dstAccessMask = barrier.dstAccess;
+      bufferBarrier.srcQueueFamilyIndex = srcQueueFamily;
+      bufferBarrier.dstQueueFamilyIndex = dstQueueFamily;
+      bufferBarrier.buffer = *resource.buffer;
+      bufferBarrier.size = VK_WHOLE_SIZE;
+    }
+    else
+    {
+      memoryBarrier.srcAccessMask |= barrier.srcAccess;
+      memoryBarrier.dstAccessMask |= barrier.dstAccess;
+    }
+  }
+
+  bool hasMemoryBarrier = memoryBarrier.srcAccessMask != 0 || memoryBarrier.dstAccessMask != 0;
+  vkCmdPipelineBarrier(commandBuffer, srcStages, dstStages, 0,
+                       hasMemoryBarrier ? 1 : 0, &memoryBarrier,
+                       numBufferBarriers, bufferBarriers,
+                       numImageBarriers, imageBarriers);
+}
+
+void RenderGraph::RecordBatch(VkCommandBuffer commandBuffer, uint32_t batch, uint32_t frame, uint32_t imageIndex) const
+{
+  for (uint32_t i = batches[batch].begin; i < batches[batch].end; i++)
+  {
+    const RenderGraphPass& pass = passes[order[i]];
+    RecordBarriers(commandBuffer, pass.barriers, imageIndex);
+
+    if (pass.raster)
+    {
+      VkRenderPassBeginInfo renderPassBeginInfo = {};
+      renderPassBeginInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+      renderPassBeginInfo.renderPass = pass.renderPass;
+      renderPassBeginInfo.clearValueCount = (uint32_t)pass.clearValues.size();
+      renderPassBeginInfo.pClearValues = pass.clearValues.data();
+      renderPassBeginInfo.framebuffer = pass.framebuffers[pass.framebuffers.size() > 1 ? imageIndex : 0];
+      renderPassBeginInfo.renderArea.offset = { 0, 0 };
+      renderPassBeginInfo.renderArea.extent = g_SwapchainExtent;
+      vkCmdBeginRenderPass(commandBuffer, &renderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
+    }
+
+    pass.record(commandBuffer, frame);
+
+    if (pass.raster)
+    {
+      vkCmdEndRenderPass(commandBuffer);
+    }
+    RecordBarriers(commandBuffer, pass.releases, imageIndex);
+  }
+}
+
+Result RenderGraph::Submit(const VkCommandBuffer* commandBuffers, uint32_t frame, uint32_t firstBatch, uint32_t endBatch,
+                           VkSemaphore acquireSemaphore, VkSemaphore presentSemaphore, VkFence fence)
+{
+  // Batches are submitted in order, so every wait has its signal submitted before it
+  bool timeline = timelines[RENDER_QUEUE_GRAPHICS] != VK_NULL_HANDLE;
+  const VkSemaphore* frameSemaphores = timeline ? nullptr : semaphores.data() + frame * edges.size();
+  for (uint32_t b = firstBatch; b < endBatch; b++)
+  {
+    const RenderBatch& batch = batches[b];
+    bool last = b + 1 == (uint32_t)batches.size();
+
+    // Values are ignored for binary semaphores, like the swapchain's
+    VkSemaphore waitSemaphores[MAX_RENDER_BATCHES + 1];
+    VkPipelineStageFlags waitStages[MAX_RENDER_BATCHES + 1];
+    uint64_t waitValues[MAX_RENDER_BATCHES + 1];
+    uint32_t numWaits = 0;
+    if (b == acquireBatch)
+    {
+      waitSemaphores[numWaits] = acquireSemaphore;
+      waitStages[numWaits] = acquireStages;
+      waitValues[numWaits++] = 0;
+    }
+    for (uint32_t e : batch.waits)
+    {
+      const RenderBatchEdge& edge = edges[e];
+      if (!timeline)
+      {
+        waitSemaphores[numWaits] = frameSemaphores[e];
+        waitStages[numWaits] = edge.stages;
+        waitValues[numWaits++] = 0;
+        continue;
+      }
+      // One wait per timeline, for the latest of the batches waited for on it
+      VkSemaphore semaphore = timelines[batches[edge.from].queue];
+      uint32_t w = (uint32_t)(std::find(waitSemaphores, waitSemaphores + numWaits, semaphore) - waitSemaphores);
+      if (w == numWaits)
+      {
+        waitSemaphores[numWaits] = semaphore;
+        waitStages[numWaits] = 0;
+        waitValues[numWaits++] = 0;
+      }
+      waitStages[w] |= edge.stages;
+      waitValues[w] = glm::max(waitValues[w], batchValues[edge.from]);
+    }
+
+    VkSemaphore signalSemaphores[MAX_RENDER_BATCHES + 1];
+    uint64_t signalValues[MAX_RENDER_BATCHES + 1];
+    uint32_t numSignals = 0;
+    if (timeline)
+    {
+      batchValues[b] = ++timelineValues[batch.queue];
+      frameValues[frame * NUM_RENDER_QUEUES + batch.queue] = batchValues[b];
+      signalSemaphores[numSignals] = timelines[batch.queue];
+      signalValues[numSignals++] = batchValues[b];
+    }
+    else
+    {
+      for (uint32_t e : batch.signals)
+      {
+        signalSemaphores[numSignals] = frameSemaphores[e];
+        signalValues[numSignals++] = 0;
+      }
+    }
+    if (b == presentBatch)
+    {
+      signalSemaphores[numSignals] = presentSemaphore;
+      signalValues[numSignals++] = 0;
+    }
+
+    VkTimelineSemaphoreSubmitInfoKHR timelineSubmitInfo = {};
+    timelineSubmitInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO_KHR;
+    timelineSubmitInfo.waitSemaphoreValueCount = numWaits;
+    timelineSubmitInfo.pWaitSemaphoreValues = waitValues;
+    timelineSubmitInfo.signalSemaphoreValueCount = numSignals;
+    timelineSubmitInfo.pSignalSemaphoreValues = signalValues;
+
+    VkSubmitInfo submitInfo = {};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.pNext = timeline ? &timelineSubmitInfo : nullptr;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &commandBuffers[b];
+    submitInfo.waitSemaphoreCount = numWaits;
+    submitInfo.pWaitSemaphores = waitSemaphores;
+    submitInfo.pWaitDstStageMask = waitStages;
+    submitInfo.signalSemaphoreCount = numSignals;
+    submitInfo.pSignalSemaphores = signalSemaphores;
+    RETURN_IF_FAILURE(Result::Vulkan(
+      vkQueueSubmit(GetRenderQueue(batch.queue), 1, &submitInfo, last ? fence : VK_NULL_HANDLE)),
+      "vkQueueSubmit");
+  }
+  return Result::Application(0);
+}
+
+bool RenderGraph::IsFrameComplete(uint32_t frame) const
+{
+  for (uint32_t q = 0; q < NUM_RENDER_QUEUES; q++)
+  {
+    uint64_t value = 0;
+    if (frameValues[frame * NUM_RENDER_QUEUES + q] != 0
+        && (g_GetSemaphoreCounterValue(g_Device, timelines[q], &value) != VK_SUCCESS
+            || value < frameValues[frame * NUM_RENDER_QUEUES + q]))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+Result RenderGraph::WaitForFrame(uint32_t frame) const
+{
+  VkSemaphoreWaitInfoKHR waitInfo = {};
+  waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO_KHR;
+  waitInfo.semaphoreCount = NUM_RENDER_QUEUES;
+  waitInfo.pSemaphores = timelines;
+  waitInfo.pValues = &frameValues[frame * NUM_RENDER_QUEUES];
+  RETURN_IF_FAILURE(Result::Vulkan(
+    g_WaitSemaphores(g_Device, &waitInfo, (uint64_t)-1)),
+    "vkWaitSemaphoresKHR");
+  return Result::Application(0);
+}
+
+// Pipelines
+// Pipelines referenced by materials, one per mesh vertex layout
+enum PipelineId
+{
+  PIPELINE_TRIANGLE = 0,
+  PIPELINE_TRIANGLE_QUANTIZED,
+  NUM_PIPELINES
+};
+static_assert(NUM_PIPELINES <= (1u << DRAW_KEY_PIPELINE_BITS), "Pipelines must fit the draw sort key");
+static VkPipeline g_GraphicsPipelines[NUM_PIPELINES];
+static VkPipeline g_MeshletGraphicsPipeline;
+// Depth-only variants for the depth prepass
+static VkPipeline g_DepthPipelines[NUM_PIPELINES];
+static VkPipeline g_MeshletDepthPipeline;
+
+// Vertex stream s is bound to binding s, per-instance data follows them
+static const uint32_t INSTANCE_DATA_BINDING = MAX_VERTEX_STREAMS;
+
+// Indexed by VertexAttributeFormat
+static const VkFormat g_VertexAttributeVkFormats[] = {
+  VK_FORMAT_UNDEFINED,
+  VK_FORMAT_R32G32_SFLOAT,
+  VK_FORMAT_R32G32B32_SFLOAT,
+  VK_FORMAT_R16G16_SFLOAT,
+  VK_FORMAT_R16G16B16A16_UNORM,
+  VK_FORMAT_R16G16_SNORM,
+  VK_FORMAT_R8G8B8A8_UNORM };
+
+// Shader input locations by VertexAttribute, the instance matrix takes 2 to 5
+static const uint32_t g_VertexAttributeLocations[NUM_VERTEX_ATTRIBUTES] = { 0, 6, 1, 7 };
+
+// Writes the attributes of the layout's streams and returns their number,
+// only the position if positionOnly
+uint32_t GetVertexAttributeDescs(const VertexLayout& layout, bool positionOnly, VkVertexInputAttributeDescription* attributeDescs)
+{
+  uint32_t numAttributes = 0;
+  for (uint32_t i = 0; i < (positionOnly ? VERTEX_ATTRIBUTE_POSITION + 1 : NUM_VERTEX_ATTRIBUTES); i++)
+  {
+    if (layout.formats[i] != VERTEX_FORMAT_NONE)
+    {
+      VkVertexInputAttributeDescription& desc = attributeDescs[numAttributes++];
+      desc = {};
+      desc.binding = layout.streams[i];
+      desc.location = g_VertexAttributeLocations[i];
+      desc.offset = layout.offsets[i];
+      desc.format = g_VertexAttributeVkFormats[layout.formats[i]];
+    }
+  }
+  return numAttributes;
+}
+
+Result InitVkGraphicsPipeline()
+{
+  VkPipelineShaderStageCreateInfo shaderStageCIs[2];
+  shaderStageCIs[0] = {};
+  shaderStageCIs[0].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+  shaderStageCIs[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
+  shaderStageCIs[0].module = g_BindlessEnabled ? g_TriangleBindlessShaderVert : g_TriangleShaderVert;
+  shaderStageCIs[0].pName = "main";
+  shaderStageCIs[1] = {};
+  shaderStageCIs[1].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+  shaderStageCIs[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+  shaderStageCIs[1].module = g_TriangleShaderFrag;
+  shaderStageCIs[1].pName = "main";
+
+  // Mesh attributes are filled in per pipeline, followed by the per-instance
+  // model matrix, one column per location
+  VkVertexInputAttributeDescription vertexAttributeDescs[NUM_VERTEX_ATTRIBUTES + 4];
+  VkVertexInputAttributeDescription instanceAttributeDescs[4];
+  for (uint32_t column = 0; column < 4; column++)
+  {
+    instanceAttributeDescs[column] = {};
+    instanceAttributeDescs[column].binding = INSTANCE_DATA_BINDING;
+    instanceAttributeDescs[column].location = 2 + column;
+    instanceAttributeDescs[column].offset = column * sizeof(glm::vec4);
+    instanceAttributeDescs[column].format = VK_FORMAT_R32G32B32A32_SFLOAT;
+  }
+
+  // Stream bindings are filled in per pipeline, the instance binding comes last
+  VkVertexInputBindingDescription vertexBindingDescs[MAX_VERTEX_STREAMS + 1];
+  VkVertexInputBindingDescription instanceBindingDesc = {};
+  instanceBindingDesc.binding = INSTANCE_DATA_BINDING;
+  instanceBindingDesc.stride = sizeof(glm::mat4x4);
+  instanceBindingDesc.inputRate = VK_VERTEX_INPUT_RATE_INSTANCE;
+
+  VkPipelineVertexInputStateCreateInfo vertexInputStateCI = {};
+  vertexInputStateCI.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+  vertexInputStateCI.pVertexAttributeDescriptions = vertexAttributeDescs;
+  vertexInputStateCI.pVertexBindingDescriptions = vertexBindingDescs;
+
+  VkPipelineInputAssemblyStateCreateInfo inputAssemblyStateCI = {};
+  inputAssemblyStateCI.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+  inputAssemblyStateCI.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+
+  VkViewport viewport = {};
+  viewport.x = 0;
+  viewport.y = 0;
+  viewport.width = (float)g_SwapchainExtent.width;
+  viewport.height = (float)g_SwapchainExtent.height;
+
+  VkRect2D scissor = {};
+  scissor.offset.x = 0;
+  scissor.offset.y = 0;
+  scissor.extent = g_SwapchainExtent;
+
+  VkPipelineViewportStateCreateInfo viewportStateCI = {};
+  viewportStateCI.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+  viewportStateCI.viewportCount = 1;
+  viewportStateCI.pViewports = &viewport;
+  viewportStateCI.scissorCount = 1;
+  viewportStateCI.pScissors = &scissor;
+
+  VkPipelineRasterizationStateCreateInfo rasterizationStateCI = {};
+  rasterizationStateCI.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+  rasterizationStateCI.rasterizerDiscardEnable = VK_FALSE;
+  rasterizationStateCI.polygonMode = VK_POLYGON_MODE_FILL;
+  rasterizationStateCI.cullMode = VK_CULL_MODE_BACK_BIT;
+  rasterizationStateCI.frontFace = VK_FRONT_FACE_CLOCKWISE;
+  rasterizationStateCI.depthBiasEnable = VK_FALSE;
+  rasterizationStateCI.lineWidth = 1.0f;
+
+  VkPipelineMultisampleStateCreateInfo multisampleStateCI = {};
+  multisampleStateCI.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+  multisampleStateCI.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+
+  VkPipelineDepthStencilStateCreateInfo depthStencilStateCI = {};
+  depthStencilStateCI.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+  depthStencilStateCI.depthTestEnable = VK_TRUE;
+  depthStencilStateCI.depthWriteEnable = VK_TRUE;
+  depthStencilStateCI.depthCompareOp = VK_COMPARE_OP_LESS;
+  depthStencilStateCI.stencilTestEnable = VK_FALSE;
+  depthStencilStateCI.minDepthBounds = 0.0f;
+  depthStencilStateCI.maxDepthBounds = 1.0f;
+
+  // After a depth prepass, shading only touches the fragments that won it.
+  // This relies on both passes computing bit-identical positions (invariant gl_Position).
+  VkPipelineDepthStencilStateCreateInfo shadingDepthStencilStateCI = depthStencilStateCI;
+  if (g_Options.depthPrepass)
+  {
+    shadingDepthStencilStateCI.depthWriteEnable = VK_FALSE;
+    shadingDepthStencilStateCI.depthCompareOp = VK_COMPARE_OP_EQUAL;
+  }
+
+  VkPipelineColorBlendAttachmentState colorBlendAttachment = {};
+  colorBlendAttachment.blendEnable = VK_TRUE;
+  colorBlendAttachment.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
+  colorBlendAttachment.colorBlendOp = VK_BLEND_OP_ADD;
+  colorBlendAttachment.srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
+  colorBlendAttachment.dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+  colorBlendAttachment.alphaBlendOp = VK_BLEND_OP_ADD;
+  colorBlendAttachment.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
+  colorBlendAttachment.dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
+
+  VkPipelineColorBlendStateCreateInfo colorBlendStateCI = {};
+  colorBlendStateCI.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+  colorBlendStateCI.logicOpEnable = VK_FALSE;
+  colorBlendStateCI.attachmentCount = 1;
+  colorBlendStateCI.pAttachments = &colorBlendAttachment;
+
+  VkPipelineColorBlendAttachmentState depthOnlyBlendAttachment = {};
+  VkPipelineColorBlendStateCreateInfo depthOnlyBlendStateCI = colorBlendStateCI;
+  depthOnlyBlendStateCI.pAttachments = &depthOnlyBlendAttachment;
+
+  VkDynamicState dynamicState = VK_DYNAMIC_STATE_VIEWPORT;
+
+  VkPipelineDynamicStateCreateInfo dynamicStateCI = {};
+  dynamicStateCI.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+  dynamicStateCI.dynamicStateCount = 1;
+  dynamicStateCI.pDynamicStates = &dynamicState;
+
+  VkGraphicsPipelineCreateInfo pipelineCI = {};
+  pipelineCI.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+  pipelineCI.stageCount = 2;
+  pipelineCI.pStages = shaderStageCIs;
+  pipelineCI.pVertexInputState = &vertexInputStateCI;
+  pipelineCI.pInputAssemblyState = &inputAssemblyStateCI;
+  pipelineCI.pTessellationState = nullptr;
+  pipelineCI.pViewportState = &viewportStateCI;
+  pipelineCI.pRasterizationState = &rasterizationStateCI;
+  pipelineCI.pMultisampleState = &multisampleStateCI;
+  pipelineCI.pDepthStencilState = &shadingDepthStencilStateCI;
+  pipelineCI.pColorBlendState = &colorBlendStateCI;
+  pipelineCI.pDynamicState = &dynamicStateCI;
+  pipelineCI.layout = g_PipelineLayout;
+  pipelineCI.renderPass = g_RenderPass;
+  pipelineCI.subpass = 0;
+
+  // The quantized layout is only used by imported meshes
+  VertexLayout vertexLayouts[NUM_PIPELINES] = { MakeFloatVertexLayout(), MakeQuantizedVertexLayout() };
+  uint32_t numPipelines = g_Options.quantizeVertices ? PIPELINE_TRIANGLE_QUANTIZED + 1 : PIPELINE_TRIANGLE + 1;
+  for (uint32_t pipeline = 0; pipeline < numPipelines; pipeline++)
+  {
+    // Depth-only pipelines read just the position stream and have no fragment shader
+    for (uint32_t depthOnly = 0; depthOnly < (g_Options.depthPrepass ? 2u : 1u); depthOnly++)
+    {
+      const VertexLayout& layout = vertexLayouts[pipeline];
+      uint32_t numAttributes = GetVertexAttributeDescs(layout, depthOnly != 0, vertexAttributeDescs);
+      memcpy(vertexAttributeDescs + numAttributes, instanceAttributeDescs, sizeof(instanceAttributeDescs));
+      vertexInputStateCI.vertexAttributeDescriptionCount = numAttributes + 4;
+
+      uint32_t numStreams = depthOnly ? 1 : layout.numStreams;
+      for (uint32_t stream = 0; stream < numStreams; stream++)
+      {
+        vertexBindingDescs[stream] = {};
+        vertexBindingDescs[stream].binding = stream;
+        vertexBindingDescs[stream].stride = layout.strides[stream];
+        vertexBindingDescs[stream].inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+      }
+      vertexBindingDescs[numStreams] = instanceBindingDesc;
+      vertexInputStateCI.vertexBindingDescriptionCount = numStreams + 1;
+
+      shaderStageCIs[0].module = depthOnly ? g_DepthOnlyShaderVert : g_BindlessEnabled ? g_TriangleBindlessShaderVert : g_TriangleShaderVert;
+      pipelineCI.stageCount = depthOnly ? 1 : 2;
+      pipelineCI.pDepthStencilState = depthOnly ? &depthStencilStateCI : &shadingDepthStencilStateCI;
+      pipelineCI.pColorBlendState = depthOnly ? &depthOnlyBlendStateCI : &colorBlendStateCI;
+
+      VkPipeline* target = depthOnly ? &g_DepthPipelines[pipeline] : &g_GraphicsPipelines[pipeline];
+      RETURN_IF_FAILURE(Result::Vulkan(
+        vkCreateGraphicsPipelines(g_Device, g_PipelineCache, 1, &pipelineCI, nullptr, target)),
+        "vkCreateGraphicsPipelines");
+    }
+  }
+  pipelineCI.stageCount = 2;
+  pipelineCI.pDepthStencilState = &shadingDepthStencilStateCI;
+  pipelineCI.pColorBlendState = &colorBlendStateCI;
+
+  // Meshlet vertices are pulled from storage buffers, so there is no vertex input.
+  // The shader unpacks the arena's layout, chosen by a specialization constant.
+  if (g_Options.meshlets)
+  {
+    VkPipelineVertexInputStateCreateInfo meshletVertexInputStateCI = {};
+    meshletVertexInputStateCI.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+
+    VkBool32 quantizedVertices = g_Options.quantizeVertices ? VK_TRUE : VK_FALSE;
+    VkSpecializationMapEntry specializationEntry = { 0, 0, sizeof(VkBool32) };
+    VkSpecializationInfo specializationInfo = {};
+    specializationInfo.mapEntryCount = 1;
+    specializationInfo.pMapEntries = &specializationEntry;
+    specializationInfo.dataSize = sizeof(quantizedVertices);
+    specializationInfo.pData = &quantizedVertices;
+
+    shaderStageCIs[0].module = g_MeshletShaderVert;
+    shaderStageCIs[0].pSpecializationInfo = &specializationInfo;
+    pipelineCI.pVertexInputState = &meshletVertexInputStateCI;
+    pipelineCI.layout = g_MeshletPipelineLayout;
+
+    RETURN_IF_FAILURE(Result::Vulkan(
+      vkCreateGraphicsPipelines(g_Device, g_PipelineCache, 1, &pipelineCI, nullptr, &g_MeshletGraphicsPipeline)),
+      "vkCreateGraphicsPipelines");
+
+    if (g_Options.depthPrepass)
+    {
+      pipelineCI.stageCount = 1;
+      pipelineCI.pDepthStencilState = &depthStencilStateCI;
+      pipelineCI.pColorBlendState = &depthOnlyBlendStateCI;
+      RETURN_IF_FAILURE(Result::Vulkan(
+        vkCreateGraphicsPipelines(g_Device, g_PipelineCache, 1, &pipelineCI, nullptr, &g_MeshletDepthPipeline)),
+        "vkCreateGraphicsPipelines");
+    }
+  }
+
+  return Result::Application(0);
+}
+
+void DestroyVkGraphicsPipeline()
+{
+  for (uint32_t i = 0; i < NUM_PIPELINES; i++)
+  {
+    if (g_GraphicsPipelines[i] != VK_NULL_HANDLE)
+    {
+      RetirePipeline(g_GraphicsPipelines[i]);
+      g_GraphicsPipelines[i] = VK_NULL_HANDLE;
+    }
+    if (g_DepthPipelines[i] != VK_NULL_HANDLE)
+    {
+      RetirePipeline(g_DepthPipelines[i]);
+      g_DepthPipelines[i] = VK_NULL_HANDLE;
+    }
+  }
+
+  if (g_MeshletGraphicsPipeline != VK_NULL_HANDLE)
+  {
+    RetirePipeline(g_MeshletGraphicsPipeline);
+    g_MeshletGraphicsPipeline = VK_NULL_HANDLE;
+  }
+
+  if (g_MeshletDepthPipeline != VK_NULL_HANDLE)
+  {
+    RetirePipeline(g_MeshletDepthPipeline);
+    g_MeshletDepthPipeline = VK_NULL_HANDLE;
+  }
+}
+
+// Command pools
+static VkCommandPool g_GraphicsCommandPool;
+static VkCommandPool g_TransferCommandPool;
+static VkCommandPool g_ComputeCommandPool;
+
+Result InitVkCommandPools()
+{
+  {
+    VkCommandPoolCreateInfo poolCI = {};
+    poolCI.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    poolCI.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT | VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+    poolCI.queueFamilyIndex = g_GraphicsQueueFamily;
+    RETURN_IF_FAILURE(Result::Vulkan(
+      vkCreateCommandPool(g_Device, &poolCI, nullptr, &g_GraphicsCommandPool)),
+      "vkCreateCommandPool");
+
+    poolCI.queueFamilyIndex = g_TransferQueueFamily;
+    RETURN_IF_FAILURE(Result::Vulkan(
+      vkCreateCommandPool(g_Device, &poolCI, nullptr, &g_TransferCommandPool)),
+      "vkCreateCommandPool");
+
+    poolCI.queueFamilyIndex = g_ComputeQueueFamily;
+    RETURN_IF_FAILURE(Result::Vulkan(
+      vkCreateCommandPool(g_Device, &poolCI, nullptr, &g_ComputeCommandPool)),
+      "vkCreateCommandPool");
+  }
+
+  return Result::Application(0);
+}
+
+void DestroyVkCommandPools()
+{
+  if (g_ComputeCommandPool != VK_NULL_HANDLE)
+  {
+    vkDestroyCommandPool(g_Device, g_ComputeCommandPool, nullptr);
+    g_ComputeCommandPool = VK_NULL_HANDLE;
+  }
+
+  if (g_TransferCommandPool != VK_NULL_HANDLE)
+  {
+    vkDestroyCommandPool(g_Device, g_TransferCommandPool, nullptr);
+    g_TransferCommandPool = VK_NULL_HANDLE;
+  }
+
+  if (g_GraphicsCommandPool != VK_NULL_HANDLE)
+  {
+    vkDestroyCommandPool(g_Device, g_GraphicsCommandPool, nullptr);
+    g_GraphicsCommandPool = VK_NULL_HANDLE;
+  }
+}
+
+// Command buffers
+// One per render graph batch and frame in flight, [frame * number of batches + batch]
+static std::vector<VkCommandBuffer> g_FrameCommandBuffers;
+static VkCommandBuffer g_TransferCommandBuffer;
+
+Result InitVkCommandBuffers()
+{
+  uint32_t numBatches = (uint32_t)g_RenderGraph.batches.size();
+  g_FrameCommandBuffers.resize(g_FramesInFlight * numBatches);
+
+  for (uint32_t i = 0; i < (uint32_t)g_FrameCommandBuffers.size(); i++)
+  {
+    VkCommandBufferAllocateInfo allocInfo = {};
+    allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    allocInfo.commandPool = g_RenderGraph.batches[i % numBatches].queue == RENDER_QUEUE_COMPUTE
+      ? g_ComputeCommandPool : g_GraphicsCommandPool;
+    allocInfo.commandBufferCount = 1;
+    allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    RETURN_IF_FAILURE(Result::Vulkan(
+      vkAllocateCommandBuffers(g_Device, &allocInfo, &g_FrameCommandBuffers[i])),
+      "vkAllocateCommandBuffers");
+  }
+
+  {
+    VkCommandBufferAllocateInfo allocInfo = {};
+    allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    allocInfo.commandPool = g_TransferCommandPool;
+    allocInfo.commandBufferCount = 1;
+    allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    RETURN_IF_FAILURE(Result::Vulkan(
+      vkAllocateCommandBuffers(g_Device, &allocInfo, &g_TransferCommandBuffer)),
+      "vkAllocateCommandBuffers");
+  }
+
+  return Result::Application(0);
+}
+
+void DestroyVkCommandBuffers()
+{
+  g_TransferCommandBuffer = VK_NULL_HANDLE;
+  g_FrameCommandBuffers.clear();
+}
+
+// Buffers
+uint32_t FindMemoryType(VkMemoryPropertyFlags propertyFlags,
+                        VkMemoryHeapFlags heapFlags)
+{
+  VkPhysicalDeviceMemoryProperties memoryProperties;
+  vkGetPhysicalDeviceMemoryProperties(g_PhysicalDevice, &memoryProperties);
+
+  for (uint32_t i = 0; i < memoryProperties.memoryTypeCount; i++)
+  {
+    uint32_t heap = memoryProperties.memoryTypes[i].heapIndex;
+    if (((memoryProperties.memoryHeaps[heap].flags & heapFlags) == heapFlags)
+        && ((memoryProperties.memoryTypes[i].propertyFlags & propertyFlags) == propertyFlags))
+    {
+      return i;
+      break;
+    }
+  }
+  return (uint32_t)-1;
+}
+
+// Staging allocator
+// Uploads are copied through persistently mapped host chunks, bump allocated
+// and reset once the transfers reading them are done. Chunks are added on
+// demand, each twice the size of the last, and chunks no upload touched for
+// STAGING_IDLE_RESETS resets (one per frame) are freed again.
+static const VkDeviceSize STAGING_MIN_CHUNK_SIZE = 64 * 1024;
+static const VkDeviceSize STAGING_MAX_CHUNK_SIZE = 64 * 1024 * 1024;
+static const VkDeviceSize STAGING_ALIGNMENT = 16;
+static const uint32_t STAGING_IDLE_RESETS = 300;
+// Staging takes at most a quarter of its heap, and doesn't grow past the
+// heap's budget
+static const VkDeviceSize STAGING_HEAP_FRACTION = 4;
+
+struct StagingRegion
+{
+  VkBuffer buffer;
+  VkDeviceSize offset;
+  char* data;
+};
+
+struct StagingAllocator
+{
+  struct Chunk
+  {
+    VkBuffer buffer;
+    VmaAllocation allocation;
+    char* mapped;
+    VkDeviceSize size;
+    uint32_t idleResets;
+  };
+  std::vector<Chunk> chunks;
+  uint32_t currentChunk = 0;
+  VkDeviceSize currentOffset = 0;
+  uint32_t memoryHeap = 0;
+  VkDeviceSize heapSize = 0;
+  VkDeviceSize totalSize = 0;
+  VkDeviceSize usedSinceReset = 0;
+  VkDeviceSize peakUsed = 0;
+  VkDeviceSize peakSize = 0;
+
+  Result Init()
+  {
+    RETURN_IF_FAILURE(FindBufferHeap(VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_CPU_ONLY, &memoryHeap),
+                      "FindBufferHeap");
+    const VkPhysicalDeviceMemoryProperties* memoryProperties;
+    vmaGetMemoryProperties(g_Allocator, &memoryProperties);
+    heapSize = memoryProperties->memoryHeaps[memoryHeap].size;
+
+    return AddChunk(STAGING_MIN_CHUNK_SIZE);
+  }
+
+  // The region stays valid until the next Reset(), sizes above
+  // STAGING_MAX_CHUNK_SIZE fail, split them up
+  Result Allocate(VkDeviceSize size, StagingRegion* outRegion)
+  {
+    RETURN_IF_FAILURE(Result::Application(
+      size <= STAGING_MAX_CHUNK_SIZE ? 0 : 1),
+      "Staging allocation exceeds the chunk size");
+
+    while (currentChunk < (uint32_t)chunks.size() && currentOffset + size > chunks[currentChunk].size)
+    {
+      currentChunk++;
+      currentOffset = 0;
+    }
+    if (currentChunk == (uint32_t)chunks.size())
+    {
+      VkDeviceSize chunkSize = chunks.empty() ? STAGING_MIN_CHUNK_SIZE : glm::min(2 * chunks.back().size, STAGING_MAX_CHUNK_SIZE);
+      while (chunkSize < size)
+      {
+        chunkSize *= 2;
+      }
+      RETURN_IF_FAILURE(AddChunk(chunkSize), "StagingAllocator::AddChunk");
+    }
+
+    Chunk& chunk = chunks[currentChunk];
+    chunk.idleResets = 0;
+    outRegion->buffer = chunk.buffer;
+    outRegion->offset = currentOffset;
+    outRegion->data = chunk.mapped + currentOffset;
+    currentOffset = AlignUp(currentOffset + size, STAGING_ALIGNMENT);
+    usedSinceReset += size;
+    peakUsed = glm::max(peakUsed, usedSinceReset);
+    return Result::Application(0);
+  }
+
+  // Regions allocated since the last reset must no longer be in use
+  void Reset()
+  {
+    currentChunk = 0;
+    currentOffset = 0;
+    usedSinceReset = 0;
+    for (Chunk& chunk : chunks)
+    {
+      chunk.idleResets++;
+    }
+    FreeIdleChunks(STAGING_IDLE_RESETS);
+  }
+
+  // Frees the chunks no frame in flight can still be reading right away,
+  // for when their heap is short on memory. Returns the bytes freed.
+  VkDeviceSize Trim()
+  {
+    VkDeviceSize sizeBefore = totalSize;
+    FreeIdleChunks(MAX_FRAMES_IN_FLIGHT);
+    return sizeBefore - totalSize;
+  }
+
+  void Destroy()
+  {
+    for (Chunk& chunk : chunks)
+    {
+      vmaDestroyBuffer(g_Allocator, chunk.buffer, chunk.allocation);
+    }
+    chunks.clear();
+    totalSize = 0;
+  }
+
+private:
+  // Shrinks back, the first chunk stays for small uploads
+  void FreeIdleChunks(uint32_t minIdleResets)
+  {
+    for (uint32_t i = (uint32_t)chunks.size(); i-- > 1;)
+    {
+      if (chunks[i].idleResets >= minIdleResets)
+      {
+        totalSize -= chunks[i].size;
+        vmaDestroyBuffer(g_Allocator, chunks[i].buffer, chunks[i].allocation);
+        chunks.erase(chunks.begin() + i);
+      }
+    }
+  }
+
+  Result AddChunk(VkDeviceSize size)
+  {
+    UpdateMemoryBudget();
+    RETURN_IF_FAILURE(Result::Application(
+      totalSize + size <= heapSize / STAGING_HEAP_FRACTION
+      && size <= GetHeapHeadroom(memoryHeap) ? 0 : 1),
+      "Staging memory exceeds the heap budget");
+
+    VkBufferCreateInfo bufferCI = {};
+    bufferCI.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    bufferCI.size = size;
+    bufferCI.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+    bufferCI.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+    VmaAllocationCreateInfo allocCI = {};
+    allocCI.usage = VMA_MEMORY_USAGE_CPU_ONLY;
+    allocCI.flags = VMA_ALLOCATION_CREATE_MAPPED_BIT;
+
+    Chunk chunk = {};
+    chunk.size = size;
+    VmaAllocationInfo allocInfo;
+    RETURN_IF_FAILURE(Result::Vulkan(
+      vmaCreateBuffer(g_Allocator, &bufferCI, &allocCI, &chunk.buffer, &chunk.allocation, &allocInfo)),
+      "vmaCreateBuffer");
+    chunk.mapped = (char*)allocInfo.pMappedData;
+    chunks.push_back(chunk);
+    totalSize += size;
+    peakSize = glm::max(peakSize, totalSize);
+    return Result::Application(0);
+  }
+};
+
+static StagingAllocator g_StagingAllocator;
+
+Result InitVkStagingBuffer()
+{
+  return g_StagingAllocator.Init();
+}
+
+void DestroyVkStagingBuffer()
+{
+  g_StagingAllocator.Destroy();
+}
+
+// Releases idle staging chunks while their heap is under pressure,
+// call after UpdateMemoryBudget()
+void RelieveMemoryPressure()
+{
+  if (!IsHeapUnderPressure(g_StagingAllocator.memoryHeap))
+  {
+    return;
+  }
+  VkDeviceSize freed = g_StagingAllocator.Trim();
+  if (freed > 0)
+  {
+    printf("Heap %u is near its budget, released %.1f KB of staging memory\n",
+           g_StagingAllocator.memoryHeap, freed / 1024.0f);
+    UpdateMemoryBudget();
+  }
+}
+
+// Copies data to dst through the staging allocator and waits for the
+// transfer, so only for loading. Resets the staging allocator, no other
+// staging regions may be pending.
+Result UploadToBuffer(VkBuffer dst, VkDeviceSize dstOffset, const void* data, VkDeviceSize size)
+{
+  for (VkDeviceSize uploaded = 0; uploaded < size;)
+  {
+    VkDeviceSize pieceSize = glm::min(size - uploaded, STAGING_MAX_CHUNK_SIZE);
+    StagingRegion region;
+    RETURN_IF_FAILURE(g_StagingAllocator.Allocate(pieceSize, &region), "StagingAllocator::Allocate");
+    memcpy(region.data, (const char*)data + uploaded, pieceSize);
+
+    VkBufferCopy copyRegion = {};
+    copyRegion.srcOffset = region.offset;
+    copyRegion.dstOffset = dstOffset + uploaded;
+    copyRegion.size = pieceSize;
+
+    VkCommandBufferBeginInfo beginInfo = {};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    vkBeginCommandBuffer(g_TransferCommandBuffer, &beginInfo);
+    vkCmdCopyBuffer(g_TransferCommandBuffer, region.buffer, dst, 1, &copyRegion);
+    vkEndCommandBuffer(g_TransferCommandBuffer);
+
+    VkSubmitInfo submitInfo = {};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &g_TransferCommandBuffer;
+    RETURN_IF_FAILURE(Result::Vulkan(
+      vkQueueSubmit(g_TransferQueue, 1, &submitInfo, VK_NULL_HANDLE)),
+      "vkQueueSubmit");
+    vkQueueWaitIdle(g_TransferQueue);
+    g_StagingAllocator.Reset();
+    uploaded += pieceSize;
+  }
+  return Result::Application(0);
+}
+
+// Defragmentation
+// Long-lived device-local buffers register here so VMA may move them to
+// compact their memory. They live in a pool of their own, so nothing else
+// is placed in memory VMA considers free while a move is under way. A step
+// runs in the background over several frames:
+// - VMA picks a move and records its copy, which runs on the transfer queue
+//   (the buffers are shared with its family) and signals a fence.
+// - Once the fence has signaled, each moved buffer is recreated at its new
+//   place and its owner swaps the old handle wherever else it is held.
+//   Per-frame descriptor sets pick the new handles up when next written.
+//   The old buffers are retired with the frames still using them.
+// - Once those frames have completed, VMA ends the step and frees the
+//   blocks it emptied.
+// A step moves one allocation: with more, a copy could land where another
+// moved buffer was, which frames in flight still read. Optimal tiling images
+// can't be moved by VMA's buffer copies and aren't registered.
+static const uint32_t DEFRAG_MAX_MOVES_PER_STEP = 1;
+static const VkDeviceSize MOVABLE_BUFFER_POOL_BLOCK_SIZE = 64ull * 1024 * 1024;
+
+struct MovableBuffer
+{
+  VkBuffer* buffer;
+  VmaAllocation allocation;
+  VkBufferCreateInfo bufferCI;
+  // Copy of bufferCI's families for CONCURRENT sharing, which bufferCI points at only while in use
+  uint32_t queueFamilies[3];
+  // Optional, called once *buffer holds the new handle
+  void (*onMoved)(VkBuffer oldBuffer, VkBuffer newBuffer);
+};
+
+static std::vector<MovableBuffer> g_MovableBuffers;
+// Null while defragmentation is off, movable buffers are then allocated as usual
+static VmaPool g_MovableBufferPool;
+static VkCommandBuffer g_DefragCommandBuffer;
+static VkFence g_DefragFence;
+// Set when a step found nothing to move, cleared when the buffers change
+static bool g_DefragConverged = false;
+
+// The step under way, if context isn't null
+static struct DefragStep
+{
+  VmaDefragmentationContext context = VK_NULL_HANDLE;
+  // Parallel to the allocations passed to VMA
+  std::vector<VkBuffer*> buffers;
+  std::vector<VmaAllocation> allocations;
+  std::vector<VkBool32> allocationsChanged;
+  VmaDefragmentationStats stats;
+  bool copiesDone;
+  // The last frame using the replaced buffers, set once the copies are done
+  uint64_t lastFrameUsingOldBuffers;
+  float fragmentationBefore;
+} g_DefragStep;
+
+static struct DefragStats
+{
+  uint32_t steps = 0;
+  uint32_t allocationsMoved = 0;
+  VkDeviceSize bytesMoved = 0;
+  uint32_t blocksFreed = 0;
+  VkDeviceSize bytesFreed = 0;
+  // CPU time spent starting, swapping and ending steps
+  double totalMs = 0.0;
+  float lastStepMs = 0.0f;
+  // Of the movable buffer pool, around the last step
+  float lastFragmentationBefore = 0.0f;
+  float lastFragmentationAfter = 0.0f;
+} g_DefragStats;
+
+Result InitVkDefragmentation()
+{
+  if (g_Options.defragBudget == 0)
+  {
+    return Result::Application(0);
+  }
+
+  // What the registered buffers are used as
+  VkBufferCreateInfo bufferCI = {};
+  bufferCI.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  bufferCI.size = 1;
+  bufferCI.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT
+    | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+  bufferCI.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+  VmaAllocationCreateInfo allocCI = {};
+  allocCI.usage = VMA_MEMORY_USAGE_GPU_ONLY;
+
+  VmaPoolCreateInfo poolCI = {};
+  RETURN_IF_FAILURE(Result::Vulkan(
+    vmaFindMemoryTypeIndexForBufferInfo(g_Allocator, &bufferCI, &allocCI, &poolCI.memoryTypeIndex)),
+    "vmaFindMemoryTypeIndexForBufferInfo");
+  poolCI.blockSize = MOVABLE_BUFFER_POOL_BLOCK_SIZE;
+  RETURN_IF_FAILURE(Result::Vulkan(
+    vmaCreatePool(g_Allocator, &poolCI, &g_MovableBufferPool)),
+    "vmaCreatePool");
+
+  VkCommandBufferAllocateInfo commandBufferInfo = {};
+  commandBufferInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  commandBufferInfo.commandPool = g_TransferCommandPool;
+  commandBufferInfo.commandBufferCount = 1;
+  commandBufferInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  RETURN_IF_FAILURE(Result::Vulkan(
+    vkAllocateCommandBuffers(g_Device, &commandBufferInfo, &g_DefragCommandBuffer)),
+    "vkAllocateCommandBuffers");
+
+  VkFenceCreateInfo fenceCI = {};
+  fenceCI.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+  RETURN_IF_FAILURE(Result::Vulkan(
+    vkCreateFence(g_Device, &fenceCI, nullptr, &g_DefragFence)),
+    "vkCreateFence");
+
+  return Result::Application(0);
+}
+
+// The buffers must have been destroyed, and the step ended
+void DestroyVkDefragmentation()
+{
+  if (g_DefragFence != VK_NULL_HANDLE)
+  {
+    vkDestroyFence(g_Device, g_DefragFence, nullptr);
+    g_DefragFence = VK_NULL_HANDLE;
+  }
+  // Freed with its pool
+  g_DefragCommandBuffer = VK_NULL_HANDLE;
+  if (g_MovableBufferPool != VK_NULL_HANDLE)
+  {
+    vmaDestroyPool(g_Allocator, g_MovableBufferPool);
+    g_MovableBufferPool = VK_NULL_HANDLE;
+  }
+}
+
+// Called on the create infos of a buffer before creating it. Returns whether
+// the buffer may be registered as movable: it then goes to the movable
+// buffer pool and is shared with the transfer queue, which does the moves.
+bool PrepareMovableBuffer(VkBufferCreateInfo& bufferCI, VmaAllocationCreateInfo& allocCI)
+{
+  if (g_MovableBufferPool == VK_NULL_HANDLE || bufferCI.size > MOVABLE_BUFFER_POOL_BLOCK_SIZE)
+  {
+    return false;
+  }
+  allocCI.pool = g_MovableBufferPool;
+  // CONCURRENT buffers are shared with all families already (see ShareWithComputeQueue)
+  if (bufferCI.sharingMode == VK_SHARING_MODE_EXCLUSIVE && g_TransferQueueFamily != g_GraphicsQueueFamily)
+  {
+    static uint32_t queueFamilies[2];
+    queueFamilies[0] = g_GraphicsQueueFamily;
+    queueFamilies[1] = g_TransferQueueFamily;
+    bufferCI.sharingMode = VK_SHARING_MODE_CONCURRENT;
+    bufferCI.queueFamilyIndexCount = 2;
+    bufferCI.pQueueFamilyIndices = queueFamilies;
+  }
+  return true;
+}
+
+// bufferCI must be what the buffer was created with, after PrepareMovableBuffer()
+void RegisterMovableBuffer(VkBuffer* buffer, VmaAllocation allocation, const VkBufferCreateInfo& bufferCI,
+                           void (*onMoved)(VkBuffer oldBuffer, VkBuffer newBuffer))
+{
+  MovableBuffer movable = {};
+  movable.buffer = buffer;
+  movable.allocation = allocation;
+  movable.bufferCI = bufferCI;
+  movable.onMoved = onMoved;
+  movable.bufferCI.pNext = nullptr;
+  movable.bufferCI.pQueueFamilyIndices = nullptr;
+  if (bufferCI.sharingMode == VK_SHARING_MODE_CONCURRENT)
+  {
+    movable.bufferCI.queueFamilyIndexCount = glm::min(bufferCI.queueFamilyIndexCount, 3u);
+    std::copy(bufferCI.pQueueFamilyIndices, bufferCI.pQueueFamilyIndices + movable.bufferCI.queueFamilyIndexCount,
+              movable.queueFamilies);
+  }
+  else
+  {
+    movable.bufferCI.queueFamilyIndexCount = 0;
+  }
+  g_MovableBuffers.push_back(movable);
+  g_DefragConverged = false;
+}
+
+// Not while a step is under way
+void UnregisterMovableBuffer(VkBuffer* buffer)
+{
+  for (uint32_t i = 0; i < (uint32_t)g_MovableBuffers.size(); i++)
+  {
+    if (g_MovableBuffers[i].buffer == buffer)
+    {
+      g_MovableBuffers.erase(g_MovableBuffers.begin() + i);
+      g_DefragConverged = false;
+      return;
+    }
+  }
+}
+
+// 1 - largest free range / free bytes in the pool's blocks
+float GetMovableBufferPoolFragmentation()
+{
+  VmaPoolStats poolStats;
+  vmaGetPoolStats(g_Allocator, g_MovableBufferPool, &poolStats);
+  return poolStats.unusedSize > 0
+    ? 1.0f - (float)poolStats.unusedRangeSizeMax / (float)poolStats.unusedSize : 0.0f;
+}
+
+// Lets VMA pick the moves of a step, at most maxBytesToMove, and submits
+// their copies to the transfer queue
+Result StartDefragmentStep(VkDeviceSize maxBytesToMove)
+{
+  DefragStep& step = g_DefragStep;
+  step.buffers.clear();
+  step.allocations.clear();
+  for (const MovableBuffer& movable : g_MovableBuffers)
+  {
+    step.buffers.push_back(movable.buffer);
+    step.allocations.push_back(movable.allocation);
+  }
+  step.allocationsChanged.assign(step.allocations.size(), VK_FALSE);
+  step.stats = {};
+  step.copiesDone = false;
+  step.lastFrameUsingOldBuffers = 0;
+  step.fragmentationBefore = GetMovableBufferPoolFragmentation();
+
+  VkCommandBufferBeginInfo beginInfo = {};
+  beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+  vkBeginCommandBuffer(g_DefragCommandBuffer, &beginInfo);
+
+  VmaDefragmentationInfo2 info = {};
+  info.allocationCount = (uint32_t)step.allocations.size();
+  info.pAllocations = step.allocations.data();
+  info.pAllocationsChanged = step.allocationsChanged.data();
+  info.maxGpuBytesToMove = maxBytesToMove;
+  info.maxGpuAllocationsToMove = DEFRAG_MAX_MOVES_PER_STEP;
+  info.commandBuffer = g_DefragCommandBuffer;
+
+  VkResult res = vmaDefragmentationBegin(g_Allocator, &info, &step.stats, &step.context);
+  vkEndCommandBuffer(g_DefragCommandBuffer);
+  RETURN_IF_FAILURE(Result::Vulkan(res < 0 ? res : VK_SUCCESS), "vmaDefragmentationBegin");
+  if (step.context == VK_NULL_HANDLE)
+  {
+    g_DefragConverged = true;
+    return Result::Application(0);
+  }
+
+  RETURN_IF_FAILURE(Result::Vulkan(
+    vkResetFences(g_Device, 1, &g_DefragFence)),
+    "vkResetFences");
+  VkSubmitInfo submitInfo = {};
+  submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+  submitInfo.commandBufferCount = 1;
+  submitInfo.pCommandBuffers = &g_DefragCommandBuffer;
+  RETURN_IF_FAILURE(Result::Vulkan(
+    vkQueueSubmit(g_TransferQueue, 1, &submitInfo, g_DefragFence)),
+    "vkQueueSubmit");
+  return Result::Application(0);
+}
+
+// Buffers are bound for good, moved ones are replaced by new buffers bound
+// to the data's new place. The frames submitted so far keep the old ones.
+Result ReplaceMovedBuffers()
+{
+  DefragStep& step = g_DefragStep;
+  for (uint32_t i = 0; i < (uint32_t)step.buffers.size(); i++)
+  {
+    if (!step.allocationsChanged[i])
+    {
+      continue;
+    }
+    auto movable = std::find_if(g_MovableBuffers.begin(), g_MovableBuffers.end(),
+      [&step, i](const MovableBuffer& m) { return m.buffer == step.buffers[i]; });
+    VkBuffer oldBuffer = *movable->buffer;
+    VkBuffer newBuffer;
+    VkBufferCreateInfo bufferCI = movable->bufferCI;
+    bufferCI.pQueueFamilyIndices = bufferCI.queueFamilyIndexCount > 0 ? movable->queueFamilies : nullptr;
+    RETURN_IF_FAILURE(Result::Vulkan(
+      vkCreateBuffer(g_Device, &bufferCI, nullptr, &newBuffer)),
+      "vkCreateBuffer");
+    RETURN_IF_FAILURE(Result::Vulkan(
+      vmaBindBufferMemory(g_Allocator, movable->allocation, newBuffer)),
+      "vmaBindBufferMemory");
+    // The allocation stays with the new buffer
+    RetireBuffer(oldBuffer, VK_NULL_HANDLE);
+    *movable->buffer = newBuffer;
+    if (movable->onMoved != nullptr)
+    {
+      movable->onMoved(oldBuffer, newBuffer);
+    }
+  }
+  step.lastFrameUsingOldBuffers = g_SubmittedFrames;
+  step.copiesDone = true;
+  return Result::Application(0);
+}
+
+// No frame may use the replaced buffers any more
+Result EndDefragmentStep()
+{
+  DefragStep& step = g_DefragStep;
+  RETURN_IF_FAILURE(Result::Vulkan(
+    vmaDefragmentationEnd(g_Allocator, step.context)),
+    "vmaDefragmentationEnd");
+  step.context = VK_NULL_HANDLE;
+
+  g_DefragStats.steps++;
+  g_DefragStats.allocationsMoved += step.stats.allocationsMoved;
+  g_DefragStats.bytesMoved += step.stats.bytesMoved;
+  g_DefragStats.blocksFreed += step.stats.deviceMemoryBlocksFreed;
+  g_DefragStats.bytesFreed += step.stats.bytesFreed;
+  g_DefragStats.lastFragmentationBefore = step.fragmentationBefore;
+  g_DefragStats.lastFragmentationAfter = GetMovableBufferPoolFragmentation();
+  if (step.stats.allocationsMoved == 0)
+  {
+    g_DefragConverged = true;
+  }
+  return Result::Application(0);
+}
+
+// Ends a step under way at shutdown, once the device is idle. Buffers whose
+// copies weren't picked up yet stay bound to memory they no longer own,
+// which is fine for destroying them.
+void AbortDefragmentStep()
+{
+  if (g_DefragStep.context != VK_NULL_HANDLE)
+  {
+    vmaDefragmentationEnd(g_Allocator, g_DefragStep.context);
+    g_DefragStep.context = VK_NULL_HANDLE;
+  }
+}
+
+// Frame scratch
+// Data the CPU writes once per frame for the GPU to read: uniforms, instance
+// data, dynamic vertices and indirect arguments. Each frame in flight bump
+// allocates from its own buffer, placed in a VMA linear pool, and is reset
+// wholesale once the frame's fence has signaled. A frame that outgrows its
+// buffer continues in overflow buffers from the same pool, and its next
+// reset replaces the buffer with one large enough for the whole frame.
+static const VkDeviceSize FRAME_SCRATCH_INITIAL_SIZE = 256 * 1024;
+static const VkBufferUsageFlags FRAME_SCRATCH_USAGE = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
+  | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT;
+
+static VmaPool g_FrameScratchPool;
+// Regions are aligned for use as uniform and storage buffers
+static VkDeviceSize g_FrameScratchAlignment;
+
+struct ScratchRegion
+{
+  VkBuffer buffer;
+  VkDeviceSize offset;
+  char* data;
+};
+
+struct FrameScratchAllocator
+{
+  struct Block
+  {
+    VkBuffer buffer;
+    VmaAllocation allocation;
+    char* mapped;
+    VkDeviceSize size;
+  };
+  // blocks[0] is the frame's buffer, any others overflowed this frame
+  std::vector<Block> blocks;
+  VkDeviceSize offset = 0;
+  VkDeviceSize used = 0;
+  VkDeviceSize peakUsed = 0;
+
+  Result Allocate(VkDeviceSize size, ScratchRegion* outRegion)
+  {
+    if (blocks.empty() || offset + size > blocks.back().size)
+    {
+      VkDeviceSize blockSize = blocks.empty() ? FRAME_SCRATCH_INITIAL_SIZE : 2 * blocks.back().size;
+      while (blockSize < size)
+      {
+        blockSize *= 2;
+      }
+      RETURN_IF_FAILURE(AddBlock(blockSize), "FrameScratchAllocator::AddBlock");
+      offset = 0;
+    }
+
+    const Block& block = blocks.back();
+    outRegion->buffer = block.buffer;
+    outRegion->offset = offset;
+    outRegion->data = block.mapped + offset;
+    VkDeviceSize alignedSize = AlignUp(size, g_FrameScratchAlignment);
+    offset += alignedSize;
+    used += alignedSize;
+    return Result::Application(0);
+  }
+
+  // Makes the frame's writes visible to the device, before submitting
+  void Flush()
+  {
+    for (const Block& block : blocks)
+    {
+      vmaFlushAllocation(g_Allocator, block.allocation, 0, VK_WHOLE_SIZE);
+    }
+  }
+
+  // Regions allocated since the last reset must no longer be in use
+  Result Reset()
+  {
+    peakUsed = glm::max(peakUsed, used);
+    if (blocks.size() > 1)
+    {
+      VkDeviceSize blockSize = blocks[0].size;
+      while (blockSize < used)
+      {
+        blockSize *= 2;
+      }
+      Destroy();
+      RETURN_IF_FAILURE(AddBlock(blockSize), "FrameScratchAllocator::AddBlock");
+    }
+    offset = 0;
+    used = 0;
+    return Result::Application(0);
+  }
+
+  void Destroy()
+  {
+    for (const Block& block : blocks)
+    {
+      vmaDestroyBuffer(g_Allocator, block.buffer, block.allocation);
+    }
+    blocks.clear();
+  }
+
+private:
+  Result AddBlock(VkDeviceSize size)
+  {
+    VkBufferCreateInfo bufferCI = {};
+    bufferCI.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    bufferCI.size = size;
+    bufferCI.usage = FRAME_SCRATCH_USAGE;
+    bufferCI.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+    VmaAllocationCreateInfo allocCI = {};
+    allocCI.pool = g_FrameScratchPool;
+    allocCI.flags = VMA_ALLOCATION_CREATE_MAPPED_BIT;
+
+    Block block = {};
+    block.size = size;
+    VmaAllocationInfo allocInfo;
+    RETURN_IF_FAILURE(Result::Vulkan(
+      vmaCreateBuffer(g_Allocator, &bufferCI, &allocCI, &block.buffer, &block.allocation, &allocInfo)),
+      "vmaCreateBuffer");
+    block.mapped = (char*)allocInfo.pMappedData;
+    blocks.push_back(block);
+    return Result::Application(0);
+  }
+};
+
+static FrameScratchAllocator g_FrameScratch[MAX_FRAMES_IN_FLIGHT];
+// Each frame's uniforms, and their bindless index on the bindless path
+static ScratchRegion g_FrameUniforms[MAX_FRAMES_IN_FLIGHT];
+static uint32_t g_FrameUniformIndices[MAX_FRAMES_IN_FLIGHT];
+
+Result InitVkFrameScratch()
+{
+  VkPhysicalDeviceProperties deviceProperties;
+  vkGetPhysicalDeviceProperties(g_PhysicalDevice, &deviceProperties);
+  g_FrameScratchAlignment = glm::max(deviceProperties.limits.minUniformBufferOffsetAlignment,
+                                     deviceProperties.limits.minStorageBufferOffsetAlignment);
+
+  VkBufferCreateInfo bufferCI = {};
+  bufferCI.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  bufferCI.size = FRAME_SCRATCH_INITIAL_SIZE;
+  bufferCI.usage = FRAME_SCRATCH_USAGE;
+  bufferCI.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+  VmaAllocationCreateInfo allocCI = {};
+  allocCI.usage = VMA_MEMORY_USAGE_CPU_TO_GPU;
+
+  VmaPoolCreateInfo poolCI = {};
+  RETURN_IF_FAILURE(Result::Vulkan(
+    vmaFindMemoryTypeIndexForBufferInfo(g_Allocator, &bufferCI, &allocCI, &poolCI.memoryTypeIndex)),
+    "vmaFindMemoryTypeIndexForBufferInfo");
+  poolCI.flags = VMA_POOL_CREATE_LINEAR_ALGORITHM_BIT;
+
+  RETURN_IF_FAILURE(Result::Vulkan(
+    vmaCreatePool(g_Allocator, &poolCI, &g_FrameScratchPool)),
+    "vmaCreatePool");
+
+  for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++)
+  {
+    g_FrameUniforms[i] = {};
+    g_FrameUniformIndices[i] = INVALID_BINDLESS_INDEX;
+  }
+
+  return Result::Application(0);
+}
+
+// Writes the frame's uniforms, the frame's scratch must have been reset
+Result WriteFrameUniforms(uint32_t frame)
+{
+  ScratchRegion region;
+  RETURN_IF_FAILURE(g_FrameScratch[frame].Allocate(sizeof(g_UniformBuffer), &region), "FrameScratchAllocator::Allocate");
+  memcpy(region.data, &g_UniformBuffer, sizeof(g_UniformBuffer));
+
+  // Uniforms come first in the frame, so the region only moves when the
+  // scratch buffer was replaced. The old index is free to reuse, its last
+  // reader was the frame that just completed.
+  if (g_BindlessEnabled && (region.buffer != g_FrameUniforms[frame].buffer || region.offset != g_FrameUniforms[frame].offset))
+  {
+    if (g_FrameUniformIndices[frame] != INVALID_BINDLESS_INDEX)
+    {
+      ReleaseBindlessStorageBuffer(g_FrameUniformIndices[frame]);
+    }
+    g_FrameUniformIndices[frame] = RegisterBindlessStorageBuffer(region.buffer, region.offset, sizeof(g_UniformBuffer));
+    RETURN_IF_FAILURE(Result::Application(
+      g_FrameUniformIndices[frame] == INVALID_BINDLESS_INDEX ? 1 : 0),
+      "RegisterBindlessStorageBuffer");
+  }
+  g_FrameUniforms[frame] = region;
+
+  return Result::Application(0);
+}
+
+void DestroyVkFrameScratch()
+{
+  for (uint32_t& index : g_FrameUniformIndices)
+  {
+    if (index != INVALID_BINDLESS_INDEX)
+    {
+      ReleaseBindlessStorageBuffer(index);
+      index = INVALID_BINDLESS_INDEX;
+    }
+  }
+  for (FrameScratchAllocator& scratch : g_FrameScratch)
+  {
+    scratch.Destroy();
+  }
+  if (g_FrameScratchPool != VK_NULL_HANDLE)
+  {
+    vmaDestroyPool(g_Allocator, g_FrameScratchPool);
+    g_FrameScratchPool = VK_NULL_HANDLE;
+  }
+}
+
+// Meshes and materials referenced by render objects
+// Meshes sharing a buffer and offsets share the vertex and index buffer
+// binds. Indices are 16 bit, so meshes are drawn as parts of at most
+// MAX_PART_VERTICES vertices, each selecting its range with its first
+// vertex as baseVertex and the LOD's firstIndex.
+struct Mesh
+{
+  VkBuffer buffer;
+  // Offset of each vertex stream of the mesh's layout, the vertex at baseVertex is the mesh's first
+  VkDeviceSize streamOffsets[MAX_VERTEX_STREAMS];
+  VkDeviceSize indexOffset;
+  int32_t baseVertex;
+  // Range in g_MeshParts
+  uint32_t firstPart;
+  uint32_t numParts;
+  // Error and total size of each level, parts hold the ranges to draw
+  uint32_t numLods;
+  MeshLod lods[MAX_MESH_LODS];
+  Aabb bounds;
+  // Maps quantized positions to bounds, folded into each instance's transform
+  bool quantized;
+  glm::mat4x4 dequantize;
+};
+static std::vector<Mesh> g_Meshes;
+static std::vector<MeshPart> g_MeshParts;
+
+// Points meshes at their buffer after defragmentation moved it
+void ReplaceMeshBuffer(VkBuffer oldBuffer, VkBuffer newBuffer)
+{
+  for (Mesh& mesh : g_Meshes)
+  {
+    if (mesh.buffer == oldBuffer)
+    {
+      mesh.buffer = newBuffer;
+    }
+  }
+}
+
+struct Material
+{
+  uint32_t pipeline;
+  uint32_t textureIndex;
+};
+static std::vector<Material> g_Materials;
+
+static VkBuffer g_TriangleBuffer;
+static VmaAllocation g_TriangleBufferAllocation;
+static uint64_t g_TriangleBufferStreamOffsets[MAX_VERTEX_STREAMS];
+static uint64_t g_TriangleBufferIndexOffset;
+
+Result InitVkTriangleBuffer()
+{
+  uint32_t bufferSize;
+  std::vector<char> bufferData;
+  // Prepare vertex buffer data
+  {
+    // Same size as the interleaved vertices, but split into a position and a color stream
+    const uint32_t numVertices = sizeof(g_VertexBuffer) / sizeof(g_VertexBuffer[0]);
+    VertexLayout vertexLayout = MakeFloatVertexLayout();
+    g_TriangleBufferStreamOffsets[0] = 0;
+    g_TriangleBufferStreamOffsets[1] = numVertices * vertexLayout.strides[0];
+    g_TriangleBufferIndexOffset = sizeof(g_VertexBuffer);
+    bufferSize = (uint32_t)(sizeof(g_VertexBuffer) + sizeof(g_IndexBuffer));
+    bufferData.resize(bufferSize);
+
+    g_UniformBuffer.model = glm::identity<glm::mat4x4>();
+    g_UniformBuffer.view = glm::identity<glm::mat4x4>();
+    g_UniformBuffer.proj = glm::perspectiveFov(glm::radians(45.0f), (float)g_DrawableWidth, (float)g_DrawableHeight, 0.01f, 100.0f);
+    g_UniformBuffer.proj[1][1] *= -1;
+
+    glm::vec3 positions[numVertices];
+    glm::vec3 colors[numVertices];
+    for (uint32_t v = 0; v < numVertices; v++)
+    {
+      positions[v] = g_VertexBuffer[v].pos;
+      colors[v] = g_VertexBuffer[v].color;
+    }
+    VertexAttributeArrays arrays = {};
+    arrays.positions = positions;
+    arrays.colors = colors;
+    arrays.numVertices = numVertices;
+    void* streams[MAX_VERTEX_STREAMS] = {
+      bufferData.data() + g_TriangleBufferStreamOffsets[0], bufferData.data() + g_TriangleBufferStreamOffsets[1] };
+    EncodeVertices(vertexLayout, arrays, MakeVertexQuantization(glm::vec3(0.0f), glm::vec3(1.0f)), streams);
+    memcpy(bufferData.data() + g_TriangleBufferIndexOffset, (void*)g_IndexBuffer, sizeof(g_IndexBuffer));
+  }
+
+  // Create device-local buffer (vertex + index), uniforms live in the frame scratch
+  {
+    VkBufferCreateInfo bufferCI = {};
+    bufferCI.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    bufferCI.size = bufferSize;
+    bufferCI.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    bufferCI.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+    VmaAllocationCreateInfo allocCI = {};
+    allocCI.usage = VMA_MEMORY_USAGE_GPU_ONLY;
+    bool movable = PrepareMovableBuffer(bufferCI, allocCI);
+   
+    vmaCreateBuffer(g_Allocator, &bufferCI, &allocCI, &g_TriangleBuffer, &g_TriangleBufferAllocation, nullptr);
+    if (movable)
+    {
+      RegisterMovableBuffer(&g_TriangleBuffer, g_TriangleBufferAllocation, bufferCI, ReplaceMeshBuffer);
+    }
+  }
+
+  RETURN_IF_FAILURE(UploadToBuffer(g_TriangleBuffer, 0, bufferData.data(), bufferSize), "UploadToBuffer");
+
+  Mesh mesh = {};
+  mesh.buffer = g_TriangleBuffer;
+  mesh.streamOffsets[0] = g_TriangleBufferStreamOffsets[0];
+  mesh.streamOffsets[1] = g_TriangleBufferStreamOffsets[1];
+  mesh.indexOffset = g_TriangleBufferIndexOffset;
+  mesh.numLods = 1;
+  mesh.lods[0] = { 0, sizeof(g_IndexBuffer) / sizeof(g_IndexBuffer[0]), 0.0f };
+  MeshPart part = {};
+  part.vertexCount = sizeof(g_VertexBuffer) / sizeof(g_VertexBuffer[0]);
+  part.lods[0] = mesh.lods[0];
+  mesh.firstPart = (uint32_t)g_MeshParts.size();
+  mesh.numParts = 1;
+  g_MeshParts.push_back(part);
+  mesh.bounds = { g_VertexBuffer[0].pos, g_VertexBuffer[0].pos };
+  for (const Vertex& vertex : g_VertexBuffer)
+  {
+    mesh.bounds.min = glm::min(mesh.bounds.min, vertex.pos);
+    mesh.bounds.max = glm::max(mesh.bounds.max, vertex.pos);
+  }
+  g_Meshes.push_back(mesh);
+
+  return Result::Application(0);
+}
+
+void DestroyVkTriangleBuffer()
+{
+  g_Meshes.clear();
+  g_MeshParts.clear();
+  UnregisterMovableBuffer(&g_TriangleBuffer);
+  RetireBuffer(g_TriangleBuffer, g_TriangleBufferAllocation);
+  g_TriangleBuffer = VK_NULL_HANDLE;
+  g_TriangleBufferAllocation = VK_NULL_HANDLE;
+}
+
+// Mesh arena
+// Vertices of all imported meshes followed by their indices, every LOD included,
+// in one device-local buffer. Imported meshes are appended to g_Meshes.
+static VkBuffer g_MeshArenaBuffer;
+static VmaAllocation g_MeshArenaAllocation;
+static uint32_t g_ImportedMesh = (uint32_t)-1;
+// Meshlets of the imported mesh's finest level, uploaded by InitVkMeshletCulling
+static MeshletData g_ImportedMeshlets;
+
+Result InitVkMeshArena()
+{
+  if (g_Options.meshPath == nullptr)
+  {
+    return Result::Application(0);
+  }
+
+  std::vector<ImportedMesh> importedMeshes(1);
+  RETURN_IF_FAILURE(Result::Application(
+    ImportMesh(g_Options.meshPath, importedMeshes[0]) ? 0 : 1),
+    "ImportMesh");
+
+  // All meshes in the arena share one layout, matching their pipeline
+  VertexLayout vertexLayout = g_Options.quantizeVertices ? MakeQuantizedVertexLayout() : MakeFloatVertexLayout();
+  // Meshlet draws pull vertices as a storage buffer
+  VkBufferUsageFlags arenaUsage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+
+  // Meshes give up their finest levels while the arena doesn't fit into the
+  // budget left in its heap, so a big model loads coarser instead of failing
+  uint32_t arenaHeap;
+  RETURN_IF_FAILURE(FindBufferHeap(arenaUsage, VMA_MEMORY_USAGE_GPU_ONLY, &arenaHeap), "FindBufferHeap");
+  UpdateMemoryBudget();
+  while (1)
+  {
+    VkDeviceSize arenaSize = 0;
+    ImportedMesh* largest = nullptr;
+    for (ImportedMesh& imported : importedMeshes)
+    {
+      VkDeviceSize meshSize = imported.positions.size() * (vertexLayout.strides[0] + vertexLayout.strides[1])
+        + imported.shortIndices.size() * sizeof(uint16_t);
+      arenaSize += meshSize;
+      if (imported.numLods > 1 && (largest == nullptr || imported.positions.size() > largest->positions.size()))
+      {
+        largest = &imported;
+      }
+    }
+    VkDeviceSize headroom = GetHeapHeadroom(arenaHeap);
+    if (arenaSize <= headroom || largest == nullptr)
+    {
+      break;
+    }
+    printf("Mesh arena needs %.1f MB with %.1f MB left in the heap budget, dropping the finest level of detail\n",
+           arenaSize / (1024.0f * 1024.0f), headroom / (1024.0f * 1024.0f));
+    DropFinestLod(*largest);
+  }
+
+  std::vector<char> streams[MAX_VERTEX_STREAMS];
+  uint32_t numArenaVertices = 0;
+  std::vector<uint16_t> indices;
+  uint32_t firstMesh = (uint32_t)g_Meshes.size();
+  for (const ImportedMesh& imported : importedMeshes)
+  {
+    uint32_t numVertices = (uint32_t)imported.positions.size();
+    Mesh mesh = {};
+    mesh.baseVertex = (int32_t)numArenaVertices;
+    mesh.numLods = imported.numLods;
+    mesh.bounds = { imported.positions[0], imported.positions[0] };
+    for (uint32_t v = 0; v < numVertices; v++)
+    {
+      mesh.bounds.min = glm::min(mesh.bounds.min, imported.positions[v]);
+      mesh.bounds.max = glm::max(mesh.bounds.max, imported.positions[v]);
+    }
+
+    VertexQuantization quantization = MakeVertexQuantization(mesh.bounds.min, mesh.bounds.max);
+    mesh.quantized = g_Options.quantizeVertices;
+    mesh.dequantize = GetDequantizeTransform(quantization);
+    VertexAttributeArrays arrays = {};
+    arrays.positions = imported.positions.data();
+    arrays.colors = imported.colors.data();
+    arrays.numVertices = numVertices;
+    void* streamData[MAX_VERTEX_STREAMS] = {};
+    for (uint32_t s = 0; s < vertexLayout.numStreams; s++)
+    {
+      streams[s].resize((size_t)(numArenaVertices + numVertices) * vertexLayout.strides[s]);
+      streamData[s] = streams[s].data() + (size_t)numArenaVertices * vertexLayout.strides[s];
+    }
+    EncodeVertices(vertexLayout, arrays, quantization, streamData);
+    numArenaVertices += numVertices;
+    memcpy(mesh.lods, imported.lods, sizeof(mesh.lods));
+    mesh.firstPart = (uint32_t)g_MeshParts.size();
+    mesh.numParts = (uint32_t)imported.parts.size();
+    for (MeshPart part : imported.parts)
+    {
+      part.firstVertex += (uint32_t)mesh.baseVertex;
+      for (uint32_t lod = 0; lod < imported.numLods; lod++)
+      {
+        part.lods[lod].firstIndex += (uint32_t)indices.size();
+      }
+      g_MeshParts.push_back(part);
+    }
+    indices.insert(indices.end(), imported.shortIndices.begin(), imported.shortIndices.end());
+    g_Meshes.push_back(mesh);
+
+    if (g_Options.meshlets)
+    {
+      BuildMeshlets(imported.positions.data(), (uint32_t)imported.positions.size(),
+                    imported.indices.data() + imported.lods[0].firstIndex, imported.lods[0].indexCount, g_ImportedMeshlets);
+      // Meshlet vertices index the whole arena
+      for (uint32_t& vertex : g_ImportedMeshlets.vertices)
+      {
+        vertex += (uint32_t)mesh.baseVertex;
+      }
+      // Culling sees the dequantize transform as part of the instance transform
+      if (mesh.quantized)
+      {
+        for (Meshlet& meshlet : g_ImportedMeshlets.meshlets)
+        {
+          glm::vec3 center = (glm::vec3(meshlet.sphere) - quantization.offset) / quantization.scale;
+          meshlet.sphere = glm::vec4(center, meshlet.sphere.w / quantization.scale);
+        }
+      }
+    }
+  }
+
+  // [stream 0 of all meshes][stream 1 of all meshes][indices], the streams are
+  // also bound as storage buffers by meshlet draws
+  VkPhysicalDeviceProperties deviceProperties;
+  vkGetPhysicalDeviceProperties(g_PhysicalDevice, &deviceProperties);
+  VkDeviceSize alignment = glm::max(deviceProperties.limits.minStorageBufferOffsetAlignment, (VkDeviceSize)4);
+  VkDeviceSize streamOffsets[MAX_VERTEX_STREAMS] = {};
+  VkDeviceSize bufferSize = 0;
+  for (uint32_t s = 0; s < vertexLayout.numStreams; s++)
+  {
+    streamOffsets[s] = bufferSize;
+    bufferSize = AlignUp(bufferSize + streams[s].size(), alignment);
+  }
+  VkDeviceSize indicesOffset = bufferSize;
+  VkDeviceSize indicesSize = indices.size() * sizeof(uint16_t);
+  bufferSize += indicesSize;
+  {
+    VkBufferCreateInfo bufferCI = {};
+    bufferCI.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    bufferCI.size = bufferSize;
+    bufferCI.usage = arenaUsage;
+    bufferCI.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+    VmaAllocationCreateInfo allocCI = {};
+    allocCI.usage = VMA_MEMORY_USAGE_GPU_ONLY;
+    bool movable = PrepareMovableBuffer(bufferCI, allocCI);
 
-  for (uint32_t i = 0; i < (uint32_t)g_SwapchainImageViews.size(); i++)
-  {
-    VkFramebufferCreateInfo framebufferCI = {};
-    framebufferCI.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
-    framebufferCI.renderPass = g_RenderPass;
-    framebufferCI.attachmentCount = 1;
-    framebufferCI.pAttachments = &g_SwapchainImageViews[i];
-    framebufferCI.width = g_SwapchainExtent.width;
-    framebufferCI.height = g_SwapchainExtent.height;
-    framebufferCI.layers = 1;
     RETURN_IF_FAILURE(Result::Vulkan(
-      vkCreateFramebuffer(g_Device, &framebufferCI, nullptr, &g_SwapchainFramebuffers[i])),
-      "vkCreateFramebuffer");
+      vmaCreateBuffer(g_Allocator, &bufferCI, &allocCI, &g_MeshArenaBuffer, &g_MeshArenaAllocation, nullptr)),
+      "vmaCreateBuffer");
+    if (movable)
+    {
+      RegisterMovableBuffer(&g_MeshArenaBuffer, g_MeshArenaAllocation, bufferCI, ReplaceMeshBuffer);
+    }
+  }
+
+  // Large streams go up in pieces, so staging stays at most one chunk
+  for (uint32_t s = 0; s < vertexLayout.numStreams; s++)
+  {
+    RETURN_IF_FAILURE(UploadToBuffer(g_MeshArenaBuffer, streamOffsets[s], streams[s].data(), streams[s].size()), "UploadToBuffer");
+  }
+  RETURN_IF_FAILURE(UploadToBuffer(g_MeshArenaBuffer, indicesOffset, indices.data(), indicesSize), "UploadToBuffer");
+
+  for (uint32_t i = firstMesh; i < (uint32_t)g_Meshes.size(); i++)
+  {
+    g_Meshes[i].buffer = g_MeshArenaBuffer;
+    memcpy(g_Meshes[i].streamOffsets, streamOffsets, sizeof(streamOffsets));
+    g_Meshes[i].indexOffset = indicesOffset;
+  }
+  g_ImportedMesh = firstMesh;
+
+  return Result::Application(0);
+}
+
+void DestroyVkMeshArena()
+{
+  g_ImportedMesh = (uint32_t)-1;
+  g_ImportedMeshlets = MeshletData();
+  UnregisterMovableBuffer(&g_MeshArenaBuffer);
+  RetireBuffer(g_MeshArenaBuffer, g_MeshArenaAllocation);
+  g_MeshArenaBuffer = VK_NULL_HANDLE;
+  g_MeshArenaAllocation = VK_NULL_HANDLE;
+}
+
+// Instance data (per-instance model matrices, written to the frame scratch)
+static ScratchRegion g_InstanceData[MAX_FRAMES_IN_FLIGHT];
+static VkDeviceSize g_InstanceDataSizes[MAX_FRAMES_IN_FLIGHT];
+static std::vector<glm::mat4x4> g_InstanceTransforms;
+
+// Render data extracted from the entities each frame,
+// g_RenderObjects[i] is drawn with g_InstanceTransforms[i]
+struct RenderObject
+{
+  uint32_t mesh;
+  uint32_t material;
+};
+static std::vector<RenderObject> g_RenderObjects;
+// World space bounds of g_RenderObjects[i]
+static std::vector<Aabb> g_RenderObjectBounds;
+
+// Render objects inside the view frustum, queried from g_SceneBvh
+static Bvh g_SceneBvh;
+static std::vector<uint32_t> g_VisibleObjects;
+
+// Render objects sorted by state, instance data is written in this order
+static DrawList g_DrawList;
+// Level of detail drawn for g_RenderObjects[i], kept between frames for hysteresis
+static std::vector<uint8_t> g_RenderObjectLods;
+static uint32_t g_NumDrawTriangles;
+
+void InitInstanceData()
+{
+  g_InstanceTransforms.assign(g_Options.numInstances, glm::identity<glm::mat4x4>());
+}
+
+void DestroyInstanceData()
+{
+  g_InstanceTransforms.clear();
+}
+
+// The frame's scratch must have been reset
+Result WriteInstanceData(uint32_t frame)
+{
+  const uint32_t* items = g_DrawList.GetItems();
+  uint32_t count = g_DrawList.GetCount();
+  g_InstanceDataSizes[frame] = glm::max(count, 1u) * sizeof(glm::mat4x4);
+  RETURN_IF_FAILURE(g_FrameScratch[frame].Allocate(g_InstanceDataSizes[frame], &g_InstanceData[frame]), "FrameScratchAllocator::Allocate");
+
+  glm::mat4x4* instances = (glm::mat4x4*)g_InstanceData[frame].data;
+  for (uint32_t i = 0; i < count; i++)
+  {
+    const Mesh& mesh = g_Meshes[g_RenderObjects[items[i]].mesh];
+    instances[i] = mesh.quantized ? g_InstanceTransforms[items[i]] * mesh.dequantize : g_InstanceTransforms[items[i]];
+  }
+  return Result::Application(0);
+}
+
+// Depth pyramid
+// Meshlet culling tests against the previous frame's depth, reduced to a
+// pyramid of ever coarser levels whose texels hold the farthest depth of the
+// texels they cover. Level 0 halves the depth, rounding up, each further
+// level halves the one before down to a single texel, and all of them are
+// packed into one storage buffer. The pyramid is built at the end of each
+// frame on the queue culling runs on, so the next frame's culling finds it
+// done without waiting on another queue, and projects into it with the
+// view-projection it was built with. The next frame's main pass clears the
+// depth the build samples only after waiting for that frame's culling,
+// which the queue runs after the build. Meshlets coming into view from
+// behind others show up a frame late.
+static const uint32_t MAX_DEPTH_PYRAMID_LEVELS = 16;
+
+static VkSampler g_DepthPyramidSampler;
+static VkPipeline g_DepthPyramidPipeline;
+// The buffer is recreated with the swapchain, offsets are in texels
+static VkBuffer g_DepthPyramidBuffer;
+static VmaAllocation g_DepthPyramidAllocation;
+static VkExtent2D g_DepthPyramidDepthExtent;
+static uint32_t g_DepthPyramidLevels;
+static uint32_t g_DepthPyramidLevelOffsets[MAX_DEPTH_PYRAMID_LEVELS];
+static VkExtent2D g_DepthPyramidLevelExtents[MAX_DEPTH_PYRAMID_LEVELS];
+// Whether the buffer holds a pyramid yet, and the model space
+// view-projection of the frame it was built from
+static bool g_DepthPyramidBuilt;
+static glm::mat4x4 g_DepthPyramidViewProjection;
+
+// The render graph's depth image, which the build samples
+static uint32_t g_DepthResource = RENDER_GRAPH_NONE;
+static VkDescriptorSet g_DepthPyramidDescriptorSets[MAX_FRAMES_IN_FLIGHT];
+
+Result InitVkDepthPyramidBuffer()
+{
+  if (!g_Options.meshlets)
+  {
+    return Result::Application(0);
   }
 
+  g_DepthPyramidDepthExtent = g_SwapchainExtent;
+  VkExtent2D extent = g_SwapchainExtent;
+  uint32_t numTexels = 0;
+  g_DepthPyramidLevels = 0;
+  do
+  {
+    extent = { (extent.width + 1) / 2, (extent.height + 1) / 2 };
+    g_DepthPyramidLevelOffsets[g_DepthPyramidLevels] = numTexels;
+    g_DepthPyramidLevelExtents[g_DepthPyramidLevels] = extent;
+    numTexels += extent.width * extent.height;
+    g_DepthPyramidLevels++;
+  } while ((extent.width > 1 || extent.height > 1) && g_DepthPyramidLevels < MAX_DEPTH_PYRAMID_LEVELS);
+
+  VkBufferCreateInfo bufferCI = {};
+  bufferCI.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+  bufferCI.size = numTexels * sizeof(float);
+  bufferCI.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+  bufferCI.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+  VmaAllocationCreateInfo allocCI = {};
+  allocCI.usage = VMA_MEMORY_USAGE_GPU_ONLY;
+
+  RETURN_IF_FAILURE(Result::Vulkan(
+    vmaCreateBuffer(g_Allocator, &bufferCI, &allocCI, &g_DepthPyramidBuffer, &g_DepthPyramidAllocation, nullptr)),
+    "vmaCreateBuffer");
+  g_DepthPyramidBuilt = false;
+
+  return Result::Application(0);
+}
+
+void DestroyVkDepthPyramidBuffer()
+{
+  if (g_DepthPyramidBuffer != VK_NULL_HANDLE)
+  {
+    RetireBuffer(g_DepthPyramidBuffer, g_DepthPyramidAllocation);
+    g_DepthPyramidBuffer = VK_NULL_HANDLE;
+    g_DepthPyramidAllocation = VK_NULL_HANDLE;
+  }
+  g_DepthPyramidBuilt = false;
+}
+
+Result InitVkDepthPyramid()
+{
+  if (!g_Options.meshlets)
+  {
+    return Result::Application(0);
+  }
+
+  // Only read with texelFetch
+  VkSamplerCreateInfo samplerCI = {};
+  samplerCI.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+  samplerCI.magFilter = VK_FILTER_NEAREST;
+  samplerCI.minFilter = VK_FILTER_NEAREST;
+  samplerCI.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+  samplerCI.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  samplerCI.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  samplerCI.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  RETURN_IF_FAILURE(Result::Vulkan(
+    vkCreateSampler(g_Device, &samplerCI, nullptr, &g_DepthPyramidSampler)),
+    "vkCreateSampler");
+
+  VkPipelineShaderStageCreateInfo shaderStageCI = {};
+  shaderStageCI.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+  shaderStageCI.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+  shaderStageCI.module = g_DepthPyramidShaderComp;
+  shaderStageCI.pName = "main";
+
+  VkComputePipelineCreateInfo pipelineCI = {};
+  pipelineCI.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+  pipelineCI.stage = shaderStageCI;
+  pipelineCI.layout = g_DepthPyramidPipelineLayout;
+
+  RETURN_IF_FAILURE(Result::Vulkan(
+    vkCreateComputePipelines(g_Device, g_PipelineCache, 1, &pipelineCI, nullptr, &g_DepthPyramidPipeline)),
+    "vkCreateComputePipelines");
+
+  return InitVkDepthPyramidBuffer();
+}
+
+void DestroyVkDepthPyramid()
+{
+  DestroyVkDepthPyramidBuffer();
+  if (g_DepthPyramidPipeline != VK_NULL_HANDLE)
+  {
+    RetirePipeline(g_DepthPyramidPipeline);
+    g_DepthPyramidPipeline = VK_NULL_HANDLE;
+  }
+  if (g_DepthPyramidSampler != VK_NULL_HANDLE)
+  {
+    vkDestroySampler(g_Device, g_DepthPyramidSampler, nullptr);
+    g_DepthPyramidSampler = VK_NULL_HANDLE;
+  }
+}
+
+// Written once the swapchain image is acquired, the depth's view changes
+// when the swapchain is recreated
+Result WriteDepthPyramidDescriptorSet(uint32_t frame)
+{
+  RETURN_IF_FAILURE(g_FrameDescriptorAllocators[frame].Allocate(
+    g_DepthPyramidDescriptorSetLayout, &g_DepthPyramidDescriptorSets[frame]),
+    "DescriptorAllocator::Allocate");
+
+  VkDescriptorImageInfo imageInfo = {};
+  imageInfo.sampler = g_DepthPyramidSampler;
+  imageInfo.imageView = g_RenderGraph.GetImageView(g_DepthResource, 0);
+  imageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+
+  VkDescriptorBufferInfo bufferInfo = { g_DepthPyramidBuffer, 0, VK_WHOLE_SIZE };
+
+  VkWriteDescriptorSet writeSets[2] = {};
+  for (uint32_t i = 0; i < 2; i++)
+  {
+    writeSets[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    writeSets[i].dstSet = g_DepthPyramidDescriptorSets[frame];
+    writeSets[i].dstBinding = i;
+    writeSets[i].descriptorCount = 1;
+  }
+  writeSets[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+  writeSets[0].pImageInfo = &imageInfo;
+  writeSets[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+  writeSets[1].pBufferInfo = &bufferInfo;
+  vkUpdateDescriptorSets(g_Device, 2, writeSets, 0, nullptr);
+
   return Result::Application(0);
 }
 
-void DestroyVkSwapchainFramebuffers()
+// One dispatch per level, reading the one before. The render graph makes
+// the last level visible to the next frame's culling.
+void RecordDepthPyramid(VkCommandBuffer commandBuffer, uint32_t frame)
 {
-  for (auto framebuffer : g_SwapchainFramebuffers)
+  vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, g_DepthPyramidPipeline);
+  vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, g_DepthPyramidPipelineLayout, 0, 1, &g_DepthPyramidDescriptorSets[frame], 0, nullptr);
+  for (uint32_t level = 0; level < g_DepthPyramidLevels; level++)
   {
-    if (framebuffer != VK_NULL_HANDLE)
+    if (level > 0)
     {
-      vkDestroyFramebuffer(g_Device, framebuffer, nullptr);
+      VkMemoryBarrier barrier = {};
+      barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+      barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+      barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+      vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+                           1, &barrier, 0, nullptr, 0, nullptr);
     }
+
+    VkExtent2D src = level > 0 ? g_DepthPyramidLevelExtents[level - 1] : g_DepthPyramidDepthExtent;
+    VkExtent2D dst = g_DepthPyramidLevelExtents[level];
+    DepthPyramidPushConstants pushConstants = {};
+    pushConstants.srcOffset = level > 0 ? g_DepthPyramidLevelOffsets[level - 1] : 0;
+    pushConstants.dstOffset = g_DepthPyramidLevelOffsets[level];
+    pushConstants.srcWidth = src.width;
+    pushConstants.srcHeight = src.height;
+    pushConstants.dstWidth = dst.width;
+    pushConstants.dstHeight = dst.height;
+    pushConstants.fromDepth = level == 0 ? 1 : 0;
+    vkCmdPushConstants(commandBuffer, g_DepthPyramidPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(pushConstants), &pushConstants);
+    vkCmdDispatch(commandBuffer, (dst.width + 7) / 8, (dst.height + 7) / 8, 1);
   }
-  g_SwapchainFramebuffers.clear();
+
+  g_DepthPyramidViewProjection = g_UniformBuffer.proj * g_UniformBuffer.view * g_UniformBuffer.model;
+  g_DepthPyramidBuilt = true;
 }
 
-// Pipelines
-static VkPipeline g_GraphicsPipeline;
+// Meshlet culling
+// Objects drawing the imported mesh are culled per meshlet against the frustum,
+// their normal cones and the depth pyramid by a compute pass. It appends the
+// surviving meshlets' triangles to a per-frame index buffer, which a single
+// indirect draw renders. The buffer holds every meshlet of as many draws as
+// fit, so no surviving meshlet is ever dropped, and the draws past that are
+// drawn as usual. It is sized for the clusters of MAX_VISIBLE_CLUSTERS, or of
+// a single draw if the mesh has more meshlets than that.
+static const uint32_t MAX_VISIBLE_CLUSTERS = 8192;
+// Dispatched along y, which only guarantees 65535 workgroups
+static const uint32_t MAX_MESHLET_DRAWS = 65535;
+// Clusters each frame's region of the cluster buffer holds, and the meshlet
+// draws per frame whose meshlets are sure to fit
+static uint32_t g_MaxVisibleClusters;
+static uint32_t g_MaxMeshletDraws;
+
+// Matches the DrawCommand block of MeshletCull.comp: the indirect draw, the
+// clusters written, and the depth pyramid to test against if it has levels.
+// Written by each frame's reset.
+struct MeshletDrawCommand
+{
+  VkDrawIndexedIndirectCommand command;
+  uint32_t clusterCount;
+  uint32_t depthWidth;
+  uint32_t depthHeight;
+  uint32_t depthPyramidLevels;
+  alignas(16) glm::mat4x4 depthViewProjection;
+};
 
-Result InitVkGraphicsPipeline()
+static VkPipeline g_MeshletCullPipeline;
+static VkBuffer g_MeshletBuffer;
+static VmaAllocation g_MeshletBufferAllocation;
+static VkDeviceSize g_MeshletVerticesOffset;
+static VkDeviceSize g_MeshletTrianglesOffset;
+static uint32_t g_NumMeshlets;
+
+// Draw command, clusters and indices of each frame in flight
+static VkBuffer g_ClusterBuffer;
+static VmaAllocation g_ClusterBufferAllocation;
+static VkDeviceSize g_ClusterBufferFrameSize;
+static VkDeviceSize g_ClusterBufferClustersOffset;
+static VkDeviceSize g_ClusterBufferIndicesOffset;
+
+// Meshlet draws sort last, g_DrawList items from g_MeshletDrawFirst on
+static uint32_t g_MeshletDrawFirst;
+static uint32_t g_MeshletDrawCount;
+
+static VkDescriptorSet g_MeshletDescriptorSets[MAX_FRAMES_IN_FLIGHT];
+
+// Culling may run on the compute queue while the draws read its results on
+// the graphics queue, each frame in its own region of the buffers. Sharing
+// them between the families saves the render graph an ownership transfer
+// each way per frame. The family list is static, so the create info stays
+// valid after the call.
+void ShareWithComputeQueue(VkBufferCreateInfo& bufferCI)
 {
-  VkPipelineShaderStageCreateInfo shaderStageCIs[2];
-  shaderStageCIs[0] = {};
-  shaderStageCIs[0].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-  shaderStageCIs[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
-  shaderStageCIs[0].module = g_TriangleShaderVert;
-  shaderStageCIs[0].pName = "main";
-  shaderStageCIs[1] = {};
-  shaderStageCIs[1].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-  shaderStageCIs[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
-  shaderStageCIs[1].module = g_TriangleShaderFrag;
-  shaderStageCIs[1].pName = "main";
+  static uint32_t queueFamilies[3];
+  uint32_t numQueueFamilies = 0;
+  for (uint32_t family : { g_GraphicsQueueFamily, g_ComputeQueueFamily, g_TransferQueueFamily })
+  {
+    if (std::find(queueFamilies, queueFamilies + numQueueFamilies, family) == queueFamilies + numQueueFamilies)
+    {
+      queueFamilies[numQueueFamilies++] = family;
+    }
+  }
+  if (numQueueFamilies > 1)
+  {
+    bufferCI.sharingMode = VK_SHARING_MODE_CONCURRENT;
+    bufferCI.queueFamilyIndexCount = numQueueFamilies;
+    bufferCI.pQueueFamilyIndices = queueFamilies;
+  }
+}
 
-  VkVertexInputAttributeDescription vertexAttributeDescs[2];
-  vertexAttributeDescs[0] = {};
-  vertexAttributeDescs[0].binding = 0;
-  vertexAttributeDescs[0].location = 0;
-  vertexAttributeDescs[0].offset = offsetof(Vertex, pos);
-  vertexAttributeDescs[0].format = VK_FORMAT_R32G32_SFLOAT;
-  vertexAttributeDescs[1] = {};
-  vertexAttributeDescs[1].binding = 0;
-  vertexAttributeDescs[1].location = 1;
-  vertexAttributeDescs[1].offset = offsetof(Vertex, color);
-  vertexAttributeDescs[1].format = VK_FORMAT_R32G32B32_SFLOAT;
-
-  VkVertexInputBindingDescription vertexBindingDesc = {};
-  vertexBindingDesc.binding = 0;
-  vertexBindingDesc.stride = sizeof(Vertex);
-  vertexBindingDesc.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+Result InitVkMeshletCulling()
+{
+  if (!g_Options.meshlets)
+  {
+    return Result::Application(0);
+  }
 
-  VkPipelineVertexInputStateCreateInfo vertexInputStateCI = {};
-  vertexInputStateCI.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-  vertexInputStateCI.vertexAttributeDescriptionCount = 2;
-  vertexInputStateCI.pVertexAttributeDescriptions = vertexAttributeDescs;
-  vertexInputStateCI.vertexBindingDescriptionCount = 1;
-  vertexInputStateCI.pVertexBindingDescriptions = &vertexBindingDesc;
+  VkPhysicalDeviceProperties deviceProperties;
+  vkGetPhysicalDeviceProperties(g_PhysicalDevice, &deviceProperties);
+  VkDeviceSize alignment = deviceProperties.limits.minStorageBufferOffsetAlignment;
+
+  // Meshlets, their vertices and their triangles
+  const MeshletData& data = g_ImportedMeshlets;
+  g_NumMeshlets = (uint32_t)data.meshlets.size();
+  VkDeviceSize meshletsSize = data.meshlets.size() * sizeof(Meshlet);
+  VkDeviceSize verticesSize = data.vertices.size() * sizeof(uint32_t);
+  VkDeviceSize trianglesSize = data.triangles.size() * sizeof(uint32_t);
+  uint32_t numMeshletTriangles = (uint32_t)data.triangles.size();
+  g_MeshletVerticesOffset = AlignUp(meshletsSize, alignment);
+  g_MeshletTrianglesOffset = AlignUp(g_MeshletVerticesOffset + verticesSize, alignment);
+  VkDeviceSize bufferSize = g_MeshletTrianglesOffset + trianglesSize;
+  {
+    VkBufferCreateInfo bufferCI = {};
+    bufferCI.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    bufferCI.size = bufferSize;
+    bufferCI.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    bufferCI.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    ShareWithComputeQueue(bufferCI);
 
-  VkPipelineInputAssemblyStateCreateInfo inputAssemblyStateCI = {};
-  inputAssemblyStateCI.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
-  inputAssemblyStateCI.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+    VmaAllocationCreateInfo allocCI = {};
+    allocCI.usage = VMA_MEMORY_USAGE_GPU_ONLY;
+    bool movable = PrepareMovableBuffer(bufferCI, allocCI);
 
-  VkViewport viewport = {};
-  viewport.x = 0;
-  viewport.y = 0;
-  viewport.width = (float)g_SwapchainExtent.width;
-  viewport.height = (float)g_SwapchainExtent.height;
+    RETURN_IF_FAILURE(Result::Vulkan(
+      vmaCreateBuffer(g_Allocator, &bufferCI, &allocCI, &g_MeshletBuffer, &g_MeshletBufferAllocation, nullptr)),
+      "vmaCreateBuffer");
+    // Held only by the per-frame meshlet sets and command buffers, which are rewritten anyway
+    if (movable)
+    {
+      RegisterMovableBuffer(&g_MeshletBuffer, g_MeshletBufferAllocation, bufferCI, nullptr);
+    }
+  }
 
-  VkRect2D scissor = {};
-  scissor.offset.x = 0;
-  scissor.offset.y = 0;
-  scissor.extent = g_SwapchainExtent;
+  RETURN_IF_FAILURE(UploadToBuffer(g_MeshletBuffer, 0, data.meshlets.data(), meshletsSize), "UploadToBuffer");
+  RETURN_IF_FAILURE(UploadToBuffer(g_MeshletBuffer, g_MeshletVerticesOffset, data.vertices.data(), verticesSize), "UploadToBuffer");
+  RETURN_IF_FAILURE(UploadToBuffer(g_MeshletBuffer, g_MeshletTrianglesOffset, data.triangles.data(), trianglesSize), "UploadToBuffer");
+  g_ImportedMeshlets = MeshletData();
+
+  // Every meshlet of every instance as far as the cap allows, but at least
+  // one instance's. The indices of a draw are those of all its meshlets.
+  uint32_t numInstances = glm::max((uint32_t)g_InstanceTransforms.size(), 1u);
+  g_MaxMeshletDraws = g_NumMeshlets > 0 ? glm::clamp(MAX_VISIBLE_CLUSTERS / g_NumMeshlets, 1u, MAX_MESHLET_DRAWS) : 0;
+  g_MaxMeshletDraws = glm::min(g_MaxMeshletDraws, numInstances);
+  g_MaxVisibleClusters = glm::max(g_MaxMeshletDraws * g_NumMeshlets, 1u);
+  VkDeviceSize indicesSize = glm::max((VkDeviceSize)g_MaxMeshletDraws * numMeshletTriangles * 3 * sizeof(uint32_t), (VkDeviceSize)sizeof(uint32_t));
+  RETURN_IF_FAILURE(Result::Application(
+    indicesSize > deviceProperties.limits.maxStorageBufferRange || (uint64_t)g_MaxVisibleClusters << 6 > UINT32_MAX ? 1 : 0),
+    "The imported mesh has too many meshlets for the cluster buffer");
+  if (g_NumMeshlets > 0 && g_MaxMeshletDraws < g_InstanceTransforms.size())
+  {
+    printf("Meshlet culling: %u of %u instances fit, the others draw as usual\n",
+           g_MaxMeshletDraws, (uint32_t)g_InstanceTransforms.size());
+  }
 
-  VkPipelineViewportStateCreateInfo viewportStateCI = {};
-  viewportStateCI.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
-  viewportStateCI.viewportCount = 1;
-  viewportStateCI.pViewports = &viewport;
-  viewportStateCI.scissorCount = 1;
-  viewportStateCI.pScissors = &scissor;
+  // Per frame: the indirect draw command, the visible clusters and their indices
+  g_ClusterBufferClustersOffset = AlignUp(sizeof(MeshletDrawCommand), alignment);
+  g_ClusterBufferIndicesOffset = AlignUp(g_ClusterBufferClustersOffset + (VkDeviceSize)g_MaxVisibleClusters * 2 * sizeof(uint32_t), alignment);
+  g_ClusterBufferFrameSize = AlignUp(g_ClusterBufferIndicesOffset + indicesSize, alignment);
+  {
+    VkBufferCreateInfo bufferCI = {};
+    bufferCI.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    bufferCI.size = g_ClusterBufferFrameSize * g_FramesInFlight;
+    bufferCI.usage = VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
+      | VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    bufferCI.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    ShareWithComputeQueue(bufferCI);
 
-  VkPipelineRasterizationStateCreateInfo rasterizationStateCI = {};
-  rasterizationStateCI.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
-  rasterizationStateCI.rasterizerDiscardEnable = VK_FALSE;
-  rasterizationStateCI.polygonMode = VK_POLYGON_MODE_FILL;
-  rasterizationStateCI.cullMode = VK_CULL_MODE_BACK_BIT;
-  rasterizationStateCI.frontFace = VK_FRONT_FACE_CLOCKWISE;
-  rasterizationStateCI.depthBiasEnable = VK_FALSE;
-  rasterizationStateCI.lineWidth = 1.0f;
+    VmaAllocationCreateInfo allocCI = {};
+    allocCI.usage = VMA_MEMORY_USAGE_GPU_ONLY;
+    bool movable = PrepareMovableBuffer(bufferCI, allocCI);
 
-  VkPipelineMultisampleStateCreateInfo multisampleStateCI = {};
-  multisampleStateCI.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
-  multisampleStateCI.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+    RETURN_IF_FAILURE(Result::Vulkan(
+      vmaCreateBuffer(g_Allocator, &bufferCI, &allocCI, &g_ClusterBuffer, &g_ClusterBufferAllocation, nullptr)),
+      "vmaCreateBuffer");
+    if (movable)
+    {
+      RegisterMovableBuffer(&g_ClusterBuffer, g_ClusterBufferAllocation, bufferCI, nullptr);
+    }
+  }
 
-  VkPipelineDepthStencilStateCreateInfo depthStencilStateCI = {};
-  depthStencilStateCI.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
-  depthStencilStateCI.depthTestEnable = VK_FALSE;
-  depthStencilStateCI.stencilTestEnable = VK_FALSE;
-  depthStencilStateCI.minDepthBounds = 0.0f;
-  depthStencilStateCI.maxDepthBounds = 1.0f;
+  VkPipelineShaderStageCreateInfo shaderStageCI = {};
+  shaderStageCI.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+  shaderStageCI.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+  shaderStageCI.module = g_MeshletCullShaderComp;
+  shaderStageCI.pName = "main";
 
-  VkPipelineColorBlendAttachmentState colorBlendAttachment = {};
-  colorBlendAttachment.blendEnable = VK_TRUE;
-  colorBlendAttachment.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
-  colorBlendAttachment.colorBlendOp = VK_BLEND_OP_ADD;
-  colorBlendAttachment.srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
-  colorBlendAttachment.dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
-  colorBlendAttachment.alphaBlendOp = VK_BLEND_OP_ADD;
-  colorBlendAttachment.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
-  colorBlendAttachment.dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
+  VkComputePipelineCreateInfo pipelineCI = {};
+  pipelineCI.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+  pipelineCI.stage = shaderStageCI;
+  pipelineCI.layout = g_MeshletPipelineLayout;
 
-  VkPipelineColorBlendStateCreateInfo colorBlendStateCI = {};
-  colorBlendStateCI.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
-  colorBlendStateCI.logicOpEnable = VK_FALSE;
-  colorBlendStateCI.attachmentCount = 1;
-  colorBlendStateCI.pAttachments = &colorBlendAttachment;
+  RETURN_IF_FAILURE(Result::Vulkan(
+    vkCreateComputePipelines(g_Device, g_PipelineCache, 1, &pipelineCI, nullptr, &g_MeshletCullPipeline)),
+    "vkCreateComputePipelines");
 
-  VkDynamicState dynamicState = VK_DYNAMIC_STATE_VIEWPORT;
+  return Result::Application(0);
+}
 
-  VkPipelineDynamicStateCreateInfo dynamicStateCI = {};
-  dynamicStateCI.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
-  dynamicStateCI.dynamicStateCount = 1;
-  dynamicStateCI.pDynamicStates = &dynamicState;
+void DestroyVkMeshletCulling()
+{
+  if (g_MeshletCullPipeline != VK_NULL_HANDLE)
+  {
+    RetirePipeline(g_MeshletCullPipeline);
+    g_MeshletCullPipeline = VK_NULL_HANDLE;
+  }
+  UnregisterMovableBuffer(&g_ClusterBuffer);
+  RetireBuffer(g_ClusterBuffer, g_ClusterBufferAllocation);
+  g_ClusterBuffer = VK_NULL_HANDLE;
+  g_ClusterBufferAllocation = VK_NULL_HANDLE;
+  UnregisterMovableBuffer(&g_MeshletBuffer);
+  RetireBuffer(g_MeshletBuffer, g_MeshletBufferAllocation);
+  g_MeshletBuffer = VK_NULL_HANDLE;
+  g_MeshletBufferAllocation = VK_NULL_HANDLE;
+  g_NumMeshlets = 0;
+  g_MaxMeshletDraws = 0;
+}
 
-  VkGraphicsPipelineCreateInfo pipelineCI = {};
-  pipelineCI.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
-  pipelineCI.stageCount = 2;
-  pipelineCI.pStages = shaderStageCIs;
-  pipelineCI.pVertexInputState = &vertexInputStateCI;
-  pipelineCI.pInputAssemblyState = &inputAssemblyStateCI;
-  pipelineCI.pTessellationState = nullptr;
-  pipelineCI.pViewportState = &viewportStateCI;
-  pipelineCI.pRasterizationState = &rasterizationStateCI;
-  pipelineCI.pMultisampleState = &multisampleStateCI;
-  pipelineCI.pDepthStencilState = &depthStencilStateCI;
-  pipelineCI.pColorBlendState = &colorBlendStateCI;
-  pipelineCI.pDynamicState = &dynamicStateCI;
-  pipelineCI.layout = g_PipelineLayout;
-  pipelineCI.renderPass = g_RenderPass;
-  pipelineCI.subpass = 0;
+// Meshlet set of the current frame, allocated from the frame's allocator
+Result WriteMeshletDescriptorSet(uint32_t frame)
+{
+  RETURN_IF_FAILURE(g_FrameDescriptorAllocators[frame].Allocate(
+    g_MeshletDescriptorSetLayout, &g_MeshletDescriptorSets[frame]),
+    "DescriptorAllocator::Allocate");
+
+  VkDeviceSize clusterFrameOffset = frame * g_ClusterBufferFrameSize;
+  const Mesh& mesh = g_Meshes[g_ImportedMesh];
+  VkDescriptorBufferInfo bufferInfos[NUM_MESHLET_BINDINGS] = {
+    { g_FrameUniforms[frame].buffer, g_FrameUniforms[frame].offset, sizeof(g_UniformBuffer) },
+    { mesh.buffer, mesh.streamOffsets[0], mesh.streamOffsets[1] - mesh.streamOffsets[0] },
+    { g_MeshletBuffer, 0, g_NumMeshlets * sizeof(Meshlet) },
+    { g_MeshletBuffer, g_MeshletVerticesOffset, g_MeshletTrianglesOffset - g_MeshletVerticesOffset },
+    { g_MeshletBuffer, g_MeshletTrianglesOffset, VK_WHOLE_SIZE },
+    { g_InstanceData[frame].buffer, g_InstanceData[frame].offset, g_InstanceDataSizes[frame] },
+    { g_ClusterBuffer, clusterFrameOffset, sizeof(MeshletDrawCommand) },
+    { g_ClusterBuffer, clusterFrameOffset + g_ClusterBufferClustersOffset, g_ClusterBufferIndicesOffset - g_ClusterBufferClustersOffset },
+    { g_ClusterBuffer, clusterFrameOffset + g_ClusterBufferIndicesOffset, g_ClusterBufferFrameSize - g_ClusterBufferIndicesOffset },
+    { mesh.buffer, mesh.streamOffsets[1], mesh.indexOffset - mesh.streamOffsets[1] },
+    { g_DepthPyramidBuffer, 0, VK_WHOLE_SIZE } };
+
+  VkWriteDescriptorSet writeSets[NUM_MESHLET_BINDINGS];
+  for (uint32_t i = 0; i < NUM_MESHLET_BINDINGS; i++)
+  {
+    writeSets[i] = {};
+    writeSets[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    writeSets[i].dstSet = g_MeshletDescriptorSets[frame];
+    writeSets[i].dstBinding = i;
+    writeSets[i].descriptorCount = 1;
+    writeSets[i].descriptorType = i == 0 ? VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER : VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    writeSets[i].pBufferInfo = &bufferInfos[i];
+  }
+  vkUpdateDescriptorSets(g_Device, NUM_MESHLET_BINDINGS, writeSets, 0, nullptr);
+
+  return Result::Application(0);
+}
+
+// Resets the frame's draw command and culls the meshlets of all meshlet draws,
+// recorded outside the render pass
+// Both run as render graph passes, which also does the barriers around them
+void RecordMeshletReset(VkCommandBuffer commandBuffer, uint32_t frame)
+{
+  if (g_MeshletDrawCount == 0)
+  {
+    return;
+  }
+  MeshletDrawCommand resetCommand = {};
+  resetCommand.command.instanceCount = 1;
+  if (g_DepthPyramidBuilt)
+  {
+    resetCommand.depthWidth = g_DepthPyramidDepthExtent.width;
+    resetCommand.depthHeight = g_DepthPyramidDepthExtent.height;
+    resetCommand.depthPyramidLevels = g_DepthPyramidLevels;
+    resetCommand.depthViewProjection = g_DepthPyramidViewProjection;
+  }
+  vkCmdUpdateBuffer(commandBuffer, g_ClusterBuffer, frame * g_ClusterBufferFrameSize, sizeof(resetCommand), &resetCommand);
+}
+
+void RecordMeshletCulling(VkCommandBuffer commandBuffer, uint32_t frame)
+{
+  if (g_MeshletDrawCount == 0)
+  {
+    return;
+  }
+
+  // Instances are placed relative to the model matrix, so culling happens in model space
+  glm::mat4x4 viewModel = g_UniformBuffer.view * g_UniformBuffer.model;
+  Frustum frustum = MakeFrustum(g_UniformBuffer.proj * viewModel);
+  MeshletCullPushConstants pushConstants = {};
+  memcpy(pushConstants.frustumPlanes, frustum.planes, sizeof(frustum.planes));
+  pushConstants.cameraPosition = glm::vec3(glm::inverse(viewModel)[3]);
+  pushConstants.instanceBase = g_MeshletDrawFirst;
+  pushConstants.numInstances = g_MeshletDrawCount;
+  pushConstants.numMeshlets = g_NumMeshlets;
+  pushConstants.maxClusters = g_MaxVisibleClusters;
+
+  vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, g_MeshletCullPipeline);
+  vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, g_MeshletPipelineLayout, 0, 1, &g_MeshletDescriptorSets[frame], 0, nullptr);
+  vkCmdPushConstants(commandBuffer, g_MeshletPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(pushConstants), &pushConstants);
+  vkCmdDispatch(commandBuffer, (g_NumMeshlets + 63) / 64, g_MeshletDrawCount, 1);
+}
+
+// Frame synchronization
+// A frame slot's resources are reused once the frame last submitted with it
+// is done, which the render graph's timeline values tell where timeline
+// semaphores are supported and a fence per slot tells otherwise. The
+// swapchain only works with binary semaphores, so acquire and present keep
+// theirs either way.
+static std::vector<VkSemaphore> g_ImageAvailableSemaphores;
+static std::vector<VkSemaphore> g_RenderFinishedSemaphores;
+static std::vector<VkFence> g_GraphicsCommandBufferIsUsedFences;
+
+Result InitVkSemaphoresAndFences()
+{
+  VkSemaphoreCreateInfo semaphoreCI = {};
+  semaphoreCI.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+
+  g_ImageAvailableSemaphores.resize(g_FramesInFlight);
+  g_RenderFinishedSemaphores.resize(g_FramesInFlight);
+
+  for (uint32_t i = 0; i < g_FramesInFlight; i++)
+  {
+    RETURN_IF_FAILURE(Result::Vulkan(
+      vkCreateSemaphore(g_Device, &semaphoreCI, nullptr, &g_ImageAvailableSemaphores[i])),
+      "");
+    RETURN_IF_FAILURE(Result::Vulkan(
+      vkCreateSemaphore(g_Device, &semaphoreCI, nullptr, &g_RenderFinishedSemaphores[i])),
+      "");
+  }
+
+  if (!g_TimelineSemaphoresEnabled)
+  {
+    g_GraphicsCommandBufferIsUsedFences.resize(g_FramesInFlight);
+
+    VkFenceCreateInfo fenceCI = {};
+    fenceCI.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    fenceCI.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+
+    for (uint32_t i = 0; i < g_FramesInFlight; i++)
+    {
+      RETURN_IF_FAILURE(Result::Vulkan(
+        vkCreateFence(g_Device, &fenceCI, nullptr, &g_GraphicsCommandBufferIsUsedFences[i])),
+        "vkCreateFence");
+    }
+  }
+
+  // Between the render graph's batches
+  RETURN_IF_FAILURE(g_RenderGraph.CreateSemaphores(g_FramesInFlight), "RenderGraph::CreateSemaphores");
+
+  return Result::Application(0);
+}
+
+void DestroyVkSemaphoresAndFences()
+{
+  for (VkFence fence : g_GraphicsCommandBufferIsUsedFences)
+  {
+    if (fence != VK_NULL_HANDLE)
+    {
+      vkDestroyFence(g_Device, fence, nullptr);
+    }
+  }
+  g_GraphicsCommandBufferIsUsedFences.clear();
+
+  for (VkSemaphore semaphore : g_ImageAvailableSemaphores)
+  {
+    if (semaphore != VK_NULL_HANDLE)
+    {
+      vkDestroySemaphore(g_Device, semaphore, nullptr);
+    }
+  }
+  g_ImageAvailableSemaphores.clear();
+
+  for (VkSemaphore semaphore : g_RenderFinishedSemaphores)
+  {
+    if (semaphore != VK_NULL_HANDLE)
+    {
+      vkDestroySemaphore(g_Device, semaphore, nullptr);
+    }
+  }
+  g_RenderFinishedSemaphores.clear();
+
+  g_RenderGraph.DestroySemaphores();
+}
+
+// Whether everything last submitted with the frame slot has completed
+bool IsFrameSlotIdle(uint32_t frame)
+{
+  if (g_TimelineSemaphoresEnabled)
+  {
+    return g_RenderGraph.IsFrameComplete(frame);
+  }
+  return vkGetFenceStatus(g_Device, g_GraphicsCommandBufferIsUsedFences[frame]) == VK_SUCCESS;
+}
 
+Result WaitForFrameSlot(uint32_t frame)
+{
+  if (g_TimelineSemaphoresEnabled)
+  {
+    return g_RenderGraph.WaitForFrame(frame);
+  }
   RETURN_IF_FAILURE(Result::Vulkan(
-    vkCreateGraphicsPipelines(g_Device, g_PipelineCache, 1, &pipelineCI, nullptr, &g_GraphicsPipeline)),
-    "vkCreateGraphicsPipelines");
-
+    vkWaitForFences(g_Device, 1, &g_GraphicsCommandBufferIsUsedFences[frame], VK_TRUE, (uint64_t)-1)),
+    "vkWaitForFences");
   return Result::Application(0);
 }
 
-void DestroyVkGraphicsPipeline()
+// Defragmentation steps
+// Steps start every DEFRAG_STEP_INTERVAL frames, with the per-frame budget
+// times the frames since the last one, and only while the movable buffer
+// pool's free space is split up. A step's later phases are checked for
+// every frame, without waiting on the GPU.
+static const uint32_t DEFRAG_STEP_INTERVAL = 30;
+static const float DEFRAG_FRAGMENTATION_THRESHOLD = 0.1f;
+
+static uint32_t g_FramesSinceDefragStep = 0;
+
+// Called once the current frame's fence has signaled, before the frame is numbered
+Result UpdateDefragmentation()
 {
-  if (g_GraphicsPipeline != VK_NULL_HANDLE)
+  if (g_MovableBufferPool == VK_NULL_HANDLE)
+  {
+    return Result::Application(0);
+  }
+
+  uint64_t start = SDL_GetPerformanceCounter();
+  DefragStep& step = g_DefragStep;
+  if (step.context != VK_NULL_HANDLE)
+  {
+    if (!step.copiesDone)
+    {
+      VkResult fenceStatus = vkGetFenceStatus(g_Device, g_DefragFence);
+      if (fenceStatus == VK_NOT_READY)
+      {
+        return Result::Application(0);
+      }
+      RETURN_IF_FAILURE(Result::Vulkan(fenceStatus), "vkGetFenceStatus");
+      RETURN_IF_FAILURE(ReplaceMovedBuffers(), "ReplaceMovedBuffers");
+    }
+    else if (g_CompletedFrames >= step.lastFrameUsingOldBuffers)
+    {
+      RETURN_IF_FAILURE(EndDefragmentStep(), "EndDefragmentStep");
+    }
+    else
+    {
+      return Result::Application(0);
+    }
+  }
+  else
   {
-    vkDestroyPipeline(g_Device, g_GraphicsPipeline, nullptr);
-    g_GraphicsPipeline = VK_NULL_HANDLE;
+    if (g_DefragConverged || g_MovableBuffers.empty() || ++g_FramesSinceDefragStep < DEFRAG_STEP_INTERVAL
+        || GetMovableBufferPoolFragmentation() <= DEFRAG_FRAGMENTATION_THRESHOLD)
+    {
+      return Result::Application(0);
+    }
+    VkDeviceSize maxBytesToMove = g_Options.defragBudget * g_FramesSinceDefragStep;
+    g_FramesSinceDefragStep = 0;
+    g_DefragStats.lastStepMs = 0.0f;
+    RETURN_IF_FAILURE(StartDefragmentStep(maxBytesToMove), "StartDefragmentStep");
   }
+
+  float ms = (float)((double)(SDL_GetPerformanceCounter() - start) * 1000.0 / (double)SDL_GetPerformanceFrequency());
+  g_DefragStats.totalMs += ms;
+  g_DefragStats.lastStepMs += ms;
+  return Result::Application(0);
 }
 
-// Command pools
-static VkCommandPool g_GraphicsCommandPool;
-static VkCommandPool g_TransferCommandPool;
+// GPU timestamps
+// Each render graph batch writes a timestamp as it starts and once it's
+// done. After a frame's fence has signaled, the intervals tell how long each
+// queue was busy with the frame, and for how long both were at once. Within
+// a frame the graphics batches wait for the compute results they use, so
+// compute overlaps mostly with the previous frame's graphics work, and it's
+// measured against both. The timestamps of one device share their time base
+// across queues.
+static VkQueryPool g_TimestampQueryPool;
+// Whether the frame slot's queries were written since they were last read
+static bool g_TimestampsWritten[MAX_FRAMES_IN_FLIGHT];
+// Start and end of the graphics batches of the frame collected last
+static uint64_t g_PreviousGraphicsTimestamps[MAX_RENDER_BATCHES * 2];
+static uint32_t g_NumPreviousGraphicsTimestamps;
+
+static struct GpuTimes
+{
+  // Sums over the frames collected since the last stats window
+  double sumBusyMs[NUM_RENDER_QUEUES];
+  double sumOverlapMs;
+  uint32_t numFrames;
+} g_GpuTimes;
 
-Result InitVkCommandPools()
+Result InitVkTimestampQueries()
 {
+  if (!g_TimestampsEnabled)
   {
-    VkCommandPoolCreateInfo poolCI = {};
-    poolCI.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
-    poolCI.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT | VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
-    poolCI.queueFamilyIndex = g_GraphicsQueueFamily;
-    RETURN_IF_FAILURE(Result::Vulkan(
-      vkCreateCommandPool(g_Device, &poolCI, nullptr, &g_GraphicsCommandPool)),
-      "vkCreateCommandPool");
-
-    poolCI.queueFamilyIndex = g_TransferQueueFamily;
-    RETURN_IF_FAILURE(Result::Vulkan(
-      vkCreateCommandPool(g_Device, &poolCI, nullptr, &g_TransferCommandPool)),
-      "vkCreateCommandPool");
+    return Result::Application(0);
   }
 
+  VkQueryPoolCreateInfo queryPoolCI = {};
+  queryPoolCI.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+  queryPoolCI.queryType = VK_QUERY_TYPE_TIMESTAMP;
+  queryPoolCI.queryCount = g_FramesInFlight * (uint32_t)g_RenderGraph.batches.size() * 2;
+  RETURN_IF_FAILURE(Result::Vulkan(
+    vkCreateQueryPool(g_Device, &queryPoolCI, nullptr, &g_TimestampQueryPool)),
+    "vkCreateQueryPool");
+  memset(g_TimestampsWritten, 0, sizeof(g_TimestampsWritten));
+  g_NumPreviousGraphicsTimestamps = 0;
+
   return Result::Application(0);
 }
 
-void DestroyVkCommandPools()
+void DestroyVkTimestampQueries()
 {
-  if (g_TransferCommandPool != VK_NULL_HANDLE)
+  if (g_TimestampQueryPool != VK_NULL_HANDLE)
   {
-    vkDestroyCommandPool(g_Device, g_TransferCommandPool, nullptr);
-    g_TransferCommandPool = VK_NULL_HANDLE;
+    vkDestroyQueryPool(g_Device, g_TimestampQueryPool, nullptr);
+    g_TimestampQueryPool = VK_NULL_HANDLE;
   }
+}
 
-  if (g_GraphicsCommandPool != VK_NULL_HANDLE)
+// The start timestamp also resets both of the batch's queries
+void WriteBatchTimestamp(VkCommandBuffer commandBuffer, uint32_t frame, uint32_t batch, bool end)
+{
+  if (g_TimestampQueryPool == VK_NULL_HANDLE)
   {
-    vkDestroyCommandPool(g_Device, g_GraphicsCommandPool, nullptr);
-    g_GraphicsCommandPool = VK_NULL_HANDLE;
+    return;
+  }
+  uint32_t query = (frame * (uint32_t)g_RenderGraph.batches.size() + batch) * 2;
+  if (!end)
+  {
+    vkCmdResetQueryPool(commandBuffer, g_TimestampQueryPool, query, 2);
+    vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, g_TimestampQueryPool, query);
+  }
+  else
+  {
+    vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, g_TimestampQueryPool, query + 1);
+    g_TimestampsWritten[frame] = true;
   }
 }
 
-// Command buffers
-static std::vector<VkCommandBuffer> g_GraphicsCommandBuffers;
-static VkCommandBuffer g_TransferCommandBuffer;
-
-Result InitVkCommandBuffers()
+// Called once the frame slot's fence has signaled
+void CollectGpuTimes(uint32_t frame)
 {
-  g_GraphicsCommandBuffers.resize(MAX_FRAMES_IN_FLIGHT);
+  if (g_TimestampQueryPool == VK_NULL_HANDLE || !g_TimestampsWritten[frame])
+  {
+    g_NumPreviousGraphicsTimestamps = 0;
+    return;
+  }
+  g_TimestampsWritten[frame] = false;
 
+  uint32_t numBatches = (uint32_t)g_RenderGraph.batches.size();
+  uint64_t timestamps[MAX_RENDER_BATCHES * 2];
+  if (vkGetQueryPoolResults(g_Device, g_TimestampQueryPool, frame * numBatches * 2, numBatches * 2,
+                            sizeof(timestamps), timestamps, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT) != VK_SUCCESS)
   {
-    VkCommandBufferAllocateInfo allocInfo = {};
-    allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-    allocInfo.commandPool = g_GraphicsCommandPool;
-    allocInfo.commandBufferCount = MAX_FRAMES_IN_FLIGHT;
-    allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    RETURN_IF_FAILURE(Result::Vulkan(
-      vkAllocateCommandBuffers(g_Device, &allocInfo, g_GraphicsCommandBuffers.data())),
-      "vkAllocateCommandBuffers");
+    g_NumPreviousGraphicsTimestamps = 0;
+    return;
   }
 
+  // The graphics intervals of this frame and the previous one, which the
+  // compute batches overlap where the intervals intersect
+  uint64_t graphicsTimestamps[MAX_RENDER_BATCHES * 4];
+  uint32_t numGraphicsTimestamps = g_NumPreviousGraphicsTimestamps;
+  std::copy(g_PreviousGraphicsTimestamps, g_PreviousGraphicsTimestamps + numGraphicsTimestamps, graphicsTimestamps);
+  g_NumPreviousGraphicsTimestamps = 0;
+  double msPerTick = g_TimestampPeriod / 1.0e6;
+  for (uint32_t b = 0; b < numBatches; b++)
   {
-    VkCommandBufferAllocateInfo allocInfo = {};
-    allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-    allocInfo.commandPool = g_TransferCommandPool;
-    allocInfo.commandBufferCount = 1;
-    allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    RETURN_IF_FAILURE(Result::Vulkan(
-      vkAllocateCommandBuffers(g_Device, &allocInfo, &g_TransferCommandBuffer)),
-      "vkAllocateCommandBuffers");
+    uint64_t start = timestamps[b * 2] & g_TimestampMask;
+    uint64_t end = timestamps[b * 2 + 1] & g_TimestampMask;
+    timestamps[b * 2] = start;
+    timestamps[b * 2 + 1] = end;
+    const RenderBatch& batch = g_RenderGraph.batches[b];
+    g_GpuTimes.sumBusyMs[batch.queue] += (double)((end - start) & g_TimestampMask) * msPerTick;
+    if (batch.queue == RENDER_QUEUE_GRAPHICS)
+    {
+      graphicsTimestamps[numGraphicsTimestamps++] = start;
+      graphicsTimestamps[numGraphicsTimestamps++] = end;
+      g_PreviousGraphicsTimestamps[g_NumPreviousGraphicsTimestamps++] = start;
+      g_PreviousGraphicsTimestamps[g_NumPreviousGraphicsTimestamps++] = end;
+    }
   }
 
-  return Result::Application(0);
+  // Intervals that wrapped around the valid bits are left out
+  for (uint32_t b = 0; b < numBatches; b++)
+  {
+    if (g_RenderGraph.batches[b].queue != RENDER_QUEUE_COMPUTE)
+    {
+      continue;
+    }
+    for (uint32_t g = 0; g < numGraphicsTimestamps; g += 2)
+    {
+      uint64_t start = glm::max(timestamps[b * 2], graphicsTimestamps[g]);
+      uint64_t end = glm::min(timestamps[b * 2 + 1], graphicsTimestamps[g + 1]);
+      g_GpuTimes.sumOverlapMs += end > start ? (double)(end - start) * msPerTick : 0.0;
+    }
+  }
+  g_GpuTimes.numFrames++;
 }
 
-void DestroyVkCommandBuffers()
+// Frame statistics (shown in the window title once per second)
+static struct FrameStats
 {
-  g_TransferCommandBuffer = VK_NULL_HANDLE;
-  g_GraphicsCommandBuffers.clear();
+  uint64_t windowStart = 0;
+  uint64_t lastFrameEnd = 0;
+  uint32_t numFrames = 0;
+  double sumInterval = 0.0;
+  double sumSqInterval = 0.0;
+  double maxInterval = 0.0;
+  double sumLatency = 0.0;
+  uint32_t numLatencySamples = 0;
+  uint64_t sumVisible = 0;
+  uint64_t sumTriangles = 0;
+  uint64_t sumDraws = 0;
+  uint64_t sumBinds = 0;
+  uint64_t sumBindsSaved = 0;
+  // Seconds Render spent blocked, with --measure-stalls
+  double sumFenceWait = 0.0;
+  double sumAcquire = 0.0;
+  double sumPresent = 0.0;
+  uint32_t numStallSamples = 0;
+
+  float fps = 0.0f;
+  float frameTimeMs = 0.0f;
+  float jitterMs = 0.0f;
+  float worstFrameTimeMs = 0.0f;
+  float latencyMs = 0.0f;
+  // Per frame averages
+  uint32_t visible = 0;
+  uint32_t triangles = 0;
+  uint32_t draws = 0;
+  uint32_t binds = 0;
+  uint32_t bindsSaved = 0;
+  // Time each queue was busy per frame, and both at once, from GPU timestamps
+  float gpuBusyMs[NUM_RENDER_QUEUES] = {};
+  float gpuOverlapMs = 0.0f;
+  float fenceWaitMs = 0.0f;
+  float acquireMs = 0.0f;
+  float presentMs = 0.0f;
+} g_FrameStats;
+
+// Input sample time of the frame last submitted in each frame-in-flight slot
+static uint64_t g_FrameInputTimes[MAX_FRAMES_IN_FLIGHT];
+
+const char* PresentModeName(VkPresentModeKHR presentMode)
+{
+  switch (presentMode)
+  {
+    case VK_PRESENT_MODE_IMMEDIATE_KHR: return "IMMEDIATE";
+    case VK_PRESENT_MODE_MAILBOX_KHR: return "MAILBOX";
+    case VK_PRESENT_MODE_FIFO_KHR: return "FIFO";
+    case VK_PRESENT_MODE_FIFO_RELAXED_KHR: return "FIFO_RELAXED";
+    default: return "UNKNOWN";
+  }
 }
 
-// Buffers
-uint32_t FindMemoryType(VkMemoryPropertyFlags propertyFlags,
-                        VkMemoryHeapFlags heapFlags)
+void ReportFrameStats()
 {
-  VkPhysicalDeviceMemoryProperties memoryProperties;
-  vkGetPhysicalDeviceMemoryProperties(g_PhysicalDevice, &memoryProperties);
-
-  for (uint32_t i = 0; i < memoryProperties.memoryTypeCount; i++)
+  // Device-local memory of the first such heap, the one resources live in
+  VkDeviceSize vramUsage = 0;
+  VkDeviceSize vramBudget = 0;
+  for (uint32_t i = 0; i < g_NumHeaps; i++)
   {
-    uint32_t heap = memoryProperties.memoryTypes[i].heapIndex;
-    if (((memoryProperties.memoryHeaps[heap].flags & heapFlags) == heapFlags)
-        && ((memoryProperties.memoryTypes[i].propertyFlags & propertyFlags) == propertyFlags))
+    if (g_HeapStats[i].deviceLocal)
     {
-      return i;
+      vramUsage = g_HeapStats[i].usage;
+      vramBudget = g_HeapStats[i].budget;
       break;
     }
   }
-  return (uint32_t)-1;
+
+  char title[480];
+  snprintf(title, sizeof(title),
+           "%.1f fps | %.2f ms (worst %.2f) | jitter %.3f ms | latency %.1f ms | %u/%u visible, %u tris, %u draws, %u binds (%u saved) | %s, %s, %u in flight | VRAM %.0f/%.0f MB | GPU %.2f ms graphics, %.2f ms compute, %.2f ms overlap",
+           g_FrameStats.fps, g_FrameStats.frameTimeMs, g_FrameStats.worstFrameTimeMs,
+           g_FrameStats.jitterMs, g_FrameStats.latencyMs,
+           g_FrameStats.visible, (uint32_t)g_RenderObjects.size(), g_FrameStats.triangles, g_FrameStats.draws, g_FrameStats.binds, g_FrameStats.bindsSaved, g_Options.profile->name,
+           PresentModeName(g_SwapchainPresentMode), g_FramesInFlight,
+           vramUsage / (1024.0f * 1024.0f), vramBudget / (1024.0f * 1024.0f),
+           g_FrameStats.gpuBusyMs[RENDER_QUEUE_GRAPHICS], g_FrameStats.gpuBusyMs[RENDER_QUEUE_COMPUTE], g_FrameStats.gpuOverlapMs);
+  if (g_Options.measureStalls)
+  {
+    size_t length = strlen(title);
+    snprintf(title + length, sizeof(title) - length, " | blocked %.2f ms fence, %.2f ms acquire, %.2f ms present",
+             g_FrameStats.fenceWaitMs, g_FrameStats.acquireMs, g_FrameStats.presentMs);
+  }
+  SDL_SetWindowTitle(g_Window, title);
 }
 
-static VkBuffer g_StagingBuffer;
-static VmaAllocation g_StagingBufferAllocation;
-static const VkDeviceSize g_StagingBufferSize = 512 * 1024 * 1024;
+// Rewrites the --stats-json file with the window's frame stats and the heaps'
+// memory stats, sizes in bytes
+void WriteStatsJson()
+{
+  if (g_Options.statsJsonPath == nullptr)
+  {
+    return;
+  }
+  FILE* file = fopen(g_Options.statsJsonPath, "w");
+  if (file == nullptr)
+  {
+    fprintf(stderr, "Failed to write %s\n", g_Options.statsJsonPath);
+    return;
+  }
+
+  fprintf(file, "{\n");
+  fprintf(file, "  \"fps\": %.2f,\n  \"frameTimeMs\": %.3f,\n  \"worstFrameTimeMs\": %.3f,\n  \"jitterMs\": %.3f,\n  \"latencyMs\": %.2f,\n",
+          g_FrameStats.fps, g_FrameStats.frameTimeMs, g_FrameStats.worstFrameTimeMs, g_FrameStats.jitterMs, g_FrameStats.latencyMs);
+  fprintf(file, "  \"visible\": %u,\n  \"triangles\": %u,\n  \"draws\": %u,\n  \"binds\": %u,\n  \"bindsSaved\": %u,\n",
+          g_FrameStats.visible, g_FrameStats.triangles, g_FrameStats.draws, g_FrameStats.binds, g_FrameStats.bindsSaved);
+  fprintf(file, "  \"memoryBudgetExtension\": %s,\n", g_MemoryBudgetEnabled ? "true" : "false");
+  fprintf(file, "  \"heaps\": [\n");
+  for (uint32_t i = 0; i < g_NumHeaps; i++)
+  {
+    const HeapStats& heap = g_HeapStats[i];
+    fprintf(file, "    { \"deviceLocal\": %s, \"size\": %llu, \"budget\": %llu, \"usage\": %llu, "
+            "\"blockCount\": %u, \"allocationCount\": %u, \"blockBytes\": %llu, \"allocationBytes\": %llu, \"fragmentation\": %.3f }%s\n",
+            heap.deviceLocal ? "true" : "false", (unsigned long long)heap.size, (unsigned long long)heap.budget,
+            (unsigned long long)heap.usage, heap.blockCount, heap.allocationCount,
+            (unsigned long long)heap.blockBytes, (unsigned long long)heap.allocationBytes, heap.fragmentation,
+            i + 1 < g_NumHeaps ? "," : "");
+  }
+  fprintf(file, "  ],\n");
+  fprintf(file, "  \"staging\": { \"size\": %llu, \"peakUsed\": %llu, \"peakSize\": %llu },\n",
+          (unsigned long long)g_StagingAllocator.totalSize, (unsigned long long)g_StagingAllocator.peakUsed,
+          (unsigned long long)g_StagingAllocator.peakSize);
+  VkDeviceSize scratchPeakUsed = 0;
+  for (const FrameScratchAllocator& scratch : g_FrameScratch)
+  {
+    scratchPeakUsed = glm::max(scratchPeakUsed, scratch.peakUsed);
+  }
+  fprintf(file, "  \"frameScratch\": { \"peakUsed\": %llu },\n", (unsigned long long)scratchPeakUsed);
+  fprintf(file, "  \"defragmentation\": { \"steps\": %u, \"allocationsMoved\": %u, \"bytesMoved\": %llu, "
+          "\"blocksFreed\": %u, \"bytesFreed\": %llu, \"totalMs\": %.3f, \"lastStepMs\": %.3f, "
+          "\"lastFragmentationBefore\": %.3f, \"lastFragmentationAfter\": %.3f },\n",
+          g_DefragStats.steps, g_DefragStats.allocationsMoved, (unsigned long long)g_DefragStats.bytesMoved,
+          g_DefragStats.blocksFreed, (unsigned long long)g_DefragStats.bytesFreed, g_DefragStats.totalMs,
+          g_DefragStats.lastStepMs, g_DefragStats.lastFragmentationBefore, g_DefragStats.lastFragmentationAfter);
+  fprintf(file, "  \"renderTargets\": { \"count\": %u, \"requestedBytes\": %llu, \"allocatedBytes\": %llu, \"bytesSaved\": %llu, \"lazyBytes\": %llu },\n",
+          (uint32_t)g_RenderTargets.size(), (unsigned long long)g_RenderTargetStats.requestedBytes,
+          (unsigned long long)g_RenderTargetStats.allocatedBytes,
+          (unsigned long long)(g_RenderTargetStats.requestedBytes - g_RenderTargetStats.allocatedBytes),
+          (unsigned long long)g_RenderTargetStats.lazyBytes);
+  fprintf(file, "  \"stalls\": { \"measured\": %s, \"fenceWaitMs\": %.3f, \"acquireMs\": %.3f, \"presentMs\": %.3f },\n",
+          g_Options.measureStalls ? "true" : "false", g_FrameStats.fenceWaitMs, g_FrameStats.acquireMs, g_FrameStats.presentMs);
+  fprintf(file, "  \"gpu\": { \"timestamps\": %s, \"asyncCompute\": %s, \"graphicsMs\": %.3f, \"computeMs\": %.3f, \"overlapMs\": %.3f }\n",
+          g_TimestampQueryPool != VK_NULL_HANDLE ? "true" : "false", g_AsyncComputeEnabled ? "true" : "false",
+          g_FrameStats.gpuBusyMs[RENDER_QUEUE_GRAPHICS], g_FrameStats.gpuBusyMs[RENDER_QUEUE_COMPUTE], g_FrameStats.gpuOverlapMs);
+  fprintf(file, "}\n");
+  fclose(file);
+}
 
-Result InitVkStagingBuffer()
+// Input-to-present latency is approximated as the time from sampling input
+// to observing the frame's fence signaled, the display scanout is not included
+void CollectFrameLatencies()
 {
-  VkBufferCreateInfo bufferCI = {};
-  bufferCI.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-  bufferCI.size = g_StagingBufferSize;
-  bufferCI.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
-  bufferCI.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  uint64_t now = SDL_GetPerformanceCounter();
+  double frequency = (double)SDL_GetPerformanceFrequency();
+  for (uint32_t i = 0; i < g_FramesInFlight; i++)
+  {
+    if (g_FrameInputTimes[i] != 0 && IsFrameSlotIdle(i))
+    {
+      g_FrameStats.sumLatency += (double)(now - g_FrameInputTimes[i]) / frequency;
+      g_FrameStats.numLatencySamples++;
+      g_FrameInputTimes[i] = 0;
+    }
+  }
+}
 
-  VmaAllocationCreateInfo allocCI = {};
-  allocCI.usage = VMA_MEMORY_USAGE_CPU_TO_GPU;
+// Called once per loop iteration, after frame pacing
+void UpdateFrameStats()
+{
+  uint64_t now = SDL_GetPerformanceCounter();
+  double frequency = (double)SDL_GetPerformanceFrequency();
 
-  RETURN_IF_FAILURE(Result::Vulkan(
-    vmaCreateBuffer(g_Allocator, &bufferCI, &allocCI, &g_StagingBuffer, &g_StagingBufferAllocation, nullptr)),
-    "vmaCreateBuffer");
+  if (g_FrameStats.windowStart == 0)
+  {
+    g_FrameStats.windowStart = now;
+    g_FrameStats.lastFrameEnd = now;
+    return;
+  }
 
-  return Result::Application(0);
+  double interval = (double)(now - g_FrameStats.lastFrameEnd) / frequency;
+  g_FrameStats.lastFrameEnd = now;
+  g_FrameStats.numFrames++;
+  g_FrameStats.sumInterval += interval;
+  g_FrameStats.sumSqInterval += interval * interval;
+  g_FrameStats.maxInterval = glm::max(g_FrameStats.maxInterval, interval);
+
+  double windowLength = (double)(now - g_FrameStats.windowStart) / frequency;
+  if (windowLength < 1.0)
+  {
+    return;
+  }
+
+  // Jitter is the standard deviation of frame-to-frame intervals
+  double n = (double)g_FrameStats.numFrames;
+  double mean = g_FrameStats.sumInterval / n;
+  double variance = glm::max(g_FrameStats.sumSqInterval / n - mean * mean, 0.0);
+  g_FrameStats.fps = (float)(n / windowLength);
+  g_FrameStats.frameTimeMs = (float)(mean * 1000.0);
+  g_FrameStats.jitterMs = (float)(sqrt(variance) * 1000.0);
+  g_FrameStats.worstFrameTimeMs = (float)(g_FrameStats.maxInterval * 1000.0);
+  if (g_FrameStats.numLatencySamples > 0)
+  {
+    g_FrameStats.latencyMs = (float)(g_FrameStats.sumLatency / g_FrameStats.numLatencySamples * 1000.0);
+  }
+  g_FrameStats.visible = (uint32_t)(g_FrameStats.sumVisible / g_FrameStats.numFrames);
+  g_FrameStats.triangles = (uint32_t)(g_FrameStats.sumTriangles / g_FrameStats.numFrames);
+  g_FrameStats.draws = (uint32_t)(g_FrameStats.sumDraws / g_FrameStats.numFrames);
+  g_FrameStats.binds = (uint32_t)(g_FrameStats.sumBinds / g_FrameStats.numFrames);
+  g_FrameStats.bindsSaved = (uint32_t)(g_FrameStats.sumBindsSaved / g_FrameStats.numFrames);
+  if (g_GpuTimes.numFrames > 0)
+  {
+    for (uint32_t q = 0; q < NUM_RENDER_QUEUES; q++)
+    {
+      g_FrameStats.gpuBusyMs[q] = (float)(g_GpuTimes.sumBusyMs[q] / g_GpuTimes.numFrames);
+    }
+    g_FrameStats.gpuOverlapMs = (float)(g_GpuTimes.sumOverlapMs / g_GpuTimes.numFrames);
+  }
+  if (g_FrameStats.numStallSamples > 0)
+  {
+    g_FrameStats.fenceWaitMs = (float)(g_FrameStats.sumFenceWait / g_FrameStats.numStallSamples * 1000.0);
+    g_FrameStats.acquireMs = (float)(g_FrameStats.sumAcquire / g_FrameStats.numStallSamples * 1000.0);
+    g_FrameStats.presentMs = (float)(g_FrameStats.sumPresent / g_FrameStats.numStallSamples * 1000.0);
+  }
+
+  UpdateMemoryBudget();
+  RelieveMemoryPressure();
+  ReportFrameStats();
+  WriteStatsJson();
+
+  g_FrameStats.windowStart = now;
+  g_FrameStats.numFrames = 0;
+  g_FrameStats.sumInterval = 0.0;
+  g_FrameStats.sumSqInterval = 0.0;
+  g_FrameStats.maxInterval = 0.0;
+  g_FrameStats.sumLatency = 0.0;
+  g_FrameStats.numLatencySamples = 0;
+  g_FrameStats.sumVisible = 0;
+  g_FrameStats.sumTriangles = 0;
+  g_FrameStats.sumDraws = 0;
+  g_FrameStats.sumBinds = 0;
+  g_FrameStats.sumBindsSaved = 0;
+  g_FrameStats.sumFenceWait = 0.0;
+  g_FrameStats.sumAcquire = 0.0;
+  g_FrameStats.sumPresent = 0.0;
+  g_FrameStats.numStallSamples = 0;
+  g_GpuTimes = {};
 }
 
-void DestroyVkStagingBuffer()
+// Frame pacing
+// Sleeps with SDL_Delay while the deadline is far away and spins on the
+// performance counter for the remainder, since SDL_Delay only has
+// millisecond granularity and tends to oversleep.
+static struct FramePacer
 {
-  vmaDestroyBuffer(g_Allocator, g_StagingBuffer, g_StagingBufferAllocation);
-  g_StagingBuffer = VK_NULL_HANDLE;
-  g_StagingBufferAllocation = VK_NULL_HANDLE;
-}
+  uint64_t periodTicks = 0; // 0 = uncapped
+  uint64_t deadline = 0;
+  double sleepOvershoot = 0.001; // running estimate of SDL_Delay oversleep, seconds
 
-static VkBuffer g_TriangleBuffer;
-static VmaAllocation g_TriangleBufferAllocation;
-static uint64_t g_TriangleBufferVertexOffset;
-static uint64_t g_TriangleBufferIndexOffset;
-static uint64_t g_TriangleBufferUniformOffset;
+  void SetTargetFrameRate(float framesPerSecond)
+  {
+    periodTicks = framesPerSecond > 0.0f
+      ? (uint64_t)((double)SDL_GetPerformanceFrequency() / (double)framesPerSecond)
+      : 0;
+    deadline = 0;
+  }
 
-Result InitVkTriangleBuffer()
-{
-  uint32_t bufferSize;
-  std::vector<char> bufferData;
-  // Prepare vertex buffer data
+  void Wait()
   {
-    VkPhysicalDeviceProperties deviceProperties;
-    vkGetPhysicalDeviceProperties(g_PhysicalDevice, &deviceProperties);
-    VkDeviceSize minAlignment = deviceProperties.limits.minUniformBufferOffsetAlignment;
+    uint64_t now = SDL_GetPerformanceCounter();
+    if (periodTicks == 0)
+    {
+      return;
+    }
 
-    g_TriangleBufferVertexOffset = 0;
-    g_TriangleBufferIndexOffset = sizeof(g_VertexBuffer);
-    g_TriangleBufferUniformOffset = (uint32_t)((sizeof(g_VertexBuffer) + sizeof(g_IndexBuffer) + (minAlignment - 1)) / minAlignment * minAlignment);
-    uint64_t padding = g_TriangleBufferUniformOffset - (sizeof(g_VertexBuffer) + sizeof(g_IndexBuffer));
-    bufferSize = (uint32_t)(sizeof(g_VertexBuffer) + sizeof(g_IndexBuffer) + padding + sizeof(g_UniformBuffer));
-    bufferData.resize(bufferSize);
+    // First frame, or fell behind by a whole period: resync instead of
+    // rushing through a burst of frames to catch up
+    if (deadline == 0 || now >= deadline + periodTicks)
+    {
+      deadline = now + periodTicks;
+      return;
+    }
 
-    g_UniformBuffer.model = glm::identity<glm::mat4x4>();
-    g_UniformBuffer.view = glm::identity<glm::mat4x4>();
-    g_UniformBuffer.proj = glm::perspectiveFov(glm::radians(45.0f), (float)g_DrawableWidth, (float)g_DrawableHeight, 0.01f, 100.0f);
-    g_UniformBuffer.proj[1][1] *= -1;
+    double frequency = (double)SDL_GetPerformanceFrequency();
+    while (now < deadline)
+    {
+      double remaining = (double)(deadline - now) / frequency;
+      double spinThreshold = sleepOvershoot + 0.00025;
+      if (remaining > spinThreshold)
+      {
+        uint32_t sleepMs = (uint32_t)((remaining - spinThreshold) * 1000.0);
+        if (sleepMs > 0)
+        {
+          uint64_t sleepStart = SDL_GetPerformanceCounter();
+          SDL_Delay(sleepMs);
+          double slept = (double)(SDL_GetPerformanceCounter() - sleepStart) / frequency;
+          double overshoot = glm::max(slept - (double)sleepMs / 1000.0, 0.0);
+          sleepOvershoot = glm::clamp(glm::mix(sleepOvershoot, overshoot, 0.1), 0.0, 0.004);
+        }
+      }
+      now = SDL_GetPerformanceCounter();
+    }
 
-    memcpy(bufferData.data() + g_TriangleBufferVertexOffset, (void*)g_VertexBuffer, sizeof(g_VertexBuffer));
-    memcpy(bufferData.data() + g_TriangleBufferIndexOffset, (void*)g_IndexBuffer, sizeof(g_IndexBuffer));
-    memcpy(bufferData.data() + g_TriangleBufferUniformOffset, (void*)&g_UniformBuffer, sizeof(g_UniformBuffer));
+    deadline += periodTicks;
   }
+} g_FramePacer;
 
-  // Create device-local buffer (vertex + index + uniform)
+// FIFO modes are paced by vsync, so the CPU cap only kicks in when asked for
+// a rate below the display refresh. MAILBOX runs uncapped unless a rate is given.
+// IMMEDIATE would otherwise spin as fast as possible, so it defaults to the refresh rate.
+void UpdateFramePacing()
+{
+  float refreshRate = 60.0f;
+  SDL_DisplayMode displayMode;
+  if (SDL_GetWindowDisplayMode(g_Window, &displayMode) == 0 && displayMode.refresh_rate > 0)
   {
-    VkBufferCreateInfo bufferCI = {};
-    bufferCI.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-    bufferCI.size = bufferSize;
-    bufferCI.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT
-      | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
-    bufferCI.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    refreshRate = (float)displayMode.refresh_rate;
+  }
 
-    VmaAllocationCreateInfo allocCI = {};
-    allocCI.usage = VMA_MEMORY_USAGE_GPU_ONLY;
-   
-    vmaCreateBuffer(g_Allocator, &bufferCI, &allocCI, &g_TriangleBuffer, &g_TriangleBufferAllocation, nullptr);
+  float targetFrameRate = 0.0f;
+  switch (g_SwapchainPresentMode)
+  {
+    case VK_PRESENT_MODE_FIFO_KHR:
+    case VK_PRESENT_MODE_FIFO_RELAXED_KHR:
+    if (g_Options.targetFrameRate > 0.0f && g_Options.targetFrameRate < refreshRate)
+    {
+      targetFrameRate = g_Options.targetFrameRate;
+    }
+    break;
+    case VK_PRESENT_MODE_MAILBOX_KHR:
+    targetFrameRate = g_Options.targetFrameRate;
+    break;
+    default:
+    targetFrameRate = g_Options.targetFrameRate > 0.0f ? g_Options.targetFrameRate : refreshRate;
+    break;
   }
 
-  // Write to staging buffer
+  g_FramePacer.SetTargetFrameRate(targetFrameRate);
+}
+
+// Frame graph
+// The passes of a frame. Swapchain images arrive with the acquire semaphore,
+// which the submission waits for at color attachment output, and leave for
+// presentation.
+float g_WorldTime = 0.0f;
+static uint32_t g_CurrentFrame = 0;
+
+// Records the draw list into the current render pass. Depth-only passes use
+// the position-only pipelines and bind only the position stream.
+void RecordDrawList(VkCommandBuffer commandBuffer, bool depthOnly, uint32_t& numDraws, uint32_t& numBinds)
+{
+  const uint64_t STATE_MASK = ~(uint64_t)((1u << DRAW_KEY_DEPTH_BITS) - 1);
+  const VkPipeline* pipelines = depthOnly ? g_DepthPipelines : g_GraphicsPipelines;
+  uint32_t numStreams = depthOnly ? 1 : MAX_VERTEX_STREAMS;
+  uint32_t boundPipeline = (uint32_t)-1;
+  uint32_t boundMaterial = (uint32_t)-1;
+  VkBuffer boundMeshBuffer = VK_NULL_HANDLE;
+  bool descriptorSetBound = false;
+
+  const uint64_t* keys = g_DrawList.GetKeys();
+  const uint32_t* items = g_DrawList.GetItems();
+  uint32_t count = g_DrawList.GetCount() - g_MeshletDrawCount;
+  for (uint32_t first = 0, end = 0; first < count; first = end)
   {
-    void* data;
-    vmaMapMemory(g_Allocator, g_StagingBufferAllocation, &data);
-    memcpy(data, bufferData.data(), bufferSize);
-    vmaUnmapMemory(g_Allocator, g_StagingBufferAllocation);
+    // Key fields are truncated, so equal keys only suggest a run
+    const RenderObject& object = g_RenderObjects[items[first]];
+    uint32_t lod = g_RenderObjectLods[items[first]];
+    for (end = first + 1; end < count && (keys[end] & STATE_MASK) == (keys[first] & STATE_MASK); end++)
+    {
+      const RenderObject& other = g_RenderObjects[items[end]];
+      if (other.material != object.material || other.mesh != object.mesh || g_RenderObjectLods[items[end]] != lod)
+      {
+        break;
+      }
+    }
+
+    const Material& material = g_Materials[object.material];
+    const Mesh& mesh = g_Meshes[object.mesh];
+
+    if (material.pipeline != boundPipeline)
+    {
+      vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelines[material.pipeline]);
+      boundPipeline = material.pipeline;
+      numBinds++;
+    }
+
+    // All pipelines share one layout, so the set stays bound across pipeline changes
+    if (!descriptorSetBound)
+    {
+      VkDescriptorSet descriptorSet = g_BindlessEnabled ? g_BindlessDescriptorSet : g_DescriptorSets[g_CurrentFrame];
+      vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, g_PipelineLayout, 0, 1, &descriptorSet, 0, nullptr);
+      descriptorSetBound = true;
+      numBinds++;
+    }
+
+    if (object.material != boundMaterial)
+    {
+      if (g_BindlessEnabled)
+      {
+        BindlessPushConstants pushConstants = {};
+        pushConstants.time = g_WorldTime;
+        pushConstants.uniformBufferIndex = g_FrameUniformIndices[g_CurrentFrame];
+        pushConstants.textureIndex = material.textureIndex;
+        vkCmdPushConstants(commandBuffer, g_PipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(pushConstants), &pushConstants);
+      }
+      else
+      {
+        vkCmdPushConstants(commandBuffer, g_PipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(float), &g_WorldTime);
+      }
+      boundMaterial = object.material;
+      numBinds++;
+    }
+
+    // Each buffer holds its meshes at one set of stream and index offsets
+    if (mesh.buffer != boundMeshBuffer)
+    {
+      VkBuffer streamBuffers[MAX_VERTEX_STREAMS];
+      for (uint32_t s = 0; s < numStreams; s++)
+      {
+        streamBuffers[s] = mesh.buffer;
+      }
+      vkCmdBindVertexBuffers(commandBuffer, 0, numStreams, streamBuffers, mesh.streamOffsets);
+      vkCmdBindIndexBuffer(commandBuffer, mesh.buffer, mesh.indexOffset, VK_INDEX_TYPE_UINT16);
+      boundMeshBuffer = mesh.buffer;
+      numBinds += 2;
+    }
+
+    for (uint32_t p = mesh.firstPart; p < mesh.firstPart + mesh.numParts; p++)
+    {
+      const MeshPart& part = g_MeshParts[p];
+      if (part.lods[lod].indexCount > 0)
+      {
+        vkCmdDrawIndexed(commandBuffer, part.lods[lod].indexCount, end - first, part.lods[lod].firstIndex, (int32_t)part.firstVertex, first);
+        numDraws++;
+      }
+    }
   }
 
-  // Write from staging buffer to device-local buffer
+  // All meshlet draws are one indirect draw of the clusters that survived culling
+  if (g_MeshletDrawCount > 0)
   {
-    VkBufferCopy copyRegion = {};
-    copyRegion.srcOffset = VkDeviceSize{ 0 };
-    copyRegion.dstOffset = VkDeviceSize{ 0 };
-    copyRegion.size = bufferSize;
+    VkDeviceSize commandOffset = g_CurrentFrame * g_ClusterBufferFrameSize;
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, depthOnly ? g_MeshletDepthPipeline : g_MeshletGraphicsPipeline);
+    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, g_MeshletPipelineLayout, 0, 1, &g_MeshletDescriptorSets[g_CurrentFrame], 0, nullptr);
+    vkCmdBindIndexBuffer(commandBuffer, g_ClusterBuffer, commandOffset + g_ClusterBufferIndicesOffset, VK_INDEX_TYPE_UINT32);
+    vkCmdDrawIndexedIndirect(commandBuffer, g_ClusterBuffer, commandOffset, 1, sizeof(VkDrawIndexedIndirectCommand));
+    numDraws++;
+    numBinds += 3;
+  }
+}
 
-    VkCommandBufferBeginInfo beginInfo = {};
-    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-    vkBeginCommandBuffer(g_TransferCommandBuffer, &beginInfo);
-    vkCmdCopyBuffer(g_TransferCommandBuffer, g_StagingBuffer, g_TriangleBuffer, 1, &copyRegion);
-    vkEndCommandBuffer(g_TransferCommandBuffer);
+void RecordMainPass(VkCommandBuffer commandBuffer, uint32_t frame)
+{
+  // Instance data is bound once, draws select their range with firstInstance
+  vkCmdBindVertexBuffers(commandBuffer, INSTANCE_DATA_BINDING, 1, &g_InstanceData[frame].buffer, &g_InstanceData[frame].offset);
 
-    VkSubmitInfo submitInfo = {};
-    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-    submitInfo.commandBufferCount = 1;
-    submitInfo.pCommandBuffers = &g_TransferCommandBuffer;
-    vkQueueSubmit(g_TransferQueue, 1, &submitInfo, VK_NULL_HANDLE);
-    vkQueueWaitIdle(g_TransferQueue);
+  VkViewport viewport = {};
+  viewport.x = 0;
+  viewport.y = 0;
+  viewport.width = (float)g_SwapchainExtent.width;
+  viewport.height = (float)g_SwapchainExtent.height;
+  viewport.minDepth = 0.0f;
+  viewport.maxDepth = 1.0f;
+  vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+
+  // Sorted draws sharing pipeline, material and mesh are merged into one
+  // instanced draw. Each draw needs a pipeline, descriptor set, push
+  // constant, vertex buffer and index buffer bind, unless already bound.
+  const uint32_t BINDS_PER_DRAW = 5;
+  uint32_t numDraws = 0;
+  uint32_t numBinds = 0;
+  // The prepass lays down depth from positions alone, so the shading pass
+  // runs its fragment shader once per pixel
+  if (g_Options.depthPrepass)
+  {
+    RecordDrawList(commandBuffer, true, numDraws, numBinds);
   }
+  RecordDrawList(commandBuffer, false, numDraws, numBinds);
 
-  return Result::Application(0);
-}
-
-void DestroyVkTriangleBuffer()
-{
-  vmaDestroyBuffer(g_Allocator, g_TriangleBuffer, g_TriangleBufferAllocation);
-  g_TriangleBuffer = VK_NULL_HANDLE;
-  g_TriangleBufferAllocation = VK_NULL_HANDLE;
+  g_FrameStats.sumDraws += numDraws;
+  g_FrameStats.sumBinds += numBinds;
+  g_FrameStats.sumBindsSaved += numDraws * BINDS_PER_DRAW - numBinds;
 }
 
-// Frame synchronization
-static std::vector<VkSemaphore> g_ImageAvailableSemaphores;
-static std::vector<VkSemaphore> g_RenderFinishedSemaphores;
-static VkFence g_UniformBufferWrittenFence;
-static std::vector<VkFence> g_GraphicsCommandBufferIsUsedFences;
+static uint32_t g_MainPass;
 
-Result InitVkSemaphoresAndFences()
+Result InitVkRenderGraph()
 {
-  VkSemaphoreCreateInfo semaphoreCI = {};
-  semaphoreCI.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+  RenderGraph& graph = g_RenderGraph;
 
-  g_ImageAvailableSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
-  g_RenderFinishedSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
+  // Shared with the present queue family where that is another one
+  uint32_t swapchain = graph.ImportImages("swapchain", &g_SwapchainImages, &g_SwapchainImageViews, g_SwapchainFormat,
+                                          VK_IMAGE_ASPECT_COLOR_BIT, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+                                          VK_IMAGE_LAYOUT_UNDEFINED, true);
+  graph.SetOutput(swapchain, RENDER_ACCESS_PRESENT);
 
-  for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++)
+  // Meshlet culling samples the depth for its depth pyramid
+  VkFormat depthFormat = FindDepthFormat(VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT
+                                         | (g_Options.meshlets ? VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT : 0));
+  RETURN_IF_FAILURE(Result::Application(
+    depthFormat == VK_FORMAT_UNDEFINED ? 1 : 0),
+    "No supported depth format");
+  uint32_t depth = graph.CreateImage("depth", depthFormat, VK_IMAGE_ASPECT_DEPTH_BIT);
+  g_DepthResource = depth;
+
+  // Culling only depends on the frame's uniforms and the previous frame's
+  // depth pyramid, so it overlaps the end of the previous frame's graphics work
+  RenderQueue cullQueue = g_AsyncComputeEnabled ? RENDER_QUEUE_COMPUTE : RENDER_QUEUE_GRAPHICS;
+  uint32_t clusters = RENDER_GRAPH_NONE;
+  uint32_t depthPyramid = RENDER_GRAPH_NONE;
+  if (g_Options.meshlets)
   {
-    RETURN_IF_FAILURE(Result::Vulkan(
-      vkCreateSemaphore(g_Device, &semaphoreCI, nullptr, &g_ImageAvailableSemaphores[i])),
-      "");
-    RETURN_IF_FAILURE(Result::Vulkan(
-      vkCreateSemaphore(g_Device, &semaphoreCI, nullptr, &g_RenderFinishedSemaphores[i])),
-      "");
+    // Both buffers are shared by the queue families (see ShareWithComputeQueue)
+    uint32_t meshlets = graph.ImportBuffer("meshlets", &g_MeshletBuffer, true);
+    clusters = graph.ImportBuffer("clusters", &g_ClusterBuffer, true);
+    // Only ever used on the culling queue, and handed over to the next frame's culling
+    depthPyramid = graph.ImportBuffer("depth pyramid", &g_DepthPyramidBuffer, false);
+    graph.SetOutput(depthPyramid, RENDER_ACCESS_STORAGE_READ_COMPUTE);
+
+    uint32_t reset = graph.AddPass("meshlet reset", cullQueue, false, RecordMeshletReset);
+    graph.Use(reset, clusters, RENDER_ACCESS_TRANSFER_WRITE);
+
+    uint32_t cull = graph.AddPass("meshlet cull", cullQueue, false, RecordMeshletCulling);
+    graph.Use(cull, meshlets, RENDER_ACCESS_STORAGE_READ_COMPUTE);
+    graph.Use(cull, depthPyramid, RENDER_ACCESS_STORAGE_READ_COMPUTE);
+    graph.Use(cull, clusters, RENDER_ACCESS_STORAGE_WRITE_COMPUTE);
   }
 
-  g_GraphicsCommandBufferIsUsedFences.resize(MAX_FRAMES_IN_FLIGHT);
-
-  VkFenceCreateInfo fenceCI = {};
-  fenceCI.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-  fenceCI.flags = VK_FENCE_CREATE_SIGNALED_BIT;
-
-  for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++)
+  VkClearValue clearColor = {};
+  clearColor.color = { { 0.0f, 0.0f, 0.0f, 1.0f } };
+  VkClearValue clearDepth = {};
+  clearDepth.depthStencil = { 1.0f, 0 };
+  g_MainPass = graph.AddPass("main", RENDER_QUEUE_GRAPHICS, true, RecordMainPass);
+  graph.Clear(g_MainPass, swapchain, RENDER_ACCESS_COLOR_ATTACHMENT, clearColor);
+  graph.Clear(g_MainPass, depth, RENDER_ACCESS_DEPTH_ATTACHMENT, clearDepth);
+  if (clusters != RENDER_GRAPH_NONE)
   {
-    RETURN_IF_FAILURE(Result::Vulkan(
-      vkCreateFence(g_Device, &fenceCI, nullptr, &g_GraphicsCommandBufferIsUsedFences[i])),
-      "vkCreateFence");
+    // Surviving clusters are one indirect draw indexing into the buffer
+    graph.Use(g_MainPass, clusters,
+              RENDER_ACCESS_INDIRECT_READ | RENDER_ACCESS_INDEX_READ | RENDER_ACCESS_STORAGE_READ_VERTEX);
+  }
+  if (depthPyramid != RENDER_GRAPH_NONE)
+  {
+    uint32_t build = graph.AddPass("depth pyramid", cullQueue, false, RecordDepthPyramid);
+    graph.Use(build, depth, RENDER_ACCESS_SAMPLED_COMPUTE);
+    graph.Use(build, depthPyramid, RENDER_ACCESS_STORAGE_WRITE_COMPUTE);
   }
 
-  fenceCI.flags = 0;
-  RETURN_IF_FAILURE(Result::Vulkan(
-    vkCreateFence(g_Device, &fenceCI, nullptr, &g_UniformBufferWrittenFence)),
-    "");
+  RETURN_IF_FAILURE(graph.Compile(), "RenderGraph::Compile");
+  g_RenderPass = graph.passes[g_MainPass].renderPass;
 
   return Result::Application(0);
 }
 
-void DestroyVkSemaphoresAndFences()
+Result InitVkRenderGraphTargets()
 {
-  if (g_UniformBufferWrittenFence != VK_NULL_HANDLE)
-  {
-    vkDestroyFence(g_Device, g_UniformBufferWrittenFence, nullptr);
-    g_UniformBufferWrittenFence = VK_NULL_HANDLE;
-  }
-
-  for (VkFence fence : g_GraphicsCommandBufferIsUsedFences)
-  {
-    if (fence != VK_NULL_HANDLE)
-    {
-      vkDestroyFence(g_Device, fence, nullptr);
-    }
-  }
-  g_GraphicsCommandBufferIsUsedFences.clear();
+  return g_RenderGraph.CreateTargets();
+}
 
-  for (VkSemaphore semaphore : g_ImageAvailableSemaphores)
-  {
-    if (semaphore != VK_NULL_HANDLE)
-    {
-      vkDestroySemaphore(g_Device, semaphore, nullptr);
-    }
-  }
-  g_GraphicsCommandBufferIsUsedFences.clear();
+void DestroyVkRenderGraphTargets()
+{
+  g_RenderGraph.DestroyTargets();
+}
 
-  for (VkSemaphore semaphore : g_RenderFinishedSemaphores)
-  {
-    if (semaphore != VK_NULL_HANDLE)
-    {
-      vkDestroySemaphore(g_Device, semaphore, nullptr);
-    }
-  }
-  g_RenderFinishedSemaphores.clear();
+void DestroyVkRenderGraph()
+{
+  g_RenderGraph.Destroy();
+  g_RenderPass = VK_NULL_HANDLE;
 }
 
 // Application
@@ -1526,20 +6769,28 @@ Result Init()
   RETURN_IF_FAILURE(InitVmaAllocator(), "InitVmaAllocator");
   RETURN_IF_FAILURE(InitVkSwapchain(), "InitVkSwapchain");
   RETURN_IF_FAILURE(InitVkShaders(), "InitVkShaders");
-  RETURN_IF_FAILURE(InitVkDescriptorPool(), "InitVkDescriptorPool");
   RETURN_IF_FAILURE(InitVkDescriptorSetLayout(), "InitVkDescriptorSetLayout");
-  RETURN_IF_FAILURE(InitVkDescriptorSets(), "InitVkDescriptorSet");
+  RETURN_IF_FAILURE(InitVkBindlessDescriptors(), "InitVkBindlessDescriptors");
   RETURN_IF_FAILURE(InitVkPipelineCache(), "InitVkPipelineCache");
   RETURN_IF_FAILURE(InitVkPipelineLayout(), "InitVkPipelineLayout");
-  RETURN_IF_FAILURE(InitVkRenderPass(), "InitVkRenderPass");
-  RETURN_IF_FAILURE(InitVkSwapchainFramebuffers(), "InitVkSwapchainFramebuffers");
+  RETURN_IF_FAILURE(InitVkRenderGraph(), "InitVkRenderGraph");
+  RETURN_IF_FAILURE(InitVkRenderGraphTargets(), "InitVkRenderGraphTargets");
   RETURN_IF_FAILURE(InitVkGraphicsPipeline(), "InitVkGraphicsPipeline");
   RETURN_IF_FAILURE(InitVkCommandPools(), "InitVkCommandPools");
   RETURN_IF_FAILURE(InitVkCommandBuffers(), "InitVkCommandBuffers");
+  RETURN_IF_FAILURE(InitVkTimestampQueries(), "InitVkTimestampQueries");
   RETURN_IF_FAILURE(InitVkStagingBuffer(), "InitVkStagingBuffer");
+  RETURN_IF_FAILURE(InitVkFrameScratch(), "InitVkFrameScratch");
+  RETURN_IF_FAILURE(InitVkDefragmentation(), "InitVkDefragmentation");
   RETURN_IF_FAILURE(InitVkTriangleBuffer(), "InitVkTriangleBuffer");
+  RETURN_IF_FAILURE(InitVkMeshArena(), "InitVkMeshArena");
+  InitInstanceData();
+  RETURN_IF_FAILURE(InitVkDepthPyramid(), "InitVkDepthPyramid");
+  RETURN_IF_FAILURE(InitVkMeshletCulling(), "InitVkMeshletCulling");
   RETURN_IF_FAILURE(InitVkSemaphoresAndFences(), "InitVkSemaphoresAndFences");
 
+  UpdateFramePacing();
+
   SDL_ShowWindow(g_Window);
 
   return Result::Application(0);
@@ -1547,21 +6798,31 @@ Result Init()
 
 void Shutdown()
 {
+  // Everything retired from here on is destroyed right away, as are old
+  // swapchains still waiting for frames after a present
   vkDeviceWaitIdle(g_Device);
+  CollectRetiredObjects((uint64_t)-1);
+  AbortDefragmentStep();
 
   DestroyVkSemaphoresAndFences();
+  DestroyVkMeshletCulling();
+  DestroyVkDepthPyramid();
+  DestroyInstanceData();
+  DestroyVkMeshArena();
   DestroyVkTriangleBuffer();
+  DestroyVkDefragmentation();
+  DestroyVkFrameScratch();
   DestroyVkStagingBuffer();
+  DestroyVkTimestampQueries();
   DestroyVkCommandBuffers();
   DestroyVkCommandPools();
   DestroyVkGraphicsPipeline();
-  DestroyVkSwapchainFramebuffers();
-  DestroyVkRenderPass();
+  DestroyVkRenderGraph();
   DestroyVkPipelineLayout();
   DestroyVkPipelineCache();
-  DestroyVkDescriptorSets();
-  DestroyVkDescriptorSetLayout();
-  DestroyVkDescriptorPool();
+  DestroyVkBindlessDescriptors();
+  DestroyVkDescriptorAllocators();
+  DestroyVkDescriptorSetLayoutCache();
   DestroyVkShaders();
   DestroyVkSwapchain();
   DestroyVmaAllocator();
@@ -1571,173 +6832,172 @@ void Shutdown()
   DestroyVkDebugMessenger();
   DestroyVkInstance();
   DestroyWindow();
+  ShutdownParallelFor();
 
   SDL_Quit();
 }
 
+// The frames in flight keep going with the objects replaced here, which are
+// retired rather than destroyed
 Result RecreateSwapchain()
 {
-  vkDeviceWaitIdle(g_Device);
-
-  DestroyVkSwapchainFramebuffers();
+  DestroyVkDepthPyramidBuffer();
+  DestroyVkRenderGraphTargets();
   DestroyVkGraphicsPipeline();
-  DestroyVkSwapchain();
 
   RETURN_IF_FAILURE(InitVkSwapchain(), "InitVkSwapchain");
   RETURN_IF_FAILURE(InitVkGraphicsPipeline(), "InitVkGraphicsPipeline");
-  RETURN_IF_FAILURE(InitVkSwapchainFramebuffers(), "InitVkSwapchainFramebuffers");
+  RETURN_IF_FAILURE(InitVkRenderGraphTargets(), "InitVkRenderGraphTargets");
+  RETURN_IF_FAILURE(InitVkDepthPyramidBuffer(), "InitVkDepthPyramidBuffer");
+
+  UpdateFramePacing();
 
   return Result::Application(0);
 }
 
-float g_WorldTime = 0.0f;
-static uint32_t g_CurrentFrame = 0;
-
-Result UpdateUniformBuffer()
+// Records the render graph's batches from firstBatch to endBatch
+Result WriteCommandBuffers(uint32_t firstBatch, uint32_t endBatch, uint32_t swapchainImageIndex)
 {
-  // Write to staging buffer
+  uint32_t numBatches = (uint32_t)g_RenderGraph.batches.size();
+  for (uint32_t b = firstBatch; b < endBatch; b++)
   {
-    void* data;
-    vmaMapMemory(g_Allocator, g_StagingBufferAllocation, &data);
-    memcpy(data, &g_UniformBuffer, sizeof(g_UniformBuffer));
-    vmaUnmapMemory(g_Allocator, g_StagingBufferAllocation);
-  }
+    VkCommandBuffer commandBuffer = g_FrameCommandBuffers[g_CurrentFrame * numBatches + b];
 
-  // Write from staging buffer to device-local buffer
-  {
-    VkBufferCopy copyRegion = {};
-    copyRegion.srcOffset = VkDeviceSize{ 0 };
-    copyRegion.dstOffset = VkDeviceSize{ g_TriangleBufferUniformOffset };
-    copyRegion.size = sizeof(g_UniformBuffer);
+    RETURN_IF_FAILURE(Result::Vulkan(
+      vkResetCommandBuffer(commandBuffer, 0)),
+      "vkResetCommandBuffer");
 
     VkCommandBufferBeginInfo beginInfo = {};
     beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
     beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-    vkBeginCommandBuffer(g_TransferCommandBuffer, &beginInfo);
-    vkCmdCopyBuffer(g_TransferCommandBuffer, g_StagingBuffer, g_TriangleBuffer, 1, &copyRegion);
-    vkEndCommandBuffer(g_TransferCommandBuffer);
+    RETURN_IF_FAILURE(Result::Vulkan(
+      vkBeginCommandBuffer(commandBuffer, &beginInfo)),
+      "vkBeginCommandBuffer");
 
-    VkSubmitInfo submitInfo = {};
-    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-    submitInfo.commandBufferCount = 1;
-    submitInfo.pCommandBuffers = &g_TransferCommandBuffer;
-    vkQueueSubmit(g_TransferQueue, 1, &submitInfo, g_UniformBufferWrittenFence);
+    WriteBatchTimestamp(commandBuffer, g_CurrentFrame, b, false);
+    g_RenderGraph.RecordBatch(commandBuffer, b, g_CurrentFrame, swapchainImageIndex);
+    WriteBatchTimestamp(commandBuffer, g_CurrentFrame, b, true);
+
+    RETURN_IF_FAILURE(Result::Vulkan(
+      vkEndCommandBuffer(commandBuffer)),
+      "vkEndCommandBuffer");
   }
 
   return Result::Application(0);
 }
 
-Result WriteCommandBuffers(uint32_t swapchainImageIndex)
+// Seconds since start, a performance counter value
+double SecondsSince(uint64_t start)
 {
-  VkCommandBuffer commandBuffer = g_GraphicsCommandBuffers[g_CurrentFrame];
-
-  RETURN_IF_FAILURE(Result::Vulkan(
-    vkResetCommandBuffer(commandBuffer, 0)),
-    "vkResetCommandBuffer");
-
-  VkCommandBufferBeginInfo beginInfo = {};
-  beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-  beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-  RETURN_IF_FAILURE(Result::Vulkan(
-    vkBeginCommandBuffer(commandBuffer, &beginInfo)),
-    "vkBeginCommandBuffer");
-
-  VkClearValue clearColor = { 0.0f, 0.0f, 0.0f, 1.0f };
-  VkRenderPassBeginInfo renderPassBeginInfo = {};
-  renderPassBeginInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-  renderPassBeginInfo.renderPass = g_RenderPass;
-  renderPassBeginInfo.clearValueCount = 1;
-  renderPassBeginInfo.pClearValues = &clearColor;
-  renderPassBeginInfo.framebuffer = g_SwapchainFramebuffers[swapchainImageIndex];
-  renderPassBeginInfo.renderArea.offset = { 0, 0 };
-  renderPassBeginInfo.renderArea.extent = g_SwapchainExtent;
-  vkCmdBeginRenderPass(commandBuffer, &renderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
-
-  vkCmdBindVertexBuffers(commandBuffer, 0, 1, &g_TriangleBuffer, &g_TriangleBufferVertexOffset);
-
-  vkCmdBindIndexBuffer(commandBuffer, g_TriangleBuffer, g_TriangleBufferIndexOffset, VK_INDEX_TYPE_UINT32);
+  return (double)(SDL_GetPerformanceCounter() - start) / (double)SDL_GetPerformanceFrequency();
+}
 
-  VkViewport viewport = {};
-  viewport.x = 0;
-  viewport.y = 0;
-  viewport.width = (float)g_SwapchainExtent.width;
-  viewport.height = (float)g_SwapchainExtent.height;
-  viewport.minDepth = 0.0f;
-  viewport.maxDepth = 1.0f;
-  vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+// CPU work comes first and the swapchain image is acquired as late as
+// possible: the frame slot is waited for, the frame's data written and the
+// batches not using any image recorded and submitted before acquiring, so
+// neither that work nor the GPU's part of it waits for the presentation engine.
+Result Render(float normalizedDelay)
+{
+  CollectFrameLatencies();
+
+  uint64_t fenceWaitStart = SDL_GetPerformanceCounter();
+  RETURN_IF_FAILURE(WaitForFrameSlot(g_CurrentFrame), "WaitForFrameSlot");
+  double fenceWait = SecondsSince(fenceWaitStart);
+  CollectRetiredObjects(g_FrameSlotNumbers[g_CurrentFrame]);
+  CollectFrameLatencies();
+  CollectGpuTimes(g_CurrentFrame);
+  RETURN_IF_FAILURE(UpdateDefragmentation(), "UpdateDefragmentation");
+  VkFence frameFence = VK_NULL_HANDLE;
+  if (!g_TimelineSemaphoresEnabled)
+  {
+    frameFence = g_GraphicsCommandBufferIsUsedFences[g_CurrentFrame];
+    RETURN_IF_FAILURE(Result::Vulkan(
+      vkResetFences(g_Device, 1, &frameFence)),
+      "vkResetFences");
+  }
+  g_StagingAllocator.Reset();
 
-  vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, g_GraphicsPipeline);
-  vkCmdPushConstants(commandBuffer, g_PipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(float), &g_WorldTime);
-  vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, g_PipelineLayout, 0, 1, &g_DescriptorSets[g_CurrentFrame], 0, nullptr);
+  // Everything this frame slot wrote last time has been read now
+  RETURN_IF_FAILURE(g_FrameScratch[g_CurrentFrame].Reset(), "FrameScratchAllocator::Reset");
+  RETURN_IF_FAILURE(WriteFrameUniforms(g_CurrentFrame), "WriteFrameUniforms");
+  RETURN_IF_FAILURE(WriteInstanceData(g_CurrentFrame), "WriteInstanceData");
 
-  vkCmdDrawIndexed(commandBuffer, sizeof(g_IndexBuffer) / sizeof(g_IndexBuffer[0]), 1, 0, 0, 0);
+  // The sets this frame slot used last time are done now
+  g_FrameDescriptorAllocators[g_CurrentFrame].Reset();
 
-  vkCmdEndRenderPass(commandBuffer);
+  // The bindless set is written once at registration
+  if (!g_BindlessEnabled)
+  {
+    RETURN_IF_FAILURE(g_FrameDescriptorAllocators[g_CurrentFrame].Allocate(
+      g_DescriptorSetLayout, &g_DescriptorSets[g_CurrentFrame]),
+      "DescriptorAllocator::Allocate");
+
+    VkDescriptorBufferInfo bufferInfo = {};
+    bufferInfo.buffer = g_FrameUniforms[g_CurrentFrame].buffer;
+    bufferInfo.offset = g_FrameUniforms[g_CurrentFrame].offset;
+    bufferInfo.range = sizeof(g_UniformBuffer);
+
+    VkWriteDescriptorSet writeSet = {};
+    writeSet.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    writeSet.dstSet = g_DescriptorSets[g_CurrentFrame];
+    writeSet.dstBinding = 0;
+    writeSet.dstArrayElement = 0;
+    writeSet.descriptorCount = 1;
+    writeSet.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    writeSet.pBufferInfo = &bufferInfo;
+    vkUpdateDescriptorSets(g_Device, 1, &writeSet, 0, nullptr);
+  }
 
-  RETURN_IF_FAILURE(Result::Vulkan(
-    vkEndCommandBuffer(commandBuffer)),
-    "vkEndCommandBuffer");
+  if (g_MeshletDrawCount > 0)
+  {
+    RETURN_IF_FAILURE(WriteMeshletDescriptorSet(g_CurrentFrame), "WriteMeshletDescriptorSet");
+  }
 
-  return Result::Application(0);
-}
+  uint32_t numBatches = (uint32_t)g_RenderGraph.batches.size();
+  uint32_t lateBatch = g_RenderGraph.lateBatch;
+  const VkCommandBuffer* commandBuffers = &g_FrameCommandBuffers[g_CurrentFrame * numBatches];
+  // Numbered as of its first submission, for what's retired while it's in flight
+  g_FrameSlotNumbers[g_CurrentFrame] = ++g_SubmittedFrames;
+  if (lateBatch > 0)
+  {
+    RETURN_IF_FAILURE(WriteCommandBuffers(0, lateBatch, 0), "WriteCommandBuffers");
+    g_FrameScratch[g_CurrentFrame].Flush();
+    RETURN_IF_FAILURE(g_RenderGraph.Submit(
+      commandBuffers, g_CurrentFrame, 0, lateBatch, g_ImageAvailableSemaphores[g_CurrentFrame],
+      g_RenderFinishedSemaphores[g_CurrentFrame], frameFence),
+      "RenderGraph::Submit");
+  }
 
-Result Render(float normalizedDelay)
-{
+  // The frame is partly submitted already, so an out of date swapchain is
+  // replaced rather than the frame skipped
+  uint64_t acquireStart = SDL_GetPerformanceCounter();
   uint32_t imageIndex;
   Result acquireNextImage = Result::Vulkan(
     vkAcquireNextImageKHR(g_Device, g_Swapchain, (uint64_t)-1, g_ImageAvailableSemaphores[g_CurrentFrame], VK_NULL_HANDLE, &imageIndex));
   if (acquireNextImage.vkResult == VK_ERROR_OUT_OF_DATE_KHR)
   {
-    acquireNextImage = RecreateSwapchain();
+    RETURN_IF_FAILURE(RecreateSwapchain(), "RecreateSwapchain");
     g_DrawableChanged = false;
+    acquireNextImage = Result::Vulkan(
+      vkAcquireNextImageKHR(g_Device, g_Swapchain, (uint64_t)-1, g_ImageAvailableSemaphores[g_CurrentFrame], VK_NULL_HANDLE, &imageIndex));
   }
   RETURN_IF_FAILURE(acquireNextImage, "vkAcquireNextImageKHR");
+  double acquire = SecondsSince(acquireStart);
 
-  VkFence fencesToWait[2] = {
-    g_GraphicsCommandBufferIsUsedFences[g_CurrentFrame],
-    g_UniformBufferWrittenFence };
-
-  RETURN_IF_FAILURE(Result::Vulkan(
-    vkWaitForFences(g_Device, 2, fencesToWait, VK_TRUE, (uint64_t)-1)),
-    "vkWaitForFences");
-  RETURN_IF_FAILURE(Result::Vulkan(
-    vkResetFences(g_Device, 2, fencesToWait)),
-    "vkResetFences");
-
-  VkDescriptorBufferInfo bufferInfo = {};
-  bufferInfo.buffer = g_TriangleBuffer;
-  bufferInfo.offset = g_TriangleBufferUniformOffset;
-  bufferInfo.range = sizeof(g_UniformBuffer);
-
-  VkWriteDescriptorSet writeSet = {};
-  writeSet.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-  writeSet.dstSet = g_DescriptorSets[g_CurrentFrame];
-  writeSet.dstBinding = 0;
-  writeSet.dstArrayElement = 0;
-  writeSet.descriptorCount = 1;
-  writeSet.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-  writeSet.pBufferInfo = &bufferInfo;
-  vkUpdateDescriptorSets(g_Device, 1, &writeSet, 0, nullptr);
+  if (g_Options.meshlets)
+  {
+    RETURN_IF_FAILURE(WriteDepthPyramidDescriptorSet(g_CurrentFrame), "WriteDepthPyramidDescriptorSet");
+  }
 
-  RETURN_IF_FAILURE(WriteCommandBuffers(imageIndex),
+  RETURN_IF_FAILURE(WriteCommandBuffers(lateBatch, numBatches, imageIndex),
                     "VkWriteCommandBuffers");
+  g_FrameScratch[g_CurrentFrame].Flush();
 
-  VkPipelineStageFlags waitStages[] = {
-    VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT };
-
-  VkSubmitInfo submitInfo = {};
-  submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-  submitInfo.commandBufferCount = 1;
-  submitInfo.pCommandBuffers = &g_GraphicsCommandBuffers[g_CurrentFrame];
-  submitInfo.waitSemaphoreCount = 1;
-  submitInfo.pWaitSemaphores = &g_ImageAvailableSemaphores[g_CurrentFrame];
-  submitInfo.pWaitDstStageMask = waitStages;
-  submitInfo.signalSemaphoreCount = 1;
-  submitInfo.pSignalSemaphores = &g_RenderFinishedSemaphores[g_CurrentFrame];
-
-  RETURN_IF_FAILURE(Result::Vulkan(
-    vkQueueSubmit(g_GraphicsQueue, 1, &submitInfo, g_GraphicsCommandBufferIsUsedFences[g_CurrentFrame])),
-    "vkQueueSubmit");
+  RETURN_IF_FAILURE(g_RenderGraph.Submit(
+    commandBuffers, g_CurrentFrame, lateBatch, numBatches, g_ImageAvailableSemaphores[g_CurrentFrame],
+    g_RenderFinishedSemaphores[g_CurrentFrame], frameFence),
+    "RenderGraph::Submit");
+  g_FrameInputTimes[g_CurrentFrame] = g_Input.sampleTime;
 
   VkPresentInfoKHR presentInfo = {};
   presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
@@ -1747,8 +7007,10 @@ Result Render(float normalizedDelay)
   presentInfo.pWaitSemaphores = &g_RenderFinishedSemaphores[g_CurrentFrame];
   presentInfo.pImageIndices = &imageIndex;
 
+  uint64_t presentStart = SDL_GetPerformanceCounter();
   Result queuePresent = Result::Vulkan(
     vkQueuePresentKHR(g_PresentQueue, &presentInfo));
+  double present = SecondsSince(presentStart);
   if (g_DrawableChanged
       || queuePresent.vkResult == VK_ERROR_OUT_OF_DATE_KHR
       || queuePresent.vkResult == VK_SUBOPTIMAL_KHR)
@@ -1756,26 +7018,336 @@ Result Render(float normalizedDelay)
     queuePresent = RecreateSwapchain();
     g_DrawableChanged = false;
   }
+  else if (queuePresent.Success() && !g_UnpresentedOldSwapchains.empty())
+  {
+    RetireOldSwapchains();
+  }
   RETURN_IF_FAILURE(queuePresent, "vkQueuePresentKHR");
 
-  g_CurrentFrame = (g_CurrentFrame + 1) % MAX_FRAMES_IN_FLIGHT;
+  if (g_Options.measureStalls)
+  {
+    g_FrameStats.sumFenceWait += fenceWait;
+    g_FrameStats.sumAcquire += acquire;
+    g_FrameStats.sumPresent += present;
+    g_FrameStats.numStallSamples++;
+  }
+
+  g_CurrentFrame = (g_CurrentFrame + 1) % g_FramesInFlight;
 
   return Result::Application(0);
 }
 
-static glm::vec3 translation = { 0.0f, 0.0f, 0.0f };
-static glm::vec3 rotationAxis = { 0.0f, 0.0f, 1.0f };
-static float rotationAngle = glm::radians(0.0f);
-static glm::vec3 scaling = { 1.0f, 1.0f, 1.0f };
+// Scene
+static SceneGraph g_SceneGraph;
+static uint32_t g_TriangleNode;
+static uint32_t g_CameraNode;
+// Instance transforms are relative to the model matrix, so instances hang
+// off their own root and are stored contiguously after it
+static uint32_t g_InstanceRootNode;
+static uint32_t g_FirstInstanceNode;
 
-static glm::vec3 cameraTranslation = { 0.0f, 2.0f, 2.0f };
 static glm::vec3 cameraTarget = { 0.0f, 0.0f, 0.0f };
 static glm::vec3 cameraUp = { 0.0f, 1.0f, 0.0f };
 
+// Entities
+// Renderable objects, their world transforms live in the scene graph
+struct TransformNode
+{
+  uint32_t node;
+};
+
+struct MeshInstance
+{
+  uint32_t mesh;
+  uint32_t material;
+};
+
+static EntityStore g_Entities;
+
+static std::vector<EntityStore::ChunkView> g_RenderChunks;
+
+Entity CreateRenderable(uint32_t node, uint32_t mesh, uint32_t material)
+{
+  Entity entity = g_Entities.Create<TransformNode, MeshInstance>();
+  if (entity == INVALID_ENTITY)
+  {
+    return INVALID_ENTITY;
+  }
+  g_Entities.Get<TransformNode>(entity)->node = node;
+  *g_Entities.Get<MeshInstance>(entity) = { mesh, material };
+  return entity;
+}
+
+Result InitScene()
+{
+  g_Materials.clear();
+  g_Materials.push_back({ PIPELINE_TRIANGLE, INVALID_BINDLESS_INDEX });
+  g_Materials.push_back({ PIPELINE_TRIANGLE_QUANTIZED, INVALID_BINDLESS_INDEX });
+
+  g_SceneGraph.Clear();
+  g_SceneGraph.Reserve(3 + (uint32_t)g_InstanceTransforms.size());
+  g_CameraNode = g_SceneGraph.AddNode(SceneGraph::NO_PARENT, glm::vec3{ 0.0f, 2.0f, 2.0f });
+  g_TriangleNode = g_SceneGraph.AddNode(SceneGraph::NO_PARENT);
+  g_InstanceRootNode = g_SceneGraph.AddNode(SceneGraph::NO_PARENT);
+
+  g_Entities.Clear();
+  g_FirstInstanceNode = g_SceneGraph.GetNumNodes();
+  uint32_t mesh = g_ImportedMesh != (uint32_t)-1 ? g_ImportedMesh : 0;
+  // The material's pipeline has to match the mesh's vertex layout
+  uint32_t material = g_Meshes[mesh].quantized ? 1 : 0;
+  if (g_Options.scene == SCENE_INSTANCED)
+  {
+    for (size_t i = 0; i < g_InstanceTransforms.size(); i++)
+    {
+      Entity entity = CreateRenderable(g_SceneGraph.AddNode(g_InstanceRootNode), mesh, material);
+      RETURN_IF_FAILURE(Result::Application(entity == INVALID_ENTITY ? 1 : 0), "EntityStore::Create");
+    }
+  }
+  else
+  {
+    Entity entity = CreateRenderable(g_InstanceRootNode, mesh, material);
+    RETURN_IF_FAILURE(Result::Application(entity == INVALID_ENTITY ? 1 : 0), "EntityStore::Create");
+  }
+
+  return Result::Application(0);
+}
+
+// Lays instances out in a cube spanning [-1, 1] and spins each one around its own Y axis
+void UpdateInstanceTransforms()
+{
+  if (g_Options.scene != SCENE_INSTANCED)
+  {
+    return;
+  }
+
+  uint32_t numInstances = (uint32_t)g_InstanceTransforms.size();
+  uint32_t side = (uint32_t)ceil(cbrt((double)numInstances));
+  float spacing = 2.0f / (float)side;
+
+  for (uint32_t i = 0; i < numInstances; i++)
+  {
+    glm::vec3 position = {
+      -1.0f + spacing * ((float)(i % side) + 0.5f),
+      -1.0f + spacing * ((float)((i / side) % side) + 0.5f),
+      -1.0f + spacing * ((float)(i / (side * side)) + 0.5f) };
+    float angle = g_WorldTime + 0.1f * (float)i;
+
+    g_SceneGraph.SetLocalTransform(g_FirstInstanceNode + i, position,
+                                   glm::angleAxis(angle, glm::vec3{ 0.0f, 1.0f, 0.0f }),
+                                   glm::vec3(0.8f * spacing));
+  }
+}
+
+// Chunks are independent and know where their output starts,
+// so they are extracted in parallel
+void ExtractRenderData()
+{
+  g_RenderChunks.clear();
+  uint32_t numObjects = g_Entities.CollectChunks(MakeComponentMask<TransformNode, MeshInstance>(), g_RenderChunks);
+  numObjects = glm::min(numObjects, (uint32_t)g_InstanceTransforms.size());
+  g_RenderObjects.resize(numObjects);
+  g_RenderObjectBounds.resize(numObjects);
+
+  const glm::mat4x4* worldTransforms = g_SceneGraph.GetWorldTransforms();
+  glm::mat4x4 model = g_UniformBuffer.model;
+  ParallelFor((uint32_t)g_RenderChunks.size(), 16, [numObjects, worldTransforms, &model](uint32_t begin, uint32_t end)
+  {
+    for (uint32_t c = begin; c < end; c++)
+    {
+      const EntityStore::ChunkView& chunk = g_RenderChunks[c];
+      if (chunk.firstIndex >= numObjects)
+      {
+        break;
+      }
+      const TransformNode* nodes = chunk.Get<TransformNode>();
+      const MeshInstance* meshes = chunk.Get<MeshInstance>();
+      uint32_t count = glm::min(chunk.GetCount(), numObjects - chunk.firstIndex);
+      glm::mat4x4* transforms = g_InstanceTransforms.data() + chunk.firstIndex;
+      RenderObject* objects = g_RenderObjects.data() + chunk.firstIndex;
+      Aabb* bounds = g_RenderObjectBounds.data() + chunk.firstIndex;
+      for (uint32_t i = 0; i < count; i++)
+      {
+        transforms[i] = worldTransforms[nodes[i].node];
+        objects[i].mesh = meshes[i].mesh;
+        objects[i].material = meshes[i].material;
+        bounds[i] = TransformAabb(g_Meshes[meshes[i].mesh].bounds, model * transforms[i]);
+      }
+    }
+  });
+}
+
+// Objects keep their place in g_RenderObjects between frames, so the tree is
+// refit to their new bounds and only rebuilt once refitting has made it
+// noticeably worse, or the objects changed
+void UpdateSceneBvh()
+{
+  const float MAX_REFIT_COST_RATIO = 1.5f;
+  uint32_t numObjects = (uint32_t)g_RenderObjects.size();
+  if (g_SceneBvh.GetNumObjects() != numObjects || g_SceneBvh.GetRefitCostRatio() > MAX_REFIT_COST_RATIO)
+  {
+    g_SceneBvh.Build(g_RenderObjectBounds.data(), numObjects);
+  }
+  else
+  {
+    g_SceneBvh.Refit(g_RenderObjectBounds.data());
+  }
+}
+
+// Prints the object under the mouse cursor when the left button is pressed
+void PickObject()
+{
+  if (!g_Input.ButtonPressed(SDL_BUTTON_LMASK) || g_WindowWidth == 0 || g_WindowHeight == 0)
+  {
+    return;
+  }
+
+  // The projection is flipped for Vulkan, so NDC y points down like window coordinates
+  float ndcX = 2.0f * ((float)g_Input.curMouse.x + 0.5f) / (float)g_WindowWidth - 1.0f;
+  float ndcY = 2.0f * ((float)g_Input.curMouse.y + 0.5f) / (float)g_WindowHeight - 1.0f;
+  Ray ray = MakeRay(g_UniformBuffer.proj * g_UniformBuffer.view, ndcX, ndcY);
+
+  float distance = 0.0f;
+  uint32_t object = g_SceneBvh.Raycast(ray, 100.0f, &distance);
+  if (object != Bvh::NO_OBJECT)
+  {
+    printf("Picked object %u at distance %.2f\n", object, distance);
+  }
+}
+
+// Picks the coarsest level whose error projects to less than g_Options.lodErrorPixels.
+// A coarser level is only taken once its error is well below the limit, so
+// objects near the threshold don't switch back and forth every frame.
+uint32_t SelectMeshLod(const Mesh& mesh, uint32_t currentLod, float pixelsPerUnit)
+{
+  const float HYSTERESIS = 0.75f;
+  float maxError = g_Options.lodErrorPixels;
+  uint32_t lod = glm::min(currentLod, mesh.numLods - 1);
+  while (lod > 0 && mesh.lods[lod].error * pixelsPerUnit > maxError)
+  {
+    lod--;
+  }
+  while (lod + 1 < mesh.numLods && mesh.lods[lod + 1].error * pixelsPerUnit < HYSTERESIS * maxError)
+  {
+    lod++;
+  }
+  return lod;
+}
+
+// Visible opaque draws, sorted by state and then front to back
+void BuildDrawList()
+{
+  const float NEAR_PLANE = 0.01f;
+  const float FAR_PLANE = 100.0f;
+  glm::mat4x4 viewModel = g_UniformBuffer.view * g_UniformBuffer.model;
+  // Pixels covered by one unit at view distance 1
+  float pixelsPerUnit = 0.5f * (float)g_DrawableHeight * glm::abs(g_UniformBuffer.proj[1][1]);
+
+  g_VisibleObjects.clear();
+  g_SceneBvh.QueryFrustum(MakeFrustum(g_UniformBuffer.proj * g_UniformBuffer.view), g_VisibleObjects);
+  g_FrameStats.sumVisible += g_VisibleObjects.size();
+  g_RenderObjectLods.resize(g_RenderObjects.size(), 0);
+
+  g_NumDrawTriangles = 0;
+  g_MeshletDrawCount = 0;
+  g_DrawList.Clear();
+  g_DrawList.Reserve((uint32_t)g_VisibleObjects.size());
+  for (uint32_t i : g_VisibleObjects)
+  {
+    const RenderObject& object = g_RenderObjects[i];
+    const Mesh& mesh = g_Meshes[object.mesh];
+    glm::mat4x4 viewTransform = viewModel * g_InstanceTransforms[i];
+    float viewDepth = -viewTransform[3].z;
+
+    // Meshlet draws only cull at full detail, past what the cluster buffer holds objects draw as usual
+    bool meshletDraw = g_NumMeshlets > 0 && object.mesh == g_ImportedMesh && g_MeshletDrawCount < g_MaxMeshletDraws;
+    g_MeshletDrawCount += meshletDraw ? 1 : 0;
+
+    uint32_t lod = 0;
+    if (!meshletDraw && g_Options.lodErrorPixels > 0.0f)
+    {
+      // Distance to the nearest point of the bounds, so large objects don't coarsen up close
+      const Aabb& bounds = g_RenderObjectBounds[i];
+      float radius = 0.5f * glm::length(bounds.max - bounds.min);
+      float distance = glm::max(glm::length(glm::vec3(viewTransform[3])) - radius, NEAR_PLANE);
+      float scale = glm::max(glm::length(glm::vec3(viewTransform[0])),
+                             glm::max(glm::length(glm::vec3(viewTransform[1])), glm::length(glm::vec3(viewTransform[2]))));
+      lod = SelectMeshLod(mesh, g_RenderObjectLods[i], pixelsPerUnit * scale / distance);
+    }
+    g_RenderObjectLods[i] = (uint8_t)lod;
+    g_NumDrawTriangles += mesh.lods[lod].indexCount / 3;
+
+    uint32_t depth = QuantizeDrawDepth(viewDepth, NEAR_PLANE, FAR_PLANE);
+    uint64_t key = MakeDrawSortKey(meshletDraw ? 1 : 0, g_Materials[object.material].pipeline, object.material,
+                                   object.mesh * MAX_MESH_LODS + lod, depth);
+    g_DrawList.Add(key, i);
+  }
+  g_DrawList.Sort();
+  g_MeshletDrawFirst = g_DrawList.GetCount() - g_MeshletDrawCount;
+  g_FrameStats.sumTriangles += g_NumDrawTriangles;
+}
+
+// Benchmark summary, accumulated over the whole run after a warm-up second
+static struct BenchmarkStats
+{
+  uint64_t start = 0;
+  uint64_t lastFrameEnd = 0;
+  uint32_t numFrames = 0;
+  double sumInterval = 0.0;
+  double sumSqInterval = 0.0;
+  double maxInterval = 0.0;
+  double sumUpdateTime = 0.0;
+  double sumTriangles = 0.0;
+} g_BenchmarkStats;
+
+// Returns true once the benchmark duration has elapsed
+bool UpdateBenchmarkStats(double updateTime)
+{
+  uint64_t now = SDL_GetPerformanceCounter();
+  double frequency = (double)SDL_GetPerformanceFrequency();
+
+  if (g_BenchmarkStats.start == 0)
+  {
+    g_BenchmarkStats.start = now;
+  }
+  double elapsed = (double)(now - g_BenchmarkStats.start) / frequency;
+  const double WARM_UP = 1.0;
+  if (elapsed < WARM_UP)
+  {
+    g_BenchmarkStats.lastFrameEnd = now;
+    return false;
+  }
+
+  double interval = (double)(now - g_BenchmarkStats.lastFrameEnd) / frequency;
+  g_BenchmarkStats.lastFrameEnd = now;
+  g_BenchmarkStats.numFrames++;
+  g_BenchmarkStats.sumInterval += interval;
+  g_BenchmarkStats.sumSqInterval += interval * interval;
+  g_BenchmarkStats.maxInterval = glm::max(g_BenchmarkStats.maxInterval, interval);
+  g_BenchmarkStats.sumUpdateTime += updateTime;
+  g_BenchmarkStats.sumTriangles += (double)g_NumDrawTriangles;
+
+  return elapsed >= WARM_UP + (double)g_Options.benchmarkDuration;
+}
+
+void PrintBenchmarkSummary()
+{
+  double n = (double)glm::max(g_BenchmarkStats.numFrames, 1u);
+  double mean = g_BenchmarkStats.sumInterval / n;
+  double variance = glm::max(g_BenchmarkStats.sumSqInterval / n - mean * mean, 0.0);
+
+  printf("Benchmark %s: %u instances, profile %s, %s\n",
+         g_Options.benchmarkName, (uint32_t)g_RenderObjects.size(),
+         g_Options.profile->name, PresentModeName(g_SwapchainPresentMode));
+  printf("  frames      %u in %.2f s\n", g_BenchmarkStats.numFrames, g_BenchmarkStats.sumInterval);
+  printf("  fps         %.1f\n", n / glm::max(g_BenchmarkStats.sumInterval, 1e-9));
+  printf("  frame time  %.3f ms avg, %.3f ms worst, %.3f ms jitter\n",
+         mean * 1000.0, g_BenchmarkStats.maxInterval * 1000.0, sqrt(variance) * 1000.0);
+  printf("  update      %.3f ms/frame\n", g_BenchmarkStats.sumUpdateTime / n * 1000.0);
+  printf("  triangles   %.0f/frame, lod error %.2f px\n", g_BenchmarkStats.sumTriangles / n, g_Options.lodErrorPixels);
+}
+
 void Loop()
 {
-  // adaptive time per loop iteration?
-  const float S_PER_FRAME = 1.0f / 60.0f;
   const float S_PER_UPDATE = 1.0f / 60.0f;
   const int MAX_UPDATES_PER_FRAME = 8;
 
@@ -1785,8 +7357,6 @@ void Loop()
   float lag = 0.0f;
   while (1)
   {
-    uint64_t loopIterationStart = SDL_GetPerformanceCounter();
-
     SDL_Event event;
     while (SDL_PollEvent(&event))
     {
@@ -1842,6 +7412,7 @@ void Loop()
     previous = current;
     lag += elapsed;
 
+    uint64_t updateStart = SDL_GetPerformanceCounter();
     int numUpdates = 0;
     while (lag >= S_PER_UPDATE)
     {
@@ -1861,13 +7432,13 @@ void Loop()
 
         glm::quat rot = glm::angleAxis(glm::radians(90.0f), glm::vec3{ -1.0f, 0.0f, 0.0f });
         rot = glm::rotate(rot, g_WorldTime * glm::radians(90.0f), glm::vec3{ 0.0f, 0.0f, 1.0f });
-        rotationAxis = glm::axis(rot);
-        rotationAngle = glm::angle(rot);
+        g_SceneGraph.SetRotation(g_TriangleNode, rot);
+
+        UpdateInstanceTransforms();
+        g_SceneGraph.UpdateWorldTransforms();
 
-        g_UniformBuffer.model = glm::identity<glm::mat4x4>();
-        g_UniformBuffer.model = glm::scale(g_UniformBuffer.model, scaling);
-        g_UniformBuffer.model = glm::rotate(g_UniformBuffer.model, rotationAngle, rotationAxis);
-        g_UniformBuffer.model = glm::translate(g_UniformBuffer.model, translation);
+        glm::vec3 cameraTranslation = glm::vec3(g_SceneGraph.GetWorldTransform(g_CameraNode)[3]);
+        g_UniformBuffer.model = g_SceneGraph.GetWorldTransform(g_TriangleNode);
         g_UniformBuffer.view = glm::lookAt(cameraTranslation, cameraTarget, cameraUp);
         g_UniformBuffer.proj = glm::perspectiveFov(glm::radians(45.0f), (float)g_DrawableWidth, (float)g_DrawableHeight, 0.01f, 100.0f);
         g_UniformBuffer.proj[1][1] *= -1.0f;
@@ -1876,10 +7447,15 @@ void Loop()
       lag -= S_PER_UPDATE;
       numUpdates++;
     }
+    double updateTime = (double)(SDL_GetPerformanceCounter() - updateStart)
+      / (double)SDL_GetPerformanceFrequency();
 
     if (windowVisible && g_WindowWidth > 0 && g_WindowHeight > 0)
     {
-      UpdateUniformBuffer();
+      ExtractRenderData();
+      UpdateSceneBvh();
+      PickObject();
+      BuildDrawList();
 
       float renderDelay = lag / S_PER_UPDATE; // normalized in range [0, 1)
       Result renderResult = Render(renderDelay);
@@ -1889,28 +7465,49 @@ void Loop()
         SDL_PushEvent(&event);
       }
     }
+    else
+    {
+      // Nothing is presented, so vsync won't throttle the loop
+      SDL_Delay((uint32_t)(S_PER_UPDATE * 1000.0f));
+    }
+
+    g_FramePacer.Wait();
+    UpdateFrameStats();
 
-    uint64_t loopIterationEnd = SDL_GetPerformanceCounter();
-    float loopIterationTime = (float)(loopIterationEnd - loopIterationStart)
-      / (float)SDL_GetPerformanceFrequency();
-    if (loopIterationTime < S_PER_FRAME)
+    if (g_Options.benchmarkDuration > 0.0f && UpdateBenchmarkStats(updateTime))
     {
-      uint32_t sleepMs = (uint32_t)((S_PER_FRAME - loopIterationTime) * 1000.0f);
-      if (sleepMs > 0)
-      {
-        SDL_Delay(sleepMs);
-      }
+      PrintBenchmarkSummary();
+      return;
     }
   }
 }
 
 int main(int argc, char** argv)
 {
+  Result parseResult = ParseCommandLine(argc, argv);
+  HandleResult(parseResult, "ParseCommandLine");
+  if (!parseResult.Success())
+  {
+    return 1;
+  }
+
+  if (g_Options.benchmarkName != nullptr && IsCpuBenchmark(g_Options.benchmarkName))
+  {
+    RunCpuBenchmark(g_Options.benchmarkName, g_Options.benchmarkDuration);
+    ShutdownParallelFor();
+    return 0;
+  }
+
   Result initResult = Init();
   HandleResult(initResult, "Init");
   if (initResult.Success())
   {
-    Loop();
+    Result sceneResult = InitScene();
+    HandleResult(sceneResult, "InitScene");
+    if (sceneResult.Success())
+    {
+      Loop();
+    }
   }
 
   Shutdown();
@@ -0,0 +1,279 @@
+#include "MeshImport.h"
+
+#include <algorithm>
+#include <float.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "assimp/cimport.h"
+#include "assimp/postprocess.h"
+#include "assimp/scene.h"
+
+bool ImportMesh(const char* path, ImportedMesh& outMesh)
+{
+  const aiScene* scene = aiImportFile(path,
+    aiProcess_Triangulate | aiProcess_JoinIdenticalVertices | aiProcess_PreTransformVertices
+    | aiProcess_GenSmoothNormals | aiProcess_SortByPType);
+  if (scene == nullptr)
+  {
+    fprintf(stderr, "Failed to import %s: %s\n", path, aiGetErrorString());
+    return false;
+  }
+
+  outMesh.positions.clear();
+  outMesh.colors.clear();
+  outMesh.indices.clear();
+  for (unsigned int m = 0; m < scene->mNumMeshes; m++)
+  {
+    const aiMesh* mesh = scene->mMeshes[m];
+    if ((mesh->mPrimitiveTypes & aiPrimitiveType_TRIANGLE) == 0)
+    {
+      continue;
+    }
+
+    // Vertex colors if the file has them, normals otherwise
+    uint32_t baseVertex = (uint32_t)outMesh.positions.size();
+    for (unsigned int v = 0; v < mesh->mNumVertices; v++)
+    {
+      const aiVector3D& position = mesh->mVertices[v];
+      outMesh.positions.push_back(glm::vec3(position.x, position.y, position.z));
+      if (mesh->HasVertexColors(0))
+      {
+        const aiColor4D& color = mesh->mColors[0][v];
+        outMesh.colors.push_back(glm::vec3(color.r, color.g, color.b));
+      }
+      else if (mesh->HasNormals())
+      {
+        const aiVector3D& normal = mesh->mNormals[v];
+        outMesh.colors.push_back(0.5f * glm::vec3(normal.x, normal.y, normal.z) + 0.5f);
+      }
+      else
+      {
+        outMesh.colors.push_back(glm::vec3(1.0f));
+      }
+    }
+    for (unsigned int f = 0; f < mesh->mNumFaces; f++)
+    {
+      const aiFace& face = mesh->mFaces[f];
+      if (face.mNumIndices == 3)
+      {
+        outMesh.indices.push_back(baseVertex + face.mIndices[0]);
+        outMesh.indices.push_back(baseVertex + face.mIndices[1]);
+        outMesh.indices.push_back(baseVertex + face.mIndices[2]);
+      }
+    }
+  }
+  aiReleaseImport(scene);
+
+  if (outMesh.indices.empty())
+  {
+    fprintf(stderr, "Failed to import %s: no triangles\n", path);
+    return false;
+  }
+
+  glm::vec3 boundsMin(FLT_MAX);
+  glm::vec3 boundsMax(-FLT_MAX);
+  for (const glm::vec3& position : outMesh.positions)
+  {
+    boundsMin = glm::min(boundsMin, position);
+    boundsMax = glm::max(boundsMax, position);
+  }
+  glm::vec3 center = 0.5f * (boundsMin + boundsMax);
+  glm::vec3 extent = boundsMax - boundsMin;
+  float scale = 1.0f / glm::max(glm::max(extent.x, extent.y), glm::max(extent.z, FLT_MIN));
+  for (glm::vec3& position : outMesh.positions)
+  {
+    position = (position - center) * scale;
+  }
+
+  outMesh.numLods = GenerateMeshLods(outMesh.positions.data(), (uint32_t)outMesh.positions.size(),
+                                     outMesh.indices, outMesh.lods);
+  SplitMeshParts(outMesh);
+  return true;
+}
+
+// Interleaves the low 10 bits of x with two zero bits each
+static uint32_t SpreadBits(uint32_t x)
+{
+  x = (x | (x << 16)) & 0x030000FF;
+  x = (x | (x << 8)) & 0x0300F00F;
+  x = (x | (x << 4)) & 0x030C30C3;
+  x = (x | (x << 2)) & 0x09249249;
+  return x;
+}
+
+static uint32_t MortonCode(const glm::vec3& position)
+{
+  // Positions are in the unit cube around the origin
+  glm::uvec3 cell = glm::uvec3(glm::clamp(position + 0.5f, 0.0f, 1.0f) * 1023.0f);
+  return SpreadBits(cell.x) | (SpreadBits(cell.y) << 1) | (SpreadBits(cell.z) << 2);
+}
+
+void SplitMeshParts(ImportedMesh& mesh)
+{
+  const uint32_t NOT_IN_PART = (uint32_t)-1;
+
+  uint32_t numVertices = (uint32_t)mesh.positions.size();
+  mesh.parts.clear();
+  mesh.numDuplicatedVertices = 0;
+  if (numVertices <= MAX_PART_VERTICES)
+  {
+    MeshPart part = {};
+    part.vertexCount = numVertices;
+    memcpy(part.lods, mesh.lods, sizeof(mesh.lods));
+    mesh.parts.push_back(part);
+    mesh.shortIndices.assign(mesh.indices.begin(), mesh.indices.end());
+    return;
+  }
+
+  // Triangles of all levels, by position, then level. Coarse levels reuse
+  // vertices of the full detail one, so a level's triangles mostly land in
+  // the parts that already hold their vertices.
+  struct Triangle
+  {
+    uint32_t code;
+    uint32_t lod;
+    uint32_t firstIndex;
+  };
+  std::vector<Triangle> triangles;
+  triangles.reserve(mesh.indices.size() / 3);
+  for (uint32_t lod = 0; lod < mesh.numLods; lod++)
+  {
+    for (uint32_t i = mesh.lods[lod].firstIndex; i < mesh.lods[lod].firstIndex + mesh.lods[lod].indexCount; i += 3)
+    {
+      glm::vec3 centroid = (mesh.positions[mesh.indices[i]] + mesh.positions[mesh.indices[i + 1]] + mesh.positions[mesh.indices[i + 2]]) / 3.0f;
+      triangles.push_back({ MortonCode(centroid), lod, i });
+    }
+  }
+  std::sort(triangles.begin(), triangles.end(), [](const Triangle& a, const Triangle& b)
+  {
+    return a.code != b.code ? a.code < b.code : a.lod < b.lod;
+  });
+
+  // Parts take triangles in curve order until their vertices are full
+  std::vector<uint32_t> localIndices(numVertices, NOT_IN_PART);
+  std::vector<uint32_t> partVertices;
+  std::vector<uint32_t> partTriangles;
+  std::vector<uint16_t> lodIndices[MAX_MESH_LODS];
+  std::vector<uint32_t> firstCopy(numVertices, NOT_IN_PART);
+  std::vector<glm::vec3> positions;
+  std::vector<glm::vec3> colors;
+  mesh.shortIndices.clear();
+  uint32_t next = 0;
+  while (next < (uint32_t)triangles.size())
+  {
+    partVertices.clear();
+    partTriangles.clear();
+    for (; next < (uint32_t)triangles.size(); next++)
+    {
+      const uint32_t* corners = &mesh.indices[triangles[next].firstIndex];
+      uint32_t newVertices = 0;
+      for (uint32_t c = 0; c < 3; c++)
+      {
+        newVertices += localIndices[corners[c]] == NOT_IN_PART ? 1 : 0;
+      }
+      if ((uint32_t)partVertices.size() + newVertices > MAX_PART_VERTICES)
+      {
+        break;
+      }
+      for (uint32_t c = 0; c < 3; c++)
+      {
+        if (localIndices[corners[c]] == NOT_IN_PART)
+        {
+          localIndices[corners[c]] = (uint32_t)partVertices.size();
+          partVertices.push_back(corners[c]);
+        }
+      }
+      partTriangles.push_back(next);
+    }
+
+    MeshPart part = {};
+    part.firstVertex = (uint32_t)positions.size();
+    part.vertexCount = (uint32_t)partVertices.size();
+    for (uint32_t lod = 0; lod < mesh.numLods; lod++)
+    {
+      lodIndices[lod].clear();
+    }
+    for (uint32_t t : partTriangles)
+    {
+      const uint32_t* corners = &mesh.indices[triangles[t].firstIndex];
+      for (uint32_t c = 0; c < 3; c++)
+      {
+        lodIndices[triangles[t].lod].push_back((uint16_t)localIndices[corners[c]]);
+      }
+    }
+    for (uint32_t lod = 0; lod < mesh.numLods; lod++)
+    {
+      part.lods[lod] = { (uint32_t)mesh.shortIndices.size(), (uint32_t)lodIndices[lod].size(), mesh.lods[lod].error };
+      mesh.shortIndices.insert(mesh.shortIndices.end(), lodIndices[lod].begin(), lodIndices[lod].end());
+    }
+    mesh.parts.push_back(part);
+
+    for (uint32_t vertex : partVertices)
+    {
+      if (firstCopy[vertex] == NOT_IN_PART)
+      {
+        firstCopy[vertex] = (uint32_t)positions.size();
+      }
+      else
+      {
+        mesh.numDuplicatedVertices++;
+      }
+      positions.push_back(mesh.positions[vertex]);
+      colors.push_back(mesh.colors[vertex]);
+      localIndices[vertex] = NOT_IN_PART;
+    }
+  }
+
+  for (uint32_t& index : mesh.indices)
+  {
+    index = firstCopy[index];
+  }
+  mesh.positions.swap(positions);
+  mesh.colors.swap(colors);
+}
+
+bool DropFinestLod(ImportedMesh& mesh)
+{
+  const uint32_t NOT_USED = (uint32_t)-1;
+
+  if (mesh.numLods < 2)
+  {
+    return false;
+  }
+
+  MeshLod dropped = mesh.lods[0];
+  mesh.indices.erase(mesh.indices.begin() + dropped.firstIndex,
+                     mesh.indices.begin() + dropped.firstIndex + dropped.indexCount);
+  for (uint32_t lod = 1; lod < mesh.numLods; lod++)
+  {
+    mesh.lods[lod - 1] = mesh.lods[lod];
+    if (mesh.lods[lod - 1].firstIndex > dropped.firstIndex)
+    {
+      mesh.lods[lod - 1].firstIndex -= dropped.indexCount;
+    }
+  }
+  mesh.numLods--;
+  mesh.lods[mesh.numLods] = {};
+
+  // Indices address each vertex's first copy, so the copies on part borders
+  // go as well and SplitMeshParts makes them again where needed
+  std::vector<uint32_t> remap(mesh.positions.size(), NOT_USED);
+  std::vector<glm::vec3> positions;
+  std::vector<glm::vec3> colors;
+  for (uint32_t& index : mesh.indices)
+  {
+    if (remap[index] == NOT_USED)
+    {
+      remap[index] = (uint32_t)positions.size();
+      positions.push_back(mesh.positions[index]);
+      colors.push_back(mesh.colors[index]);
+    }
+    index = remap[index];
+  }
+  mesh.positions.swap(positions);
+  mesh.colors.swap(colors);
+
+  SplitMeshParts(mesh);
+  return true;
+}
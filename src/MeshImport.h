@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+#include "glm/glm.hpp"
+
+#include "MeshSimplify.h"
+
+// Most vertices a part's 16 bit indices address
+static const uint32_t MAX_PART_VERTICES = 65535;
+
+// A window of the mesh's vertices small enough for 16 bit indices. Each
+// level's triangles are spread over the parts, lods index shortIndices
+// relative to firstVertex.
+struct MeshPart
+{
+  uint32_t firstVertex;
+  uint32_t vertexCount;
+  MeshLod lods[MAX_MESH_LODS];
+};
+
+// All meshes of a model file merged into one indexed triangle list,
+// centered and scaled to fit a unit cube, with generated levels of detail.
+// indices address all vertices, shortIndices are what gets drawn.
+struct ImportedMesh
+{
+  std::vector<glm::vec3> positions;
+  std::vector<glm::vec3> colors;
+  std::vector<uint32_t> indices;
+  MeshLod lods[MAX_MESH_LODS];
+  uint32_t numLods = 0;
+  std::vector<uint16_t> shortIndices;
+  std::vector<MeshPart> parts;
+  // Vertices on part borders are copied into each part using them
+  uint32_t numDuplicatedVertices = 0;
+};
+
+// Splits the mesh's levels into parts of at most MAX_PART_VERTICES vertices.
+// Meshes that fit keep their vertices and triangles in order as one part.
+// Larger ones get their triangles sorted along a Morton curve, so parts
+// are compact and only their borders duplicate vertices. Vertices are
+// reordered by part and indices remapped to each vertex's first copy.
+void SplitMeshParts(ImportedMesh& mesh);
+
+// Removes the finest level, the vertices only it used, and splits the rest
+// into parts again. Returns false if the mesh is down to its last level.
+bool DropFinestLod(ImportedMesh& mesh);
+
+// Returns false and prints the importer's error if the file can't be read
+bool ImportMesh(const char* path, ImportedMesh& outMesh);
@@ -0,0 +1,287 @@
+#include "MeshSimplify.h"
+
+#include <algorithm>
+#include <math.h>
+
+// Error quadric of a set of planes, the symmetric 4x4 matrix sum(p * p^T)
+struct Quadric
+{
+  double a2, ab, ac, ad, b2, bc, bd, c2, cd, d2;
+
+  void AddPlane(const glm::dvec3& normal, double distance, double weight)
+  {
+    a2 += weight * normal.x * normal.x;
+    ab += weight * normal.x * normal.y;
+    ac += weight * normal.x * normal.z;
+    ad += weight * normal.x * distance;
+    b2 += weight * normal.y * normal.y;
+    bc += weight * normal.y * normal.z;
+    bd += weight * normal.y * distance;
+    c2 += weight * normal.z * normal.z;
+    cd += weight * normal.z * distance;
+    d2 += weight * distance * distance;
+  }
+
+  void Add(const Quadric& other)
+  {
+    a2 += other.a2; ab += other.ab; ac += other.ac; ad += other.ad;
+    b2 += other.b2; bc += other.bc; bd += other.bd;
+    c2 += other.c2; cd += other.cd;
+    d2 += other.d2;
+  }
+
+  // Sum of squared distances of p to the planes
+  double Evaluate(const glm::dvec3& p) const
+  {
+    return a2 * p.x * p.x + 2.0 * ab * p.x * p.y + 2.0 * ac * p.x * p.z + 2.0 * ad * p.x
+      + b2 * p.y * p.y + 2.0 * bc * p.y * p.z + 2.0 * bd * p.y
+      + c2 * p.z * p.z + 2.0 * cd * p.z
+      + d2;
+  }
+};
+
+struct EdgeCollapse
+{
+  uint32_t from;
+  uint32_t to;
+  double cost;
+};
+
+static uint64_t EdgeKey(uint32_t a, uint32_t b)
+{
+  return a < b ? ((uint64_t)a << 32) | b : ((uint64_t)b << 32) | a;
+}
+
+static glm::dvec3 TriangleNormal(const glm::dvec3& p0, const glm::dvec3& p1, const glm::dvec3& p2)
+{
+  return glm::cross(p1 - p0, p2 - p0);
+}
+
+float SimplifyMesh(const glm::vec3* positions, uint32_t numVertices,
+                   const uint32_t* indices, uint32_t numIndices,
+                   uint32_t targetIndexCount, std::vector<uint32_t>& outIndices)
+{
+  // Border planes are weighted up so open edges barely move
+  const double BORDER_WEIGHT = 10.0;
+  const uint32_t MAX_PASSES = 32;
+
+  outIndices.assign(indices, indices + numIndices);
+  std::vector<glm::dvec3> points(positions, positions + numVertices);
+
+  // Quadrics of the faces around each vertex, plus planes through border
+  // edges perpendicular to their face
+  std::vector<Quadric> quadrics(numVertices, Quadric{});
+  std::vector<uint64_t> edges;
+  edges.reserve(numIndices);
+  for (uint32_t i = 0; i < numIndices; i += 3)
+  {
+    for (uint32_t e = 0; e < 3; e++)
+    {
+      edges.push_back(EdgeKey(indices[i + e], indices[i + (e + 1) % 3]));
+    }
+  }
+  std::sort(edges.begin(), edges.end());
+
+  for (uint32_t i = 0; i < numIndices; i += 3)
+  {
+    uint32_t v[3] = { indices[i], indices[i + 1], indices[i + 2] };
+    glm::dvec3 normal = TriangleNormal(points[v[0]], points[v[1]], points[v[2]]);
+    double length = glm::length(normal);
+    if (length == 0.0)
+    {
+      continue;
+    }
+    normal /= length;
+    for (uint32_t e = 0; e < 3; e++)
+    {
+      quadrics[v[e]].AddPlane(normal, -glm::dot(normal, points[v[0]]), 1.0);
+
+      uint32_t a = v[e];
+      uint32_t b = v[(e + 1) % 3];
+      uint64_t key = EdgeKey(a, b);
+      std::vector<uint64_t>::iterator first = std::lower_bound(edges.begin(), edges.end(), key);
+      if (first + 1 != edges.end() && first[1] == key)
+      {
+        continue;
+      }
+      glm::dvec3 borderNormal = glm::cross(points[b] - points[a], normal);
+      double borderLength = glm::length(borderNormal);
+      if (borderLength > 0.0)
+      {
+        borderNormal /= borderLength;
+        double distance = -glm::dot(borderNormal, points[a]);
+        quadrics[a].AddPlane(borderNormal, distance, BORDER_WEIGHT);
+        quadrics[b].AddPlane(borderNormal, distance, BORDER_WEIGHT);
+      }
+    }
+  }
+
+  double maxCost = 0.0;
+  std::vector<uint32_t> triangleOffsets(numVertices + 1);
+  std::vector<uint32_t> vertexTriangles;
+  std::vector<EdgeCollapse> collapses;
+  std::vector<uint32_t> remap(numVertices);
+  std::vector<uint8_t> locked(numVertices);
+  for (uint32_t pass = 0; pass < MAX_PASSES && outIndices.size() > targetIndexCount; pass++)
+  {
+    uint32_t indexCount = (uint32_t)outIndices.size();
+
+    // Triangles around each vertex
+    std::fill(triangleOffsets.begin(), triangleOffsets.end(), 0);
+    for (uint32_t index : outIndices)
+    {
+      triangleOffsets[index + 1]++;
+    }
+    for (uint32_t v = 0; v < numVertices; v++)
+    {
+      triangleOffsets[v + 1] += triangleOffsets[v];
+    }
+    vertexTriangles.resize(indexCount);
+    std::vector<uint32_t> fill(triangleOffsets.begin(), triangleOffsets.end() - 1);
+    for (uint32_t i = 0; i < indexCount; i++)
+    {
+      vertexTriangles[fill[outIndices[i]]++] = i / 3;
+    }
+
+    // Each edge collapses in its cheaper direction
+    edges.clear();
+    for (uint32_t i = 0; i < indexCount; i += 3)
+    {
+      for (uint32_t e = 0; e < 3; e++)
+      {
+        edges.push_back(EdgeKey(outIndices[i + e], outIndices[i + (e + 1) % 3]));
+      }
+    }
+    std::sort(edges.begin(), edges.end());
+    edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+
+    collapses.clear();
+    for (uint64_t edge : edges)
+    {
+      uint32_t a = (uint32_t)(edge >> 32);
+      uint32_t b = (uint32_t)edge;
+      Quadric quadric = quadrics[a];
+      quadric.Add(quadrics[b]);
+      double costToA = quadric.Evaluate(points[a]);
+      double costToB = quadric.Evaluate(points[b]);
+      collapses.push_back(costToA < costToB ? EdgeCollapse{ b, a, costToA } : EdgeCollapse{ a, b, costToB });
+    }
+    std::sort(collapses.begin(), collapses.end(), [](const EdgeCollapse& x, const EdgeCollapse& y)
+    {
+      return x.cost < y.cost;
+    });
+
+    // Collapses in one pass must not touch each other's triangles, since
+    // the flip test below only sees the triangles as of the pass start
+    for (uint32_t v = 0; v < numVertices; v++)
+    {
+      remap[v] = v;
+      locked[v] = 0;
+    }
+    uint32_t trianglesToRemove = (indexCount - targetIndexCount) / 3;
+    uint32_t trianglesRemoved = 0;
+    for (const EdgeCollapse& collapse : collapses)
+    {
+      if (trianglesRemoved >= trianglesToRemove)
+      {
+        break;
+      }
+      if (locked[collapse.from] || locked[collapse.to])
+      {
+        continue;
+      }
+
+      bool flips = false;
+      uint32_t sharedTriangles = 0;
+      for (uint32_t t = triangleOffsets[collapse.from]; t < triangleOffsets[collapse.from + 1] && !flips; t++)
+      {
+        const uint32_t* triangle = &outIndices[vertexTriangles[t] * 3];
+        if (triangle[0] == collapse.to || triangle[1] == collapse.to || triangle[2] == collapse.to)
+        {
+          sharedTriangles++;
+          continue;
+        }
+        glm::dvec3 before = TriangleNormal(points[triangle[0]], points[triangle[1]], points[triangle[2]]);
+        glm::dvec3 corners[3];
+        for (uint32_t c = 0; c < 3; c++)
+        {
+          corners[c] = points[triangle[c] == collapse.from ? collapse.to : triangle[c]];
+        }
+        glm::dvec3 after = TriangleNormal(corners[0], corners[1], corners[2]);
+        flips = glm::dot(before, after) <= 0.0;
+      }
+      if (flips)
+      {
+        continue;
+      }
+
+      remap[collapse.from] = collapse.to;
+      quadrics[collapse.to].Add(quadrics[collapse.from]);
+      maxCost = std::max(maxCost, collapse.cost);
+      trianglesRemoved += sharedTriangles;
+      for (uint32_t t = triangleOffsets[collapse.from]; t < triangleOffsets[collapse.from + 1]; t++)
+      {
+        const uint32_t* triangle = &outIndices[vertexTriangles[t] * 3];
+        locked[triangle[0]] = 1;
+        locked[triangle[1]] = 1;
+        locked[triangle[2]] = 1;
+      }
+    }
+    if (trianglesRemoved == 0)
+    {
+      break;
+    }
+
+    uint32_t written = 0;
+    for (uint32_t i = 0; i < indexCount; i += 3)
+    {
+      uint32_t a = remap[outIndices[i]];
+      uint32_t b = remap[outIndices[i + 1]];
+      uint32_t c = remap[outIndices[i + 2]];
+      if (a != b && b != c && c != a)
+      {
+        outIndices[written++] = a;
+        outIndices[written++] = b;
+        outIndices[written++] = c;
+      }
+    }
+    outIndices.resize(written);
+  }
+
+  return (float)sqrt(maxCost);
+}
+
+uint32_t GenerateMeshLods(const glm::vec3* positions, uint32_t numVertices,
+                          std::vector<uint32_t>& indices, MeshLod* outLods)
+{
+  const uint32_t MIN_LOD_TRIANGLES = 32;
+  // Levels that barely reduce the triangle count aren't worth a draw state change
+  const float MIN_REDUCTION = 0.8f;
+
+  outLods[0] = { 0, (uint32_t)indices.size(), 0.0f };
+  uint32_t numLods = 1;
+  std::vector<uint32_t> source;
+  std::vector<uint32_t> simplified;
+  while (numLods < MAX_MESH_LODS)
+  {
+    const MeshLod& previous = outLods[numLods - 1];
+    uint32_t target = previous.indexCount / 6 * 3;
+    if (target < MIN_LOD_TRIANGLES * 3)
+    {
+      break;
+    }
+
+    // Each level is simplified from the previous one, so errors add up
+    source.assign(indices.begin() + previous.firstIndex, indices.begin() + previous.firstIndex + previous.indexCount);
+    float error = SimplifyMesh(positions, numVertices, source.data(), previous.indexCount, target, simplified);
+    if ((float)simplified.size() > MIN_REDUCTION * (float)previous.indexCount)
+    {
+      break;
+    }
+
+    outLods[numLods] = { (uint32_t)indices.size(), (uint32_t)simplified.size(), previous.error + error };
+    indices.insert(indices.end(), simplified.begin(), simplified.end());
+    numLods++;
+  }
+  return numLods;
+}
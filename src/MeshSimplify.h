@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+#include "glm/glm.hpp"
+
+static const uint32_t MAX_MESH_LODS = 4;
+
+// A level of detail is a range of a mesh's index list. All levels index the
+// same vertices, so they can share one vertex range.
+struct MeshLod
+{
+  uint32_t firstIndex;
+  uint32_t indexCount;
+  // Object space distance the level may deviate from the full detail mesh
+  float error;
+};
+
+// Reduces a triangle list towards targetIndexCount by collapsing edges onto
+// one of their vertices, cheapest quadric error first. Open borders are
+// kept in place. Returns the largest error of a collapse, as a distance.
+float SimplifyMesh(const glm::vec3* positions, uint32_t numVertices,
+                   const uint32_t* indices, uint32_t numIndices,
+                   uint32_t targetIndexCount, std::vector<uint32_t>& outIndices);
+
+// indices holds the full detail triangle list on input. Simplified levels,
+// each about half the triangles of the previous one, are appended to it.
+// Returns the number of levels written to outLods, including the first.
+uint32_t GenerateMeshLods(const glm::vec3* positions, uint32_t numVertices,
+                          std::vector<uint32_t>& indices, MeshLod* outLods);
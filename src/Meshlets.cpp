@@ -0,0 +1,165 @@
+#include "Meshlets.h"
+
+#include <float.h>
+#include <math.h>
+
+static const uint32_t NO_TRIANGLE = (uint32_t)-1;
+static const uint8_t NOT_IN_MESHLET = 0xFF;
+
+static void ComputeMeshletBounds(const glm::vec3* positions, const uint32_t* vertices,
+                                 const uint32_t* triangles, Meshlet& meshlet)
+{
+  glm::vec3 boundsMin(FLT_MAX);
+  glm::vec3 boundsMax(-FLT_MAX);
+  for (uint32_t i = 0; i < meshlet.vertexCount; i++)
+  {
+    boundsMin = glm::min(boundsMin, positions[vertices[i]]);
+    boundsMax = glm::max(boundsMax, positions[vertices[i]]);
+  }
+  glm::vec3 center = 0.5f * (boundsMin + boundsMax);
+  float radius = 0.0f;
+  for (uint32_t i = 0; i < meshlet.vertexCount; i++)
+  {
+    radius = glm::max(radius, glm::length(positions[vertices[i]] - center));
+  }
+  meshlet.sphere = glm::vec4(center, radius);
+
+  // The cone's axis is the average face normal, its spread the widest
+  // angle between a face normal and the axis
+  glm::vec3 normals[MAX_MESHLET_TRIANGLES];
+  glm::vec3 axis(0.0f);
+  for (uint32_t i = 0; i < meshlet.triangleCount; i++)
+  {
+    uint32_t triangle = triangles[i];
+    const glm::vec3& p0 = positions[vertices[triangle & 0xFF]];
+    const glm::vec3& p1 = positions[vertices[(triangle >> 8) & 0xFF]];
+    const glm::vec3& p2 = positions[vertices[(triangle >> 16) & 0xFF]];
+    glm::vec3 normal = glm::cross(p1 - p0, p2 - p0);
+    float length = glm::length(normal);
+    normals[i] = length > 0.0f ? normal / length : glm::vec3(0.0f);
+    axis += normals[i];
+  }
+
+  meshlet.cone = glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+  float axisLength = glm::length(axis);
+  if (axisLength == 0.0f)
+  {
+    return;
+  }
+  axis /= axisLength;
+  float minDot = 1.0f;
+  for (uint32_t i = 0; i < meshlet.triangleCount; i++)
+  {
+    if (normals[i] != glm::vec3(0.0f))
+    {
+      minDot = glm::min(minDot, glm::dot(normals[i], axis));
+    }
+  }
+  // Normals spread over a hemisphere or more, no view direction sees only backs
+  if (minDot <= 0.0f)
+  {
+    return;
+  }
+  meshlet.cone = glm::vec4(axis, sqrtf(1.0f - minDot * minDot));
+}
+
+void BuildMeshlets(const glm::vec3* positions, uint32_t numVertices,
+                   const uint32_t* indices, uint32_t numIndices, MeshletData& outData)
+{
+  outData.meshlets.clear();
+  outData.vertices.clear();
+  outData.triangles.clear();
+
+  // Triangles around each vertex
+  uint32_t numTriangles = numIndices / 3;
+  std::vector<uint32_t> triangleOffsets(numVertices + 1, 0);
+  for (uint32_t i = 0; i < numTriangles * 3; i++)
+  {
+    triangleOffsets[indices[i] + 1]++;
+  }
+  for (uint32_t v = 0; v < numVertices; v++)
+  {
+    triangleOffsets[v + 1] += triangleOffsets[v];
+  }
+  std::vector<uint32_t> vertexTriangles(numTriangles * 3);
+  std::vector<uint32_t> fill(triangleOffsets.begin(), triangleOffsets.end() - 1);
+  for (uint32_t i = 0; i < numTriangles * 3; i++)
+  {
+    vertexTriangles[fill[indices[i]]++] = i / 3;
+  }
+
+  std::vector<uint8_t> usedTriangles(numTriangles, 0);
+  std::vector<uint8_t> localIndices(numVertices, NOT_IN_MESHLET);
+  uint32_t nextSeed = 0;
+  while (1)
+  {
+    while (nextSeed < numTriangles && usedTriangles[nextSeed])
+    {
+      nextSeed++;
+    }
+    if (nextSeed == numTriangles)
+    {
+      break;
+    }
+
+    Meshlet meshlet = {};
+    meshlet.vertexOffset = (uint32_t)outData.vertices.size();
+    meshlet.triangleOffset = (uint32_t)outData.triangles.size();
+    uint32_t triangle = nextSeed;
+    while (triangle != NO_TRIANGLE)
+    {
+      uint32_t packed = 0;
+      for (uint32_t corner = 0; corner < 3; corner++)
+      {
+        uint32_t vertex = indices[triangle * 3 + corner];
+        if (localIndices[vertex] == NOT_IN_MESHLET)
+        {
+          localIndices[vertex] = (uint8_t)meshlet.vertexCount++;
+          outData.vertices.push_back(vertex);
+        }
+        packed |= (uint32_t)localIndices[vertex] << (8 * corner);
+      }
+      outData.triangles.push_back(packed);
+      meshlet.triangleCount++;
+      usedTriangles[triangle] = 1;
+      if (meshlet.triangleCount == MAX_MESHLET_TRIANGLES)
+      {
+        break;
+      }
+
+      // Continue with the unused neighbor that adds the fewest vertices
+      triangle = NO_TRIANGLE;
+      uint32_t fewestNewVertices = 4;
+      for (uint32_t i = 0; i < meshlet.vertexCount && fewestNewVertices > 0; i++)
+      {
+        uint32_t vertex = outData.vertices[meshlet.vertexOffset + i];
+        for (uint32_t t = triangleOffsets[vertex]; t < triangleOffsets[vertex + 1]; t++)
+        {
+          uint32_t neighbor = vertexTriangles[t];
+          if (usedTriangles[neighbor])
+          {
+            continue;
+          }
+          uint32_t newVertices = 0;
+          for (uint32_t corner = 0; corner < 3; corner++)
+          {
+            newVertices += localIndices[indices[neighbor * 3 + corner]] == NOT_IN_MESHLET ? 1 : 0;
+          }
+          if (meshlet.vertexCount + newVertices <= MAX_MESHLET_VERTICES && newVertices < fewestNewVertices)
+          {
+            triangle = neighbor;
+            fewestNewVertices = newVertices;
+          }
+        }
+      }
+    }
+
+    ComputeMeshletBounds(positions, &outData.vertices[meshlet.vertexOffset],
+                         &outData.triangles[meshlet.triangleOffset], meshlet);
+    outData.meshlets.push_back(meshlet);
+    for (uint32_t i = 0; i < meshlet.vertexCount; i++)
+    {
+      localIndices[outData.vertices[meshlet.vertexOffset + i]] = NOT_IN_MESHLET;
+    }
+  }
+}
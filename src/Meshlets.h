@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+#include "glm/glm.hpp"
+
+static const uint32_t MAX_MESHLET_VERTICES = 64;
+static const uint32_t MAX_MESHLET_TRIANGLES = 124;
+
+// Matches the std430 layout of Meshlet in the meshlet shaders
+struct Meshlet
+{
+  // Bounding sphere, xyz = center, w = radius
+  glm::vec4 sphere;
+  // Normal cone, xyz = axis, w = cutoff. The meshlet faces away from any
+  // viewer at v for which dot(normalize(center - v), axis) >= cutoff,
+  // widened by the radius. A cutoff of 1 never culls.
+  glm::vec4 cone;
+  // Range in the meshlet vertex list, which holds indices into the mesh's vertices
+  uint32_t vertexOffset;
+  uint32_t vertexCount;
+  // Range in the meshlet triangle list, one packed triangle of local vertex
+  // indices (8 bits each) per entry
+  uint32_t triangleOffset;
+  uint32_t triangleCount;
+};
+
+struct MeshletData
+{
+  std::vector<Meshlet> meshlets;
+  std::vector<uint32_t> vertices;
+  std::vector<uint32_t> triangles;
+};
+
+// Splits a triangle list into meshlets of at most MAX_MESHLET_VERTICES
+// vertices and MAX_MESHLET_TRIANGLES triangles. Meshlets grow through
+// triangles that share vertices with them, which keeps them compact so
+// their bounds and cones cull well.
+void BuildMeshlets(const glm::vec3* positions, uint32_t numVertices,
+                   const uint32_t* indices, uint32_t numIndices, MeshletData& outData);
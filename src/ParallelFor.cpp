@@ -0,0 +1,172 @@
+#include "ParallelFor.h"
+
+#include <vector>
+
+#include "SDL.h"
+
+// Worker threads are started on the first ParallelFor() and sleep on a
+// condition variable between calls. All job state is guarded by the mutex;
+// ranges are claimed one at a time, there are never more than CPU cores.
+struct ParallelForPool
+{
+  std::vector<SDL_Thread*> threads;
+  SDL_mutex* mutex = nullptr;
+  SDL_cond* workAvailable = nullptr;
+  SDL_cond* workDone = nullptr;
+  bool quit = false;
+
+  // Current job
+  const std::function<void(uint32_t, uint32_t)>* task = nullptr;
+  uint32_t count = 0;
+  uint32_t numRanges = 0;
+  uint32_t nextRange = 0;
+  uint32_t rangesLeft = 0;
+};
+static ParallelForPool g_ParallelForPool;
+
+// Called with the mutex locked, returns with it locked
+static void RunParallelForRanges(ParallelForPool& pool)
+{
+  while (pool.nextRange < pool.numRanges)
+  {
+    uint32_t i = pool.nextRange++;
+    const std::function<void(uint32_t, uint32_t)>& task = *pool.task;
+    uint32_t begin = (uint32_t)((uint64_t)pool.count * i / pool.numRanges);
+    uint32_t end = (uint32_t)((uint64_t)pool.count * (i + 1) / pool.numRanges);
+
+    SDL_UnlockMutex(pool.mutex);
+    task(begin, end);
+    SDL_LockMutex(pool.mutex);
+
+    if (--pool.rangesLeft == 0)
+    {
+      SDL_CondSignal(pool.workDone);
+    }
+  }
+}
+
+static int RunParallelForWorker(void* data)
+{
+  ParallelForPool& pool = *(ParallelForPool*)data;
+  SDL_LockMutex(pool.mutex);
+  while (!pool.quit)
+  {
+    RunParallelForRanges(pool);
+    if (!pool.quit)
+    {
+      SDL_CondWait(pool.workAvailable, pool.mutex);
+    }
+  }
+  SDL_UnlockMutex(pool.mutex);
+  return 0;
+}
+
+static bool StartParallelForPool(ParallelForPool& pool)
+{
+  if (pool.mutex != nullptr)
+  {
+    return true;
+  }
+
+  pool.mutex = SDL_CreateMutex();
+  pool.workAvailable = SDL_CreateCond();
+  pool.workDone = SDL_CreateCond();
+  if (pool.mutex == nullptr || pool.workAvailable == nullptr || pool.workDone == nullptr)
+  {
+    ShutdownParallelFor();
+    return false;
+  }
+
+  // The calling thread takes part too. If a worker cannot be created the
+  // others (or the caller) pick up its ranges.
+  uint32_t numWorkers = (uint32_t)SDL_GetCPUCount() - 1;
+  for (uint32_t i = 0; i < numWorkers; i++)
+  {
+    SDL_Thread* thread = SDL_CreateThread(RunParallelForWorker, "ParallelFor", &pool);
+    if (thread != nullptr)
+    {
+      pool.threads.push_back(thread);
+    }
+  }
+  return true;
+}
+
+void ParallelFor(uint32_t count, uint32_t minPerTask, const std::function<void(uint32_t, uint32_t)>& task)
+{
+  uint32_t numTasks = (uint32_t)SDL_GetCPUCount();
+  if (minPerTask > 0 && count / minPerTask < numTasks)
+  {
+    numTasks = count / minPerTask;
+  }
+  if (numTasks <= 1 || !StartParallelForPool(g_ParallelForPool))
+  {
+    task(0, count);
+    return;
+  }
+
+  ParallelForPool& pool = g_ParallelForPool;
+  SDL_LockMutex(pool.mutex);
+  if (pool.rangesLeft > 0)
+  {
+    // Called from a task or from another thread while a job is running
+    SDL_UnlockMutex(pool.mutex);
+    task(0, count);
+    return;
+  }
+
+  pool.task = &task;
+  pool.count = count;
+  pool.numRanges = numTasks;
+  pool.nextRange = 0;
+  pool.rangesLeft = numTasks;
+  SDL_CondBroadcast(pool.workAvailable);
+
+  RunParallelForRanges(pool);
+  while (pool.rangesLeft > 0)
+  {
+    SDL_CondWait(pool.workDone, pool.mutex);
+  }
+
+  pool.task = nullptr;
+  pool.numRanges = 0;
+  pool.nextRange = 0;
+  SDL_UnlockMutex(pool.mutex);
+}
+
+void ShutdownParallelFor()
+{
+  ParallelForPool& pool = g_ParallelForPool;
+  if (pool.mutex != nullptr)
+  {
+    SDL_LockMutex(pool.mutex);
+    pool.quit = true;
+    if (pool.workAvailable != nullptr)
+    {
+      SDL_CondBroadcast(pool.workAvailable);
+    }
+    SDL_UnlockMutex(pool.mutex);
+  }
+
+  for (SDL_Thread* thread : pool.threads)
+  {
+    SDL_WaitThread(thread, nullptr);
+  }
+  pool.threads.clear();
+
+  if (pool.workDone != nullptr)
+  {
+    SDL_DestroyCond(pool.workDone);
+    pool.workDone = nullptr;
+  }
+  if (pool.workAvailable != nullptr)
+  {
+    SDL_DestroyCond(pool.workAvailable);
+    pool.workAvailable = nullptr;
+  }
+  if (pool.mutex != nullptr)
+  {
+    SDL_DestroyMutex(pool.mutex);
+    pool.mutex = nullptr;
+  }
+  pool.quit = false;
+}
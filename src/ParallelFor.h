@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stdint.h>
+#include <functional>
+
+// Splits [0, count) into contiguous ranges of at least minPerTask items,
+// one per CPU core at most, and runs task(begin, end) on each range. The
+// ranges run on a pool of worker threads started by the first call, with
+// the calling thread taking part; returns once all are done. Calls made
+// while another one is running (e.g. from inside a task) run serially.
+void ParallelFor(uint32_t count, uint32_t minPerTask, const std::function<void(uint32_t, uint32_t)>& task);
+
+// Stops the worker threads; a later ParallelFor() starts them again
+void ShutdownParallelFor();
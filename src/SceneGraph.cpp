@@ -0,0 +1,109 @@
+#include "SceneGraph.h"
+
+#include <algorithm>
+
+#include "TransformKernels.h"
+
+void SceneGraph::Reserve(uint32_t numNodes)
+{
+  m_Parents.reserve(numNodes);
+  m_Translations.reserve(numNodes);
+  m_Rotations.reserve(numNodes);
+  m_Scales.reserve(numNodes);
+  m_WorldTransforms.reserve(numNodes);
+  m_Dirty.reserve(numNodes);
+}
+
+void SceneGraph::Clear()
+{
+  m_Parents.clear();
+  m_Translations.clear();
+  m_Rotations.clear();
+  m_Scales.clear();
+  m_WorldTransforms.clear();
+  m_Dirty.clear();
+  m_FirstDirty = (uint32_t)-1;
+  m_NumUpdatedNodes = 0;
+}
+
+uint32_t SceneGraph::AddNode(uint32_t parent, const glm::vec3& translation,
+                             const glm::quat& rotation, const glm::vec3& scale)
+{
+  uint32_t node = GetNumNodes();
+  m_Parents.push_back(parent);
+  m_Translations.push_back(translation);
+  m_Rotations.push_back(rotation);
+  m_Scales.push_back(scale);
+  m_WorldTransforms.push_back(glm::mat4x4(1.0f));
+  m_Dirty.push_back(0);
+  MarkDirty(node);
+  return node;
+}
+
+void SceneGraph::SetTranslation(uint32_t node, const glm::vec3& translation)
+{
+  m_Translations[node] = translation;
+  MarkDirty(node);
+}
+
+void SceneGraph::SetRotation(uint32_t node, const glm::quat& rotation)
+{
+  m_Rotations[node] = rotation;
+  MarkDirty(node);
+}
+
+void SceneGraph::SetScale(uint32_t node, const glm::vec3& scale)
+{
+  m_Scales[node] = scale;
+  MarkDirty(node);
+}
+
+void SceneGraph::SetLocalTransform(uint32_t node, const glm::vec3& translation,
+                                   const glm::quat& rotation, const glm::vec3& scale)
+{
+  m_Translations[node] = translation;
+  m_Rotations[node] = rotation;
+  m_Scales[node] = scale;
+  MarkDirty(node);
+}
+
+void SceneGraph::UpdateWorldTransforms()
+{
+  m_NumUpdatedNodes = 0;
+  uint32_t numNodes = GetNumNodes();
+  if (m_FirstDirty >= numNodes)
+  {
+    return;
+  }
+
+  // Parents are visited first, so a dirty flag set here reaches
+  // the whole subtree within the same pass
+  m_DirtyNodes.clear();
+  for (uint32_t i = m_FirstDirty; i < numNodes; i++)
+  {
+    uint32_t parent = m_Parents[i];
+    if (m_Dirty[i] || (parent != NO_PARENT && m_Dirty[parent]))
+    {
+      m_Dirty[i] = 1;
+      m_DirtyNodes.push_back(i);
+    }
+  }
+
+  // Local transforms are built in small batches that stay in cache
+  // until they are multiplied into the world transforms
+  const uint32_t BATCH_SIZE = 256;
+  glm::mat4x4 localTransforms[BATCH_SIZE];
+  uint32_t numDirty = (uint32_t)m_DirtyNodes.size();
+  for (uint32_t first = 0; first < numDirty; first += BATCH_SIZE)
+  {
+    uint32_t count = std::min(BATCH_SIZE, numDirty - first);
+    const uint32_t* nodes = m_DirtyNodes.data() + first;
+    ComposeTransforms(m_Rotations.data(), m_Translations.data(), m_Scales.data(),
+                      nodes, count, localTransforms);
+    PropagateTransforms(m_Parents.data(), localTransforms, nodes, count, m_WorldTransforms.data());
+  }
+  m_NumUpdatedNodes = numDirty;
+
+  std::fill(m_Dirty.begin() + m_FirstDirty, m_Dirty.end(), (uint8_t)0);
+  m_FirstDirty = (uint32_t)-1;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+#include "glm/glm.hpp"
+#include "glm/gtc/quaternion.hpp"
+
+// Transform hierarchy stored as structure of arrays. A node can only be
+// parented to an existing node, so parents always precede their children
+// and world transforms resolve in a single forward pass. Only nodes that
+// were changed, or whose ancestors were changed, are recomputed.
+class SceneGraph
+{
+public:
+  static const uint32_t NO_PARENT = (uint32_t)-1;
+
+  void Reserve(uint32_t numNodes);
+  void Clear();
+
+  // parent must be NO_PARENT or an existing node
+  uint32_t AddNode(uint32_t parent,
+                   const glm::vec3& translation = glm::vec3(0.0f),
+                   const glm::quat& rotation = glm::quat(1.0f, 0.0f, 0.0f, 0.0f),
+                   const glm::vec3& scale = glm::vec3(1.0f));
+
+  void SetTranslation(uint32_t node, const glm::vec3& translation);
+  void SetRotation(uint32_t node, const glm::quat& rotation);
+  void SetScale(uint32_t node, const glm::vec3& scale);
+  void SetLocalTransform(uint32_t node, const glm::vec3& translation,
+                         const glm::quat& rotation, const glm::vec3& scale);
+
+  // Recomputes world transforms of dirty subtrees
+  void UpdateWorldTransforms();
+
+  uint32_t GetNumNodes() const { return (uint32_t)m_Parents.size(); }
+  uint32_t GetParent(uint32_t node) const { return m_Parents[node]; }
+  const glm::vec3& GetTranslation(uint32_t node) const { return m_Translations[node]; }
+  const glm::quat& GetRotation(uint32_t node) const { return m_Rotations[node]; }
+  const glm::vec3& GetScale(uint32_t node) const { return m_Scales[node]; }
+  // Valid as of the last UpdateWorldTransforms()
+  const glm::mat4x4& GetWorldTransform(uint32_t node) const { return m_WorldTransforms[node]; }
+  const glm::mat4x4* GetWorldTransforms() const { return m_WorldTransforms.data(); }
+  // Number of world transforms recomputed by the last update
+  uint32_t GetNumUpdatedNodes() const { return m_NumUpdatedNodes; }
+
+private:
+  void MarkDirty(uint32_t node)
+  {
+    m_Dirty[node] = 1;
+    if (node < m_FirstDirty)
+    {
+      m_FirstDirty = node;
+    }
+  }
+
+  std::vector<uint32_t> m_Parents;
+  std::vector<glm::vec3> m_Translations;
+  std::vector<glm::quat> m_Rotations;
+  std::vector<glm::vec3> m_Scales;
+  std::vector<glm::mat4x4> m_WorldTransforms;
+  std::vector<uint8_t> m_Dirty;
+  // Nodes recomputed by an update, in hierarchy order
+  std::vector<uint32_t> m_DirtyNodes;
+  // Nodes before this one are known to be clean
+  uint32_t m_FirstDirty = (uint32_t)-1;
+  uint32_t m_NumUpdatedNodes = 0;
+};
@@ -0,0 +1,21 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+
+// Position stream only, for depth-only passes. The transform must match
+// Triangle.vert exactly, so the shading pass can test for equal depth.
+layout(location = 0) in vec3 inPosition;
+layout(location = 2) in mat4x4 instanceModel;
+
+layout(set = 0, binding = 0) uniform MVP
+{
+	mat4x4 model;
+	mat4x4 view;
+	mat4x4 proj;
+};
+
+invariant gl_Position;
+
+void main()
+{
+	gl_Position = proj * view * model * instanceModel * vec4(inPosition, 1.0);
+}
\ No newline at end of file
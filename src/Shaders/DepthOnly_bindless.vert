@@ -0,0 +1,31 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+#extension GL_EXT_nonuniform_qualifier : enable
+
+// Position stream only, for depth-only passes. The transform must match
+// Triangle_bindless.vert exactly, so the shading pass can test for equal depth.
+layout(location = 0) in vec3 inPosition;
+layout(location = 2) in mat4x4 instanceModel;
+
+layout(set = 0, binding = 0) readonly buffer MVP
+{
+	mat4x4 model;
+	mat4x4 view;
+	mat4x4 proj;
+} storageBuffers[];
+
+layout(push_constant) uniform PushConstants {
+	float time;
+	uint uniformBufferIndex;
+	uint textureIndex;
+};
+
+invariant gl_Position;
+
+void main()
+{
+	gl_Position = storageBuffers[uniformBufferIndex].proj
+		* storageBuffers[uniformBufferIndex].view
+		* storageBuffers[uniformBufferIndex].model
+		* instanceModel * vec4(inPosition, 1.0);
+}
\ No newline at end of file
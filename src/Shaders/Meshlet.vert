@@ -0,0 +1,80 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+
+// Vertex layout of the mesh arena, see VertexFormat.h
+layout(constant_id = 0) const bool QUANTIZED_VERTICES = false;
+
+struct Meshlet
+{
+	vec4 sphere;
+	vec4 cone;
+	uint vertexOffset;
+	uint vertexCount;
+	uint triangleOffset;
+	uint triangleCount;
+};
+
+layout(location = 0) out vec3 fragColor;
+
+layout(set = 0, binding = 0) uniform MVP
+{
+	mat4x4 model;
+	mat4x4 view;
+	mat4x4 proj;
+};
+
+// Float layout: 3 floats per position, 3 floats per color.
+// Quantized layout: 16 bit position in the mesh's bounds plus padding, 8 bit color.
+layout(set = 0, binding = 1) readonly buffer VertexPositions
+{
+	uint positions[];
+};
+
+layout(set = 0, binding = 9) readonly buffer VertexAttributes
+{
+	uint attributes[];
+};
+
+layout(set = 0, binding = 2) readonly buffer Meshlets
+{
+	Meshlet meshlets[];
+};
+
+layout(set = 0, binding = 3) readonly buffer MeshletVertices
+{
+	uint meshletVertices[];
+};
+
+layout(set = 0, binding = 5) readonly buffer Instances
+{
+	mat4x4 instances[];
+};
+
+layout(set = 0, binding = 7) readonly buffer Clusters
+{
+	uvec2 clusters[];
+};
+
+invariant gl_Position;
+
+// Vertices are pulled from the cluster the culling pass wrote the index for
+void main()
+{
+	uvec2 cluster = clusters[gl_VertexIndex >> 6];
+	Meshlet meshlet = meshlets[cluster.y];
+	uint vertex = meshletVertices[meshlet.vertexOffset + (gl_VertexIndex & 63)];
+
+	vec3 position;
+	if (QUANTIZED_VERTICES)
+	{
+		// The instance transform maps the bounds back
+		position = vec3(unpackUnorm2x16(positions[vertex * 2 + 0]), unpackUnorm2x16(positions[vertex * 2 + 1]).x);
+		fragColor = unpackUnorm4x8(attributes[vertex]).rgb;
+	}
+	else
+	{
+		position = uintBitsToFloat(uvec3(positions[vertex * 3 + 0], positions[vertex * 3 + 1], positions[vertex * 3 + 2]));
+		fragColor = uintBitsToFloat(uvec3(attributes[vertex * 3 + 0], attributes[vertex * 3 + 1], attributes[vertex * 3 + 2]));
+	}
+	gl_Position = proj * view * model * instances[cluster.x] * vec4(position, 1.0);
+}
@@ -1,8 +1,9 @@
 #version 450
 #extension GL_ARB_separate_shader_objects : enable
 
-layout(location = 0) in vec2 inPosition;
+layout(location = 0) in vec3 inPosition;
 layout(location = 1) in vec3 inColor;
+layout(location = 2) in mat4x4 instanceModel;
 
 layout(location = 0) out vec3 fragColor;
 
@@ -17,11 +18,13 @@ layout(push_constant) uniform PushConstants {
 	float time;
 };
 
+invariant gl_Position;
+
 void main()
 {
 	fragColor = mix(
 		inColor,
 		vec3(1.0f, 1.0f, 1.0f),
 		0.5f * (sin(5.0f * time) + 1.0f));
-	gl_Position = proj * view * model * vec4(inPosition.xy, 0.0, 1.0);
+	gl_Position = proj * view * model * instanceModel * vec4(inPosition, 1.0);
 }
\ No newline at end of file
@@ -0,0 +1,36 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+#extension GL_EXT_nonuniform_qualifier : enable
+
+layout(location = 0) in vec3 inPosition;
+layout(location = 1) in vec3 inColor;
+layout(location = 2) in mat4x4 instanceModel;
+
+layout(location = 0) out vec3 fragColor;
+
+layout(set = 0, binding = 0) readonly buffer MVP
+{
+	mat4x4 model;
+	mat4x4 view;
+	mat4x4 proj;
+} storageBuffers[];
+
+layout(push_constant) uniform PushConstants {
+	float time;
+	uint uniformBufferIndex;
+	uint textureIndex;
+};
+
+invariant gl_Position;
+
+void main()
+{
+	fragColor = mix(
+		inColor,
+		vec3(1.0f, 1.0f, 1.0f),
+		0.5f * (sin(5.0f * time) + 1.0f));
+	gl_Position = storageBuffers[uniformBufferIndex].proj
+		* storageBuffers[uniformBufferIndex].view
+		* storageBuffers[uniformBufferIndex].model
+		* instanceModel * vec4(inPosition, 1.0);
+}
\ No newline at end of file
@@ -0,0 +1,427 @@
+#include "TransformKernels.h"
+
+#include "SDL.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define TRANSFORM_KERNELS_X86 1
+#include <immintrin.h>
+// MSVC exposes every intrinsic without per-function target flags
+#if defined(_MSC_VER) && !defined(__clang__)
+#define TARGET_SSE
+#define TARGET_AVX2
+#else
+#define TARGET_SSE __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+static const uint32_t NO_PARENT = (uint32_t)-1;
+
+// Scalar
+static inline void ComposeTransformScalar(const glm::quat& rotation, const glm::vec3& translation,
+                                          const glm::vec3& scale, glm::mat4x4& out)
+{
+  glm::mat3x3 r = glm::mat3_cast(rotation);
+  out[0] = glm::vec4(r[0] * scale.x, 0.0f);
+  out[1] = glm::vec4(r[1] * scale.y, 0.0f);
+  out[2] = glm::vec4(r[2] * scale.z, 0.0f);
+  out[3] = glm::vec4(translation, 1.0f);
+}
+
+static void ComposeTransformsScalar(const glm::quat* rotations, const glm::vec3* translations, const glm::vec3* scales,
+                                    const uint32_t* indices, uint32_t count, glm::mat4x4* out)
+{
+  for (uint32_t i = 0; i < count; i++)
+  {
+    uint32_t k = indices ? indices[i] : i;
+    ComposeTransformScalar(rotations[k], translations[k], scales[k], out[i]);
+  }
+}
+
+static void PropagateTransformsScalar(const uint32_t* parents, const glm::mat4x4* locals,
+                                      const uint32_t* indices, uint32_t count, glm::mat4x4* worlds)
+{
+  for (uint32_t i = 0; i < count; i++)
+  {
+    uint32_t k = indices ? indices[i] : i;
+    uint32_t parent = parents[k];
+    worlds[k] = parent == NO_PARENT ? locals[i] : worlds[parent] * locals[i];
+  }
+}
+
+static void MultiplyTransformsScalar(const glm::mat4x4* a, const glm::mat4x4* b, glm::mat4x4* out, uint32_t count)
+{
+  for (uint32_t i = 0; i < count; i++)
+  {
+    out[i] = a[i] * b[i];
+  }
+}
+
+#ifdef TRANSFORM_KERNELS_X86
+// SSE
+// Four transforms per iteration, with the quaternion components
+// transposed into one register per component
+TARGET_SSE static inline void StoreColumnSSE(__m128 x, __m128 y, __m128 z, __m128 w,
+                                             uint32_t column, glm::mat4x4* out)
+{
+  _MM_TRANSPOSE4_PS(x, y, z, w);
+  _mm_storeu_ps(&out[0][column].x, x);
+  _mm_storeu_ps(&out[1][column].x, y);
+  _mm_storeu_ps(&out[2][column].x, z);
+  _mm_storeu_ps(&out[3][column].x, w);
+}
+
+TARGET_SSE static void ComposeTransformsSSE(const glm::quat* rotations, const glm::vec3* translations, const glm::vec3* scales,
+                                            const uint32_t* indices, uint32_t count, glm::mat4x4* out)
+{
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 one = _mm_set1_ps(1.0f);
+  const __m128 two = _mm_set1_ps(2.0f);
+
+  uint32_t i = 0;
+  for (; i + 4 <= count; i += 4)
+  {
+    uint32_t k[4];
+    for (uint32_t j = 0; j < 4; j++)
+    {
+      k[j] = indices ? indices[i + j] : i + j;
+    }
+
+    __m128 x = _mm_loadu_ps(&rotations[k[0]].x);
+    __m128 y = _mm_loadu_ps(&rotations[k[1]].x);
+    __m128 z = _mm_loadu_ps(&rotations[k[2]].x);
+    __m128 w = _mm_loadu_ps(&rotations[k[3]].x);
+    _MM_TRANSPOSE4_PS(x, y, z, w);
+
+    __m128 sx = _mm_setr_ps(scales[k[0]].x, scales[k[1]].x, scales[k[2]].x, scales[k[3]].x);
+    __m128 sy = _mm_setr_ps(scales[k[0]].y, scales[k[1]].y, scales[k[2]].y, scales[k[3]].y);
+    __m128 sz = _mm_setr_ps(scales[k[0]].z, scales[k[1]].z, scales[k[2]].z, scales[k[3]].z);
+    __m128 tx = _mm_setr_ps(translations[k[0]].x, translations[k[1]].x, translations[k[2]].x, translations[k[3]].x);
+    __m128 ty = _mm_setr_ps(translations[k[0]].y, translations[k[1]].y, translations[k[2]].y, translations[k[3]].y);
+    __m128 tz = _mm_setr_ps(translations[k[0]].z, translations[k[1]].z, translations[k[2]].z, translations[k[3]].z);
+
+    __m128 xx = _mm_mul_ps(x, x);
+    __m128 yy = _mm_mul_ps(y, y);
+    __m128 zz = _mm_mul_ps(z, z);
+    __m128 xy = _mm_mul_ps(x, y);
+    __m128 xz = _mm_mul_ps(x, z);
+    __m128 yz = _mm_mul_ps(y, z);
+    __m128 wx = _mm_mul_ps(w, x);
+    __m128 wy = _mm_mul_ps(w, y);
+    __m128 wz = _mm_mul_ps(w, z);
+
+    __m128 c00 = _mm_mul_ps(_mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(yy, zz))), sx);
+    __m128 c01 = _mm_mul_ps(_mm_mul_ps(two, _mm_add_ps(xy, wz)), sx);
+    __m128 c02 = _mm_mul_ps(_mm_mul_ps(two, _mm_sub_ps(xz, wy)), sx);
+    __m128 c10 = _mm_mul_ps(_mm_mul_ps(two, _mm_sub_ps(xy, wz)), sy);
+    __m128 c11 = _mm_mul_ps(_mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(xx, zz))), sy);
+    __m128 c12 = _mm_mul_ps(_mm_mul_ps(two, _mm_add_ps(yz, wx)), sy);
+    __m128 c20 = _mm_mul_ps(_mm_mul_ps(two, _mm_add_ps(xz, wy)), sz);
+    __m128 c21 = _mm_mul_ps(_mm_mul_ps(two, _mm_sub_ps(yz, wx)), sz);
+    __m128 c22 = _mm_mul_ps(_mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(xx, yy))), sz);
+
+    StoreColumnSSE(c00, c01, c02, zero, 0, out + i);
+    StoreColumnSSE(c10, c11, c12, zero, 1, out + i);
+    StoreColumnSSE(c20, c21, c22, zero, 2, out + i);
+    StoreColumnSSE(tx, ty, tz, one, 3, out + i);
+  }
+
+  for (; i < count; i++)
+  {
+    uint32_t k = indices ? indices[i] : i;
+    ComposeTransformScalar(rotations[k], translations[k], scales[k], out[i]);
+  }
+}
+
+// Column j of a * b is the sum of a's columns weighted by b's column j,
+// added in the same order as glm
+TARGET_SSE static inline void MultiplyTransformSSE(const glm::mat4x4& a, const glm::mat4x4& b, glm::mat4x4& out)
+{
+  __m128 a0 = _mm_loadu_ps(&a[0].x);
+  __m128 a1 = _mm_loadu_ps(&a[1].x);
+  __m128 a2 = _mm_loadu_ps(&a[2].x);
+  __m128 a3 = _mm_loadu_ps(&a[3].x);
+  __m128 columns[4];
+  for (uint32_t j = 0; j < 4; j++)
+  {
+    __m128 bj = _mm_loadu_ps(&b[j].x);
+    __m128 r = _mm_mul_ps(a0, _mm_shuffle_ps(bj, bj, _MM_SHUFFLE(0, 0, 0, 0)));
+    r = _mm_add_ps(r, _mm_mul_ps(a1, _mm_shuffle_ps(bj, bj, _MM_SHUFFLE(1, 1, 1, 1))));
+    r = _mm_add_ps(r, _mm_mul_ps(a2, _mm_shuffle_ps(bj, bj, _MM_SHUFFLE(2, 2, 2, 2))));
+    r = _mm_add_ps(r, _mm_mul_ps(a3, _mm_shuffle_ps(bj, bj, _MM_SHUFFLE(3, 3, 3, 3))));
+    columns[j] = r;
+  }
+  // out may alias a or b
+  for (uint32_t j = 0; j < 4; j++)
+  {
+    _mm_storeu_ps(&out[j].x, columns[j]);
+  }
+}
+
+TARGET_SSE static void PropagateTransformsSSE(const uint32_t* parents, const glm::mat4x4* locals,
+                                              const uint32_t* indices, uint32_t count, glm::mat4x4* worlds)
+{
+  for (uint32_t i = 0; i < count; i++)
+  {
+    uint32_t k = indices ? indices[i] : i;
+    uint32_t parent = parents[k];
+    if (parent == NO_PARENT)
+    {
+      worlds[k] = locals[i];
+    }
+    else
+    {
+      MultiplyTransformSSE(worlds[parent], locals[i], worlds[k]);
+    }
+  }
+}
+
+TARGET_SSE static void MultiplyTransformsSSE(const glm::mat4x4* a, const glm::mat4x4* b, glm::mat4x4* out, uint32_t count)
+{
+  for (uint32_t i = 0; i < count; i++)
+  {
+    MultiplyTransformSSE(a[i], b[i], out[i]);
+  }
+}
+
+// AVX2
+// Eight transforms per iteration. Each 128-bit lane holds four of them,
+// so the SSE-style 4x4 transposes work per lane.
+TARGET_AVX2 static inline void Transpose4x4LanesAVX(__m256& a, __m256& b, __m256& c, __m256& d)
+{
+  __m256 t0 = _mm256_unpacklo_ps(a, b);
+  __m256 t1 = _mm256_unpacklo_ps(c, d);
+  __m256 t2 = _mm256_unpackhi_ps(a, b);
+  __m256 t3 = _mm256_unpackhi_ps(c, d);
+  a = _mm256_shuffle_ps(t0, t1, _MM_SHUFFLE(1, 0, 1, 0));
+  b = _mm256_shuffle_ps(t0, t1, _MM_SHUFFLE(3, 2, 3, 2));
+  c = _mm256_shuffle_ps(t2, t3, _MM_SHUFFLE(1, 0, 1, 0));
+  d = _mm256_shuffle_ps(t2, t3, _MM_SHUFFLE(3, 2, 3, 2));
+}
+
+TARGET_AVX2 static inline __m256 LoadPairAVX(const float* lo, const float* hi)
+{
+  return _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(lo)), _mm_loadu_ps(hi), 1);
+}
+
+TARGET_AVX2 static inline void StorePairAVX(__m256 value, float* lo, float* hi)
+{
+  _mm_storeu_ps(lo, _mm256_castps256_ps128(value));
+  _mm_storeu_ps(hi, _mm256_extractf128_ps(value, 1));
+}
+
+TARGET_AVX2 static inline void StoreColumnAVX(__m256 x, __m256 y, __m256 z, __m256 w,
+                                              uint32_t column, glm::mat4x4* out)
+{
+  Transpose4x4LanesAVX(x, y, z, w);
+  StorePairAVX(x, &out[0][column].x, &out[4][column].x);
+  StorePairAVX(y, &out[1][column].x, &out[5][column].x);
+  StorePairAVX(z, &out[2][column].x, &out[6][column].x);
+  StorePairAVX(w, &out[3][column].x, &out[7][column].x);
+}
+
+#define GATHER8(array, member) _mm256_setr_ps( \
+  array[k[0]].member, array[k[1]].member, array[k[2]].member, array[k[3]].member, \
+  array[k[4]].member, array[k[5]].member, array[k[6]].member, array[k[7]].member)
+
+TARGET_AVX2 static void ComposeTransformsAVX2(const glm::quat* rotations, const glm::vec3* translations, const glm::vec3* scales,
+                                              const uint32_t* indices, uint32_t count, glm::mat4x4* out)
+{
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256 one = _mm256_set1_ps(1.0f);
+  const __m256 two = _mm256_set1_ps(2.0f);
+
+  uint32_t i = 0;
+  for (; i + 8 <= count; i += 8)
+  {
+    uint32_t k[8];
+    for (uint32_t j = 0; j < 8; j++)
+    {
+      k[j] = indices ? indices[i + j] : i + j;
+    }
+
+    __m256 x = LoadPairAVX(&rotations[k[0]].x, &rotations[k[4]].x);
+    __m256 y = LoadPairAVX(&rotations[k[1]].x, &rotations[k[5]].x);
+    __m256 z = LoadPairAVX(&rotations[k[2]].x, &rotations[k[6]].x);
+    __m256 w = LoadPairAVX(&rotations[k[3]].x, &rotations[k[7]].x);
+    Transpose4x4LanesAVX(x, y, z, w);
+
+    __m256 sx = GATHER8(scales, x);
+    __m256 sy = GATHER8(scales, y);
+    __m256 sz = GATHER8(scales, z);
+    __m256 tx = GATHER8(translations, x);
+    __m256 ty = GATHER8(translations, y);
+    __m256 tz = GATHER8(translations, z);
+
+    __m256 xx = _mm256_mul_ps(x, x);
+    __m256 yy = _mm256_mul_ps(y, y);
+    __m256 zz = _mm256_mul_ps(z, z);
+    __m256 xy = _mm256_mul_ps(x, y);
+    __m256 xz = _mm256_mul_ps(x, z);
+    __m256 yz = _mm256_mul_ps(y, z);
+    __m256 wx = _mm256_mul_ps(w, x);
+    __m256 wy = _mm256_mul_ps(w, y);
+    __m256 wz = _mm256_mul_ps(w, z);
+
+    __m256 c00 = _mm256_mul_ps(_mm256_sub_ps(one, _mm256_mul_ps(two, _mm256_add_ps(yy, zz))), sx);
+    __m256 c01 = _mm256_mul_ps(_mm256_mul_ps(two, _mm256_add_ps(xy, wz)), sx);
+    __m256 c02 = _mm256_mul_ps(_mm256_mul_ps(two, _mm256_sub_ps(xz, wy)), sx);
+    __m256 c10 = _mm256_mul_ps(_mm256_mul_ps(two, _mm256_sub_ps(xy, wz)), sy);
+    __m256 c11 = _mm256_mul_ps(_mm256_sub_ps(one, _mm256_mul_ps(two, _mm256_add_ps(xx, zz))), sy);
+    __m256 c12 = _mm256_mul_ps(_mm256_mul_ps(two, _mm256_add_ps(yz, wx)), sy);
+    __m256 c20 = _mm256_mul_ps(_mm256_mul_ps(two, _mm256_add_ps(xz, wy)), sz);
+    __m256 c21 = _mm256_mul_ps(_mm256_mul_ps(two, _mm256_sub_ps(yz, wx)), sz);
+    __m256 c22 = _mm256_mul_ps(_mm256_sub_ps(one, _mm256_mul_ps(two, _mm256_add_ps(xx, yy))), sz);
+
+    StoreColumnAVX(c00, c01, c02, zero, 0, out + i);
+    StoreColumnAVX(c10, c11, c12, zero, 1, out + i);
+    StoreColumnAVX(c20, c21, c22, zero, 2, out + i);
+    StoreColumnAVX(tx, ty, tz, one, 3, out + i);
+  }
+
+  for (; i < count; i++)
+  {
+    uint32_t k = indices ? indices[i] : i;
+    ComposeTransformScalar(rotations[k], translations[k], scales[k], out[i]);
+  }
+}
+
+#undef GATHER8
+
+// Two result columns per iteration, one per 128-bit lane
+TARGET_AVX2 static inline void MultiplyTransformAVX2(const glm::mat4x4& a, const glm::mat4x4& b, glm::mat4x4& out)
+{
+  __m256 a0 = _mm256_broadcast_ps((const __m128*)&a[0].x);
+  __m256 a1 = _mm256_broadcast_ps((const __m128*)&a[1].x);
+  __m256 a2 = _mm256_broadcast_ps((const __m128*)&a[2].x);
+  __m256 a3 = _mm256_broadcast_ps((const __m128*)&a[3].x);
+  __m256 b01 = _mm256_loadu_ps(&b[0].x);
+  __m256 b23 = _mm256_loadu_ps(&b[2].x);
+
+  __m256 r01 = _mm256_mul_ps(a0, _mm256_permute_ps(b01, _MM_SHUFFLE(0, 0, 0, 0)));
+  r01 = _mm256_add_ps(r01, _mm256_mul_ps(a1, _mm256_permute_ps(b01, _MM_SHUFFLE(1, 1, 1, 1))));
+  r01 = _mm256_add_ps(r01, _mm256_mul_ps(a2, _mm256_permute_ps(b01, _MM_SHUFFLE(2, 2, 2, 2))));
+  r01 = _mm256_add_ps(r01, _mm256_mul_ps(a3, _mm256_permute_ps(b01, _MM_SHUFFLE(3, 3, 3, 3))));
+  __m256 r23 = _mm256_mul_ps(a0, _mm256_permute_ps(b23, _MM_SHUFFLE(0, 0, 0, 0)));
+  r23 = _mm256_add_ps(r23, _mm256_mul_ps(a1, _mm256_permute_ps(b23, _MM_SHUFFLE(1, 1, 1, 1))));
+  r23 = _mm256_add_ps(r23, _mm256_mul_ps(a2, _mm256_permute_ps(b23, _MM_SHUFFLE(2, 2, 2, 2))));
+  r23 = _mm256_add_ps(r23, _mm256_mul_ps(a3, _mm256_permute_ps(b23, _MM_SHUFFLE(3, 3, 3, 3))));
+
+  _mm256_storeu_ps(&out[0].x, r01);
+  _mm256_storeu_ps(&out[2].x, r23);
+}
+
+TARGET_AVX2 static void PropagateTransformsAVX2(const uint32_t* parents, const glm::mat4x4* locals,
+                                                const uint32_t* indices, uint32_t count, glm::mat4x4* worlds)
+{
+  for (uint32_t i = 0; i < count; i++)
+  {
+    uint32_t k = indices ? indices[i] : i;
+    uint32_t parent = parents[k];
+    if (parent == NO_PARENT)
+    {
+      worlds[k] = locals[i];
+    }
+    else
+    {
+      MultiplyTransformAVX2(worlds[parent], locals[i], worlds[k]);
+    }
+  }
+}
+
+TARGET_AVX2 static void MultiplyTransformsAVX2(const glm::mat4x4* a, const glm::mat4x4* b, glm::mat4x4* out, uint32_t count)
+{
+  for (uint32_t i = 0; i < count; i++)
+  {
+    MultiplyTransformAVX2(a[i], b[i], out[i]);
+  }
+}
+#endif // TRANSFORM_KERNELS_X86
+
+// Dispatch
+static const struct TransformKernelFunctions
+{
+  const char* name;
+  void (*compose)(const glm::quat*, const glm::vec3*, const glm::vec3*, const uint32_t*, uint32_t, glm::mat4x4*);
+  void (*propagate)(const uint32_t*, const glm::mat4x4*, const uint32_t*, uint32_t, glm::mat4x4*);
+  void (*multiply)(const glm::mat4x4*, const glm::mat4x4*, glm::mat4x4*, uint32_t);
+} g_TransformKernels[TRANSFORM_KERNEL_COUNT] = {
+  {"scalar", ComposeTransformsScalar, PropagateTransformsScalar, MultiplyTransformsScalar},
+#ifdef TRANSFORM_KERNELS_X86
+  {"sse", ComposeTransformsSSE, PropagateTransformsSSE, MultiplyTransformsSSE},
+  {"avx2", ComposeTransformsAVX2, PropagateTransformsAVX2, MultiplyTransformsAVX2}
+#else
+  {"sse", ComposeTransformsScalar, PropagateTransformsScalar, MultiplyTransformsScalar},
+  {"avx2", ComposeTransformsScalar, PropagateTransformsScalar, MultiplyTransformsScalar}
+#endif
+};
+
+static const TransformKernelFunctions* g_CurrentTransformKernel = nullptr;
+
+const char* TransformKernelName(TransformKernel kernel)
+{
+  return g_TransformKernels[kernel].name;
+}
+
+bool IsTransformKernelSupported(TransformKernel kernel)
+{
+  switch (kernel)
+  {
+    case TRANSFORM_KERNEL_SCALAR:
+    return true;
+#ifdef TRANSFORM_KERNELS_X86
+    case TRANSFORM_KERNEL_SSE:
+    return SDL_HasSSE2() == SDL_TRUE;
+    case TRANSFORM_KERNEL_AVX2:
+    return SDL_HasAVX2() == SDL_TRUE;
+#endif
+    default:
+    return false;
+  }
+}
+
+static const TransformKernelFunctions* CurrentTransformKernel()
+{
+  if (g_CurrentTransformKernel == nullptr)
+  {
+    int best = TRANSFORM_KERNEL_COUNT - 1;
+    while (!IsTransformKernelSupported((TransformKernel)best))
+    {
+      best--;
+    }
+    g_CurrentTransformKernel = &g_TransformKernels[best];
+  }
+  return g_CurrentTransformKernel;
+}
+
+TransformKernel GetTransformKernel()
+{
+  return (TransformKernel)(CurrentTransformKernel() - g_TransformKernels);
+}
+
+bool SetTransformKernel(TransformKernel kernel)
+{
+  if (!IsTransformKernelSupported(kernel))
+  {
+    return false;
+  }
+  g_CurrentTransformKernel = &g_TransformKernels[kernel];
+  return true;
+}
+
+void ComposeTransforms(const glm::quat* rotations, const glm::vec3* translations, const glm::vec3* scales,
+                       const uint32_t* indices, uint32_t count, glm::mat4x4* out)
+{
+  CurrentTransformKernel()->compose(rotations, translations, scales, indices, count, out);
+}
+
+void PropagateTransforms(const uint32_t* parents, const glm::mat4x4* locals,
+                         const uint32_t* indices, uint32_t count, glm::mat4x4* worlds)
+{
+  CurrentTransformKernel()->propagate(parents, locals, indices, count, worlds);
+}
+
+void MultiplyTransforms(const glm::mat4x4* a, const glm::mat4x4* b, glm::mat4x4* out, uint32_t count)
+{
+  CurrentTransformKernel()->multiply(a, b, out, count);
+}
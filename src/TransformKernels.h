@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "glm/glm.hpp"
+#include "glm/gtc/quaternion.hpp"
+
+// Batch transform kernels with SSE and AVX2 variants. The fastest variant
+// supported by the CPU is picked at first use, the scalar one is always
+// available and matches the glm results.
+
+enum TransformKernel
+{
+  TRANSFORM_KERNEL_SCALAR = 0,
+  TRANSFORM_KERNEL_SSE = 1,
+  TRANSFORM_KERNEL_AVX2 = 2,
+  TRANSFORM_KERNEL_COUNT
+};
+
+const char* TransformKernelName(TransformKernel kernel);
+bool IsTransformKernelSupported(TransformKernel kernel);
+TransformKernel GetTransformKernel();
+// Returns false and keeps the current kernel if unsupported
+bool SetTransformKernel(TransformKernel kernel);
+
+// out[i] = translate(translations[k]) * mat4(rotations[k]) * scale(scales[k])
+// for i in [0, count), with k = indices[i], or k = i if indices is null
+void ComposeTransforms(const glm::quat* rotations, const glm::vec3* translations, const glm::vec3* scales,
+                       const uint32_t* indices, uint32_t count, glm::mat4x4* out);
+
+// worlds[k] = worlds[parents[k]] * locals[i] for i in [0, count) in order,
+// with k as above, or worlds[k] = locals[i] if parents[k] is (uint32_t)-1.
+// Parents listed before their children see the updated parent transform.
+void PropagateTransforms(const uint32_t* parents, const glm::mat4x4* locals,
+                         const uint32_t* indices, uint32_t count, glm::mat4x4* worlds);
+
+// out[i] = a[i] * b[i]
+void MultiplyTransforms(const glm::mat4x4* a, const glm::mat4x4* b, glm::mat4x4* out, uint32_t count);
@@ -0,0 +1,235 @@
+#include "VertexFormat.h"
+
+#include <float.h>
+#include <math.h>
+#include <string.h>
+
+uint32_t GetVertexFormatSize(VertexAttributeFormat format)
+{
+  switch (format)
+  {
+  case VERTEX_FORMAT_FLOAT32X2: return 8;
+  case VERTEX_FORMAT_FLOAT32X3: return 12;
+  case VERTEX_FORMAT_FLOAT16X2: return 4;
+  case VERTEX_FORMAT_UNORM16X4: return 8;
+  case VERTEX_FORMAT_SNORM16X2_OCTAHEDRAL: return 4;
+  case VERTEX_FORMAT_UNORM8X4: return 4;
+  default: return 0;
+  }
+}
+
+VertexLayout MakeVertexLayout(const VertexAttributeFormat (&formats)[NUM_VERTEX_ATTRIBUTES],
+                              const uint32_t (&streams)[NUM_VERTEX_ATTRIBUTES])
+{
+  VertexLayout layout = {};
+  for (uint32_t i = 0; i < NUM_VERTEX_ATTRIBUTES; i++)
+  {
+    layout.formats[i] = formats[i];
+    if (formats[i] == VERTEX_FORMAT_NONE)
+    {
+      continue;
+    }
+    uint32_t stream = streams[i];
+    layout.streams[i] = stream;
+    layout.offsets[i] = layout.strides[stream];
+    layout.strides[stream] += GetVertexFormatSize(formats[i]);
+    layout.numStreams = glm::max(layout.numStreams, stream + 1);
+  }
+  return layout;
+}
+
+static const uint32_t g_PositionStreamLayout[NUM_VERTEX_ATTRIBUTES] = { 0, 1, 1, 1 };
+
+VertexLayout MakeFloatVertexLayout()
+{
+  const VertexAttributeFormat formats[NUM_VERTEX_ATTRIBUTES] = {
+    VERTEX_FORMAT_FLOAT32X3, VERTEX_FORMAT_NONE, VERTEX_FORMAT_FLOAT32X3, VERTEX_FORMAT_NONE };
+  return MakeVertexLayout(formats, g_PositionStreamLayout);
+}
+
+VertexLayout MakeQuantizedVertexLayout()
+{
+  const VertexAttributeFormat formats[NUM_VERTEX_ATTRIBUTES] = {
+    VERTEX_FORMAT_UNORM16X4, VERTEX_FORMAT_NONE, VERTEX_FORMAT_UNORM8X4, VERTEX_FORMAT_NONE };
+  return MakeVertexLayout(formats, g_PositionStreamLayout);
+}
+
+VertexQuantization MakeVertexQuantization(const glm::vec3& boundsMin, const glm::vec3& boundsMax)
+{
+  glm::vec3 extent = boundsMax - boundsMin;
+  return { boundsMin, glm::max(glm::max(extent.x, extent.y), glm::max(extent.z, FLT_MIN)) };
+}
+
+glm::mat4x4 GetDequantizeTransform(const VertexQuantization& quantization)
+{
+  glm::mat4x4 transform(quantization.scale);
+  transform[3] = glm::vec4(quantization.offset, 1.0f);
+  return transform;
+}
+
+static uint16_t QuantizeUnorm16(float value)
+{
+  return (uint16_t)(glm::clamp(value, 0.0f, 1.0f) * 65535.0f + 0.5f);
+}
+
+static int16_t QuantizeSnorm16(float value)
+{
+  return (int16_t)roundf(glm::clamp(value, -1.0f, 1.0f) * 32767.0f);
+}
+
+static uint8_t QuantizeUnorm8(float value)
+{
+  return (uint8_t)(glm::clamp(value, 0.0f, 1.0f) * 255.0f + 0.5f);
+}
+
+glm::vec2 EncodeOctahedral(const glm::vec3& normal)
+{
+  glm::vec3 n = normal / (fabsf(normal.x) + fabsf(normal.y) + fabsf(normal.z));
+  glm::vec2 encoded(n.x, n.y);
+  // The lower hemisphere is folded over the diagonals
+  if (n.z < 0.0f)
+  {
+    encoded.x = (1.0f - fabsf(n.y)) * (n.x >= 0.0f ? 1.0f : -1.0f);
+    encoded.y = (1.0f - fabsf(n.x)) * (n.y >= 0.0f ? 1.0f : -1.0f);
+  }
+  return encoded;
+}
+
+glm::vec3 DecodeOctahedral(const glm::vec2& encoded)
+{
+  glm::vec3 n(encoded.x, encoded.y, 1.0f - fabsf(encoded.x) - fabsf(encoded.y));
+  if (n.z < 0.0f)
+  {
+    n.x = (1.0f - fabsf(encoded.y)) * (encoded.x >= 0.0f ? 1.0f : -1.0f);
+    n.y = (1.0f - fabsf(encoded.x)) * (encoded.y >= 0.0f ? 1.0f : -1.0f);
+  }
+  return glm::normalize(n);
+}
+
+// Rounds to nearest, values too small for a normal half flush to zero and
+// values too large saturate to infinity
+uint16_t FloatToHalf(float value)
+{
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  uint16_t sign = (uint16_t)((bits >> 16) & 0x8000);
+  int32_t exponent = (int32_t)((bits >> 23) & 0xFF) - 127 + 15;
+  uint32_t mantissa = bits & 0x7FFFFF;
+  if (exponent <= 0)
+  {
+    return sign;
+  }
+  if (exponent >= 31)
+  {
+    return (uint16_t)(sign | 0x7C00);
+  }
+  uint32_t half = ((uint32_t)exponent << 10) | (mantissa >> 13);
+  half += (mantissa >> 12) & 1;
+  return (uint16_t)(sign | glm::min(half, 0x7C00u));
+}
+
+float HalfToFloat(uint16_t value)
+{
+  uint32_t sign = (uint32_t)(value & 0x8000) << 16;
+  uint32_t exponent = (value >> 10) & 0x1F;
+  uint32_t mantissa = value & 0x3FF;
+  uint32_t bits;
+  if (exponent == 0)
+  {
+    bits = sign;
+  }
+  else if (exponent == 31)
+  {
+    bits = sign | 0x7F800000 | (mantissa << 13);
+  }
+  else
+  {
+    bits = sign | ((exponent - 15 + 127) << 23) | (mantissa << 13);
+  }
+  float result;
+  memcpy(&result, &bits, sizeof(result));
+  return result;
+}
+
+static void EncodeAttribute(VertexAttributeFormat format, const float* value, uint32_t numComponents, char* out)
+{
+  switch (format)
+  {
+  case VERTEX_FORMAT_FLOAT32X2:
+  case VERTEX_FORMAT_FLOAT32X3:
+  {
+    uint32_t size = GetVertexFormatSize(format);
+    memset(out, 0, size);
+    memcpy(out, value, glm::min(size, numComponents * (uint32_t)sizeof(float)));
+    break;
+  }
+  case VERTEX_FORMAT_FLOAT16X2:
+  {
+    uint16_t halfs[2] = { FloatToHalf(value[0]), FloatToHalf(value[1]) };
+    memcpy(out, halfs, sizeof(halfs));
+    break;
+  }
+  case VERTEX_FORMAT_UNORM16X4:
+  {
+    uint16_t unorms[4] = {};
+    for (uint32_t i = 0; i < glm::min(numComponents, 4u); i++)
+    {
+      unorms[i] = QuantizeUnorm16(value[i]);
+    }
+    memcpy(out, unorms, sizeof(unorms));
+    break;
+  }
+  case VERTEX_FORMAT_SNORM16X2_OCTAHEDRAL:
+  {
+    glm::vec2 encoded = EncodeOctahedral(glm::vec3(value[0], value[1], value[2]));
+    int16_t snorms[2] = { QuantizeSnorm16(encoded.x), QuantizeSnorm16(encoded.y) };
+    memcpy(out, snorms, sizeof(snorms));
+    break;
+  }
+  case VERTEX_FORMAT_UNORM8X4:
+  {
+    uint8_t unorms[4] = { 0, 0, 0, 255 };
+    for (uint32_t i = 0; i < numComponents; i++)
+    {
+      unorms[i] = QuantizeUnorm8(value[i]);
+    }
+    memcpy(out, unorms, sizeof(unorms));
+    break;
+  }
+  default:
+    break;
+  }
+}
+
+void EncodeVertices(const VertexLayout& layout, const VertexAttributeArrays& arrays,
+                    const VertexQuantization& quantization, void* const* outStreams)
+{
+  bool quantizePositions = layout.formats[VERTEX_ATTRIBUTE_POSITION] == VERTEX_FORMAT_UNORM16X4;
+  float inverseScale = 1.0f / quantization.scale;
+  const float* sources[NUM_VERTEX_ATTRIBUTES] = {
+    nullptr,
+    arrays.normals != nullptr ? &arrays.normals[0].x : nullptr,
+    arrays.colors != nullptr ? &arrays.colors[0].x : nullptr,
+    arrays.texcoords != nullptr ? &arrays.texcoords[0].x : nullptr };
+  const uint32_t numComponents[NUM_VERTEX_ATTRIBUTES] = { 3, 3, 3, 2 };
+
+  for (uint32_t v = 0; v < arrays.numVertices; v++)
+  {
+    glm::vec3 position = arrays.positions[v];
+    if (quantizePositions)
+    {
+      position = (position - quantization.offset) * inverseScale;
+    }
+    for (uint32_t i = 0; i < NUM_VERTEX_ATTRIBUTES; i++)
+    {
+      if (layout.formats[i] == VERTEX_FORMAT_NONE)
+      {
+        continue;
+      }
+      uint32_t stream = layout.streams[i];
+      char* out = (char*)outStreams[stream] + (size_t)v * layout.strides[stream] + layout.offsets[i];
+      const float* value = i == VERTEX_ATTRIBUTE_POSITION ? &position.x : sources[i] + (size_t)v * numComponents[i];
+      EncodeAttribute(layout.formats[i], value, numComponents[i], out);
+    }
+  }
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "glm/glm.hpp"
+
+enum VertexAttribute
+{
+  VERTEX_ATTRIBUTE_POSITION = 0,
+  VERTEX_ATTRIBUTE_NORMAL,
+  VERTEX_ATTRIBUTE_COLOR,
+  VERTEX_ATTRIBUTE_TEXCOORD,
+  NUM_VERTEX_ATTRIBUTES
+};
+
+// Storage formats of vertex attributes. Quantized positions are relative to
+// the mesh's bounding cube (see VertexQuantization), octahedral normals are
+// unit vectors folded onto a square.
+enum VertexAttributeFormat
+{
+  VERTEX_FORMAT_NONE = 0,
+  VERTEX_FORMAT_FLOAT32X2,
+  VERTEX_FORMAT_FLOAT32X3,
+  VERTEX_FORMAT_FLOAT16X2,
+  VERTEX_FORMAT_UNORM16X4,
+  VERTEX_FORMAT_SNORM16X2_OCTAHEDRAL,
+  VERTEX_FORMAT_UNORM8X4
+};
+
+uint32_t GetVertexFormatSize(VertexAttributeFormat format);
+
+// Attributes are split across separately stored streams, each of them
+// interleaving its attributes in attribute order. Positions go in a stream
+// of their own, so depth-only passes read nothing else.
+static const uint32_t MAX_VERTEX_STREAMS = 2;
+
+struct VertexLayout
+{
+  VertexAttributeFormat formats[NUM_VERTEX_ATTRIBUTES];
+  uint32_t streams[NUM_VERTEX_ATTRIBUTES];
+  // Offset within the attribute's stream
+  uint32_t offsets[NUM_VERTEX_ATTRIBUTES];
+  uint32_t strides[MAX_VERTEX_STREAMS];
+  uint32_t numStreams;
+};
+
+// Unused attributes are VERTEX_FORMAT_NONE, their stream is ignored
+VertexLayout MakeVertexLayout(const VertexAttributeFormat (&formats)[NUM_VERTEX_ATTRIBUTES],
+                              const uint32_t (&streams)[NUM_VERTEX_ATTRIBUTES]);
+
+// float3 positions and float3 colors
+VertexLayout MakeFloatVertexLayout();
+// 16 bit positions and 8 bit colors
+VertexLayout MakeQuantizedVertexLayout();
+
+// Quantized positions p map back to offset + scale * p. The scale is the same
+// on all axes, so quantization commutes with rotations and the mapping can be
+// folded into instance transforms without changing normals or bounding spheres.
+struct VertexQuantization
+{
+  glm::vec3 offset;
+  float scale;
+};
+
+VertexQuantization MakeVertexQuantization(const glm::vec3& boundsMin, const glm::vec3& boundsMax);
+glm::mat4x4 GetDequantizeTransform(const VertexQuantization& quantization);
+
+// Per-attribute source arrays, attributes the layout doesn't use may be null
+struct VertexAttributeArrays
+{
+  const glm::vec3* positions;
+  const glm::vec3* normals;
+  const glm::vec3* colors;
+  const glm::vec2* texcoords;
+  uint32_t numVertices;
+};
+
+// Writes numVertices * layout.strides[s] bytes to outStreams[s] for each of
+// the layout's streams. Positions are quantized with quantization if the
+// layout stores them normalized, else left as is.
+void EncodeVertices(const VertexLayout& layout, const VertexAttributeArrays& arrays,
+                    const VertexQuantization& quantization, void* const* outStreams);
+
+glm::vec2 EncodeOctahedral(const glm::vec3& normal);
+glm::vec3 DecodeOctahedral(const glm::vec2& encoded);
+uint16_t FloatToHalf(float value);
+float HalfToFloat(uint16_t value);